@@ -0,0 +1,29 @@
+#include "mdns.h"
+
+#include <csignal>
+#include <cstdio>
+
+static volatile std::sig_atomic_t running = 1;
+
+static void stop(int) { running = 0; }
+
+/// Usage: mdns_daemon [socket path] [shared memory name]
+int main(int argc, char** argv) {
+    const char* socket_path = argc > 1 ? argv[1] : mdns::DAEMON_SOCKET_PATH;
+    const char* cache_name = argc > 2 ? argv[2] : mdns::DAEMON_CACHE_NAME;
+
+    std::signal(SIGINT, stop);
+    std::signal(SIGTERM, stop);
+
+    mdns::MdnsDynamic mdns;
+    auto daemon = mdns.daemon();
+    if (!daemon->open(socket_path, cache_name)) {
+        printf("Failed to open %s and %s\n", socket_path, cache_name);
+        return 1;
+    }
+    printf("Resolving on %s, cache in %s\n", socket_path, cache_name);
+    while (running)
+        daemon->poll(std::chrono::milliseconds(1000));
+    printf("Stopped\n");
+    return 0;
+}
@@ -0,0 +1,30 @@
+#include "mdns.h"
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+
+static volatile std::sig_atomic_t running = 1;
+
+static void stop(int) { running = 0; }
+
+/// Usage: mdns_gateway [address] [port]
+int main(int argc, char** argv) {
+    const char* address = argc > 1 ? argv[1] : mdns::DNS_GATEWAY_ADDRESS;
+    const uint16_t port = argc > 2 ? (uint16_t)atoi(argv[2]) : mdns::DNS_GATEWAY_PORT;
+
+    std::signal(SIGINT, stop);
+    std::signal(SIGTERM, stop);
+
+    mdns::MdnsDynamic mdns;
+    auto gateway = mdns.gateway();
+    if (!gateway->open(address, port)) {
+        printf("Failed to listen on %s port %u\n", address, port);
+        return 1;
+    }
+    printf("Answering .local names on %s port %u\n", address, port);
+    while (running)
+        gateway->poll(std::chrono::milliseconds(1000));
+    printf("Stopped\n");
+    return 0;
+}
@@ -0,0 +1,370 @@
+#pragma once
+
+#include "record_cache.h"
+#include "dedup.h"
+#include "txt.h"
+#include "cpp_concepts.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include <sys/select.h>
+
+namespace mdns
+{
+
+/// A service instance as seen by a browse session
+struct BrowseInstance {
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+
+    BrowseInstance() = default;
+    explicit BrowseInstance(const allocator_type& allocator) : name(allocator), target(allocator), txt(allocator) {}
+    BrowseInstance(const BrowseInstance& other) = default;
+    BrowseInstance(BrowseInstance&& other) = default;
+    BrowseInstance(const BrowseInstance& other, const allocator_type& allocator)
+        : name(other.name, allocator), target(other.target, allocator), port(other.port), priority(other.priority),
+          weight(other.weight), txt(other.txt, allocator) {}
+    BrowseInstance(BrowseInstance&& other, const allocator_type& allocator)
+        : name(std::move(other.name), allocator), target(std::move(other.target), allocator), port(other.port),
+          priority(other.priority), weight(other.weight), txt(std::move(other.txt), allocator) {}
+    BrowseInstance& operator=(const BrowseInstance& other) = default;
+    BrowseInstance& operator=(BrowseInstance&& other) = default;
+
+    /// Full instance name, for example "Printer._http._tcp.local."
+    std::pmr::string name;
+    /// Host name from the SRV record, empty until the SRV record is known
+    std::pmr::string target;
+    uint16_t port{};
+    uint16_t priority{};
+    uint16_t weight{};
+    /// Raw TXT record data
+    std::pmr::vector<uint8_t> txt;
+
+    /// Keys of the TXT record, valid as long as txt is not changed
+    TxtView txt_view() const noexcept { return TxtView(txt); }
+};
+
+enum class BrowseEventType {
+    Added,
+    /// The PTR record expired or a goodbye packet was received
+    Removed,
+    /// The SRV or TXT record of the instance changed
+    Updated
+};
+
+struct BrowseEvent {
+    BrowseEventType type;
+    const BrowseInstance& instance;
+};
+
+/// Continuous browsing for the instances of one service type
+///
+/// The session keeps its sockets open on the mDNS port, so it also sees announcements and goodbyes
+/// that are not replies to its own queries. All records go into the shared record cache, which keeps
+/// the PTR record of the service type and the SRV and TXT records of all instances fresh. Subscribers
+/// only receive changes: instances that were added or removed and instances with changed SRV or TXT
+/// data. A new subscriber receives an Added event for every instance known at that time.
+///
+/// Call poll() in a loop to drive the session. Subscribers are called from poll() and subscribe().
+/// Instances and all other state of the session are allocated from the resource of the memory manager.
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+class BrowseSession
+{
+public:
+    using Cache = RecordCache<ThreadSafetyManager>;
+    using Subscriber = std::function<void(const BrowseEvent&)>;
+
+    /// \param service_type The service to browse for. For example "_http._tcp.local."
+    BrowseSession(MemoryManager& memory, SocketLayer& sockets, Cache& cache, std::string_view service_type);
+    ~BrowseSession();
+
+    BrowseSession(const BrowseSession&) = delete;
+    BrowseSession& operator=(const BrowseSession&) = delete;
+
+    /// \return An id for unsubscribe()
+    int subscribe(Subscriber subscriber);
+    void unsubscribe(int id);
+
+    /// Wait up to \p timeout for responses and deliver all changes to the subscribers.
+    /// Returns early when the cache has refresh queries or expiries due.
+    /// \return The number of events delivered, or <0 if the session has no open sockets or no buffer
+    int poll(std::chrono::milliseconds timeout);
+
+    std::string_view service_type() const { return m_service_type; }
+    size_t size() const { return m_instances.size(); }
+
+private:
+    static int record_callback(int sock, const struct sockaddr* from, size_t addrlen, mdns_entry_type_t entry,
+                               uint16_t query_id, uint16_t rtype, uint16_t rclass, uint32_t ttl, const void* data,
+                               size_t size, size_t name_offset, size_t name_length, size_t record_offset,
+                               size_t record_length, void* user_data);
+
+    bool is_relevant(const CacheRecord& record) const;
+    BrowseInstance& add_instance(std::string_view name);
+    bool apply(BrowseInstance& instance, const CacheRecord& record);
+    void release_instance(const BrowseInstance& instance);
+    int deliver(BrowseEventType type, const BrowseInstance& instance);
+
+    MemoryManager& m_memory;
+    SocketLayer& m_sockets;
+    Cache& m_cache;
+    std::pmr::string m_service_type;
+    std::pmr::vector<typename SocketLayer::SocketDP> m_socket_dps;
+    std::pmr::vector<int> m_fds;
+    int m_cache_observer{};
+    /// Responses arrive once per socket, each record goes into the cache once
+    DuplicateFilter<> m_duplicates;
+
+    /// Cache changes are queued by the observer and processed outside of the cache lock
+    ThreadSafetyManager m_lock;
+    std::pmr::vector<std::pair<CacheEvent, CacheRecord>> m_pending;
+    std::pmr::vector<std::pair<CacheEvent, CacheRecord>> m_processing;
+
+    std::pmr::unordered_map<std::pmr::string, BrowseInstance, NameHash, NameEqual> m_instances;
+    std::pmr::vector<std::pair<int, Subscriber>> m_subscribers;
+    int m_last_subscriber{};
+    typename MemoryManager::Buffer* m_buffer{};
+};
+
+/// Implementation ///
+
+namespace detail
+{
+
+/// Decode an uncompressed wire format name, as stored in cached record data, into dotted form
+inline FixedName rdata_name(std::span<const uint8_t> rdata, size_t offset) {
+    if (offset >= rdata.size())
+        return {};
+    return FixedName::extract(rdata.data(), rdata.size(), &offset);
+}
+
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+BrowseSession<MemoryManager, SocketLayer, ThreadSafetyManager>::BrowseSession(MemoryManager& memory,
+                                                                              SocketLayer& sockets, Cache& cache,
+                                                                              std::string_view service_type)
+    : m_memory(memory), m_sockets(sockets), m_cache(cache), m_service_type(service_type, memory.resource()),
+      m_socket_dps(memory.resource()), m_fds(memory.resource()), m_pending(memory.resource()),
+      m_processing(memory.resource()), m_instances(memory.resource()), m_subscribers(memory.resource()),
+      m_buffer(memory.acquire()) {
+    if (m_service_type.empty() || m_service_type.back() != '.')
+        m_service_type += '.';
+    // Bind to the mDNS port to also receive unsolicited announcements and goodbyes
+    m_sockets.open_client_sockets([](char*, uint8_t[16], size_t) { return true; },
+                                  [this](typename SocketLayer::SocketDP socketDp) {
+                                      m_socket_dps.push_back(socketDp);
+                                      m_fds.push_back(socketDp.socket);
+                                  },
+                                  MDNS_PORT);
+
+    m_cache_observer = m_cache.subscribe([this](CacheEvent event, const CacheRecord& record) {
+        if (event == CacheEvent::Refreshed || !is_relevant(record))
+            return;
+        auto lock = m_lock.scopeLock();
+        m_pending.emplace_back(event, record);
+    });
+    m_cache.add_interest(m_service_type, MDNS_RECORDTYPE_PTR);
+
+    // Start with what is already known
+    std::pmr::vector<CacheRecord> known(m_memory.resource());
+    m_cache.find(m_service_type, MDNS_RECORDTYPE_PTR, Clock::now(),
+                 [&known](const CacheRecord& record) { known.push_back(record); });
+    for (const CacheRecord& record : known) {
+        const FixedName name = detail::rdata_name(record.rdata, 0);
+        if (!name.empty())
+            add_instance(name);
+    }
+
+    if (!m_buffer)
+        return;
+    for (int sock : m_fds)
+        mdns_query_send(sock, MDNS_RECORDTYPE_PTR, m_service_type.data(), m_service_type.size(), m_buffer->data(),
+                        m_buffer->capacity(), 0);
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+BrowseSession<MemoryManager, SocketLayer, ThreadSafetyManager>::~BrowseSession() {
+    m_cache.unsubscribe(m_cache_observer);
+    for (const auto& instance : m_instances)
+        release_instance(instance.second);
+    m_cache.remove_interest(m_service_type, MDNS_RECORDTYPE_PTR);
+    for (auto socketDp : m_socket_dps)
+        m_sockets.close(socketDp);
+    m_memory.release(m_buffer);
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+int BrowseSession<MemoryManager, SocketLayer, ThreadSafetyManager>::subscribe(Subscriber subscriber) {
+    for (const auto& instance : m_instances)
+        subscriber(BrowseEvent{BrowseEventType::Added, instance.second});
+    m_subscribers.emplace_back(++m_last_subscriber, std::move(subscriber));
+    return m_last_subscriber;
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+void BrowseSession<MemoryManager, SocketLayer, ThreadSafetyManager>::unsubscribe(int id) {
+    std::erase_if(m_subscribers, [id](const auto& subscriber) { return subscriber.first == id; });
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+int BrowseSession<MemoryManager, SocketLayer, ThreadSafetyManager>::poll(std::chrono::milliseconds timeout) {
+    if (m_fds.empty() || !m_buffer)
+        return -1;
+
+    auto now = Clock::now();
+    auto wait_until = now + timeout;
+    if (m_cache.next_deadline() < wait_until)
+        wait_until = m_cache.next_deadline();
+    auto wait = std::chrono::duration_cast<std::chrono::microseconds>(wait_until - now);
+    if (wait.count() < 0)
+        wait = std::chrono::microseconds(0);
+
+    timeval tv{};
+    tv.tv_sec = (time_t)(wait.count() / 1000000);
+    tv.tv_usec = (suseconds_t)(wait.count() % 1000000);
+
+    int nfds = 0;
+    fd_set readfs;
+    FD_ZERO(&readfs);
+    for (int sock : m_fds) {
+        if (sock >= nfds)
+            nfds = sock + 1;
+        FD_SET(sock, &readfs);
+    }
+
+    if (select(nfds, &readfs, nullptr, nullptr, &tv) > 0) {
+        for (int sock : m_fds) {
+            if (FD_ISSET(sock, &readfs)) {
+                mdns_query_recv(sock, m_buffer->data(), m_buffer->capacity(), record_callback, this, 0);
+                m_buffer->reset();
+            }
+        }
+    }
+
+    now = Clock::now();
+    m_cache.expire(now);
+    refresh_cache(m_cache, now, std::span<const int>(m_fds), m_buffer->data(), m_buffer->capacity());
+
+    {
+        auto lock = m_lock.scopeLock();
+        m_processing.swap(m_pending);
+    }
+
+    int delivered = 0;
+    for (const auto& [event, record] : m_processing) {
+        if (record.rtype == MDNS_RECORDTYPE_PTR) {
+            const FixedName name = detail::rdata_name(record.rdata, 0);
+            auto instance_it = m_instances.find(name.view());
+            if (event == CacheEvent::Added && instance_it == m_instances.end() && !name.empty()) {
+                delivered += deliver(BrowseEventType::Added, add_instance(name));
+            } else if (event == CacheEvent::Removed && instance_it != m_instances.end()) {
+                delivered += deliver(BrowseEventType::Removed, instance_it->second);
+                release_instance(instance_it->second);
+                m_instances.erase(instance_it);
+            }
+        } else if (event == CacheEvent::Added) {
+            // SRV and TXT records of instances we do not know (yet) are picked up from the cache
+            // when the PTR record arrives
+            auto instance_it = m_instances.find(record.name.view());
+            if (instance_it != m_instances.end() && apply(instance_it->second, record))
+                delivered += deliver(BrowseEventType::Updated, instance_it->second);
+        }
+    }
+    m_processing.clear();
+
+    return delivered;
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+int BrowseSession<MemoryManager, SocketLayer, ThreadSafetyManager>::record_callback(
+    int, const struct sockaddr*, size_t, mdns_entry_type_t, uint16_t, uint16_t rtype, uint16_t rclass, uint32_t ttl,
+    const void* data, size_t size, size_t name_offset, size_t, size_t record_offset, size_t record_length,
+    void* user_data) {
+    auto* session = static_cast<BrowseSession*>(user_data);
+    const auto now = Clock::now();
+    if (session->m_duplicates.duplicate(data, size, name_offset, rtype, ttl, record_offset, record_length, now))
+        return 0;
+    session->m_cache.insert(data, size, name_offset, rtype, rclass, ttl, record_offset, record_length, now);
+    return 0;
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+bool BrowseSession<MemoryManager, SocketLayer, ThreadSafetyManager>::is_relevant(const CacheRecord& record) const {
+    const std::string_view name = record.name;
+    if (record.rtype == MDNS_RECORDTYPE_PTR)
+        return name_equal(name, m_service_type);
+    if (record.rtype != MDNS_RECORDTYPE_SRV && record.rtype != MDNS_RECORDTYPE_TXT)
+        return false;
+    // <instance>.<service type>
+    return name.size() > m_service_type.size() && name_in_domain(name, m_service_type);
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+BrowseInstance& BrowseSession<MemoryManager, SocketLayer, ThreadSafetyManager>::add_instance(std::string_view name) {
+    BrowseInstance& instance = m_instances.try_emplace(std::pmr::string(name, m_memory.resource())).first->second;
+    instance.name = name;
+
+    m_cache.add_interest(name, MDNS_RECORDTYPE_SRV);
+    m_cache.add_interest(name, MDNS_RECORDTYPE_TXT);
+
+    std::pmr::vector<CacheRecord> known(m_memory.resource());
+    auto collect = [&known](const CacheRecord& record) { known.push_back(record); };
+    auto now = Clock::now();
+    m_cache.find(name, MDNS_RECORDTYPE_SRV, now, collect);
+    m_cache.find(name, MDNS_RECORDTYPE_TXT, now, collect);
+    for (const CacheRecord& record : known)
+        apply(instance, record);
+    return instance;
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+bool BrowseSession<MemoryManager, SocketLayer, ThreadSafetyManager>::apply(
+    BrowseInstance& instance, const CacheRecord& record) {
+    if (record.rtype == MDNS_RECORDTYPE_TXT) {
+        if (std::ranges::equal(instance.txt, record.rdata))
+            return false;
+        instance.txt.assign(record.rdata.begin(), record.rdata.end());
+        return true;
+    }
+
+    if (record.rdata.size() < 7)
+        return false;
+    const uint8_t* rdata = record.rdata.data();
+    uint16_t priority = (uint16_t)((rdata[0] << 8) | rdata[1]);
+    uint16_t weight = (uint16_t)((rdata[2] << 8) | rdata[3]);
+    uint16_t port = (uint16_t)((rdata[4] << 8) | rdata[5]);
+    const FixedName target = detail::rdata_name(record.rdata, 6);
+    if (priority == instance.priority && weight == instance.weight && port == instance.port &&
+        target == std::string_view(instance.target))
+        return false;
+    instance.priority = priority;
+    instance.weight = weight;
+    instance.port = port;
+    instance.target = target.view();
+    return true;
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+void BrowseSession<MemoryManager, SocketLayer, ThreadSafetyManager>::release_instance(const BrowseInstance& instance) {
+    m_cache.remove_interest(instance.name, MDNS_RECORDTYPE_SRV);
+    m_cache.remove_interest(instance.name, MDNS_RECORDTYPE_TXT);
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+int BrowseSession<MemoryManager, SocketLayer, ThreadSafetyManager>::deliver(
+    BrowseEventType type, const BrowseInstance& instance) {
+    for (const auto& subscriber : m_subscribers)
+        subscriber.second(BrowseEvent{type, instance});
+    return 1;
+}
+
+}
@@ -1,16 +1,227 @@
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <new>
+#include <utility>
 
 namespace mdns
 {
 
-template<int NUM>
+/// Memory statistics of a memory manager, in bytes
+struct MemoryUsage {
+    /// Currently allocated
+    size_t allocated;
+    /// Highest value of allocated so far
+    size_t peak;
+    /// 0 if unlimited
+    size_t limit;
+    /// Allocations refused because of the limit
+    uint64_t failures;
+};
+
+/// Memory resource that forwards to an upstream resource, counts what is allocated and optionally
+/// enforces an upper limit. Allocations beyond the limit throw std::bad_alloc like an exhausted
+/// upstream resource would. Counting is thread safe, the upstream resource must be as well if it
+/// is used from multiple threads.
+class CountingResource : public std::pmr::memory_resource
+{
+public:
+    explicit CountingResource(std::pmr::memory_resource* upstream = std::pmr::get_default_resource(),
+                              size_t limit = 0)
+        : m_upstream(upstream), m_limit(limit) {}
+    CountingResource(const CountingResource&) = delete;
+    CountingResource& operator=(const CountingResource&) = delete;
+
+    /// \param limit The new limit in bytes, 0 for unlimited. Memory already allocated is not affected.
+    void set_limit(size_t limit) noexcept { m_limit.store(limit, std::memory_order_relaxed); }
+
+    MemoryUsage usage() const noexcept {
+        return {m_allocated.load(std::memory_order_relaxed), m_peak.load(std::memory_order_relaxed),
+                m_limit.load(std::memory_order_relaxed), m_failures.load(std::memory_order_relaxed)};
+    }
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        const size_t limit = m_limit.load(std::memory_order_relaxed);
+        const size_t allocated = m_allocated.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+        if (limit && allocated > limit) {
+            m_allocated.fetch_sub(bytes, std::memory_order_relaxed);
+            m_failures.fetch_add(1, std::memory_order_relaxed);
+            throw std::bad_alloc();
+        }
+        void* p;
+        try {
+            p = m_upstream->allocate(bytes, alignment);
+        } catch (...) {
+            m_allocated.fetch_sub(bytes, std::memory_order_relaxed);
+            throw;
+        }
+        size_t peak = m_peak.load(std::memory_order_relaxed);
+        while (allocated > peak && !m_peak.compare_exchange_weak(peak, allocated, std::memory_order_relaxed)) {
+        }
+        return p;
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+        m_upstream->deallocate(p, bytes, alignment);
+        m_allocated.fetch_sub(bytes, std::memory_order_relaxed);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+    std::pmr::memory_resource* m_upstream;
+    std::atomic<size_t> m_limit;
+    std::atomic<size_t> m_allocated{};
+    std::atomic<size_t> m_peak{};
+    std::atomic<uint64_t> m_failures{};
+};
+
+/// Bump allocator for data that lives as long as one packet is processed: decoded names, match
+/// lists and other scratch containers. Use it with the std::pmr containers. Deallocation is a no-op,
+/// reset() frees everything at once. Requests beyond the inline storage go to the upstream resource
+/// and are freed by reset() as well.
+template<size_t SIZE>
+class Arena : public std::pmr::memory_resource
+{
+public:
+    explicit Arena(std::pmr::memory_resource* upstream = std::pmr::get_default_resource())
+        : m_resource(m_storage.data(), m_storage.size(), upstream) {}
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void reset() noexcept { m_resource.release(); }
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override { return m_resource.allocate(bytes, alignment); }
+    void do_deallocate(void*, size_t, size_t) override {}
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+    alignas(std::max_align_t) std::array<std::byte, SIZE> m_storage;
+    std::pmr::monotonic_buffer_resource m_resource;
+};
+
+/// One datagram plus an arena for the data parsed from it
+template<size_t PACKET_SIZE, size_t ARENA_SIZE>
+class PacketBuffer
+{
+public:
+    explicit PacketBuffer(std::pmr::memory_resource* upstream) : m_arena(upstream) {}
+    PacketBuffer(const PacketBuffer&) = delete;
+    PacketBuffer& operator=(const PacketBuffer&) = delete;
+
+    void* data() noexcept { return m_data.data(); }
+    static constexpr size_t capacity() noexcept { return PACKET_SIZE; }
+    std::pmr::memory_resource* arena() noexcept { return &m_arena; }
+    /// Call after a packet has been processed
+    void reset() noexcept { m_arena.reset(); }
+
+private:
+    alignas(std::max_align_t) std::array<uint8_t, PACKET_SIZE> m_data;
+    Arena<ARENA_SIZE> m_arena;
+};
+
+/// Memory manager with a fixed pool of NUM packet buffers
+///
+/// All packet buffers are part of the manager object itself, acquiring and releasing buffers never
+/// touches the heap. Buffers can be acquired and released from any thread.
+/// Long lived state like the record cache and the service registry allocates from resource(), which
+/// counts the memory it hands out.
+template<int NUM, size_t PACKET_SIZE = 2048, size_t ARENA_SIZE = 4096>
 class FixedSizeBuffer
 {
 public:
-    size_t allocate(size_t) {return 0;}
-    size_t deallocate(size_t) {return 0;}
+    using Buffer = PacketBuffer<PACKET_SIZE, ARENA_SIZE>;
+
+    /// \param upstream Memory for long lived state and for packets that overflow their arena
+    /// \param limit Upper limit of the memory taken from \p upstream in bytes, 0 for unlimited
+    explicit FixedSizeBuffer(std::pmr::memory_resource* upstream = std::pmr::get_default_resource(),
+                             size_t limit = 0)
+        : m_resource(upstream, limit), m_buffers(make_buffers(std::make_index_sequence<NUM>{})) {}
+
+    static constexpr int size() noexcept { return NUM; }
+
+    /// \return A free buffer, or nullptr if all NUM buffers are in use
+    Buffer* acquire() noexcept {
+        for (int i = 0; i < NUM; ++i) {
+            bool expected = false;
+            if (!m_used[i].load(std::memory_order_relaxed) &&
+                m_used[i].compare_exchange_strong(expected, true, std::memory_order_acquire))
+                return &m_buffers[i];
+        }
+        return nullptr;
+    }
+
+    void release(Buffer* buffer) noexcept {
+        if (!buffer)
+            return;
+        buffer->reset();
+        m_used[buffer - m_buffers.data()].store(false, std::memory_order_release);
+    }
+
+    CountingResource* resource() noexcept { return &m_resource; }
+    void set_limit(size_t limit) noexcept { m_resource.set_limit(limit); }
+    /// Memory taken from the upstream resource, the pool itself is not included
+    MemoryUsage usage() const noexcept { return m_resource.usage(); }
+
+private:
+    template<size_t... I>
+    std::array<Buffer, NUM> make_buffers(std::index_sequence<I...>) {
+        return {{(static_cast<void>(I), Buffer(&m_resource))...}};
+    }
+
+    CountingResource m_resource;
+    std::array<Buffer, NUM> m_buffers;
+    std::array<std::atomic<bool>, NUM> m_used{};
+};
+
+/// Memory manager that takes everything from a std::pmr::memory_resource
+///
+/// Plug in a process wide pool or monotonic resource to control where mDNS memory comes from and
+/// set a limit to cap it. Packet buffers are allocated when acquired and returned to the resource
+/// when released, acquire() returns nullptr if the limit does not allow another buffer. Long lived
+/// state like the record cache and the service registry allocates from resource() as well, so
+/// usage() covers all memory of an Mdns instance.
+template<size_t PACKET_SIZE = 2048, size_t ARENA_SIZE = 4096>
+class DynamicMemory
+{
+public:
+    using Buffer = PacketBuffer<PACKET_SIZE, ARENA_SIZE>;
+
+    /// \param upstream Where all memory comes from, must be thread safe if buffers are acquired from
+    /// multiple threads
+    /// \param limit Upper limit in bytes, 0 for unlimited
+    explicit DynamicMemory(std::pmr::memory_resource* upstream = std::pmr::get_default_resource(), size_t limit = 0)
+        : m_resource(upstream, limit) {}
+    DynamicMemory(const DynamicMemory&) = delete;
+    DynamicMemory& operator=(const DynamicMemory&) = delete;
+
+    /// \return A new buffer, or nullptr if the memory limit is reached
+    Buffer* acquire() noexcept {
+        std::pmr::polymorphic_allocator<Buffer> allocator(&m_resource);
+        try {
+            return allocator.template new_object<Buffer>(&m_resource);
+        } catch (const std::bad_alloc&) {
+            return nullptr;
+        }
+    }
+
+    void release(Buffer* buffer) noexcept {
+        if (!buffer)
+            return;
+        std::pmr::polymorphic_allocator<Buffer> allocator(&m_resource);
+        allocator.delete_object(buffer);
+    }
+
+    CountingResource* resource() noexcept { return &m_resource; }
+    void set_limit(size_t limit) noexcept { m_resource.set_limit(limit); }
+    MemoryUsage usage() const noexcept { return m_resource.usage(); }
+
+private:
+    CountingResource m_resource;
 };
 
 }
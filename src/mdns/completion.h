@@ -0,0 +1,154 @@
+#pragma once
+
+#include "record_cache.h"
+#include "thread_safety.h"
+#include "cpp_concepts.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace mdns
+{
+
+/// How a one-shot query decides that it has received all answers
+enum class CompletionKind {
+    /// Unique records (A, AAAA, SRV) have a single owner, the first answer is the answer
+    First,
+    /// Shared records (PTR and everything else) are answered by any number of responders, the query
+    /// waits until they go quiet
+    Settle
+};
+
+inline CompletionKind completion_kind(uint16_t rtype) noexcept {
+    return rtype == MDNS_RECORDTYPE_A || rtype == MDNS_RECORDTYPE_AAAA || rtype == MDNS_RECORDTYPE_SRV
+               ? CompletionKind::First
+               : CompletionKind::Settle;
+}
+
+/// Response latencies of each interface, learned from the answers to one-shot queries
+///
+/// Keeps the smoothed latency of the answers and its mean deviation per interface, the way TCP
+/// estimates round trip times (RFC 6298). Answers to shared records are spread by the random delay
+/// of each responder (RFC 6762 6), so most of them arrive within latency + 4 * deviation of the
+/// question: that is the answer window of the interface. Interfaces that were not seen yet start
+/// with the full 120 ms responder delay.
+template<ThreadSafetyManagerType ThreadSafetyManager>
+class LatencyEstimator
+{
+public:
+    static constexpr auto INITIAL_LATENCY = std::chrono::milliseconds(120);
+    static constexpr auto MIN_WINDOW = std::chrono::milliseconds(50);
+    static constexpr auto MAX_WINDOW = std::chrono::seconds(5);
+    /// Interfaces with an estimate of their own, further ones share the initial estimate
+    static constexpr size_t MAX_INTERFACES = 32;
+
+    /// An answer arrived on \p interface \p latency after the question was sent
+    void add(unsigned interface, Clock::duration latency);
+    /// How long after a question answers arrive on \p interface
+    Clock::duration window(unsigned interface);
+
+private:
+    struct Estimate {
+        unsigned interface;
+        Clock::duration latency;
+        Clock::duration deviation;
+    };
+
+    ThreadSafetyManager m_lock;
+    std::array<Estimate, MAX_INTERFACES> m_estimates{};
+    size_t m_count{};
+};
+
+/// Completion state of one question of a one-shot query
+///
+/// Before the first answer a question is complete at its timeout. After that, a question for a
+/// unique record is complete right away. A question for shared records is complete when the answer
+/// window of every interface that answered has passed, and no answer arrived for MIN_QUIET.
+template<ThreadSafetyManagerType ThreadSafetyManager>
+class QueryCompletion
+{
+public:
+    using Latencies = LatencyEstimator<ThreadSafetyManager>;
+
+    static constexpr auto DEFAULT_TIMEOUT = std::chrono::seconds(5);
+    static constexpr auto MIN_QUIET = std::chrono::milliseconds(50);
+
+    /// \param sent When the question was sent
+    QueryCompletion(CompletionKind kind, Latencies& latencies, Clock::time_point sent,
+                    Clock::duration timeout = DEFAULT_TIMEOUT)
+        : m_kind(kind), m_latencies(latencies), m_sent(sent), m_deadline(sent + timeout), m_timeout(m_deadline) {}
+
+    /// An answer to the question arrived on \p interface at \p now
+    void answered(unsigned interface, Clock::time_point now);
+    /// The question was asked again at \p now, latencies of later answers count from then
+    void resent(Clock::time_point now) noexcept { m_sent = now; }
+
+    bool complete(Clock::time_point now) const noexcept { return now >= m_deadline; }
+    /// When the question is complete unless more answers arrive
+    Clock::time_point deadline() const noexcept { return m_deadline; }
+    size_t answers() const noexcept { return m_answers; }
+
+private:
+    CompletionKind m_kind;
+    Latencies& m_latencies;
+    Clock::time_point m_sent;
+    Clock::time_point m_deadline;
+    Clock::time_point m_timeout;
+    /// End of the answer windows of the interfaces that answered
+    Clock::time_point m_window{};
+    size_t m_answers{};
+};
+
+/// Implementation ///
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+void LatencyEstimator<ThreadSafetyManager>::add(unsigned interface, Clock::duration latency) {
+    auto lock = m_lock.scopeLock();
+    auto end = m_estimates.begin() + m_count;
+    auto it =
+        std::find_if(m_estimates.begin(), end, [interface](const Estimate& e) { return e.interface == interface; });
+    if (it == end) {
+        if (m_count == MAX_INTERFACES)
+            return;
+        *it = Estimate{interface, latency, latency / 2};
+        ++m_count;
+        return;
+    }
+    const Clock::duration error = latency > it->latency ? latency - it->latency : it->latency - latency;
+    it->deviation = (3 * it->deviation + error) / 4;
+    it->latency = (7 * it->latency + latency) / 8;
+}
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+Clock::duration LatencyEstimator<ThreadSafetyManager>::window(unsigned interface) {
+    Clock::duration latency = INITIAL_LATENCY;
+    Clock::duration deviation = INITIAL_LATENCY / 2;
+    {
+        auto lock = m_lock.scopeLock();
+        auto end = m_estimates.begin() + m_count;
+        auto it =
+            std::find_if(m_estimates.begin(), end, [interface](const Estimate& e) { return e.interface == interface; });
+        if (it != end) {
+            latency = it->latency;
+            deviation = it->deviation;
+        }
+    }
+    return std::clamp<Clock::duration>(latency + 4 * deviation, MIN_WINDOW, MAX_WINDOW);
+}
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+void QueryCompletion<ThreadSafetyManager>::answered(unsigned interface, Clock::time_point now) {
+    ++m_answers;
+    m_latencies.add(interface, now - m_sent);
+    if (m_kind == CompletionKind::First) {
+        m_deadline = now;
+        return;
+    }
+    m_window = std::max(m_window, m_sent + m_latencies.window(interface));
+    m_deadline = std::min(m_timeout, std::max(m_window, now + MIN_QUIET));
+}
+
+}
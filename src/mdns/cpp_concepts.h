@@ -1,11 +1,17 @@
 #pragma once
 
 /// Concepts in this library are entirely optionally and help to develop own implementations
-/// for memory management, thread safety and the socket layer with rich compiler error messages.
+/// for memory management, thread safety, the socket layer and tracing with rich compiler error messages.
 
 #include "buffers.h"
 #include "thread_safety.h"
+#include "ip_address.h"
+#include "trace.h"
 
+#include <array>
+#include <cstdint>
+#include <memory_resource>
+#include <optional>
 #include <string_view>
 
 #if __cpp_concepts
@@ -19,9 +25,16 @@ namespace mdns
 
 template <class T>
 concept MemoryManagerType =
-    requires (T x, size_t i) {
-        { x.allocate(i) } -> std::convertible_to<size_t> ;
-        { x.deallocate(i) } -> std::convertible_to<size_t> ;
+    requires (T x, typename T::Buffer* buffer) {
+        { x.acquire() } -> std::same_as<typename T::Buffer*>;
+        x.release(buffer);
+        { x.resource() } -> std::convertible_to<std::pmr::memory_resource*>;
+        { x.usage() } -> std::same_as<MemoryUsage>;
+        x.set_limit(size_t{});
+        { buffer->data() } -> std::convertible_to<void*>;
+        { buffer->capacity() } -> std::convertible_to<size_t>;
+        { buffer->arena() } -> std::convertible_to<std::pmr::memory_resource*>;
+        buffer->reset();
     };
 
 template<class T>
@@ -32,12 +45,17 @@ concept AddSocketCallbackConcept = std::invocable<void(SocketDP), SocketDP>;
 
 template <class T>
 concept SocketLayerType = std::is_default_constructible_v<T> &&
-requires (T x, int size, int port, typename T::SocketDP* socketDp, typename T::AcceptInterface pre, typename T::AddSocketCallback addSocketCallback) {
+requires (T x, int size, int port, typename T::SocketDP* socketDp, typename T::SocketDP openSocket, typename T::AcceptInterface pre, typename T::AddSocketCallback addSocketCallback) {
     requires AcceptInterfaceConcept<typename T::AcceptInterface>;
     requires AddSocketCallbackConcept<typename T::AddSocketCallback, typename T::SocketDP>;
     { x.hostname() } -> std::same_as<std::string_view>;
-    { x.open_service_sockets(socketDp, size) } -> std::convertible_to<std::array<typename T::SocketDP,2>>;
+    { x.open_service_sockets(true, true, port) } -> std::convertible_to<std::array<typename T::SocketDP,2>>;
     { x.open_client_sockets(pre, addSocketCallback, port) } -> std::convertible_to<int>;
+    x.close(openSocket);
+    { x.ipv4_address() } -> std::convertible_to<std::optional<uint32_t>>;
+    { x.ipv6_address() } -> std::convertible_to<std::optional<std::array<uint8_t, 16>>>;
+    { x.interface_addresses().begin()->address } -> std::convertible_to<IpAddress>;
+    { x.interface_addresses().begin()->interface } -> std::convertible_to<unsigned>;
 };
 
 
@@ -48,6 +66,24 @@ template <class T>
 concept ThreadSafetyManagerType =
 requires (T x) {
     { x.scopeLock() } -> ThreadSafetyScopeType ;
+    { x.sharedLock() } -> ThreadSafetyScopeType ;
+};
+
+template <class T>
+concept TraceType =
+requires (T x, TraceOperation operation, int sock, unsigned interface, const sockaddr* from, size_t size,
+          std::string_view name, uint16_t rtype, uint32_t ttl, const void* data) {
+    { T::ENABLED } -> std::convertible_to<bool>;
+    x.opened(operation, sock);
+    x.no_buffer(operation);
+    x.sent(operation, sock, name, rtype, sock);
+    x.received(sock, interface, from, size, size);
+    x.parsed(sock, size);
+    x.record(sock, from, size, MDNS_ENTRYTYPE_ANSWER, rtype, rtype, ttl, data, size, size, size, size);
+    x.matched(sock, rtype);
+    x.published(name, name, rtype, true);
+    x.conflict(name, name);
+    x.closed(operation, sock);
 };
 
 #else
@@ -56,6 +92,7 @@ requires (T x) {
     #define MemoryManagerType class
     #define SocketLayerType class
     #define ThreadSafetyManagerType class
+    #define TraceType class
 #endif
 
 }
@@ -0,0 +1,546 @@
+#pragma once
+
+#include "record_cache.h"
+#include "shared_cache.h"
+#include "completion.h"
+#include "query_schedule.h"
+#include "dedup.h"
+#include "metrics.h"
+#include "wire_name.h"
+#include "cpp_concepts.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <new>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace mdns
+{
+
+inline constexpr const char* DAEMON_SOCKET_PATH = "/tmp/mdnscpp.sock";
+inline constexpr const char* DAEMON_CACHE_NAME = "/mdnscpp-cache";
+
+/// Requests to a ResolverDaemon, one per datagram of its SOCK_SEQPACKET socket
+enum class DaemonRequestType : uint8_t {
+    /// Reply once the snapshot has records of the name and type. Asks the network unless the
+    /// cache already has them.
+    Query = 1,
+    /// Keep the records of the name and type fresh until RemoveInterest or until the client
+    /// disconnects. Asks the network if the cache has no records yet. Replied to right away.
+    AddInterest,
+    RemoveInterest
+};
+
+struct DaemonRequest {
+    DaemonRequestType type;
+    uint16_t rtype;
+    /// How long a query may take, 0 for QueryCompletion::DEFAULT_TIMEOUT
+    uint32_t timeout_ms;
+    uint16_t name_length;
+    char name[255];
+};
+
+struct DaemonReply {
+    /// 0 on success, -1 for malformed requests or if the cache is out of memory
+    int32_t status;
+    /// Records of the name and type in the snapshot when the reply was sent
+    uint32_t records;
+};
+
+/// Resolver shared by all processes of a host
+///
+/// Owns the mDNS sockets and the record cache so that processes do not each open their own sockets,
+/// ask the same questions and cache the same records. Clients connect to a Unix domain socket and
+/// read records from a SharedCacheWriter snapshot of the cache in shared memory, see DaemonClient.
+/// Only questions and interest go through the socket: a query is answered from the cache when it
+/// can be, otherwise it is asked on all interfaces and retransmitted like Mdns::query(), and the
+/// client receives a reply once the snapshot holds the answers or the query timed out.
+///
+/// Call poll() in a loop on one thread.
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+class ResolverDaemon
+{
+public:
+    using Cache = RecordCache<ThreadSafetyManager>;
+
+    static constexpr int MAX_CLIENTS = 256;
+
+    ResolverDaemon(MemoryManager& memory, SocketLayer& sockets, Cache& cache);
+    ~ResolverDaemon();
+
+    ResolverDaemon(const ResolverDaemon&) = delete;
+    ResolverDaemon& operator=(const ResolverDaemon&) = delete;
+
+    /// Listen on \p socket_path and publish the cache as the shared memory object \p cache_name
+    /// \return False if the socket or the shared memory cannot be created, or no mDNS socket is open
+    bool open(std::string_view socket_path = DAEMON_SOCKET_PATH, std::string_view cache_name = DAEMON_CACHE_NAME);
+
+    /// Wait up to \p timeout for responses and requests, refresh and expire the cache, publish
+    /// changes and reply to completed queries. Returns early when the cache or a query is due.
+    /// \return The number of replies sent, or <0 if the daemon is not open
+    int poll(std::chrono::milliseconds timeout);
+
+    size_t clients() const noexcept { return m_clients.size(); }
+
+private:
+    struct Client {
+        int fd;
+        /// Names and types this client added interest for
+        std::vector<std::pair<std::string, uint16_t>> interests;
+    };
+
+    struct Pending {
+        /// Client waiting for the reply, -1 if nobody is
+        int fd;
+        std::string name;
+        uint16_t rtype;
+        QueryCompletion<ThreadSafetyManager> completion;
+        QuerySchedule schedule;
+    };
+
+    static int record_callback(int sock, const struct sockaddr* from, size_t addrlen, mdns_entry_type_t entry,
+                               uint16_t query_id, uint16_t rtype, uint16_t rclass, uint32_t ttl, const void* data,
+                               size_t size, size_t name_offset, size_t name_length, size_t record_offset,
+                               size_t record_length, void* user_data);
+
+    void receive(int sock);
+    void accept_client();
+    /// \return False if the client disconnected
+    bool handle_request(Client& client, Clock::time_point now);
+    void drop_client(Client& client);
+    void ask(const std::string& name, uint16_t rtype, int fd, uint32_t timeout_ms, Clock::time_point now);
+    void send_question(const Pending& pending);
+    void reply(int fd, int32_t status, uint32_t records);
+
+    MemoryManager& m_memory;
+    SocketLayer& m_sockets;
+    Cache& m_cache;
+    std::vector<typename SocketLayer::SocketDP> m_socket_dps;
+    std::vector<int> m_fds;
+    typename MemoryManager::Buffer* m_buffer{};
+    int m_cache_observer{};
+
+    int m_listen{-1};
+    std::string m_socket_path;
+    SharedCacheWriter m_snapshot;
+    /// The cache changed since the last snapshot
+    bool m_dirty{};
+
+    std::vector<Client> m_clients;
+    std::list<Pending> m_pending;
+    LatencyEstimator<ThreadSafetyManager> m_latencies;
+    DuplicateFilter<> m_duplicates;
+    /// Interface of the packet being parsed
+    unsigned m_interface{};
+};
+
+/// Client of a ResolverDaemon
+///
+/// find() reads the shared snapshot of the daemon directly and does not wait for the daemon, except
+/// for at most SharedCacheReader::MAX_WAIT while it publishes. If the daemon died while publishing,
+/// find() returns 0 like for a cache miss. query() and the interest methods are a round trip over
+/// the socket of the daemon. After the daemon restarted, connect() again to map its new snapshot.
+class DaemonClient
+{
+public:
+    DaemonClient() = default;
+    ~DaemonClient() { close(); }
+
+    DaemonClient(const DaemonClient&) = delete;
+    DaemonClient& operator=(const DaemonClient&) = delete;
+
+    /// \return False if the daemon is not running
+    bool connect(const char* socket_path = DAEMON_SOCKET_PATH, const char* cache_name = DAEMON_CACHE_NAME);
+    void close();
+
+    /// Call \p fn with each cached record of the name and type, see SharedCacheReader::find()
+    template<class Fn>
+    size_t find(std::string_view name, uint16_t rtype, Fn&& fn) {
+        return m_snapshot.find(qualified_name(name), rtype, Clock::now(), std::forward<Fn>(fn));
+    }
+
+    /// Have the daemon ask for the name and type unless it has records of them, and wait for its
+    /// reply. Blocks up to \p timeout.
+    /// \return The number of records find() returns now, or -1 on errors
+    int query(std::string_view name, uint16_t rtype,
+              std::chrono::milliseconds timeout = QueryCompletion<SingleThreadSafe>::DEFAULT_TIMEOUT);
+
+    /// Have the daemon keep the records of the name and type fresh, see RecordCache::add_interest()
+    bool add_interest(std::string_view name, uint16_t rtype) {
+        return request(DaemonRequestType::AddInterest, name, rtype, std::chrono::milliseconds(0)) >= 0;
+    }
+    bool remove_interest(std::string_view name, uint16_t rtype) {
+        return request(DaemonRequestType::RemoveInterest, name, rtype, std::chrono::milliseconds(0)) >= 0;
+    }
+
+private:
+    int request(DaemonRequestType type, std::string_view name, uint16_t rtype, std::chrono::milliseconds timeout);
+
+    int m_fd{-1};
+    SharedCacheReader m_snapshot;
+};
+
+/// Implementation ///
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+ResolverDaemon<MemoryManager, SocketLayer, ThreadSafetyManager>::ResolverDaemon(MemoryManager& memory,
+                                                                                SocketLayer& sockets, Cache& cache)
+    : m_memory(memory), m_sockets(sockets), m_cache(cache), m_buffer(memory.acquire()) {
+    m_cache_observer = m_cache.subscribe([this](CacheEvent, const CacheRecord&) { m_dirty = true; });
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+ResolverDaemon<MemoryManager, SocketLayer, ThreadSafetyManager>::~ResolverDaemon() {
+    while (!m_clients.empty())
+        drop_client(m_clients.back());
+    if (m_listen >= 0) {
+        ::close(m_listen);
+        unlink(m_socket_path.c_str());
+    }
+    m_cache.unsubscribe(m_cache_observer);
+    for (auto socketDp : m_socket_dps)
+        m_sockets.close(socketDp);
+    m_memory.release(m_buffer);
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+bool ResolverDaemon<MemoryManager, SocketLayer, ThreadSafetyManager>::open(std::string_view socket_path,
+                                                                           std::string_view cache_name) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (m_listen >= 0 || !m_buffer || socket_path.empty() || socket_path.size() >= sizeof(address.sun_path))
+        return false;
+    memcpy(address.sun_path, socket_path.data(), socket_path.size());
+
+    // Bound to the mDNS port, questions ask for multicast responses that every querier on the link
+    // can cache
+    m_sockets.open_client_sockets([](char*, uint8_t[16], size_t) { return true; },
+                                  [this](typename SocketLayer::SocketDP socketDp) {
+                                      m_socket_dps.push_back(socketDp);
+                                      m_fds.push_back(socketDp.socket);
+                                  },
+                                  MDNS_PORT);
+    if (m_fds.empty() || !m_snapshot.open(cache_name))
+        return false;
+
+    m_listen = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (m_listen < 0)
+        return false;
+    // A socket left behind by a daemon that did not shut down cleanly
+    unlink(address.sun_path);
+    if (bind(m_listen, (const sockaddr*)&address, sizeof(address)) < 0 || listen(m_listen, 16) < 0) {
+        ::close(m_listen);
+        m_listen = -1;
+        return false;
+    }
+    // Every process of the host may use the daemon
+    chmod(address.sun_path, 0666);
+    m_socket_path = socket_path;
+    m_snapshot.publish(m_cache, Clock::now());
+    return true;
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+int ResolverDaemon<MemoryManager, SocketLayer, ThreadSafetyManager>::poll(std::chrono::milliseconds timeout) {
+    if (m_listen < 0)
+        return -1;
+
+    auto now = Clock::now();
+    auto wait_until = std::min(now + timeout, m_cache.next_deadline());
+    for (const Pending& pending : m_pending)
+        wait_until = std::min({wait_until, pending.completion.deadline(), pending.schedule.next()});
+    auto wait = std::chrono::duration_cast<std::chrono::microseconds>(wait_until - now);
+    if (wait.count() < 0)
+        wait = std::chrono::microseconds(0);
+
+    timeval tv{};
+    tv.tv_sec = (time_t)(wait.count() / 1000000);
+    tv.tv_usec = (suseconds_t)(wait.count() % 1000000);
+
+    int nfds = m_listen + 1;
+    fd_set readfs;
+    FD_ZERO(&readfs);
+    FD_SET(m_listen, &readfs);
+    for (int sock : m_fds) {
+        nfds = std::max(nfds, sock + 1);
+        FD_SET(sock, &readfs);
+    }
+    for (const Client& client : m_clients) {
+        nfds = std::max(nfds, client.fd + 1);
+        FD_SET(client.fd, &readfs);
+    }
+
+    if (select(nfds, &readfs, nullptr, nullptr, &tv) > 0) {
+        for (int sock : m_fds) {
+            if (FD_ISSET(sock, &readfs))
+                receive(sock);
+        }
+        now = Clock::now();
+        for (size_t i = 0; i < m_clients.size();) {
+            if (FD_ISSET(m_clients[i].fd, &readfs) && !handle_request(m_clients[i], now)) {
+                drop_client(m_clients[i]);
+                continue;
+            }
+            ++i;
+        }
+        if (FD_ISSET(m_listen, &readfs))
+            accept_client();
+    }
+
+    now = Clock::now();
+    m_cache.expire(now);
+    refresh_cache(m_cache, now, std::span<const int>(m_fds), m_buffer->data(), m_buffer->capacity());
+    for (Pending& pending : m_pending) {
+        if (!pending.schedule.due(now) || pending.completion.complete(now))
+            continue;
+        if (pending.schedule.sent())
+            pending.completion.resent(now);
+        send_question(pending);
+        pending.schedule.sent(now);
+    }
+
+    // Clients read the answers from the snapshot, it has to be up to date before they are told
+    if (m_dirty) {
+        m_dirty = false;
+        m_snapshot.publish(m_cache, now);
+    }
+    int replies = 0;
+    for (auto it = m_pending.begin(); it != m_pending.end();) {
+        if (!it->completion.complete(now)) {
+            ++it;
+            continue;
+        }
+        if (it->fd >= 0) {
+            reply(it->fd, 0, (uint32_t)m_cache.find(it->name, it->rtype, now, [](const CacheRecord&) {}));
+            ++replies;
+        }
+        it = m_pending.erase(it);
+    }
+    return replies;
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+void ResolverDaemon<MemoryManager, SocketLayer, ThreadSafetyManager>::receive(int sock) {
+    sockaddr_in6 from;
+    size_t from_size;
+    const size_t size = mdns_socket_recv_interface(sock, m_buffer->data(), m_buffer->capacity(), &from, &from_size,
+                                                   &m_interface);
+    // Only responses, questions of other queriers are none of our business
+    if (size >= sizeof(mdns_header_t) && (((const uint8_t*)m_buffer->data())[2] & 0x80))
+        mdns_query_parse(sock, (const sockaddr*)&from, from_size, m_buffer->data(), size, record_callback, this, 0);
+    m_buffer->reset();
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+int ResolverDaemon<MemoryManager, SocketLayer, ThreadSafetyManager>::record_callback(
+    int, const struct sockaddr*, size_t, mdns_entry_type_t entry, uint16_t, uint16_t rtype, uint16_t rclass,
+    uint32_t ttl, const void* data, size_t size, size_t name_offset, size_t, size_t record_offset,
+    size_t record_length, void* user_data) {
+    if (entry != MDNS_ENTRYTYPE_ANSWER && entry != MDNS_ENTRYTYPE_ADDITIONAL)
+        return 0;
+    auto* daemon = static_cast<ResolverDaemon*>(user_data);
+    const auto now = Clock::now();
+    if (daemon->m_duplicates.duplicate(data, size, name_offset, rtype, ttl, record_offset, record_length, now))
+        return 0;
+    if (!daemon->m_cache.insert(data, size, name_offset, rtype, rclass, ttl, record_offset, record_length, now) ||
+        !ttl)
+        return 0;
+    const WireName name(data, size, name_offset);
+    for (Pending& pending : daemon->m_pending) {
+        if (pending.rtype == rtype && name == pending.name)
+            pending.completion.answered(daemon->m_interface, now);
+    }
+    return 0;
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+void ResolverDaemon<MemoryManager, SocketLayer, ThreadSafetyManager>::accept_client() {
+    const int fd = accept4(m_listen, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0)
+        return;
+    if (m_clients.size() >= MAX_CLIENTS || fd >= FD_SETSIZE) {
+        ::close(fd);
+        return;
+    }
+    m_clients.push_back(Client{fd, {}});
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+bool ResolverDaemon<MemoryManager, SocketLayer, ThreadSafetyManager>::handle_request(Client& client,
+                                                                                     Clock::time_point now) {
+    DaemonRequest request{};
+    const ssize_t size = recv(client.fd, &request, sizeof(request), MSG_DONTWAIT);
+    if (size == 0)
+        return false;
+    if (size < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    if ((size_t)size < offsetof(DaemonRequest, name) || !request.name_length ||
+        request.name_length > sizeof(request.name) ||
+        (size_t)size < offsetof(DaemonRequest, name) + request.name_length) {
+        reply(client.fd, -1, 0);
+        return true;
+    }
+
+    const std::string name = qualified_name({request.name, request.name_length});
+    const auto cached = [&] { return m_cache.find(name, request.rtype, now, [](const CacheRecord&) {}); };
+    switch (request.type) {
+    case DaemonRequestType::Query:
+        // Answered by a query of another client or a refresh before
+        if (const size_t records = cached()) {
+            MetricsRegistry::add(MetricCounter::CacheHits);
+            if (m_dirty) {
+                m_dirty = false;
+                m_snapshot.publish(m_cache, now);
+            }
+            reply(client.fd, 0, (uint32_t)records);
+        } else {
+            MetricsRegistry::add(MetricCounter::CacheMisses);
+            ask(name, request.rtype, client.fd, request.timeout_ms, now);
+        }
+        return true;
+    case DaemonRequestType::AddInterest:
+        try {
+            m_cache.add_interest(name, request.rtype);
+            client.interests.emplace_back(name, request.rtype);
+        } catch (const std::bad_alloc&) {
+            reply(client.fd, -1, 0);
+            return true;
+        }
+        if (!cached())
+            ask(name, request.rtype, -1, 0, now);
+        reply(client.fd, 0, (uint32_t)cached());
+        return true;
+    case DaemonRequestType::RemoveInterest: {
+        auto it = std::find_if(client.interests.begin(), client.interests.end(), [&](const auto& interest) {
+            return interest.second == request.rtype && name_equal(interest.first, name);
+        });
+        if (it == client.interests.end()) {
+            reply(client.fd, -1, 0);
+            return true;
+        }
+        m_cache.remove_interest(it->first, it->second);
+        client.interests.erase(it);
+        reply(client.fd, 0, (uint32_t)cached());
+        return true;
+    }
+    }
+    reply(client.fd, -1, 0);
+    return true;
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+void ResolverDaemon<MemoryManager, SocketLayer, ThreadSafetyManager>::drop_client(Client& client) {
+    for (const auto& [name, rtype] : client.interests)
+        m_cache.remove_interest(name, rtype);
+    // Queries keep running for the other clients asking the same, their answers still get cached
+    for (Pending& pending : m_pending) {
+        if (pending.fd == client.fd)
+            pending.fd = -1;
+    }
+    ::close(client.fd);
+    std::swap(client, m_clients.back());
+    m_clients.pop_back();
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+void ResolverDaemon<MemoryManager, SocketLayer, ThreadSafetyManager>::ask(const std::string& name, uint16_t rtype,
+                                                                          int fd, uint32_t timeout_ms,
+                                                                          Clock::time_point now) {
+    const Clock::duration timeout = timeout_ms ? std::chrono::duration_cast<Clock::duration>(
+                                                     std::chrono::milliseconds(timeout_ms))
+                                               : QueryCompletion<ThreadSafetyManager>::DEFAULT_TIMEOUT;
+    m_pending.push_back(Pending{fd, name, rtype,
+                                QueryCompletion<ThreadSafetyManager>(completion_kind(rtype), m_latencies, now, timeout),
+                                QuerySchedule(now)});
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+void ResolverDaemon<MemoryManager, SocketLayer, ThreadSafetyManager>::send_question(const Pending& pending) {
+    // Another client asking the same is already waiting for the answers of the earlier question
+    for (const Pending& other : m_pending) {
+        if (&other == &pending)
+            break;
+        if (other.rtype == pending.rtype && name_equal(other.name, pending.name) && other.schedule.sent())
+            return;
+    }
+    for (int sock : m_fds) {
+        mdns_query_send(sock, (mdns_record_type_t)pending.rtype, pending.name.data(), pending.name.size(),
+                        m_buffer->data(), m_buffer->capacity(), 0);
+    }
+    m_buffer->reset();
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+void ResolverDaemon<MemoryManager, SocketLayer, ThreadSafetyManager>::reply(int fd, int32_t status,
+                                                                            uint32_t records) {
+    const DaemonReply message{status, records};
+    send(fd, &message, sizeof(message), MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+inline bool DaemonClient::connect(const char* socket_path, const char* cache_name) {
+    close();
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path))
+        return false;
+    strcpy(address.sun_path, socket_path);
+    m_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (m_fd < 0)
+        return false;
+    if (::connect(m_fd, (const sockaddr*)&address, sizeof(address)) < 0 || !m_snapshot.open(cache_name)) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+inline void DaemonClient::close() {
+    if (m_fd >= 0)
+        ::close(m_fd);
+    m_fd = -1;
+    m_snapshot.close();
+}
+
+inline int DaemonClient::query(std::string_view name, uint16_t rtype, std::chrono::milliseconds timeout) {
+    return request(DaemonRequestType::Query, name, rtype, timeout);
+}
+
+inline int DaemonClient::request(DaemonRequestType type, std::string_view name, uint16_t rtype,
+                                 std::chrono::milliseconds timeout) {
+    DaemonRequest request{};
+    if (m_fd < 0 || name.empty() || name.size() > sizeof(request.name))
+        return -1;
+    request.type = type;
+    request.rtype = rtype;
+    request.timeout_ms = (uint32_t)timeout.count();
+    request.name_length = (uint16_t)name.size();
+    memcpy(request.name, name.data(), name.size());
+    if (send(m_fd, &request, offsetof(DaemonRequest, name) + name.size(), MSG_NOSIGNAL) < 0)
+        return -1;
+
+    // The daemon replies at the end of the query timeout at the latest
+    const auto limit = timeout + std::chrono::seconds(timeout.count() ? 1 : 6);
+    timeval tv{};
+    tv.tv_sec = (time_t)std::chrono::duration_cast<std::chrono::seconds>(limit).count();
+    setsockopt(m_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    DaemonReply reply{};
+    if (recv(m_fd, &reply, sizeof(reply), 0) != (ssize_t)sizeof(reply) || reply.status < 0)
+        return -1;
+    return (int)reply.records;
+}
+
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "mdns_old.h"
+#include "metrics.h"
+#include "record_cache.h"
+#include "wire_name.h"
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace mdns
+{
+
+/// Drops records that arrive again within a short window
+///
+/// Client sockets are opened per interface address, so a response usually arrives once per socket
+/// and address family. The filter remembers a 64 bit hash of the name, type and record data of each
+/// record it has let through, so the copies can be dropped before their names are decoded and the
+/// record callback runs. Names are hashed label by label, copies compressed differently are still
+/// recognized. Goodbye records (TTL 0) are distinct from announcements of the same record.
+///
+/// The table is lossy: a hash can go into one of WAYS neighbouring slots and evicts the oldest of
+/// them, so under load a copy is occasionally delivered once more. A record is never dropped unless
+/// its hash was seen within WINDOW. Not thread safe, use one filter per receiving thread.
+template<size_t Slots = 256>
+class DuplicateFilter
+{
+    static_assert((Slots & (Slots - 1)) == 0, "Slots must be a power of two");
+
+public:
+    /// Copies of one response arrive within microseconds, later repetitions are new information
+    /// to the cache (RFC 6762 10.2 uses the same one second for cache flushes)
+    static constexpr auto WINDOW = std::chrono::seconds(1);
+    /// Slots a hash can occupy. Records of one response evicting each other from a single slot
+    /// would defeat the filter.
+    static constexpr size_t WAYS = 4;
+
+    /// Arguments as passed to mdns_record_callback_fn
+    static uint64_t record_hash(const void* data, size_t size, size_t name_offset, uint16_t rtype, uint32_t ttl,
+                                size_t record_offset, size_t record_length) noexcept;
+
+    /// \return True if \p hash was seen within WINDOW before \p now, otherwise remembers it
+    bool duplicate(uint64_t hash, Clock::time_point now) noexcept;
+
+    /// record_hash() and duplicate() in one
+    bool duplicate(const void* data, size_t size, size_t name_offset, uint16_t rtype, uint32_t ttl,
+                   size_t record_offset, size_t record_length, Clock::time_point now) noexcept {
+        return duplicate(record_hash(data, size, name_offset, rtype, ttl, record_offset, record_length), now);
+    }
+
+    /// Number of records dropped so far
+    size_t dropped() const noexcept { return m_dropped; }
+
+private:
+    struct Slot {
+        uint64_t hash;
+        Clock::time_point seen;
+    };
+
+    std::array<Slot, Slots> m_slots{};
+    size_t m_dropped{};
+};
+
+/// Implementation ///
+
+template<size_t Slots>
+uint64_t DuplicateFilter<Slots>::record_hash(const void* data, size_t size, size_t name_offset, uint16_t rtype,
+                                             uint32_t ttl, size_t record_offset, size_t record_length) noexcept {
+    const auto mix = [](uint64_t hash, uint64_t value) { return (hash ^ value) * 0x100000001b3ULL; };
+    uint64_t hash = mix(WireName(data, size, name_offset).fingerprint(), rtype);
+    hash = mix(hash, ttl == 0);
+    if (record_offset > size || record_length > size - record_offset)
+        return hash;
+
+    // Names in record data may be compressed differently in each copy, the same types as
+    // mdns_record_rdata_expand expands
+    size_t rdata_name = record_length;
+    if (rtype == MDNS_RECORDTYPE_PTR)
+        rdata_name = 0;
+    else if (rtype == MDNS_RECORDTYPE_SRV && record_length >= 8)
+        rdata_name = 6;
+    const auto* rdata = (const uint8_t*)data + record_offset;
+    for (size_t i = 0; i < rdata_name; ++i)
+        hash = mix(hash, rdata[i]);
+    if (rdata_name < record_length)
+        hash = mix(hash, WireName(data, size, record_offset + rdata_name).fingerprint());
+    return hash;
+}
+
+template<size_t Slots>
+bool DuplicateFilter<Slots>::duplicate(uint64_t hash, Clock::time_point now) noexcept {
+    const size_t first = (size_t)(hash ^ (hash >> 32));
+    Slot* oldest = nullptr;
+    for (size_t way = 0; way < WAYS; ++way) {
+        Slot& slot = m_slots[(first + way) & (Slots - 1)];
+        if (slot.hash == hash && now - slot.seen < WINDOW) {
+            ++m_dropped;
+            MetricsRegistry::add(MetricCounter::Duplicates);
+            return true;
+        }
+        if (!oldest || slot.seen < oldest->seen)
+            oldest = &slot;
+    }
+    *oldest = Slot{hash, now};
+    return false;
+}
+
+}
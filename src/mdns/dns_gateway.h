@@ -0,0 +1,489 @@
+#pragma once
+
+#include "record_cache.h"
+#include "completion.h"
+#include "query_schedule.h"
+#include "dedup.h"
+#include "metrics.h"
+#include "packet_writer.h"
+#include "wire_name.h"
+#include "fixed_name.h"
+#include "dns_name.h"
+#include "cpp_concepts.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace mdns
+{
+
+inline constexpr const char* DNS_GATEWAY_ADDRESS = "127.0.0.53";
+inline constexpr uint16_t DNS_GATEWAY_PORT = 5300;
+
+/// Answers unicast DNS queries for .local names from the record cache
+///
+/// For software that only speaks regular DNS: point its resolver, or a forwarding rule of the system
+/// resolver, at the gateway. A request is answered from the cache as soon as it is received when the
+/// cache has the records, so a cached lookup costs a receive, a cache lookup and a send. Requests
+/// that miss are asked on all interfaces: the questions of all requests that missed since the last
+/// poll() go out together, are retransmitted like Mdns::query(), and each request is answered when
+/// its question completes (see QueryCompletion) or its timeout passed.
+///
+/// Only names below local. are served, other names are refused. A name without records of any type
+/// in the cache is answered with NXDOMAIN. Answers larger than the UDP payload size of the client
+/// (512 bytes without EDNS) are sent without records and with the truncation bit, TCP is not served.
+///
+/// Call poll() in a loop on one thread.
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+class DnsGateway
+{
+public:
+    using Cache = RecordCache<ThreadSafetyManager>;
+
+    /// Stub resolvers retry after 5 seconds, the answer has to be there before
+    static constexpr auto DEFAULT_TIMEOUT = std::chrono::seconds(2);
+    /// Requests waiting for the network, further misses are answered with SERVFAIL
+    static constexpr size_t MAX_PENDING = 1024;
+    /// Requests handled per poll() before the mDNS sockets are read again
+    static constexpr int MAX_REQUESTS = 64;
+    /// EDNS payload size offered to clients (DNS flag day 2020)
+    static constexpr uint16_t MAX_PAYLOAD = 1232;
+
+    DnsGateway(MemoryManager& memory, SocketLayer& sockets, Cache& cache);
+    ~DnsGateway();
+
+    DnsGateway(const DnsGateway&) = delete;
+    DnsGateway& operator=(const DnsGateway&) = delete;
+
+    /// Listen for DNS requests on the UDP port \p port of \p address, an IPv4 or IPv6 address
+    /// \param timeout How long a request that missed the cache waits for the network
+    /// \return False if the socket cannot be bound or no mDNS socket is open
+    bool open(std::string_view address = DNS_GATEWAY_ADDRESS, uint16_t port = DNS_GATEWAY_PORT,
+              Clock::duration timeout = DEFAULT_TIMEOUT);
+
+    /// Wait up to \p timeout for requests and responses, answer requests, send due questions and
+    /// expire the cache. Returns early when the cache or a pending request is due.
+    /// \return The number of DNS responses sent, or <0 if the gateway is not open
+    int poll(std::chrono::milliseconds timeout);
+
+    /// Requests waiting for the network
+    size_t pending() const noexcept { return m_pending.size(); }
+
+private:
+    enum class ResponseCode : uint16_t {
+        NoError = 0,
+        FormatError = 1,
+        ServerFailure = 2,
+        NameError = 3,
+        NotImplemented = 4,
+        Refused = 5
+    };
+
+    struct Request {
+        sockaddr_in6 from;
+        size_t from_size;
+        uint16_t id;
+        uint16_t flags;
+        FixedName name;
+        uint16_t rtype;
+        uint16_t rclass;
+        /// UDP payload size of the client, 0 if the request has no EDNS record
+        uint16_t payload;
+        size_t questions;
+    };
+
+    struct Pending {
+        Request request;
+        QueryCompletion<ThreadSafetyManager> completion;
+        QuerySchedule schedule;
+    };
+
+    static int request_callback(int sock, const struct sockaddr* from, size_t addrlen, mdns_entry_type_t entry,
+                                uint16_t query_id, uint16_t rtype, uint16_t rclass, uint32_t ttl, const void* data,
+                                size_t size, size_t name_offset, size_t name_length, size_t record_offset,
+                                size_t record_length, void* user_data);
+    static int record_callback(int sock, const struct sockaddr* from, size_t addrlen, mdns_entry_type_t entry,
+                               uint16_t query_id, uint16_t rtype, uint16_t rclass, uint32_t ttl, const void* data,
+                               size_t size, size_t name_offset, size_t name_length, size_t record_offset,
+                               size_t record_length, void* user_data);
+    /// True if a record of type \p rtype answers a question for \p question
+    static bool answers(uint16_t question, uint16_t rtype) noexcept;
+
+    void receive(int sock);
+    /// \return The number of responses sent right away
+    int handle_requests(Clock::time_point now);
+    /// Send the records of the cache that answer \p request. Unless \p final, nothing is sent if
+    /// there are none. \return True if a response was sent
+    bool respond(const Request& request, Clock::time_point now, bool final);
+    void respond_error(const Request& request, ResponseCode code);
+    void send_questions(Clock::time_point now);
+
+    MemoryManager& m_memory;
+    SocketLayer& m_sockets;
+    Cache& m_cache;
+    std::vector<typename SocketLayer::SocketDP> m_socket_dps;
+    std::vector<int> m_fds;
+    typename MemoryManager::Buffer* m_buffer{};
+
+    int m_listen{-1};
+    Clock::duration m_timeout{DEFAULT_TIMEOUT};
+    std::list<Pending> m_pending;
+    LatencyEstimator<ThreadSafetyManager> m_latencies;
+    DuplicateFilter<> m_duplicates;
+    /// Interface of the packet being parsed
+    unsigned m_interface{};
+};
+
+/// Implementation ///
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+DnsGateway<MemoryManager, SocketLayer, ThreadSafetyManager>::DnsGateway(MemoryManager& memory, SocketLayer& sockets,
+                                                                        Cache& cache)
+    : m_memory(memory), m_sockets(sockets), m_cache(cache), m_buffer(memory.acquire()) {}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+DnsGateway<MemoryManager, SocketLayer, ThreadSafetyManager>::~DnsGateway() {
+    if (m_listen >= 0)
+        ::close(m_listen);
+    for (auto socketDp : m_socket_dps)
+        m_sockets.close(socketDp);
+    m_memory.release(m_buffer);
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+bool DnsGateway<MemoryManager, SocketLayer, ThreadSafetyManager>::open(std::string_view address, uint16_t port,
+                                                                       Clock::duration timeout) {
+    if (m_listen >= 0 || !m_buffer)
+        return false;
+    sockaddr_in6 bind_address{};
+    size_t bind_size = 0;
+    const std::string text(address);
+    auto* ipv4 = (sockaddr_in*)&bind_address;
+    if (inet_pton(AF_INET, text.c_str(), &ipv4->sin_addr) == 1) {
+        ipv4->sin_family = AF_INET;
+        ipv4->sin_port = htons(port);
+        bind_size = sizeof(sockaddr_in);
+    } else if (inet_pton(AF_INET6, text.c_str(), &bind_address.sin6_addr) == 1) {
+        bind_address.sin6_family = AF_INET6;
+        bind_address.sin6_port = htons(port);
+        bind_size = sizeof(sockaddr_in6);
+    } else {
+        return false;
+    }
+
+    // Bound to the mDNS port, questions ask for multicast responses that every querier on the link
+    // can cache
+    m_sockets.open_client_sockets([](char*, uint8_t[16], size_t) { return true; },
+                                  [this](typename SocketLayer::SocketDP socketDp) {
+                                      m_socket_dps.push_back(socketDp);
+                                      m_fds.push_back(socketDp.socket);
+                                  },
+                                  MDNS_PORT);
+    if (m_fds.empty())
+        return false;
+
+    m_listen = socket(bind_address.sin6_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m_listen < 0)
+        return false;
+    if (bind(m_listen, (const sockaddr*)&bind_address, (socklen_t)bind_size) < 0) {
+        ::close(m_listen);
+        m_listen = -1;
+        return false;
+    }
+    m_timeout = timeout;
+    return true;
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+int DnsGateway<MemoryManager, SocketLayer, ThreadSafetyManager>::poll(std::chrono::milliseconds timeout) {
+    if (m_listen < 0)
+        return -1;
+
+    auto now = Clock::now();
+    auto wait_until = std::min(now + timeout, m_cache.next_deadline());
+    for (const Pending& pending : m_pending)
+        wait_until = std::min({wait_until, pending.completion.deadline(), pending.schedule.next()});
+    auto wait = std::chrono::duration_cast<std::chrono::microseconds>(wait_until - now);
+    if (wait.count() < 0)
+        wait = std::chrono::microseconds(0);
+
+    timeval tv{};
+    tv.tv_sec = (time_t)(wait.count() / 1000000);
+    tv.tv_usec = (suseconds_t)(wait.count() % 1000000);
+
+    int nfds = m_listen + 1;
+    fd_set readfs;
+    FD_ZERO(&readfs);
+    FD_SET(m_listen, &readfs);
+    for (int sock : m_fds) {
+        nfds = std::max(nfds, sock + 1);
+        FD_SET(sock, &readfs);
+    }
+
+    int responses = 0;
+    if (select(nfds, &readfs, nullptr, nullptr, &tv) > 0) {
+        for (int sock : m_fds) {
+            if (FD_ISSET(sock, &readfs))
+                receive(sock);
+        }
+        if (FD_ISSET(m_listen, &readfs))
+            responses += handle_requests(Clock::now());
+    }
+
+    now = Clock::now();
+    m_cache.expire(now);
+    refresh_cache(m_cache, now, std::span<const int>(m_fds), m_buffer->data(), m_buffer->capacity());
+    send_questions(now);
+    for (auto it = m_pending.begin(); it != m_pending.end();) {
+        if (!it->completion.complete(now)) {
+            ++it;
+            continue;
+        }
+        responses += respond(it->request, now, true);
+        it = m_pending.erase(it);
+    }
+    return responses;
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+void DnsGateway<MemoryManager, SocketLayer, ThreadSafetyManager>::receive(int sock) {
+    sockaddr_in6 from;
+    size_t from_size;
+    const size_t size = mdns_socket_recv_interface(sock, m_buffer->data(), m_buffer->capacity(), &from, &from_size,
+                                                   &m_interface);
+    // Only responses, questions of other queriers are none of our business
+    if (size >= sizeof(mdns_header_t) && (((const uint8_t*)m_buffer->data())[2] & 0x80))
+        mdns_query_parse(sock, (const sockaddr*)&from, from_size, m_buffer->data(), size, record_callback, this, 0);
+    m_buffer->reset();
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+int DnsGateway<MemoryManager, SocketLayer, ThreadSafetyManager>::record_callback(
+    int, const struct sockaddr*, size_t, mdns_entry_type_t entry, uint16_t, uint16_t rtype, uint16_t rclass,
+    uint32_t ttl, const void* data, size_t size, size_t name_offset, size_t, size_t record_offset,
+    size_t record_length, void* user_data) {
+    if (entry != MDNS_ENTRYTYPE_ANSWER && entry != MDNS_ENTRYTYPE_ADDITIONAL)
+        return 0;
+    auto* gateway = static_cast<DnsGateway*>(user_data);
+    const auto now = Clock::now();
+    if (gateway->m_duplicates.duplicate(data, size, name_offset, rtype, ttl, record_offset, record_length, now))
+        return 0;
+    if (!gateway->m_cache.insert(data, size, name_offset, rtype, rclass, ttl, record_offset, record_length, now) ||
+        !ttl)
+        return 0;
+    const WireName name(data, size, name_offset);
+    for (Pending& pending : gateway->m_pending) {
+        if (answers(pending.request.rtype, rtype) && name == pending.request.name)
+            pending.completion.answered(gateway->m_interface, now);
+    }
+    return 0;
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+bool DnsGateway<MemoryManager, SocketLayer, ThreadSafetyManager>::answers(uint16_t question, uint16_t rtype) noexcept {
+    constexpr uint16_t any = 255;
+    if (question == rtype || question == any)
+        return true;
+    // Responders add the addresses of the other family to address answers (RFC 6762 6.2), an A
+    // answer without AAAA records means the host has none
+    const auto address = [](uint16_t type) { return type == MDNS_RECORDTYPE_A || type == MDNS_RECORDTYPE_AAAA; };
+    return address(question) && address(rtype);
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+int DnsGateway<MemoryManager, SocketLayer, ThreadSafetyManager>::request_callback(
+    int, const struct sockaddr*, size_t, mdns_entry_type_t entry, uint16_t, uint16_t rtype, uint16_t rclass,
+    uint32_t, const void* data, size_t size, size_t name_offset, size_t, size_t, size_t, void* user_data) {
+    constexpr uint16_t opt = 41;
+    auto* request = static_cast<Request*>(user_data);
+    if (entry == MDNS_ENTRYTYPE_QUESTION) {
+        if (!request->questions++) {
+            request->name = WireName(data, size, name_offset).decompress();
+            request->rtype = rtype;
+            request->rclass = rclass;
+        }
+    } else if (entry == MDNS_ENTRYTYPE_ADDITIONAL && rtype == opt) {
+        // The class of the EDNS record is the payload size, smaller ones mean 512 (RFC 6891 6.2.3)
+        request->payload = std::max<uint16_t>(rclass, 512);
+    }
+    return 0;
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+int DnsGateway<MemoryManager, SocketLayer, ThreadSafetyManager>::handle_requests(Clock::time_point now) {
+    int responses = 0;
+    for (int i = 0; i < MAX_REQUESTS; ++i) {
+        Request request{};
+        const size_t size =
+            mdns_socket_recv(m_listen, m_buffer->data(), m_buffer->capacity(), &request.from, &request.from_size);
+        if (!size)
+            break;
+        const auto* header = (const uint8_t*)m_buffer->data();
+        // Responses are never requests, and too short datagrams cannot be answered
+        if (size < sizeof(mdns_header_t) || (header[2] & 0x80)) {
+            m_buffer->reset();
+            continue;
+        }
+        request.id = (uint16_t)((header[0] << 8) | header[1]);
+        request.flags = (uint16_t)((header[2] << 8) | header[3]);
+        mdns_packet_parse(m_listen, (const sockaddr*)&request.from, request.from_size, m_buffer->data(), size,
+                          request_callback, &request);
+        m_buffer->reset();
+
+        const unsigned opcode = (request.flags >> 11) & 0xF;
+        if (opcode) {
+            respond_error(request, ResponseCode::NotImplemented);
+        } else if (request.questions != 1 || request.name.empty()) {
+            respond_error(request, ResponseCode::FormatError);
+        } else if ((request.rclass & ~MDNS_UNICAST_RESPONSE) != MDNS_CLASS_IN ||
+                   !name_in_domain(request.name, "local.")) {
+            respond_error(request, ResponseCode::Refused);
+        } else if (respond(request, now, false)) {
+            MetricsRegistry::add(MetricCounter::CacheHits);
+            ++responses;
+            continue;
+        } else {
+            // A client that did not get an answer yet asks again, it is already waiting
+            const bool waiting = std::any_of(m_pending.begin(), m_pending.end(), [&](const Pending& pending) {
+                return pending.request.id == request.id && pending.request.from_size == request.from_size &&
+                       !memcmp(&pending.request.from, &request.from, request.from_size);
+            });
+            if (waiting)
+                continue;
+            MetricsRegistry::add(MetricCounter::CacheMisses);
+            if (m_pending.size() >= MAX_PENDING) {
+                respond_error(request, ResponseCode::ServerFailure);
+            } else {
+                m_pending.push_back(Pending{request,
+                                            QueryCompletion<ThreadSafetyManager>(completion_kind(request.rtype),
+                                                                                 m_latencies, now, m_timeout),
+                                            QuerySchedule(now)});
+                continue;
+            }
+        }
+        ++responses;
+    }
+    return responses;
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+bool DnsGateway<MemoryManager, SocketLayer, ThreadSafetyManager>::respond(const Request& request,
+                                                                          Clock::time_point now, bool final) {
+    constexpr uint16_t any = 255;
+    constexpr uint16_t opt = 41;
+    constexpr uint16_t truncated = 0x0200;
+    std::vector<CacheRecord> records;
+    if (request.rtype == any) {
+        m_cache.for_each(now, [&](const CacheRecord& record) {
+            if (name_equal(record.name, request.name))
+                records.push_back(record);
+        });
+    } else {
+        m_cache.find(request.name, request.rtype, now, [&](const CacheRecord& record) { records.push_back(record); });
+    }
+    if (records.empty() && !final)
+        return false;
+
+    // Without records of the asked type the name may still exist, with records of other types
+    ResponseCode code = ResponseCode::NoError;
+    if (records.empty()) {
+        bool exists = false;
+        m_cache.for_each(now, [&](const CacheRecord& record) { exists |= name_equal(record.name, request.name); });
+        if (!exists)
+            code = ResponseCode::NameError;
+    }
+
+    // Authoritative answer, the recursion desired bit is copied from the request
+    const uint16_t flags = (uint16_t)(0x8400 | (request.flags & 0x0100) | (uint16_t)code);
+    const size_t limit = std::min<size_t>(m_buffer->capacity(), request.payload ? request.payload : 512);
+    const uint16_t payload = std::min<uint16_t>(MAX_PAYLOAD, (uint16_t)std::min<size_t>(m_buffer->capacity(), 0xFFFF));
+    PacketWriter writer(m_buffer->data(), limit);
+    const auto write = [&](uint16_t extra_flags, bool with_records) {
+        writer.begin(request.id, flags | extra_flags);
+        if (!writer.question(request.name, request.rtype, request.rclass))
+            return false;
+        if (with_records) {
+            for (const CacheRecord& record : records) {
+                const auto left = std::chrono::duration_cast<std::chrono::seconds>(record.expires - now);
+                if (!writer.record(MDNS_ENTRYTYPE_ANSWER, record.name, record.rtype, record.rclass,
+                                   (uint32_t)std::max<Clock::rep>(left.count(), 0), record.rdata))
+                    return false;
+            }
+        }
+        return !request.payload || writer.record(MDNS_ENTRYTYPE_ADDITIONAL, "", opt, payload, 0, {});
+    };
+    bool written = write(0, true) || write(truncated, false);
+    if (written)
+        mdns_unicast_send(m_listen, &request.from, request.from_size, writer.data(), writer.size());
+    m_buffer->reset();
+    return written;
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+void DnsGateway<MemoryManager, SocketLayer, ThreadSafetyManager>::respond_error(const Request& request,
+                                                                                ResponseCode code) {
+    // Just the header, the question may be what could not be parsed
+    PacketWriter writer(m_buffer->data(), m_buffer->capacity());
+    writer.begin(request.id, (uint16_t)(0x8000 | (request.flags & 0x7900) | (uint16_t)code));
+    mdns_unicast_send(m_listen, &request.from, request.from_size, writer.data(), writer.size());
+    m_buffer->reset();
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+void DnsGateway<MemoryManager, SocketLayer, ThreadSafetyManager>::send_questions(Clock::time_point now) {
+    constexpr size_t batch = 16;
+    mdns_question_t questions[batch];
+    size_t count = 0;
+    const auto flush = [&] {
+        for (int sock : m_fds) {
+            if (count)
+                mdns_query_send_multi(sock, questions, count, m_buffer->data(), m_buffer->capacity(), 0);
+        }
+        m_buffer->reset();
+        count = 0;
+    };
+
+    for (Pending& pending : m_pending) {
+        if (!pending.schedule.due(now) || pending.completion.complete(now))
+            continue;
+        if (pending.schedule.sent())
+            pending.completion.resent(now);
+        pending.schedule.sent(now);
+        const Request& request = pending.request;
+        const auto ask = [&](uint16_t rtype) {
+            // Requests of several clients for the same name share the question
+            const bool asked = std::any_of(questions, questions + count, [&](const mdns_question_t& question) {
+                return question.type == rtype && name_equal({question.name, question.length}, request.name);
+            });
+            if (asked)
+                return;
+            if (count == batch)
+                flush();
+            questions[count++] = {request.name.data(), request.name.size(), rtype};
+        };
+        ask(request.rtype);
+        // Clients ask for both address families, a host without addresses of one family only
+        // answers the question for the other
+        if (request.rtype == MDNS_RECORDTYPE_A)
+            ask(MDNS_RECORDTYPE_AAAA);
+        else if (request.rtype == MDNS_RECORDTYPE_AAAA)
+            ask(MDNS_RECORDTYPE_A);
+    }
+    flush();
+}
+
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace mdns
+{
+
+/// Name and record type, the key of a record set
+struct NameType {
+    std::string_view name;
+    uint16_t rtype;
+};
+
+/// DNS names compare case insensitive (ASCII only, RFC 4343)
+inline bool name_equal(std::string_view lhs, std::string_view rhs) noexcept {
+    if (lhs.size() != rhs.size())
+        return false;
+    for (size_t i = 0; i < lhs.size(); ++i) {
+        char l = lhs[i], r = rhs[i];
+        if (l >= 'A' && l <= 'Z')
+            l = (char)(l | 0x20);
+        if (r >= 'A' && r <= 'Z')
+            r = (char)(r | 0x20);
+        if (l != r)
+            return false;
+    }
+    return true;
+}
+
+/// FNV-1a over the lower-cased name, the part of name_hash() that can be computed once per name
+inline uint64_t name_fingerprint(std::string_view name) noexcept {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (char c : name) {
+        if (c >= 'A' && c <= 'Z')
+            c = (char)(c | 0x20);
+        hash = (hash ^ (uint8_t)c) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+inline size_t name_hash(uint64_t fingerprint, uint16_t rtype) noexcept {
+    return (size_t)((fingerprint ^ rtype) * 0x100000001b3ULL);
+}
+
+inline size_t name_hash(std::string_view name, uint16_t rtype) noexcept {
+    return name_hash(name_fingerprint(name), rtype);
+}
+
+class WireName;
+
+/// Hash and equality for DNS names, usable for heterogeneous lookup with std::string_view and with
+/// a WireName (defined in wire_name.h), which is looked up without decoding it
+struct NameHash {
+    using is_transparent = void;
+    size_t operator()(std::string_view name) const noexcept { return name_hash(name, 0); }
+    size_t operator()(const WireName& name) const noexcept;
+};
+
+struct NameEqual {
+    using is_transparent = void;
+    bool operator()(std::string_view lhs, std::string_view rhs) const noexcept { return name_equal(lhs, rhs); }
+    bool operator()(std::string_view lhs, const WireName& rhs) const noexcept;
+    bool operator()(const WireName& lhs, std::string_view rhs) const noexcept;
+};
+
+/// True if \p name is \p domain or a name below \p domain
+inline bool name_in_domain(std::string_view name, std::string_view domain) noexcept {
+    if (name.size() < domain.size())
+        return false;
+    if (name.size() > domain.size() && name[name.size() - domain.size() - 1] != '.')
+        return false;
+    return name_equal(name.substr(name.size() - domain.size()), domain);
+}
+
+/// Append a trailing dot if missing, so names can be compared in their fully qualified form
+inline std::string qualified_name(std::string_view name) {
+    std::string result(name);
+    if (result.empty() || result.back() != '.')
+        result += '.';
+    return result;
+}
+
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include "dns_name.h"
+#include "mdns_old.h"
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string_view>
+#include <type_traits>
+
+#if __has_include(<format>)
+#include <format>
+#endif
+
+namespace mdns
+{
+
+/// A domain name in dotted form ("host.local.") with inline storage
+///
+/// Names are at most 255 bytes (RFC 1035 2.3.4), so a FixedName can hold every name of a valid
+/// packet without touching the heap. It is trivially copyable and can be stored in containers,
+/// queues and shared memory by value. The case insensitive hash is computed once on construction.
+class FixedName
+{
+public:
+    static constexpr size_t CAPACITY = 255;
+
+    constexpr FixedName() noexcept = default;
+    /// Names longer than CAPACITY yield an empty name
+    explicit FixedName(std::string_view name) noexcept { assign(name); }
+
+    /// Decode a possibly compressed name from a packet, see WireName::decompress
+    /// \param offset Advanced past the name, MDNS_INVALID_POS for malformed names
+    /// \return An empty name for malformed names: reference loops, labels beyond the packet or more
+    /// than CAPACITY bytes
+    static FixedName extract(const void* buffer, size_t size, size_t* offset) noexcept;
+
+    std::string_view view() const noexcept { return {m_data, m_length}; }
+    operator std::string_view() const noexcept { return view(); }
+    const char* data() const noexcept { return m_data; }
+    /// Always null terminated, for printf("%s")
+    const char* c_str() const noexcept { return m_data; }
+    size_t size() const noexcept { return m_length; }
+    bool empty() const noexcept { return !m_length; }
+
+    /// This name with a trailing dot, see qualified_name(). Empty if the dot does not fit.
+    FixedName qualified() const noexcept {
+        if (m_length && m_data[m_length - 1] == '.')
+            return *this;
+        char text[CAPACITY + 1];
+        memcpy(text, m_data, m_length);
+        text[m_length] = '.';
+        return FixedName(std::string_view(text, m_length + 1));
+    }
+
+    /// Same value as name_hash(view(), rtype), without looking at the name again
+    size_t hash(uint16_t rtype = 0) const noexcept { return name_hash(m_fingerprint, rtype); }
+
+    /// Case insensitive like all DNS name comparisons
+    friend bool operator==(const FixedName& lhs, const FixedName& rhs) noexcept {
+        return lhs.m_fingerprint == rhs.m_fingerprint && name_equal(lhs.view(), rhs.view());
+    }
+    friend bool operator==(const FixedName& lhs, std::string_view rhs) noexcept { return name_equal(lhs.view(), rhs); }
+
+private:
+    void assign(std::string_view name) noexcept {
+        if (name.size() > CAPACITY)
+            name = {};
+        memcpy(m_data, name.data(), name.size());
+        m_length = (uint8_t)name.size();
+        m_data[m_length] = 0;
+        m_fingerprint = name_fingerprint(name);
+    }
+
+    uint64_t m_fingerprint{0xcbf29ce484222325ULL};
+    uint8_t m_length{};
+    char m_data[CAPACITY + 1]{};
+};
+
+static_assert(std::is_trivially_copyable_v<FixedName>);
+
+/// SRV record data with the target decoded into a FixedName
+struct SrvRecord {
+    uint16_t priority;
+    uint16_t weight;
+    uint16_t port;
+    FixedName target;
+};
+
+/// Decode the target of a PTR record, see mdns_record_parse_ptr
+inline FixedName parse_ptr(const void* buffer, size_t size, size_t offset, size_t length) noexcept {
+    if (length < 2 || offset + length > size)
+        return {};
+    return FixedName::extract(buffer, size, &offset);
+}
+
+/// Decode an SRV record, see mdns_record_parse_srv
+inline SrvRecord parse_srv(const void* buffer, size_t size, size_t offset, size_t length) noexcept {
+    SrvRecord srv{};
+    if (length < 8 || offset + length > size)
+        return srv;
+    const auto* data = (const uint8_t*)buffer + offset;
+    srv.priority = (uint16_t)((data[0] << 8) | data[1]);
+    srv.weight = (uint16_t)((data[2] << 8) | data[3]);
+    srv.port = (uint16_t)((data[4] << 8) | data[5]);
+    offset += 6;
+    srv.target = FixedName::extract(buffer, size, &offset);
+    return srv;
+}
+
+}
+
+template<>
+struct std::hash<mdns::FixedName> {
+    size_t operator()(const mdns::FixedName& name) const noexcept { return name.hash(); }
+};
+
+// FixedName::extract() decodes through WireName
+#include "wire_name.h"
+
+#if __cpp_lib_format
+template<>
+struct std::formatter<mdns::FixedName> : std::formatter<std::string_view> {
+    auto format(const mdns::FixedName& name, std::format_context& context) const {
+        return std::formatter<std::string_view>::format(name.view(), context);
+    }
+};
+#endif
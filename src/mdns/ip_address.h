@@ -0,0 +1,48 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace mdns
+{
+
+/// IPv4 or IPv6 address as a hashable value, IPv4 addresses use the first 4 bytes
+struct IpAddress {
+    std::array<uint8_t, 16> bytes{};
+    /// 4 or 16, 0 for no address
+    uint8_t size{};
+
+    /// \param address In network byte order
+    static IpAddress ipv4(uint32_t address) noexcept {
+        IpAddress ip;
+        memcpy(ip.bytes.data(), &address, 4);
+        ip.size = 4;
+        return ip;
+    }
+    static IpAddress ipv6(const std::array<uint8_t, 16>& address) noexcept { return IpAddress{address, 16}; }
+    /// The IPv4 address in network byte order
+    uint32_t to_ipv4() const noexcept {
+        uint32_t address;
+        memcpy(&address, bytes.data(), 4);
+        return address;
+    }
+
+    bool is_ipv4() const noexcept { return size == 4; }
+    bool is_ipv6() const noexcept { return size == 16; }
+    explicit operator bool() const noexcept { return size != 0; }
+
+    friend bool operator==(const IpAddress&, const IpAddress&) = default;
+};
+
+struct IpAddressHash {
+    size_t operator()(const IpAddress& address) const noexcept {
+        uint64_t hash = 0xcbf29ce484222325ULL ^ address.size;
+        for (size_t i = 0; i < address.size; ++i)
+            hash = (hash ^ address.bytes[i]) * 0x100000001b3ULL;
+        return (size_t)hash;
+    }
+};
+
+}
@@ -5,215 +5,445 @@
 #include "thread_safety.h"
 #include "socket_unix.h"
 #include "cpp_concepts.h"
+#include "trace.h"
+#include "record_cache.h"
+#include "fixed_name.h"
+#include "browse.h"
+#include "completion.h"
+#include "daemon.h"
+#include "dns_gateway.h"
+#include "dedup.h"
+#include "query_schedule.h"
+#include "packet_writer.h"
+#include "resolve.h"
+#include "responder.h"
+#include "pipeline.h"
+#include "packet.h"
+#include "network_tools.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <utility>
 
-#include <cstdio>
-#include <cstring>
 namespace mdns
 {
 
-template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+/// \tparam TracePolicy Receives the events of discover(), query() and service_mdns(), see trace.h. NullTrace
+/// compiles them out, PrintTrace prints them and RingTrace records them for post-mortem dumps.
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager,
+         TraceType TracePolicy = NullTrace>
 class Mdns
 {
 public:
+    /// \param memory_args Passed to the constructor of the MemoryManager, for example an upstream
+    /// memory resource and a memory limit
+    template<class... MemoryArgs>
+    explicit Mdns(MemoryArgs&&... memory_args)
+        : m_memory(std::forward<MemoryArgs>(memory_args)...), m_cache(m_memory.resource()),
+          m_registry(m_memory.resource()) {}
+
+    /// Answer queries for a single service, announced as <hostname>.<service>.
     ///
+    /// The service is probed and announced, then added to registry(), which can hold any number of
+    /// additional services.
+    /// This is a blocking call.
     int service_mdns(const char* hostname, const char* service, int service_port);
 
-    /// Query for one specific service
+    /// Query for one specific service or record
     ///
-    /// This is a blocking call.
+    /// This is a blocking call. It returns with the first answer for unique records (A, AAAA, SRV).
+    /// For shared records it returns once the answers stopped arriving, after a quiet period learned
+    /// from the answer latencies of each interface, see QueryCompletion. Without answers it returns
+    /// after \p timeout.
+    /// Until then the question is asked again after 1, 2, 4 ... seconds, see QuerySchedule, with the
+    /// answers received so far as known answers.
     /// \param service The service to query for. For example "_test-mdns._tcp.local."
-    /// \return
-    int query(std::string_view service);
+    /// \param rtype Record type to ask for
+    /// \return 0, or -1 if \p service is longer than a DNS name or no socket or buffer is available
+    int query(std::string_view service, mdns_record_type_t rtype = MDNS_RECORDTYPE_PTR,
+              Clock::duration timeout = QueryCompletion<ThreadSafetyManager>::DEFAULT_TIMEOUT);
 
-    /// Service discovery
+    /// Service discovery, returns like query() for PTR records
     int discover();
+
+    /// Continuously browse for the instances of one service type
+    ///
+    /// Unlike discover() the returned session keeps its sockets open and reports only changes.
+    /// \param service_type The service to browse for. For example "_http._tcp.local."
+    using Browse = BrowseSession<MemoryManager, SocketLayer, ThreadSafetyManager>;
+    std::unique_ptr<Browse> browse(std::string_view service_type) {
+        return std::make_unique<Browse>(m_memory, sockets, m_cache, service_type);
+    }
+
+    /// Resolve many host names at once, for example "printer.local", see HostResolver
+    ///
+    /// This is a blocking call that returns when all names are resolved or at \p deadline.
+    /// \return One result per name in the order of \p hosts, empty if no socket could be opened
+    std::vector<ResolvedHost> resolve(std::span<const std::string_view> hosts, Clock::time_point deadline) {
+        HostResolver<MemoryManager, SocketLayer, ThreadSafetyManager> resolver(m_memory, sockets, m_cache);
+        const auto results = resolver.resolve(hosts, deadline);
+        return {results.begin(), results.end()};
+    }
+
+    /// Answer questions for registry() on multiple threads, see ResponderPipeline. Call start() on
+    /// the returned pipeline.
+    /// \param workers Number of parser threads
+    using Pipeline = ResponderPipeline<MemoryManager, SocketLayer, ThreadSafetyManager>;
+    std::unique_ptr<Pipeline> pipeline(unsigned workers = 2) {
+        return std::make_unique<Pipeline>(m_memory, sockets, m_registry, workers);
+    }
+
+    /// Resolver shared by the processes of this host, see ResolverDaemon. Call open() and then
+    /// poll() in a loop on the returned daemon. Processes use it through a DaemonClient.
+    using Daemon = ResolverDaemon<MemoryManager, SocketLayer, ThreadSafetyManager>;
+    std::unique_ptr<Daemon> daemon() { return std::make_unique<Daemon>(m_memory, sockets, m_cache); }
+
+    /// Unicast DNS server for .local names answered from the cache of this instance, see DnsGateway.
+    /// Call open() and then poll() in a loop on the returned gateway.
+    using Gateway = DnsGateway<MemoryManager, SocketLayer, ThreadSafetyManager>;
+    std::unique_ptr<Gateway> gateway() { return std::make_unique<Gateway>(m_memory, sockets, m_cache); }
+
+    /// Services answered by service_mdns() and Responder instances created on this registry
+    ServiceRegistry<ThreadSafetyManager>& registry() { return m_registry; }
+
+    /// Records received by this instance. Add interest for records that are used actively to
+    /// have them refreshed before they expire, see refresh_cache().
+    RecordCache<ThreadSafetyManager>& cache() { return m_cache; }
+
+    /// Receive one datagram on \p sock into a packet buffer of memory(), for example to parse it on
+    /// another thread
+    /// \return An empty packet if nothing was received or no buffer is available
+    SharedPacket<MemoryManager> receive(int sock) { return SharedPacket<MemoryManager>::receive(m_memory, sock); }
+
+    /// Packet buffers used by all queries, sessions and responders of this instance and the memory
+    /// resource of cache() and registry(). Use memory().usage() for memory statistics.
+    MemoryManager& memory() { return m_memory; }
+
+    /// Events of discover(), query() and service_mdns(), for example to dump a RingTrace
+    TracePolicy& trace() { return m_trace; }
 private:
+    static constexpr int MAX_CLIENT_SOCKETS = 32;
+    /// Keep questions with known answers within a typical Ethernet MTU
+    static constexpr size_t MAX_QUERY_SIZE = 1440;
+
+    /// \return The number of sockets opened, at most \p max_sockets
+    int open_client_sockets(typename SocketLayer::SocketDP* socketDps, int max_sockets);
+
+    /// The question of a query, user data of record_callback
+    struct Question {
+        /// Qualified name
+        std::string_view name;
+        uint16_t rtype;
+        /// Received records go into this cache
+        RecordCache<ThreadSafetyManager>* cache;
+        TracePolicy* trace;
+        /// Answers to the question in the packet being parsed
+        size_t answers{};
+        /// Copies of records received on more than one socket are traced once
+        DuplicateFilter<> duplicates{};
+    };
+
+    /// Receive replies and parse them with \p parse until \p completion is complete
+    /// \param resend Called with the current time whenever it is due, returns when it is due next
+    template<class Parse, class Resend>
+    size_t read_replies(typename SocketLayer::SocketDP* socketDps, int num_sockets,
+                        typename MemoryManager::Buffer& buffer, Question& question,
+                        QueryCompletion<ThreadSafetyManager>& completion, Parse&& parse, Resend&& resend);
+
+    /// Ask \p question on all sockets. Answers in the cache that were received since \p since and
+    /// have more than half of their TTL left are added as known answers (RFC 6762 7.1).
+    /// \return The number of sockets the question could not be sent on
+    int send_question(typename SocketLayer::SocketDP* socketDps, int num_sockets,
+                      typename MemoryManager::Buffer& buffer, const Question& question, Clock::time_point since);
+
+    static int record_callback(int sock, const struct sockaddr* from, size_t addrlen, mdns_entry_type_t entry,
+                               uint16_t query_id, uint16_t rtype, uint16_t rclass, uint32_t ttl, const void* data,
+                               size_t size, size_t name_offset, size_t name_length, size_t record_offset,
+                               size_t record_length, void* user_data);
+
+    MemoryManager m_memory;
     SocketLayer sockets;
+    RecordCache<ThreadSafetyManager> m_cache;
+    ServiceRegistry<ThreadSafetyManager> m_registry;
+    /// Answer latencies of query() and discover()
+    LatencyEstimator<ThreadSafetyManager> m_latencies;
+    TracePolicy m_trace;
 };
 
 using MdnsDefault = Mdns<FixedSizeBuffer<5>,UnixSocket,SingleThreadSafe>;
 using MdnsMultThread = Mdns<FixedSizeBuffer<5>,UnixSocket,MultiThreadSafe>;
+using MdnsSharedMutex = Mdns<FixedSizeBuffer<5>,UnixSocket,SharedMutexThreadSafe>;
+using MdnsDynamic = Mdns<DynamicMemory<>,UnixSocket,SingleThreadSafe>;
 
 /// Implementation ///
 
 
-template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
-int Mdns<MemoryManager, SocketLayer, ThreadSafetyManager>::discover() {
-    typename SocketLayer::SocketDP socketsBuffer[10];
-    int socketCounter = 0;
-
-    sockets.open_client_sockets([](char* interfaceName, uint8_t interfaceIPAddr[16], size_t ipLen){return true;},
-                                                  [&socketsBuffer,&socketCounter](typename SocketLayer::SocketDP socketDp) {
-        socketsBuffer[socketCounter++] = socketDp;
-        }, 0);
-
-    if (socketCounter <= 0) {
-        printf("Failed to open any client sockets\n");
-        return -1;
-    }
-    printf("Opened %d socket%s for DNS-SD\n", socketCounter, socketCounter ? "s" : "");
-
-    printf("Sending DNS-SD discovery\n");
-    for (int isock = 0; isock < socketCounter; ++isock) {
-        if (mdns_discovery_send(socketsBuffer[isock]))
-            printf("Failed to send DNS-DS discovery: %s\n", strerror(errno));
-    }
-
-    size_t capacity = 2048;
-    void* buffer = malloc(capacity);
-    void* user_data = nullptr;
-    size_t records;
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager,
+         TraceType TracePolicy>
+int Mdns<MemoryManager, SocketLayer, ThreadSafetyManager, TracePolicy>::open_client_sockets(
+    typename SocketLayer::SocketDP* socketDps, int max_sockets) {
+    int num_sockets = 0;
+    sockets.open_client_sockets([](char*, uint8_t*, size_t) { return true; },
+                                [&](typename SocketLayer::SocketDP socketDp) {
+                                    if (num_sockets < max_sockets)
+                                        socketDps[num_sockets++] = socketDp;
+                                    else
+                                        sockets.close(socketDp);
+                                },
+                                0);
+    return num_sockets;
+}
 
-    // This is a simple implementation that loops for 5 seconds or as long as we get replies
-    int res;
-    printf("Reading DNS-SD replies\n");
-    do {
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager,
+         TraceType TracePolicy>
+template<class Parse, class Resend>
+size_t Mdns<MemoryManager, SocketLayer, ThreadSafetyManager, TracePolicy>::read_replies(
+    typename SocketLayer::SocketDP* socketDps, int num_sockets, typename MemoryManager::Buffer& buffer,
+    Question& question, QueryCompletion<ThreadSafetyManager>& completion, Parse&& parse, Resend&& resend) {
+    size_t records = 0;
+    auto next_resend = Clock::time_point::min();
+    for (auto now = Clock::now(); !completion.complete(now); now = Clock::now()) {
+        if (now >= next_resend)
+            next_resend = resend(now);
+        auto wait = std::chrono::duration_cast<std::chrono::microseconds>(std::min(completion.deadline(), next_resend) -
+                                                                          now);
         timeval timeout{};
-        timeout.tv_sec = 5;
-        timeout.tv_usec = 0;
+        timeout.tv_sec = (time_t)(wait.count() / 1000000);
+        timeout.tv_usec = (suseconds_t)(wait.count() % 1000000);
 
         int nfds = 0;
         fd_set readfs;
         FD_ZERO(&readfs);
         for (int isock = 0; isock < num_sockets; ++isock) {
-            if (socketsBuffer[isock] >= nfds)
-                nfds = socketsBuffer[isock] + 1;
-            FD_SET(socketsBuffer[isock], &readfs);
+            if (socketDps[isock].socket >= nfds)
+                nfds = socketDps[isock].socket + 1;
+            FD_SET(socketDps[isock].socket, &readfs);
         }
 
-        records = 0;
-        res = select(nfds, &readfs, 0, 0, &timeout);
-        if (res > 0) {
-            for (int isock = 0; isock < num_sockets; ++isock) {
-                if (FD_ISSET(socketsBuffer[isock], &readfs)) {
-                    records += mdns_discovery_recv(socketsBuffer[isock], buffer, capacity, query_callback, user_data);
-                }
+        if (select(nfds, &readfs, nullptr, nullptr, &timeout) <= 0)
+            continue;
+        for (int isock = 0; isock < num_sockets; ++isock) {
+            if (!FD_ISSET(socketDps[isock].socket, &readfs))
+                continue;
+            sockaddr_in6 from;
+            size_t from_size;
+            unsigned interface;
+            const size_t size = mdns_socket_recv_interface(socketDps[isock].socket, buffer.data(), buffer.capacity(),
+                                                           &from, &from_size, &interface);
+            if (size) {
+                m_trace.received(socketDps[isock].socket, interface, (const sockaddr*)&from, from_size, size);
+                question.answers = 0;
+                const size_t parsed = parse(isock, (const sockaddr*)&from, from_size, buffer.data(), size);
+                m_trace.parsed(socketDps[isock].socket, parsed);
+                records += parsed;
+                if (question.answers)
+                    completion.answered(interface, Clock::now());
             }
+            buffer.reset();
         }
-    } while (res > 0);
-
-    free(buffer);
-
-    for (int isock = 0; isock < num_sockets; ++isock)
-        mdns_socket_close(socketsBuffer[isock]);
-    printf("Closed socket%s\n", num_sockets ? "s" : "");
+    }
+    return records;
+}
 
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager,
+         TraceType TracePolicy>
+int Mdns<MemoryManager, SocketLayer, ThreadSafetyManager, TracePolicy>::record_callback(
+    int sock, const struct sockaddr* from, size_t addrlen, mdns_entry_type_t entry, uint16_t query_id, uint16_t rtype,
+    uint16_t rclass, uint32_t ttl, const void* data, size_t size, size_t name_offset, size_t name_length,
+    size_t record_offset, size_t record_length, void* user_data) {
+    auto* question = static_cast<Question*>(user_data);
+    if (!question)
+        return 0;
+    const auto now = Clock::now();
+    if (question->duplicates.duplicate(data, size, name_offset, rtype, ttl, record_offset, record_length, now))
+        return 0;
+    question->trace->record(sock, from, addrlen, entry, rtype, rclass, ttl, data, size, name_offset, record_offset,
+                            record_length);
+    if (entry == MDNS_ENTRYTYPE_ANSWER && rtype == question->rtype &&
+        WireName(data, size, name_offset) == question->name) {
+        ++question->answers;
+        question->trace->matched(sock, rtype);
+    }
+    if (question->cache && entry != MDNS_ENTRYTYPE_AUTHORITY)
+        question->cache->insert(data, size, name_offset, rtype, rclass, ttl, record_offset, record_length, now);
     return 0;
 }
 
-template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
-int Mdns<MemoryManager, SocketLayer, ThreadSafetyManager>::query(std::string_view service) {
-    typename SocketLayer::SocketDP socketsBuffer[32];
-    int query_id[32];
-    int num_sockets = sockets.open_client_sockets(socketsBuffer, sizeof(socketsBuffer) / sizeof(socketsBuffer[0]), 0);
-    if (num_sockets <= 0) {
-        printf("Failed to open any client sockets\n");
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager,
+         TraceType TracePolicy>
+int Mdns<MemoryManager, SocketLayer, ThreadSafetyManager, TracePolicy>::discover() {
+    typename SocketLayer::SocketDP socketDps[MAX_CLIENT_SOCKETS];
+    int num_sockets = open_client_sockets(socketDps, MAX_CLIENT_SOCKETS);
+    m_trace.opened(TraceOperation::Discover, num_sockets);
+    if (num_sockets <= 0)
         return -1;
-    }
-    printf("Opened %d socket%s for mDNS query\n", num_sockets, num_sockets ? "s" : "");
 
-    size_t capacity = 2048;
-    void* buffer = malloc(capacity);
-    void* user_data = 0;
-    size_t records;
+    typename MemoryManager::Buffer* buffer = m_memory.acquire();
+    if (!buffer) {
+        m_trace.no_buffer(TraceOperation::Discover);
+        for (int isock = 0; isock < num_sockets; ++isock)
+            sockets.close(socketDps[isock]);
+        m_trace.closed(TraceOperation::Discover, num_sockets);
+        return -1;
+    }
 
-    printf("Sending mDNS query: %s\n", service.data());
+    Question question{"_services._dns-sd._udp.local.", MDNS_RECORDTYPE_PTR, &m_cache, &m_trace};
     for (int isock = 0; isock < num_sockets; ++isock) {
-        query_id[isock] = mdns_query_send(socketsBuffer[isock], MDNS_RECORDTYPE_PTR, service.data(), service.size(), buffer, capacity, 0);
-        if (query_id[isock] < 0)
-            printf("Failed to send mDNS query: %s\n", strerror(errno));
+        const int error = mdns_discovery_send(socketDps[isock].socket) ? errno : 0;
+        m_trace.sent(TraceOperation::Discover, socketDps[isock].socket, question.name, question.rtype, error);
     }
 
-    // This is a simple implementation that loops for 5 seconds or as long as we get replies
-    int res;
-    printf("Reading mDNS query replies\n");
-    do {
-        timeval timeout;
-        timeout.tv_sec = 5;
-        timeout.tv_usec = 0;
-
-        int nfds = 0;
-        fd_set readfs;
-        FD_ZERO(&readfs);
-        for (int isock = 0; isock < num_sockets; ++isock) {
-            if (socketsBuffer[isock] >= nfds)
-                nfds = socketsBuffer[isock] + 1;
-            FD_SET(socketsBuffer[isock], &readfs);
-        }
-
-        records = 0;
-        res = select(nfds, &readfs, nullptr, nullptr, &timeout);
-        if (res > 0) {
-            for (int isock = 0; isock < num_sockets; ++isock) {
-                if (FD_ISSET(socketsBuffer[isock], &readfs)) {
-                    records += mdns_query_recv(socketsBuffer[isock], buffer, capacity, query_callback,
-                                               user_data, query_id[isock]);
-                }
-                FD_SET(socketsBuffer[isock], &readfs);
-            }
-        }
-    } while (res > 0);
-
-    free(buffer);
+    QueryCompletion<ThreadSafetyManager> completion(CompletionKind::Settle, m_latencies, Clock::now());
+    read_replies(
+        socketDps, num_sockets, *buffer, question, completion,
+        [&](int isock, const sockaddr* from, size_t from_size, const void* data, size_t size) {
+            return mdns_discovery_parse(socketDps[isock].socket, from, from_size, data, size, record_callback,
+                                        &question);
+        },
+        [](Clock::time_point) { return Clock::time_point::max(); });
 
+    m_memory.release(buffer);
     for (int isock = 0; isock < num_sockets; ++isock)
-        mdns_socket_close(socketsBuffer[isock]);
-    printf("Closed socket%s\n", num_sockets ? "s" : "");
+        sockets.close(socketDps[isock]);
+    m_trace.closed(TraceOperation::Discover, num_sockets);
 
     return 0;
 }
 
-template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
-int Mdns<MemoryManager, SocketLayer, ThreadSafetyManager>::service_mdns(const char* hostname, const char* service, int service_port) {
-    typename SocketLayer::SocketDP socketsBuffer[32];
-    int num_sockets = sockets.open_service_sockets(socketsBuffer, sizeof(socketsBuffer) / sizeof(socketsBuffer[0]));
-    if (num_sockets <= 0) {
-        printf("Failed to open any client sockets\n");
-        return -1;
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager,
+         TraceType TracePolicy>
+int Mdns<MemoryManager, SocketLayer, ThreadSafetyManager, TracePolicy>::send_question(
+    typename SocketLayer::SocketDP* socketDps, int num_sockets, typename MemoryManager::Buffer& buffer,
+    const Question& question, Clock::time_point since) {
+    // Freed by buffer.reset() below
+    std::pmr::vector<CacheRecord> known(buffer.arena());
+    const auto now = Clock::now();
+    m_cache.find(question.name, question.rtype, now, [&](const CacheRecord& record) {
+        if (record.received >= since && record.expires - now > std::chrono::seconds(record.ttl) / 2)
+            known.push_back(record);
+    });
+
+    int failed = 0;
+    for (int isock = 0; isock < num_sockets; ++isock) {
+        const int sock = socketDps[isock].socket;
+        PacketWriter writer(buffer.data(), std::min(buffer.capacity(), MAX_QUERY_SIZE));
+        if (!writer.question(question.name, question.rtype, mdns_query_rclass(sock))) {
+            m_trace.sent(TraceOperation::Query, sock, question.name, question.rtype, EMSGSIZE);
+            ++failed;
+            continue;
+        }
+        // Known answers that do not fit are left out, their owners answer them once more
+        for (const CacheRecord& record : known) {
+            const auto left = std::chrono::duration_cast<std::chrono::seconds>(record.expires - now);
+            if (!writer.record(MDNS_ENTRYTYPE_ANSWER, record.name, record.rtype, MDNS_CLASS_IN, (uint32_t)left.count(),
+                               record.rdata))
+                break;
+        }
+        const int error = mdns_multicast_send(sock, writer.data(), writer.size()) ? errno : 0;
+        m_trace.sent(TraceOperation::Query, sock, question.name, question.rtype, error);
+        if (error)
+            ++failed;
     }
-    printf("Opened %d socket%s for mDNS service\n", num_sockets, num_sockets ? "s" : "");
+    buffer.reset();
+    return failed;
+}
 
-    printf("Service mDNS: %s:%d\n", service, service_port);
-    printf("Hostname: %s\n", hostname);
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager,
+         TraceType TracePolicy>
+int Mdns<MemoryManager, SocketLayer, ThreadSafetyManager, TracePolicy>::query(std::string_view service,
+                                                                              mdns_record_type_t rtype,
+                                                                              Clock::duration timeout) {
+    const FixedName name = FixedName(service).qualified();
+    if (name.empty())
+        return -1;
 
-    size_t capacity = 2048;
-    void* buffer = malloc(capacity);
+    typename SocketLayer::SocketDP socketDps[MAX_CLIENT_SOCKETS];
+    int num_sockets = open_client_sockets(socketDps, MAX_CLIENT_SOCKETS);
+    m_trace.opened(TraceOperation::Query, num_sockets);
+    if (num_sockets <= 0)
+        return -1;
 
-    service_record_t service_record;
-    service_record.service = service;
-    service_record.hostname = hostname;
-    service_record.address_ipv4 = has_ipv4 ? service_address_ipv4 : 0;
-    service_record.address_ipv6 = has_ipv6 ? service_address_ipv6 : 0;
-    service_record.port = service_port;
+    typename MemoryManager::Buffer* buffer = m_memory.acquire();
+    if (!buffer) {
+        m_trace.no_buffer(TraceOperation::Query);
+        for (int isock = 0; isock < num_sockets; ++isock)
+            sockets.close(socketDps[isock]);
+        m_trace.closed(TraceOperation::Query, num_sockets);
+        return -1;
+    }
 
-    // This is a crude implementation that checks for incoming queries
-    while (true) {
-        int nfds = 0;
-        fd_set readfs;
-        FD_ZERO(&readfs);
-        for (int isock = 0; isock < num_sockets; ++isock) {
-            if (socketsBuffer[isock] >= nfds)
-                nfds = socketsBuffer[isock] + 1;
-            FD_SET(socketsBuffer[isock], &readfs);
-        }
+    Question question{name, rtype, &m_cache, &m_trace};
+    const auto start = Clock::now();
+    QuerySchedule schedule(start);
+    QueryCompletion<ThreadSafetyManager> completion(completion_kind(rtype), m_latencies, start, timeout);
+
+    read_replies(
+        socketDps, num_sockets, *buffer, question, completion,
+        [&](int isock, const sockaddr* from, size_t from_size, const void* data, size_t size) {
+            return mdns_query_parse(socketDps[isock].socket, from, from_size, data, size, record_callback,
+                                    &question, 0);
+        },
+        [&](Clock::time_point now) {
+            if (schedule.sent())
+                completion.resent(now);
+            send_question(socketDps, num_sockets, *buffer, question, start);
+            schedule.sent(now);
+            return schedule.next();
+        });
+
+    m_memory.release(buffer);
+    for (int isock = 0; isock < num_sockets; ++isock)
+        sockets.close(socketDps[isock]);
+    m_trace.closed(TraceOperation::Query, num_sockets);
 
-        if (select(nfds, &readfs, nullptr, nullptr, nullptr) >= 0) {
-            for (int isock = 0; isock < num_sockets; ++isock) {
-                if (FD_ISSET(socketsBuffer[isock], &readfs)) {
-                    mdns_socket_listen(socketsBuffer[isock], buffer, capacity, service_callback, &service_record);
-                }
-                FD_SET(socketsBuffer[isock], &readfs);
-            }
-        } else {
-            break;
-        }
+    return 0;
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager,
+         TraceType TracePolicy>
+int Mdns<MemoryManager, SocketLayer, ThreadSafetyManager, TracePolicy>::service_mdns(
+    const char* hostname, const char* service, int service_port) {
+    Responder<MemoryManager, SocketLayer, ThreadSafetyManager> responder(m_memory, sockets, m_registry);
+    const bool opened = responder.open();
+    m_trace.opened(TraceOperation::Service, (int)responder.sockets());
+    if (!opened)
+        return -1;
+
+    ServiceInstance instance;
+    instance.name = hostname;
+    instance.service_type = service;
+    instance.host = std::string(hostname) + ".local.";
+    instance.port = (uint16_t)service_port;
+    instance.ipv4 = sockets.ipv4_address().value_or(0);
+    instance.ipv6 = sockets.ipv6_address();
+    const bool published = responder.publish(instance);
+    m_trace.published(instance.name, instance.service_type, instance.port, published);
+    if (!published) {
+        const int num_sockets = (int)responder.sockets();
+        responder.close();
+        m_trace.closed(TraceOperation::Service, num_sockets);
+        return -1;
+    }
+    // Every address of this machine answers reverse lookups, and the host is answered on each interface
+    // with the addresses of that interface instead of the ones in the instance
+    for (const auto& address : sockets.interface_addresses())
+        m_registry.add_address(address.address, instance.host, address.interface);
+    if constexpr (TracePolicy::ENABLED) {
+        responder.set_conflict_callback(
+            [](const ServiceInstance& renamed, void* trace) {
+                static_cast<TracePolicy*>(trace)->conflict(renamed.name, renamed.host);
+            },
+            &m_trace);
     }
 
-    free(buffer);
+    // This is a crude implementation that answers incoming queries until an error occurs
+    while (responder.poll(std::chrono::hours(1)) >= 0) {
+    }
 
-    for (int isock = 0; isock < num_sockets; ++isock)
-        mdns_socket_close(socketsBuffer[isock]);
-    printf("Closed socket%s\n", num_sockets ? "s" : "");
+    const int num_sockets = (int)responder.sockets();
+    responder.goodbye();
+    responder.close();
+    m_trace.closed(TraceOperation::Service, num_sockets);
 
     return 0;
 }
@@ -42,7 +42,7 @@
 #define MDNS_POINTER_OFFSET_CONST(p, ofs) ((const void*)((const char*)(p) + (ptrdiff_t)(ofs)))
 #define MDNS_POINTER_DIFF(a, b) ((size_t)((const char*)(a) - (const char*)(b)))
 
-#define MDNS_PORT 5353
+constexpr uint16_t MDNS_PORT = 5353;
 #define MDNS_UNICAST_RESPONSE 0x8000U
 #define MDNS_CACHE_FLUSH 0x8000U
 
@@ -55,6 +55,7 @@ typedef int (*mdns_record_callback_fn)(int sock, const struct sockaddr* from, si
 typedef struct mdns_string_pair_t mdns_string_pair_t;
 typedef struct mdns_record_srv_t mdns_record_srv_t;
 typedef struct mdns_record_txt_t mdns_record_txt_t;
+typedef struct mdns_question_t mdns_question_t;
 
 #ifdef _WIN32
 typedef int mdns_size_t;
@@ -80,29 +81,35 @@ struct mdns_record_txt_t {
     std::string_view value;
 };
 
+struct mdns_question_t {
+    const char* name;
+    size_t length;
+    uint16_t type;
+};
+
 // mDNS/DNS-SD public API
 
 //! Listen for incoming multicast DNS-SD and mDNS query requests. The socket should have been
 //  opened on port MDNS_PORT using one of the mdns open or setup socket functions. Returns the
 //  number of queries  parsed.
-static size_t
+size_t
 mdns_socket_listen(int sock, void* buffer, size_t capacity, mdns_record_callback_fn callback,
                    void* user_data);
 
 //! Send a multicast DNS-SD reqeuest on the given socket to discover available services. Returns
 //  0 on success, or <0 if error.
-static int
+int
 mdns_discovery_send(int sock);
 
 //! Recieve unicast responses to a DNS-SD sent with mdns_discovery_send. Any data will be piped to
 //  the given callback for parsing. Returns the number of responses parsed.
-static size_t
+size_t
 mdns_discovery_recv(int sock, void* buffer, size_t capacity, mdns_record_callback_fn callback,
                     void* user_data);
 
 //! Send a unicast DNS-SD answer with a single record to the given address. Returns 0 if success,
 //  or <0 if error.
-static int
+int
 mdns_discovery_answer(int sock, const void* address, size_t address_size, void* buffer,
                       size_t capacity, const char* record, size_t length);
 
@@ -112,67 +119,147 @@ mdns_discovery_answer(int sock, const void* address, size_t address_size, void*
 //  will request a unicast response if the socket is bound to an ephemeral port, or a multicast
 //  response if the socket is bound to mDNS port 5353.
 //  Returns the used query ID, or <0 if error.
-static int
+int
 mdns_query_send(int sock, mdns_record_type_t type, const char* name, size_t length, void* buffer,
                 size_t capacity, uint16_t query_id);
 
+//! Class of the questions sent on the given socket: IN, with the unicast response bit set unless
+//  the socket is bound to mDNS port 5353.
+uint16_t
+mdns_query_rclass(int sock);
+
+//! Send multicast mDNS queries for all given questions on the given socket. As many questions as
+//  fit into the supplied buffer are packed into each packet, so the number of packets sent is
+//  usually one. The unicast response bit is set the same way as in mdns_query_send.
+//  Returns the number of packets sent, or <0 if error.
+int
+mdns_query_send_multi(int sock, const mdns_question_t* questions, size_t count, void* buffer,
+                      size_t capacity, uint16_t query_id);
+
 //! Receive unicast responses to a mDNS query sent with mdns_discovery_recv, optionally filtering
 //  out any responses not matching the given query ID. Set the query ID to 0 to parse
 //  all responses, even if it is not matching the query ID set in a specific query. Any data will
 //  be piped to the given callback for parsing. Returns the number of responses parsed.
-static size_t
+size_t
 mdns_query_recv(int sock, void* buffer, size_t capacity, mdns_record_callback_fn callback,
                 void* user_data, int query_id);
 
+//! Receive one datagram into the supplied buffer without parsing it. The source address is
+//  written to address, which must have room for a sockaddr_in6, and its size to address_size.
+//  Returns the size of the datagram, or 0 if nothing was received.
+size_t
+mdns_socket_recv(int sock, void* buffer, size_t capacity, void* address, size_t* address_size);
+
+//! Receive one datagram like mdns_socket_recv and write the index of the interface it arrived on to
+//  interface. The interface is only known if the socket has IP_PKTINFO or IPV6_RECVPKTINFO set,
+//  otherwise it is 0.
+size_t
+mdns_socket_recv_interface(int sock, void* buffer, size_t capacity, void* address, size_t* address_size,
+                           unsigned* interface);
+
+//! Parse the questions of a datagram received with mdns_socket_recv like mdns_socket_listen does.
+//  Returns the number of questions parsed.
+size_t
+mdns_question_parse(int sock, const struct sockaddr* from, size_t addrlen, const void* buffer, size_t size,
+                    mdns_record_callback_fn callback, void* user_data);
+
+//! Parse a datagram received with mdns_socket_recv like mdns_query_recv does. The buffer is only
+//  read, so a datagram can be parsed any number of times and from any thread.
+//  Returns the number of records parsed.
+size_t
+mdns_query_parse(int sock, const struct sockaddr* from, size_t addrlen, const void* buffer, size_t size,
+                 mdns_record_callback_fn callback, void* user_data, int query_id);
+
+//! Parse a datagram received with mdns_socket_recv like mdns_discovery_recv does.
+//  Returns the number of records parsed.
+size_t
+mdns_discovery_parse(int sock, const struct sockaddr* from, size_t addrlen, const void* buffer, size_t size,
+                     mdns_record_callback_fn callback, void* user_data);
+
+//! Parse all questions and records of a datagram, whether it is a query or a response and however
+//  many questions it has. Questions are passed to the callback with MDNS_ENTRYTYPE_QUESTION like
+//  mdns_question_parse does, records like mdns_query_parse does. Returns the number of entries parsed.
+size_t
+mdns_packet_parse(int sock, const struct sockaddr* from, size_t addrlen, const void* buffer, size_t size,
+                  mdns_record_callback_fn callback, void* user_data);
+
 //! Send a unicast or multicast mDNS query answer with a single record to the given address. The
 //  answer will be sent multicast if address size is 0, otherwise it will be sent unicast to the
 //  given address. Use the top bit of the query class field (MDNS_UNICAST_RESPONSE) to determine
 //  if the answer should be sent unicast (bit set) or multicast (bit not set).
 //  Returns 0 if success, or <0 if error.
-static int
+int
 mdns_query_answer(int sock, const void* address, size_t address_size, void* buffer, size_t capacity,
                   uint16_t query_id, const char* service, size_t service_length,
                   const char* hostname, size_t hostname_length, uint32_t ipv4, const uint8_t* ipv6,
                   uint16_t port, const char* txt, size_t txt_length);
 
+//! Send a prebuilt packet unicast to the given address. Returns 0 if success, or <0 if error.
+int
+mdns_unicast_send(int sock, const void* address, size_t address_size, const void* buffer, size_t size);
+
+//! Send a prebuilt packet to the mDNS multicast group of the socket address family. Returns 0 if
+//  success, or <0 if error.
+int
+mdns_multicast_send(int sock, const void* buffer, size_t size);
+
+//! Send a prebuilt packet to the mDNS multicast group on the interface with the given index, on the
+//  multicast interface of the socket if the index is 0. Returns 0 if success, or <0 if error.
+int
+mdns_multicast_send_interface(int sock, const void* buffer, size_t size, unsigned interface);
+
+//! Send prebuilt packets to the mDNS multicast group of the socket address family on the given
+//  interface like mdns_multicast_send_interface, with as few system calls as the platform allows
+//  (sendmmsg on Linux). Returns the number of packets sent, or <0 if none could be sent.
+int
+mdns_multicast_send_batch(int sock, const void* const* buffers, const size_t* sizes, size_t count,
+                          unsigned interface);
+
 // Internal functions
 
-static std::string_view
+std::string_view
 mdns_string_extract(const void* buffer, size_t size, size_t* offset, char* str, size_t capacity);
 
-static int
+int
 mdns_string_skip(const void* buffer, size_t size, size_t* offset);
 
-static int
+int
 mdns_string_equal(const void* buffer_lhs, size_t size_lhs, size_t* ofs_lhs, const void* buffer_rhs,
                   size_t size_rhs, size_t* ofs_rhs);
 
-static void*
+void*
 mdns_string_make(void* data, size_t capacity, const char* name, size_t length);
 
-static void*
+void*
 mdns_string_make_ref(void* data, size_t capacity, size_t ref_offset);
 
-static void*
+void*
 mdns_string_make_with_ref(void* data, size_t capacity, const char* name, size_t length,
                           size_t ref_offset);
 
-static std::string_view
+//! Copy the record data at the given offset into the given buffer with all domain names (PTR and
+//  SRV targets) expanded to uncompressed wire format, so the result is independent of the packet
+//  it was received in. Returns the number of bytes written, or MDNS_INVALID_POS if error.
+size_t
+mdns_record_rdata_expand(const void* buffer, size_t size, size_t offset, size_t length,
+                         uint16_t rtype, void* rdata, size_t capacity);
+
+std::string_view
 mdns_record_parse_ptr(const void* buffer, size_t size, size_t offset, size_t length,
                       char* strbuffer, size_t capacity);
 
-static mdns_record_srv_t
+mdns_record_srv_t
 mdns_record_parse_srv(const void* buffer, size_t size, size_t offset, size_t length,
                       char* strbuffer, size_t capacity);
 
-static struct sockaddr_in*
+struct sockaddr_in*
 mdns_record_parse_a(const void* buffer, size_t size, size_t offset, size_t length,
                     sockaddr_in* addr);
 
-static struct sockaddr_in6*
+struct sockaddr_in6*
 mdns_record_parse_aaaa(const void* buffer, size_t size, size_t offset, size_t length,
                        sockaddr_in6* addr);
 
-static size_t
+size_t
 mdns_record_parse_txt(const void* buffer, size_t size, size_t offset, size_t length,
                       mdns_record_txt_t* records, size_t capacity);
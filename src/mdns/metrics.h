@@ -0,0 +1,357 @@
+#pragma once
+
+#include "queue.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <net/if.h>
+
+/// Build with MDNS_METRICS=0 to compile all metrics out (CMake option MDNS_METRICS)
+#ifndef MDNS_METRICS
+#define MDNS_METRICS 1
+#endif
+
+namespace mdns
+{
+
+inline constexpr bool METRICS_ENABLED = MDNS_METRICS != 0;
+
+enum class MetricCounter : uint8_t {
+    /// Datagrams or entries that could not be parsed, the rest of the datagram is skipped
+    ParseErrors,
+    /// Datagrams larger than the receive buffer, cut off at its end
+    Truncated,
+    /// Lookups answered from the record cache without asking the network
+    CacheHits,
+    CacheMisses,
+    /// Records dropped by a DuplicateFilter
+    Duplicates,
+    /// Records left out of multicast responses by a RateLimiter
+    MulticastSuppressed,
+    /// Unicast responses dropped by a RateLimiter
+    UnicastDropped,
+    Count
+};
+
+enum class MetricHistogram : uint8_t {
+    /// Time spent in a record callback of a parser, per record. Sampled, see CALLBACK_SAMPLING.
+    CallbackTime,
+    /// Time a Responder takes to build the answer to a question it has records for
+    AnswerTime,
+    Count
+};
+
+/// Traffic of one network interface
+struct InterfaceMetrics {
+    /// Interface index, 0 for datagrams whose interface is not known
+    unsigned interface;
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+};
+
+/// Distribution of durations in power of two buckets
+struct HistogramSnapshot {
+    /// The first bucket holds durations up to 64 ns, every further one up to twice the bound of the
+    /// one before, the last one everything above 2^25 ns (34 ms)
+    static constexpr size_t BUCKETS = 21;
+    static constexpr unsigned FIRST_BUCKET_BITS = 6;
+
+    /// Upper bound of bucket \p bucket, in nanoseconds, UINT64_MAX for the last one
+    static constexpr uint64_t bound_ns(size_t bucket) noexcept {
+        return bucket + 1 < BUCKETS ? uint64_t(1) << (FIRST_BUCKET_BITS + bucket) : UINT64_MAX;
+    }
+
+    uint64_t count;
+    uint64_t sum_ns;
+    std::array<uint64_t, BUCKETS> buckets;
+};
+
+/// Sum of the metrics of all threads at one point in time
+struct MetricsSnapshot {
+    /// Interfaces that received or sent anything, ordered by index
+    std::vector<InterfaceMetrics> interfaces;
+    std::array<uint64_t, (size_t)MetricCounter::Count> counters;
+    std::array<HistogramSnapshot, (size_t)MetricHistogram::Count> histograms;
+
+    uint64_t counter(MetricCounter counter) const noexcept { return counters[(size_t)counter]; }
+    const HistogramSnapshot& histogram(MetricHistogram histogram) const noexcept {
+        return histograms[(size_t)histogram];
+    }
+    /// Share of cache lookups that were hits, 0 without lookups
+    double cache_hit_rate() const noexcept {
+        const uint64_t lookups = counter(MetricCounter::CacheHits) + counter(MetricCounter::CacheMisses);
+        return lookups ? (double)counter(MetricCounter::CacheHits) / (double)lookups : 0;
+    }
+};
+
+/// Process wide counters and histograms of the library
+///
+/// Every thread that records a metric gets a shard of its own, aligned to a cache line, and is its
+/// only writer: recording a metric is a relaxed load and store on a line no other thread writes,
+/// without locked instructions or contention. snapshot() adds up the shards of all threads. Shards
+/// of threads that ended are reused by new threads, so their counts are never lost.
+///
+/// Datagrams and bytes are counted per interface where they are received and sent in the socket
+/// functions of mdns_old.h, together with parse errors, truncated datagrams and the time spent in
+/// record callbacks. Interfaces with an index of MAX_INTERFACES and above are counted as interface 0.
+///
+/// With MDNS_METRICS=0 all recording functions are empty and snapshot() returns zeros.
+class MetricsRegistry
+{
+public:
+    static constexpr size_t MAX_INTERFACES = 64;
+    /// Record callbacks of a thread per timed one, reading the clock twice per record costs as much
+    /// as a cheap callback
+    static constexpr unsigned CALLBACK_SAMPLING = 16;
+
+    static void add(MetricCounter counter, uint64_t value = 1) noexcept {
+        if constexpr (METRICS_ENABLED)
+            increment(shard().counters[(size_t)counter], value);
+    }
+    static void received(unsigned interface, size_t bytes) noexcept {
+        if constexpr (METRICS_ENABLED) {
+            Traffic& traffic = shard().traffic[interface < MAX_INTERFACES ? interface : 0];
+            increment(traffic.rx_packets, 1);
+            increment(traffic.rx_bytes, bytes);
+        }
+    }
+    static void sent(unsigned interface, size_t bytes, size_t packets = 1) noexcept {
+        if constexpr (METRICS_ENABLED) {
+            Traffic& traffic = shard().traffic[interface < MAX_INTERFACES ? interface : 0];
+            increment(traffic.tx_packets, packets);
+            increment(traffic.tx_bytes, bytes);
+        }
+    }
+    static void record(MetricHistogram histogram, std::chrono::nanoseconds duration) noexcept;
+    /// True for one in \p every calls of a thread for \p histogram
+    static bool sample(MetricHistogram histogram, unsigned every) noexcept {
+        if constexpr (!METRICS_ENABLED)
+            return false;
+        if (every <= 1)
+            return true;
+        unsigned& calls = shard().calls[(size_t)histogram];
+        if (++calls < every)
+            return false;
+        calls = 0;
+        return true;
+    }
+
+    static MetricsSnapshot snapshot();
+
+private:
+    struct Traffic {
+        std::atomic<uint64_t> rx_packets;
+        std::atomic<uint64_t> rx_bytes;
+        std::atomic<uint64_t> tx_packets;
+        std::atomic<uint64_t> tx_bytes;
+    };
+    struct Histogram {
+        std::array<std::atomic<uint64_t>, HistogramSnapshot::BUCKETS> buckets;
+        std::atomic<uint64_t> sum_ns;
+    };
+    struct alignas(detail::CACHE_LINE) Shard {
+        /// A thread writes to the shard
+        std::atomic<bool> owned{true};
+        Shard* next{};
+        std::array<std::atomic<uint64_t>, (size_t)MetricCounter::Count> counters{};
+        std::array<Histogram, (size_t)MetricHistogram::Count> histograms{};
+        std::array<Traffic, MAX_INTERFACES> traffic{};
+        /// Calls of sample() since the last sampled one, only read by the owner
+        std::array<unsigned, (size_t)MetricHistogram::Count> calls{};
+    };
+    /// Hands the shard of a thread back when the thread ends
+    struct Owner {
+        Shard* shard{};
+        ~Owner() {
+            if (shard)
+                shard->owned.store(false, std::memory_order_release);
+        }
+    };
+
+    /// Only the owner of a shard writes it, readers see either the old or the new value
+    static void increment(std::atomic<uint64_t>& value, uint64_t amount) noexcept {
+        value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    /// Shards are never freed, threads may still record while the process exits
+    static std::atomic<Shard*>& shards() noexcept {
+        static std::atomic<Shard*> head{};
+        return head;
+    }
+    static Shard& shard() noexcept {
+        // Trivial, so reading it needs no guard for the destructor of Owner
+        thread_local constinit Shard* current = nullptr;
+        if (!current) [[unlikely]]
+            current = adopt();
+        return *current;
+    }
+    static Shard* adopt() noexcept {
+        thread_local Owner owner;
+        owner.shard = claim();
+        return owner.shard;
+    }
+    static Shard* claim() noexcept;
+};
+
+/// Records the time from its construction to its destruction in a histogram
+class MetricsTimer
+{
+public:
+    /// \param every Only time one in this many timers of the thread, see MetricsRegistry::sample()
+    explicit MetricsTimer(MetricHistogram histogram, unsigned every = 1) noexcept : m_histogram(histogram) {
+        if (MetricsRegistry::sample(histogram, every))
+            m_start = std::chrono::steady_clock::now();
+    }
+    ~MetricsTimer() {
+        if (m_start != std::chrono::steady_clock::time_point{})
+            MetricsRegistry::record(m_histogram, std::chrono::steady_clock::now() - m_start);
+    }
+
+    MetricsTimer(const MetricsTimer&) = delete;
+    MetricsTimer& operator=(const MetricsTimer&) = delete;
+
+private:
+    MetricHistogram m_histogram;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+/// Text exposition of a snapshot in the Prometheus text format, metric names start with mdns_
+std::string format_metrics(const MetricsSnapshot& snapshot);
+
+/// Implementation ///
+
+inline void MetricsRegistry::record(MetricHistogram histogram, std::chrono::nanoseconds duration) noexcept {
+    if constexpr (METRICS_ENABLED) {
+        const uint64_t ns = duration.count() > 0 ? (uint64_t)duration.count() : 0;
+        const size_t width = (size_t)std::bit_width(ns ? ns - 1 : 0);
+        const size_t bucket =
+            width <= HistogramSnapshot::FIRST_BUCKET_BITS
+                ? 0
+                : std::min(width - HistogramSnapshot::FIRST_BUCKET_BITS, HistogramSnapshot::BUCKETS - 1);
+        Histogram& target = shard().histograms[(size_t)histogram];
+        increment(target.buckets[bucket], 1);
+        increment(target.sum_ns, ns);
+    }
+}
+
+inline MetricsRegistry::Shard* MetricsRegistry::claim() noexcept {
+    std::atomic<Shard*>& head = shards();
+    for (Shard* shard = head.load(std::memory_order_acquire); shard; shard = shard->next) {
+        bool owned = false;
+        if (shard->owned.compare_exchange_strong(owned, true, std::memory_order_acquire))
+            return shard;
+    }
+    auto* shard = new Shard;
+    shard->next = head.load(std::memory_order_relaxed);
+    while (!head.compare_exchange_weak(shard->next, shard, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+    return shard;
+}
+
+inline MetricsSnapshot MetricsRegistry::snapshot() {
+    MetricsSnapshot snapshot{};
+    if constexpr (!METRICS_ENABLED)
+        return snapshot;
+    std::array<InterfaceMetrics, MAX_INTERFACES> traffic{};
+    for (Shard* shard = shards().load(std::memory_order_acquire); shard; shard = shard->next) {
+        for (size_t i = 0; i < snapshot.counters.size(); ++i)
+            snapshot.counters[i] += shard->counters[i].load(std::memory_order_relaxed);
+        for (size_t h = 0; h < snapshot.histograms.size(); ++h) {
+            HistogramSnapshot& sum = snapshot.histograms[h];
+            for (size_t b = 0; b < HistogramSnapshot::BUCKETS; ++b) {
+                const uint64_t count = shard->histograms[h].buckets[b].load(std::memory_order_relaxed);
+                sum.buckets[b] += count;
+                sum.count += count;
+            }
+            sum.sum_ns += shard->histograms[h].sum_ns.load(std::memory_order_relaxed);
+        }
+        for (size_t i = 0; i < MAX_INTERFACES; ++i) {
+            traffic[i].rx_packets += shard->traffic[i].rx_packets.load(std::memory_order_relaxed);
+            traffic[i].rx_bytes += shard->traffic[i].rx_bytes.load(std::memory_order_relaxed);
+            traffic[i].tx_packets += shard->traffic[i].tx_packets.load(std::memory_order_relaxed);
+            traffic[i].tx_bytes += shard->traffic[i].tx_bytes.load(std::memory_order_relaxed);
+        }
+    }
+    for (size_t i = 0; i < MAX_INTERFACES; ++i) {
+        if (traffic[i].rx_packets || traffic[i].tx_packets) {
+            traffic[i].interface = (unsigned)i;
+            snapshot.interfaces.push_back(traffic[i]);
+        }
+    }
+    return snapshot;
+}
+
+inline std::string format_metrics(const MetricsSnapshot& snapshot) {
+    std::string text;
+    char line[256];
+    const auto append = [&](const char* format, auto... args) {
+        snprintf(line, sizeof(line), format, args...);
+        text += line;
+    };
+
+    static constexpr const char* traffic[][2] = {{"mdns_rx_packets_total", "Datagrams received"},
+                                                 {"mdns_rx_bytes_total", "Bytes received"},
+                                                 {"mdns_tx_packets_total", "Datagrams sent"},
+                                                 {"mdns_tx_bytes_total", "Bytes sent"}};
+    for (size_t metric = 0; metric < 4; ++metric) {
+        append("# HELP %s %s\n# TYPE %s counter\n", traffic[metric][0], traffic[metric][1], traffic[metric][0]);
+        for (const InterfaceMetrics& interface : snapshot.interfaces) {
+            const uint64_t values[] = {interface.rx_packets, interface.rx_bytes, interface.tx_packets,
+                                       interface.tx_bytes};
+            char name[IF_NAMESIZE]{};
+            if (!interface.interface || !if_indextoname(interface.interface, name))
+                snprintf(name, sizeof(name), "%u", interface.interface);
+            append("%s{interface=\"%s\"} %llu\n", traffic[metric][0], name, (unsigned long long)values[metric]);
+        }
+    }
+
+    static constexpr const char* counters[][2] = {
+        {"mdns_parse_errors_total", "Datagrams or entries that could not be parsed"},
+        {"mdns_truncated_total", "Datagrams larger than the receive buffer"},
+        {"mdns_cache_hits_total", "Lookups answered from the record cache"},
+        {"mdns_cache_misses_total", "Lookups that asked the network"},
+        {"mdns_duplicates_total", "Records dropped as copies received on several sockets"},
+        {"mdns_multicast_suppressed_total", "Records left out of multicast responses by the rate limit"},
+        {"mdns_unicast_dropped_total", "Unicast responses dropped by the rate limit"}};
+    static_assert(std::size(counters) == (size_t)MetricCounter::Count);
+    for (size_t i = 0; i < std::size(counters); ++i) {
+        append("# HELP %s %s\n# TYPE %s counter\n%s %llu\n", counters[i][0], counters[i][1], counters[i][0],
+               counters[i][0], (unsigned long long)snapshot.counters[i]);
+    }
+
+    static constexpr const char* histograms[][2] = {
+        {"mdns_callback_seconds", "Time spent in record callbacks, per record, sampled"},
+        {"mdns_answer_build_seconds", "Time to build the answer to a question"}};
+    static_assert(std::size(histograms) == (size_t)MetricHistogram::Count);
+    for (size_t h = 0; h < std::size(histograms); ++h) {
+        const HistogramSnapshot& histogram = snapshot.histograms[h];
+        const char* name = histograms[h][0];
+        append("# HELP %s %s\n# TYPE %s histogram\n", name, histograms[h][1], name);
+        uint64_t cumulative = 0;
+        for (size_t b = 0; b < HistogramSnapshot::BUCKETS; ++b) {
+            cumulative += histogram.buckets[b];
+            if (b + 1 < HistogramSnapshot::BUCKETS)
+                append("%s_bucket{le=\"%g\"} %llu\n", name, (double)HistogramSnapshot::bound_ns(b) * 1e-9,
+                       (unsigned long long)cumulative);
+            else
+                append("%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)cumulative);
+        }
+        append("%s_sum %.9f\n%s_count %llu\n", name, (double)histogram.sum_ns * 1e-9, name,
+               (unsigned long long)histogram.count);
+    }
+    return text;
+}
+
+}
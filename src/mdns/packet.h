@@ -0,0 +1,128 @@
+#pragma once
+
+#include "mdns_old.h"
+#include "cpp_concepts.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory_resource>
+#include <new>
+#include <utility>
+
+#include <netinet/in.h>
+
+namespace mdns
+{
+
+/// A received datagram in a buffer of the memory manager, shared by reference counting
+///
+/// Copies share the same buffer, the buffer returns to the memory manager when the last copy is
+/// destroyed. The datagram is never written after it was received, so copies can be handed to other
+/// threads or queued without copying the data, and the data pointers and offsets passed to a record
+/// callback by parse() stay valid as long as a copy is kept.
+///
+/// Data derived from the datagram can be allocated from arena(). The arena is freed together with
+/// the buffer. Allocating from it is not synchronized, only one thread may do so at a time.
+template<MemoryManagerType MemoryManager>
+class SharedPacket
+{
+public:
+    using Buffer = typename MemoryManager::Buffer;
+
+    SharedPacket() = default;
+    SharedPacket(const SharedPacket& other) noexcept : m_packet(other.m_packet) {
+        if (m_packet)
+            m_packet->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    SharedPacket(SharedPacket&& other) noexcept : m_packet(std::exchange(other.m_packet, nullptr)) {}
+    SharedPacket& operator=(SharedPacket other) noexcept {
+        std::swap(m_packet, other.m_packet);
+        return *this;
+    }
+    ~SharedPacket() { reset(); }
+
+    /// Receive one datagram into a buffer acquired from \p memory
+    /// \return An empty packet if no buffer is available or nothing was received
+    static SharedPacket receive(MemoryManager& memory, int sock);
+
+    explicit operator bool() const noexcept { return m_packet != nullptr; }
+
+    const void* data() const noexcept { return m_packet->buffer->data(); }
+    size_t size() const noexcept { return m_packet->size; }
+    /// The socket the datagram was received on
+    int socket() const noexcept { return m_packet->sock; }
+    const struct sockaddr* from() const noexcept { return (const struct sockaddr*)&m_packet->from; }
+    size_t from_size() const noexcept { return m_packet->from_size; }
+    /// Index of the interface the datagram arrived on, 0 if unknown
+    unsigned interface() const noexcept { return m_packet->interface; }
+    std::pmr::memory_resource* arena() const noexcept { return m_packet->buffer->arena(); }
+
+    /// Pass all records of the datagram to \p callback, see mdns_query_parse
+    /// \return The number of records parsed
+    size_t parse(mdns_record_callback_fn callback, void* user_data, int query_id = 0) const {
+        return mdns_query_parse(socket(), from(), from_size(), data(), size(), callback, user_data, query_id);
+    }
+
+    /// Number of copies sharing the datagram, 0 for an empty packet
+    uint32_t use_count() const noexcept { return m_packet ? m_packet->refs.load(std::memory_order_relaxed) : 0; }
+
+    /// Drop this reference
+    void reset() noexcept;
+
+private:
+    /// Lives at the start of the buffer arena
+    struct Packet {
+        std::atomic<uint32_t> refs;
+        MemoryManager* memory;
+        Buffer* buffer;
+        size_t size;
+        int sock;
+        sockaddr_in6 from;
+        size_t from_size;
+        unsigned interface;
+    };
+
+    explicit SharedPacket(Packet* packet) noexcept : m_packet(packet) {}
+
+    Packet* m_packet{};
+};
+
+/// Implementation ///
+
+template<MemoryManagerType MemoryManager>
+SharedPacket<MemoryManager> SharedPacket<MemoryManager>::receive(MemoryManager& memory, int sock) {
+    Buffer* buffer = memory.acquire();
+    if (!buffer)
+        return {};
+
+    sockaddr_in6 from{};
+    size_t from_size = 0;
+    unsigned interface = 0;
+    const size_t size =
+        mdns_socket_recv_interface(sock, buffer->data(), buffer->capacity(), &from, &from_size, &interface);
+    void* storage = nullptr;
+    if (size) {
+        try {
+            storage = buffer->arena()->allocate(sizeof(Packet), alignof(Packet));
+        } catch (const std::bad_alloc&) {
+        }
+    }
+    if (!storage) {
+        memory.release(buffer);
+        return {};
+    }
+    return SharedPacket(new (storage) Packet{{1}, &memory, buffer, size, sock, from, from_size, interface});
+}
+
+template<MemoryManagerType MemoryManager>
+void SharedPacket<MemoryManager>::reset() noexcept {
+    Packet* packet = std::exchange(m_packet, nullptr);
+    if (!packet || packet->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+    MemoryManager* memory = packet->memory;
+    Buffer* buffer = packet->buffer;
+    packet->~Packet();
+    memory->release(buffer);
+}
+
+}
@@ -0,0 +1,263 @@
+#pragma once
+
+#include "mdns_old.h"
+#include "dns_name.h"
+#include "wire_name.h"
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <string_view>
+
+namespace mdns
+{
+
+/// Builds a DNS message record by record into a caller supplied buffer
+///
+/// Questions and records must be added in section order (questions, answers, authority, additional).
+/// Every add method either appends the complete entry and updates the header counters, or leaves the
+/// packet unchanged and returns false if the buffer is full. This allows to pack entries until a
+/// packet is full, send it and continue with the entry that did not fit in a fresh packet.
+///
+/// Names are compressed (RFC 1035 4.1.4): a name, or the rest of a name from one of its labels on,
+/// that was already written to the packet is replaced by a reference to it. This applies across
+/// records and to names in record data, so a packet answering many instances of one service type
+/// repeats the service type only once.
+class PacketWriter
+{
+public:
+    /// Number of written names remembered for compression, later names are written in full
+    static constexpr size_t MAX_NAMES = 64;
+
+    PacketWriter() = default;
+    PacketWriter(void* buffer, size_t capacity) : m_buffer((uint8_t*)buffer), m_capacity(capacity) { begin(0, 0); }
+
+    /// Start a new message
+    void begin(uint16_t query_id, uint16_t flags) {
+        m_size = sizeof(mdns_header_t);
+        m_section = MDNS_ENTRYTYPE_QUESTION;
+        m_names = 0;
+        memset(m_buffer, 0, sizeof(mdns_header_t));
+        put16(0, query_id);
+        put16(2, flags);
+    }
+
+    bool question(std::string_view name, uint16_t rtype, uint16_t rclass) {
+        if (m_section != MDNS_ENTRYTYPE_QUESTION)
+            return false;
+        const size_t mark = m_size;
+        if (!write_name(name) || !write16(rtype) || !write16(rclass))
+            return rollback(mark);
+        increment(MDNS_ENTRYTYPE_QUESTION);
+        return true;
+    }
+
+    /// Add a record with raw record data
+    bool record(mdns_entry_type_t section, std::string_view name, uint16_t rtype, uint16_t rclass, uint32_t ttl,
+                std::span<const uint8_t> rdata) {
+        const size_t mark = m_size;
+        if (!begin_record(section, name, rtype, rclass, ttl) || !write(rdata.data(), rdata.size()))
+            return rollback(mark);
+        end_record(section);
+        return true;
+    }
+
+    bool ptr(mdns_entry_type_t section, std::string_view name, uint16_t rclass, uint32_t ttl,
+             std::string_view target) {
+        const size_t mark = m_size;
+        if (!begin_record(section, name, MDNS_RECORDTYPE_PTR, rclass, ttl) || !write_name(target))
+            return rollback(mark);
+        end_record(section);
+        return true;
+    }
+
+    bool srv(mdns_entry_type_t section, std::string_view name, uint16_t rclass, uint32_t ttl, uint16_t priority,
+             uint16_t weight, uint16_t port, std::string_view target) {
+        const size_t mark = m_size;
+        if (!begin_record(section, name, MDNS_RECORDTYPE_SRV, rclass, ttl) || !write16(priority) ||
+            !write16(weight) || !write16(port) || !write_name(target))
+            return rollback(mark);
+        end_record(section);
+        return true;
+    }
+
+    /// \param rdata Encoded TXT record data, a sequence of length prefixed strings. An empty TXT
+    /// record is sent as a single empty string as required by RFC 6763 6.1.
+    bool txt(mdns_entry_type_t section, std::string_view name, uint16_t rclass, uint32_t ttl,
+             std::span<const uint8_t> rdata) {
+        static const uint8_t empty_txt[] = {0};
+        if (rdata.empty())
+            rdata = empty_txt;
+        return record(section, name, MDNS_RECORDTYPE_TXT, rclass, ttl, rdata);
+    }
+
+    /// \param ipv4 Address in network byte order
+    bool a(mdns_entry_type_t section, std::string_view name, uint16_t rclass, uint32_t ttl, uint32_t ipv4) {
+        return record(section, name, MDNS_RECORDTYPE_A, rclass, ttl, {(const uint8_t*)&ipv4, 4});
+    }
+
+    bool aaaa(mdns_entry_type_t section, std::string_view name, uint16_t rclass, uint32_t ttl,
+              const uint8_t ipv6[16]) {
+        return record(section, name, MDNS_RECORDTYPE_AAAA, rclass, ttl, {ipv6, 16});
+    }
+
+    const void* data() const { return m_buffer; }
+    size_t size() const { return m_size; }
+    size_t capacity() const { return m_capacity; }
+
+    /// Number of entries in the given section
+    uint16_t count(mdns_entry_type_t section) const { return get16(4 + 2 * section); }
+    bool empty() const { return m_size == sizeof(mdns_header_t); }
+
+private:
+    bool begin_record(mdns_entry_type_t section, std::string_view name, uint16_t rtype, uint16_t rclass,
+                      uint32_t ttl) {
+        if (section < m_section || section == MDNS_ENTRYTYPE_QUESTION)
+            return false;
+        if (!write_name(name) || !write16(rtype) || !write16(rclass) || !write16((uint16_t)(ttl >> 16)) ||
+            !write16((uint16_t)ttl))
+            return false;
+        m_rdlength = m_size;
+        return write16(0);
+    }
+
+    void end_record(mdns_entry_type_t section) {
+        put16(m_rdlength, (uint16_t)(m_size - m_rdlength - 2));
+        m_section = section;
+        increment(section);
+    }
+
+    bool write_name(std::string_view name);
+    /// Offset of a written name equal to \p suffix, 0 if there is none
+    size_t find_name(std::string_view suffix, uint64_t fingerprint) const;
+    void remember_name(size_t offset, uint64_t fingerprint) {
+        // References can only address the first 16 KiB of a packet
+        if (m_names < MAX_NAMES && offset < 0x4000)
+            m_name_table[m_names++] = {(uint16_t)offset, fingerprint};
+    }
+
+    bool write(const void* data, size_t length) {
+        if (m_capacity - m_size < length)
+            return false;
+        // Empty record data, such as that of an EDNS record, may come without a buffer
+        if (length)
+            memcpy(m_buffer + m_size, data, length);
+        m_size += length;
+        return true;
+    }
+
+    bool write16(uint16_t value) {
+        if (m_capacity - m_size < 2)
+            return false;
+        put16(m_size, value);
+        m_size += 2;
+        return true;
+    }
+
+    void put16(size_t offset, uint16_t value) {
+        m_buffer[offset] = (uint8_t)(value >> 8);
+        m_buffer[offset + 1] = (uint8_t)value;
+    }
+
+    uint16_t get16(size_t offset) const { return (uint16_t)((m_buffer[offset] << 8) | m_buffer[offset + 1]); }
+
+    void increment(mdns_entry_type_t section) { put16(4 + 2 * section, (uint16_t)(get16(4 + 2 * section) + 1)); }
+
+    bool rollback(size_t mark) {
+        m_size = mark;
+        // Names are remembered in packet order, forget the ones written after the mark
+        while (m_names && m_name_table[m_names - 1].offset >= mark)
+            --m_names;
+        return false;
+    }
+
+    uint8_t* m_buffer{};
+    size_t m_capacity{};
+    size_t m_size{};
+    size_t m_rdlength{};
+    mdns_entry_type_t m_section{};
+
+    struct WrittenName {
+        uint16_t offset;
+        /// name_fingerprint() of the dotted form with trailing dot
+        uint64_t fingerprint;
+    };
+    std::array<WrittenName, MAX_NAMES> m_name_table;
+    size_t m_names{};
+};
+
+/// Implementation ///
+
+namespace detail
+{
+
+/// name_fingerprint() of \p name with a trailing dot, whether \p name has one or not
+inline uint64_t qualified_fingerprint(std::string_view name) noexcept {
+    uint64_t hash = name_fingerprint(name);
+    if (!name.empty() && name.back() != '.')
+        hash = (hash ^ (uint8_t)'.') * 0x100000001b3ULL;
+    return hash;
+}
+
+}
+
+inline bool PacketWriter::write_name(std::string_view name) {
+    if (!name.empty() && name.back() == '.')
+        name.remove_suffix(1);
+    // Look for the longest suffix that is in the packet already, the labels in front of it are
+    // written and remembered for later names
+    const size_t start = m_size;
+    size_t label = 0;
+    size_t reference = 0;
+    while (label < name.size()) {
+        const std::string_view suffix = name.substr(label);
+        const uint64_t fingerprint = detail::qualified_fingerprint(suffix);
+        reference = find_name(suffix, fingerprint);
+        if (reference)
+            break;
+        size_t dot = name.find('.', label);
+        if (dot == std::string_view::npos)
+            dot = name.size();
+        const size_t length = dot - label;
+        if (!length || length > 63 || m_capacity - m_size < length + 1)
+            return rollback(start);
+        m_buffer[m_size] = (uint8_t)length;
+        memcpy(m_buffer + m_size + 1, name.data() + label, length);
+        remember_name(m_size, fingerprint);
+        m_size += length + 1;
+        label = dot + 1;
+    }
+    if (reference) {
+        void* end = mdns_string_make_ref(m_buffer + m_size, m_capacity - m_size, reference);
+        if (!end)
+            return rollback(start);
+        m_size = (size_t)((uint8_t*)end - m_buffer);
+    } else {
+        static const uint8_t root = 0;
+        if (!write(&root, 1))
+            return rollback(start);
+    }
+    return true;
+}
+
+inline size_t PacketWriter::find_name(std::string_view suffix, uint64_t fingerprint) const {
+    for (size_t i = 0; i < m_names; ++i) {
+        if (m_name_table[i].fingerprint != fingerprint)
+            continue;
+        // Rule out fingerprint collisions
+        size_t label = 0;
+        bool equal = true;
+        auto it = WireName(m_buffer, m_size, m_name_table[i].offset).begin();
+        for (; equal && it != std::default_sentinel && label < suffix.size(); ++it) {
+            const size_t dot = std::min(suffix.find('.', label), suffix.size());
+            equal = name_equal(*it, suffix.substr(label, dot - label));
+            label = dot + 1;
+        }
+        if (equal && it == std::default_sentinel && it.complete() && label >= suffix.size())
+            return m_name_table[i].offset;
+    }
+    return 0;
+}
+
+}
@@ -0,0 +1,336 @@
+#pragma once
+
+#include "responder.h"
+#include "packet.h"
+#include "queue.h"
+#include "cpp_concepts.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <sys/select.h>
+
+namespace mdns
+{
+
+/// Counters of a ResponderPipeline
+struct PipelineStats {
+    /// Datagrams received by the I/O thread
+    uint64_t received;
+    /// Datagrams read and dropped because no packet buffer was free
+    uint64_t no_buffer;
+    /// Datagrams dropped because the queue of their parser worker was full
+    uint64_t parse_queue_full;
+    /// Questions answered by the parser workers
+    uint64_t answered;
+    /// Response packets dropped because the sender queue was full
+    uint64_t send_queue_full;
+    /// Response packets sent
+    uint64_t sent;
+    /// Rate limits of all parser workers, see RateLimiter and SharedMulticastLimit
+    RateLimitStats rate_limit;
+};
+
+/// Multi threaded responder: receive, parse and answer, send
+///
+/// Responder::poll() does everything on one thread, so a slow record callback or a burst of
+/// questions keeps it from reading the sockets and the kernel drops datagrams silently. The pipeline
+/// splits the work into stages connected by bounded lock-free queues:
+///
+/// - one I/O thread only receives datagrams into packet buffers and hands them to the parser
+///   workers (one SpscQueue per worker), all datagrams of a source address to the same worker, so
+///   the per source rate limit of its Responder sees all of them,
+/// - parser workers pass the records of every packet to the record callback and answer its
+///   questions, each with its own Responder. The multicast rate limit is shared by all of them, a
+///   record is multicast at most once per second no matter how many workers answer for it,
+/// - one sender thread transmits the responses of all workers (MpscQueue).
+///
+/// Delayed answers with shared records (see Responder) are aggregated per worker: questions for the
+/// same socket that a worker parses during the delay share response packets.
+///
+/// A full queue never blocks the stage in front of it, the datagram or response is dropped and
+/// counted instead, see stats(). A datagram is never handed to another worker, that would get
+/// around the per source rate limit. The I/O thread keeps reading the sockets even if no packet
+/// buffer is free, so all drops show up in the counters.
+///
+/// Every queued packet and response holds a buffer of the memory manager, which needs room for
+/// (workers + 1) * QUEUE_SIZE buffers to never be the bottleneck, for example DynamicMemory. A
+/// worker holds buffers only while it answers a packet, with fewer buffers datagrams are dropped
+/// and counted in no_buffer, but all workers keep answering.
+/// The registry is read from all workers, use a ThreadSafetyManager with shared scopes like
+/// SharedMutexThreadSafe. The sockets must be non-blocking, as the ones of UnixSocket are.
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager,
+         size_t QUEUE_SIZE = 64>
+class ResponderPipeline
+{
+public:
+    using Registry = ServiceRegistry<ThreadSafetyManager>;
+    using Packet = SharedPacket<MemoryManager>;
+    using Worker = Responder<MemoryManager, SocketLayer, ThreadSafetyManager>;
+    using Response = typename Worker::Response;
+
+    /// Datagrams received per socket before the I/O thread looks at the other sockets
+    static constexpr int RECEIVE_BATCH = 32;
+    /// How often the I/O thread checks for stop()
+    static constexpr int STOP_CHECK_MS = 100;
+    /// How long an idle parser worker with delayed answers sleeps before it checks its queue again
+    static constexpr auto PENDING_CHECK = std::chrono::milliseconds(2);
+
+    ResponderPipeline(MemoryManager& memory, SocketLayer& sockets, Registry& registry, unsigned workers = 2)
+        : m_memory(memory), m_sockets(sockets), m_registry(registry), m_num_workers(workers ? workers : 1) {}
+    ~ResponderPipeline() { stop(); }
+
+    ResponderPipeline(const ResponderPipeline&) = delete;
+    ResponderPipeline& operator=(const ResponderPipeline&) = delete;
+
+    /// Pass all records of every received packet to \p callback, invoked on the parser workers.
+    /// Call before start().
+    void set_record_callback(mdns_record_callback_fn callback, void* user_data) {
+        m_callback = callback;
+        m_callback_data = user_data;
+    }
+
+    /// Open the service sockets on the mDNS port and start all threads
+    /// \return False if no socket could be opened
+    bool start(bool ipv4 = true, bool ipv6 = true);
+    /// Stop all threads and close the sockets. Queued packets are still answered.
+    void stop();
+
+    bool running() const noexcept { return m_receiving.load(std::memory_order_relaxed); }
+
+    /// Safe to call from any thread, but not at the same time as start() or stop()
+    PipelineStats stats() const noexcept;
+
+private:
+    struct Stage {
+        Stage(MemoryManager& memory, SocketLayer& sockets, Registry& registry) : responder(memory, sockets, registry) {}
+
+        Worker responder;
+        SpscQueue<Packet, QUEUE_SIZE> queue;
+        std::thread thread;
+    };
+
+    void receive_loop();
+    void parse_loop(Stage& stage);
+    void send_loop();
+    /// \return False if the queue of the parser worker of the source is full
+    bool dispatch(Packet&& packet);
+    void send(Response& response);
+    static bool queue_response(Response& response, void* user_data);
+
+    MemoryManager& m_memory;
+    SocketLayer& m_sockets;
+    Registry& m_registry;
+    const unsigned m_num_workers;
+    mdns_record_callback_fn m_callback{};
+    void* m_callback_data{};
+
+    std::vector<typename SocketLayer::SocketDP> m_socket_dps;
+    std::vector<std::unique_ptr<Stage>> m_stages;
+    SharedMulticastLimit m_multicast_limit;
+    MpscQueue<Response, QUEUE_SIZE> m_responses;
+    std::thread m_receiver;
+    std::thread m_sender;
+    // One flag per stage, stages are stopped front to back
+    std::atomic<bool> m_receiving{};
+    std::atomic<bool> m_parsing{};
+    std::atomic<bool> m_sending{};
+
+    std::atomic<uint64_t> m_received{};
+    std::atomic<uint64_t> m_no_buffer{};
+    std::atomic<uint64_t> m_parse_queue_full{};
+    std::atomic<uint64_t> m_answered{};
+    std::atomic<uint64_t> m_sent{};
+    // Unicast rate limits of the workers of previous runs
+    std::atomic<uint64_t> m_rate_limited{};
+};
+
+/// Implementation ///
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager,
+         size_t QUEUE_SIZE>
+bool ResponderPipeline<MemoryManager, SocketLayer, ThreadSafetyManager, QUEUE_SIZE>::start(bool ipv4, bool ipv6) {
+    stop();
+    for (auto socketDp : m_sockets.open_service_sockets(ipv4, ipv6, MDNS_PORT)) {
+        if (socketDp.socket >= 0)
+            m_socket_dps.push_back(socketDp);
+    }
+    if (m_socket_dps.empty())
+        return false;
+
+    m_receiving = m_parsing = m_sending = true;
+    for (unsigned i = 0; i < m_num_workers; ++i)
+        m_stages.push_back(std::make_unique<Stage>(m_memory, m_sockets, m_registry));
+    for (auto& stage : m_stages) {
+        Stage* worker = stage.get();
+        worker->responder.set_multicast_limit(&m_multicast_limit);
+        worker->thread = std::thread([this, worker] { parse_loop(*worker); });
+    }
+    m_sender = std::thread([this] { send_loop(); });
+    m_receiver = std::thread([this] { receive_loop(); });
+    return true;
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager,
+         size_t QUEUE_SIZE>
+void ResponderPipeline<MemoryManager, SocketLayer, ThreadSafetyManager, QUEUE_SIZE>::stop() {
+    // Stop stage by stage, so every stage drains what the previous one queued
+    m_receiving = false;
+    if (m_receiver.joinable())
+        m_receiver.join();
+    m_parsing = false;
+    for (auto& stage : m_stages) {
+        stage->queue.wake();
+        if (stage->thread.joinable())
+            stage->thread.join();
+    }
+    m_sending = false;
+    m_responses.wake();
+    if (m_sender.joinable())
+        m_sender.join();
+
+    Response response;
+    while (m_responses.try_pop(response))
+        m_memory.release(response.buffer);
+    for (const auto& stage : m_stages)
+        m_rate_limited.fetch_add(stage->responder.rate_limit_stats().dropped, std::memory_order_relaxed);
+    m_stages.clear();
+    for (auto socketDp : m_socket_dps)
+        m_sockets.close(socketDp);
+    m_socket_dps.clear();
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager,
+         size_t QUEUE_SIZE>
+PipelineStats ResponderPipeline<MemoryManager, SocketLayer, ThreadSafetyManager, QUEUE_SIZE>::stats() const noexcept {
+    PipelineStats stats{m_received.load(std::memory_order_relaxed),
+                        m_no_buffer.load(std::memory_order_relaxed),
+                        m_parse_queue_full.load(std::memory_order_relaxed),
+                        m_answered.load(std::memory_order_relaxed),
+                        m_responses.rejected(),
+                        m_sent.load(std::memory_order_relaxed),
+                        {m_multicast_limit.stats().suppressed, m_rate_limited.load(std::memory_order_relaxed)}};
+    for (const auto& stage : m_stages)
+        stats.rate_limit.dropped += stage->responder.rate_limit_stats().dropped;
+    return stats;
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager,
+         size_t QUEUE_SIZE>
+void ResponderPipeline<MemoryManager, SocketLayer, ThreadSafetyManager, QUEUE_SIZE>::receive_loop() {
+    uint8_t discard[2048];
+    while (m_receiving.load(std::memory_order_relaxed)) {
+        timeval tv{};
+        tv.tv_usec = STOP_CHECK_MS * 1000;
+
+        int nfds = 0;
+        fd_set readfs;
+        FD_ZERO(&readfs);
+        for (auto socketDp : m_socket_dps) {
+            if (socketDp.socket >= nfds)
+                nfds = socketDp.socket + 1;
+            FD_SET(socketDp.socket, &readfs);
+        }
+        if (select(nfds, &readfs, nullptr, nullptr, &tv) <= 0)
+            continue;
+
+        for (auto socketDp : m_socket_dps) {
+            if (!FD_ISSET(socketDp.socket, &readfs))
+                continue;
+            for (int i = 0; i < RECEIVE_BATCH; ++i) {
+                Packet packet = Packet::receive(m_memory, socketDp.socket);
+                if (!packet) {
+                    // Either nothing left to read or no buffer, read into the void to tell
+                    sockaddr_in6 from;
+                    size_t from_size;
+                    if (!mdns_socket_recv(socketDp.socket, discard, sizeof(discard), &from, &from_size))
+                        break;
+                    m_received.fetch_add(1, std::memory_order_relaxed);
+                    m_no_buffer.fetch_add(1, std::memory_order_relaxed);
+                    continue;
+                }
+                m_received.fetch_add(1, std::memory_order_relaxed);
+                if (!dispatch(std::move(packet)))
+                    m_parse_queue_full.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager,
+         size_t QUEUE_SIZE>
+bool ResponderPipeline<MemoryManager, SocketLayer, ThreadSafetyManager, QUEUE_SIZE>::dispatch(Packet&& packet) {
+    Stage& stage = *m_stages[detail::address_hash(packet.from()) % m_stages.size()];
+    return stage.queue.try_push(std::move(packet));
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager,
+         size_t QUEUE_SIZE>
+void ResponderPipeline<MemoryManager, SocketLayer, ThreadSafetyManager, QUEUE_SIZE>::parse_loop(Stage& stage) {
+    Packet packet;
+    while (true) {
+        const auto deadline = stage.responder.pending_deadline();
+        if (Clock::now() >= deadline)
+            stage.responder.send_pending(queue_response, this);
+        if (!stage.queue.try_pop(packet)) {
+            if (!m_parsing.load()) {
+                stage.responder.send_pending(queue_response, this);
+                break;
+            }
+            // The queue signal cannot time out, poll while answers are delayed
+            if (deadline == Clock::time_point::max())
+                stage.queue.wait(m_parsing);
+            else
+                std::this_thread::sleep_for(std::min<Clock::duration>(deadline - Clock::now(), PENDING_CHECK));
+            continue;
+        }
+        if (m_callback)
+            packet.parse(m_callback, m_callback_data);
+        const int answered = stage.responder.answer(packet, queue_response, this);
+        m_answered.fetch_add((uint64_t)answered, std::memory_order_relaxed);
+        packet.reset();
+    }
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager,
+         size_t QUEUE_SIZE>
+bool ResponderPipeline<MemoryManager, SocketLayer, ThreadSafetyManager, QUEUE_SIZE>::queue_response(
+    Response& response, void* user_data) {
+    auto* pipeline = static_cast<ResponderPipeline*>(user_data);
+    return pipeline->m_responses.try_push(std::move(response));
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager,
+         size_t QUEUE_SIZE>
+void ResponderPipeline<MemoryManager, SocketLayer, ThreadSafetyManager, QUEUE_SIZE>::send_loop() {
+    Response response;
+    while (true) {
+        if (!m_responses.try_pop(response)) {
+            if (!m_sending.load())
+                break;
+            m_responses.wait(m_sending);
+            continue;
+        }
+        send(response);
+    }
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager,
+         size_t QUEUE_SIZE>
+void ResponderPipeline<MemoryManager, SocketLayer, ThreadSafetyManager, QUEUE_SIZE>::send(Response& response) {
+    int result;
+    if (response.address_size)
+        result = mdns_unicast_send(response.sock, &response.address, response.address_size, response.buffer->data(),
+                                   response.size);
+    else
+        result = mdns_multicast_send_interface(response.sock, response.buffer->data(), response.size,
+                                               response.interface);
+    if (result >= 0)
+        m_sent.fetch_add(1, std::memory_order_relaxed);
+    m_memory.release(response.buffer);
+}
+
+}
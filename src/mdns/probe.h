@@ -0,0 +1,495 @@
+#pragma once
+
+#include "service_registry.h"
+#include "record_cache.h"
+#include "packet_writer.h"
+#include "wire_name.h"
+
+#include <algorithm>
+#include <chrono>
+#include <compare>
+#include <cstdint>
+#include <list>
+#include <memory_resource>
+#include <random>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace mdns
+{
+
+/// Probes the names of new service instances and schedules their announcement (RFC 6762 8)
+///
+/// All instances added within one probe interval share a probe cycle: the probe questions and the
+/// proposed records in the authority section of all of them are packed into as few packets as
+/// possible, three probes 250 ms apart, so publishing thousands of instances takes as long as
+/// publishing one. Instances whose names are still unique after the third probe are handed out to
+/// be registered and announced twice, one second apart.
+///
+/// received() watches all packets for the names being probed:
+/// - A response with a different record for a name means the name is taken. The instance (or the
+///   host of its SRV record) is renamed to "<name> (2)" ("<host>-2") and probed again, see
+///   set_conflict_callback().
+/// - A probe of another host for the same name is resolved by comparing the proposed records
+///   (RFC 6762 8.2). If ours compare lower, the instance probes again after one second.
+///
+/// Records identical to the proposed ones are never a conflict, so our own packets looped back by
+/// the network stack are ignored.
+///
+/// The ProbeSet does no I/O and is not thread safe, see Responder::publish().
+class ProbeSet
+{
+public:
+    static constexpr auto PROBE_DELAY = std::chrono::milliseconds(250);
+    static constexpr auto PROBE_INTERVAL = std::chrono::milliseconds(250);
+    static constexpr unsigned PROBE_COUNT = 3;
+    static constexpr auto ANNOUNCE_INTERVAL = std::chrono::seconds(1);
+    static constexpr unsigned ANNOUNCE_COUNT = 2;
+    /// Wait after a lost tie-break
+    static constexpr auto DEFER_DELAY = std::chrono::seconds(1);
+
+    /// Called after an instance was renamed because its name was taken
+    using ConflictCallback = void (*)(const ServiceInstance& instance, void* user_data);
+
+    explicit ProbeSet(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : m_resource(resource), m_probes(resource), m_names(resource), m_random(std::random_device{}()) {}
+
+    ProbeSet(const ProbeSet&) = delete;
+    ProbeSet& operator=(const ProbeSet&) = delete;
+
+    void set_conflict_callback(ConflictCallback callback, void* user_data) {
+        m_conflict_callback = callback;
+        m_conflict_data = user_data;
+    }
+
+    /// Start probing for \p instance
+    /// \return False if the instance is invalid, see ServiceRegistry::is_valid()
+    bool add(const ServiceInstance& instance, Clock::time_point now);
+
+    bool empty() const noexcept { return m_probes.empty(); }
+    /// Number of instances being probed or announced
+    size_t size() const noexcept { return m_probes.size(); }
+
+    /// When run() has something to do, Clock::time_point::max() if the set is empty
+    Clock::time_point next_deadline() const noexcept;
+
+    /// Send the probes due at \p now
+    /// \param send Called with \p writer for every finished probe packet
+    /// \param published Instances that finished probing, register them now
+    /// \param announce Full names of the instances to announce now
+    template<class Send>
+    void run(Clock::time_point now, PacketWriter& writer, Send&& send, std::vector<ServiceInstance>& published,
+             std::pmr::vector<std::pmr::string>& announce);
+
+    /// Check a received datagram for conflicts with the names being probed
+    void received(const void* data, size_t size, Clock::time_point now);
+
+private:
+    enum class State { Probing, Announcing };
+
+    struct Probe {
+        explicit Probe(std::pmr::memory_resource* resource) : instance(resource), full_name(resource) {}
+
+        ServiceInstance instance;
+        std::pmr::string full_name;
+        State state{State::Probing};
+        /// Probes or announcements sent in the current state
+        unsigned sent{};
+        Clock::time_point next;
+    };
+
+    /// A name being probed, the instance name or the host of the probe
+    struct NameRef {
+        Probe* probe;
+        bool host;
+    };
+
+    /// A record in the form compared by the tie-break rules: class, type and uncompressed data
+    struct ProbeRecord {
+        uint16_t rclass;
+        uint16_t rtype;
+        std::pmr::vector<uint8_t> rdata;
+
+        friend bool operator==(const ProbeRecord&, const ProbeRecord&) = default;
+        friend auto operator<=>(const ProbeRecord&, const ProbeRecord&) = default;
+    };
+
+    struct Received;
+
+    static int record_callback(int sock, const struct sockaddr* from, size_t addrlen, mdns_entry_type_t entry,
+                               uint16_t query_id, uint16_t rtype, uint16_t rclass, uint32_t ttl, const void* data,
+                               size_t size, size_t name_offset, size_t name_length, size_t record_offset,
+                               size_t record_length, void* user_data);
+
+    /// The records we propose for \p name, sorted
+    static std::pmr::vector<ProbeRecord> proposed(const NameRef& name, std::pmr::memory_resource* resource);
+    /// Upper bound of the bytes the probe of \p probe adds to a packet
+    static size_t probe_size(const Probe& probe);
+
+    template<class Send>
+    void write_probes(std::span<Probe* const> probes, PacketWriter& writer, Send& send);
+    void index(Probe& probe);
+    void unindex(Probe& probe);
+    /// \param renamed All names renamed are added to it
+    void rename(const NameRef& name, Clock::time_point now, std::pmr::vector<NameRef>& renamed);
+    void restart(Probe& probe, Clock::time_point at);
+    Clock::time_point start_time(Clock::time_point now);
+
+    std::pmr::memory_resource* m_resource;
+    /// A list, so names can be indexed by view
+    std::pmr::list<Probe> m_probes;
+    std::pmr::unordered_multimap<std::string_view, NameRef, NameHash, NameEqual> m_names;
+    /// Start of the newest probe cycle that has not sent its first probe, instances added until then join it
+    Clock::time_point m_next_start{};
+    std::minstd_rand m_random;
+    ConflictCallback m_conflict_callback{};
+    void* m_conflict_data{};
+};
+
+/// Implementation ///
+
+namespace detail
+{
+
+/// "name" -> "name (2)", "name (2)" -> "name (3)" (RFC 6763 appendix D)
+inline std::string next_instance_name(std::string_view name) {
+    unsigned number = 1;
+    if (name.size() > 4 && name.back() == ')') {
+        const size_t open = name.rfind(" (");
+        if (open != std::string_view::npos) {
+            unsigned value = 0;
+            bool digits = open + 3 < name.size();
+            for (size_t i = open + 2; digits && i + 1 < name.size(); ++i) {
+                digits = name[i] >= '0' && name[i] <= '9';
+                value = value * 10 + (unsigned)(name[i] - '0');
+            }
+            if (digits) {
+                number = value;
+                name = name.substr(0, open);
+            }
+        }
+    }
+    std::string result(name.substr(0, 63 - 12));
+    result += " (" + std::to_string(number + 1) + ")";
+    return result;
+}
+
+/// "host.local." -> "host-2.local.", "host-2.local." -> "host-3.local."
+inline std::string next_host_name(std::string_view host) {
+    const size_t dot = std::min(host.find('.'), host.size());
+    std::string_view label = host.substr(0, dot);
+    unsigned number = 1;
+    const size_t dash = label.rfind('-');
+    if (dash != std::string_view::npos && dash + 1 < label.size() &&
+        std::all_of(label.begin() + (ptrdiff_t)dash + 1, label.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+        number = (unsigned)std::stoul(std::string(label.substr(dash + 1)));
+        label = label.substr(0, dash);
+    }
+    std::string result(label.substr(0, 63 - 12));
+    result += '-' + std::to_string(number + 1);
+    result += host.substr(dot);
+    return result;
+}
+
+}
+
+/// State of one received() call
+struct ProbeSet::Received {
+    ProbeSet* probes;
+    bool response;
+    std::pmr::memory_resource* resource;
+    /// Authority records of a probe for one of our names
+    std::pmr::vector<std::pair<NameRef, ProbeRecord>> authority;
+    /// Names taken by someone else
+    std::pmr::vector<NameRef> conflicts;
+};
+
+inline bool ProbeSet::add(const ServiceInstance& instance, Clock::time_point now) {
+    if (!ServiceRegistry<SingleThreadSafe>::is_valid(instance))
+        return false;
+    Probe& probe = m_probes.emplace_back(m_resource);
+    probe.instance = instance;
+    probe.instance.service_type = qualified_name(instance.service_type);
+    probe.instance.host = qualified_name(instance.host);
+    probe.full_name = ServiceRegistry<SingleThreadSafe>::instance_name(probe.instance);
+    probe.next = start_time(now);
+    index(probe);
+    return true;
+}
+
+inline Clock::time_point ProbeSet::start_time(Clock::time_point now) {
+    // Join the cycle that has not started yet, or start a new one after a random delay of up to 250 ms
+    if (m_next_start > now)
+        return m_next_start;
+    std::uniform_int_distribution<long> delay(0, PROBE_DELAY.count());
+    m_next_start = now + std::chrono::milliseconds(delay(m_random));
+    return m_next_start;
+}
+
+inline Clock::time_point ProbeSet::next_deadline() const noexcept {
+    Clock::time_point deadline = Clock::time_point::max();
+    for (const Probe& probe : m_probes)
+        deadline = std::min(deadline, probe.next);
+    return deadline;
+}
+
+template<class Send>
+void ProbeSet::run(Clock::time_point now, PacketWriter& writer, Send&& send, std::vector<ServiceInstance>& published,
+                   std::pmr::vector<std::pmr::string>& announce) {
+    std::pmr::vector<Probe*> probing(announce.get_allocator());
+    for (auto it = m_probes.begin(); it != m_probes.end();) {
+        Probe& probe = *it;
+        if (probe.next > now) {
+            ++it;
+            continue;
+        }
+        if (probe.state == State::Probing && probe.sent == PROBE_COUNT) {
+            // No conflict within 250 ms of the last probe, the names are ours
+            probe.state = State::Announcing;
+            probe.sent = 0;
+            published.push_back(probe.instance);
+        }
+        if (probe.state == State::Probing) {
+            probing.push_back(&probe);
+            ++probe.sent;
+            probe.next = now + PROBE_INTERVAL;
+        } else {
+            announce.emplace_back(probe.full_name);
+            if (++probe.sent == ANNOUNCE_COUNT) {
+                unindex(probe);
+                it = m_probes.erase(it);
+                continue;
+            }
+            probe.next = now + ANNOUNCE_INTERVAL;
+        }
+        ++it;
+    }
+    write_probes(probing, writer, send);
+}
+
+template<class Send>
+void ProbeSet::write_probes(std::span<Probe* const> probes, PacketWriter& writer, Send& send) {
+    constexpr uint16_t any = 255;
+    auto first_of_host = [&probes](size_t begin, size_t i) {
+        for (size_t j = begin; j < i; ++j) {
+            if (name_equal(probes[j]->instance.host, probes[i]->instance.host))
+                return false;
+        }
+        return true;
+    };
+
+    size_t begin = 0;
+    while (begin < probes.size()) {
+        // As many probes as certainly fit, the questions have to precede all authority records
+        size_t end = begin;
+        size_t size = sizeof(mdns_header_t);
+        while (end < probes.size() && (end == begin || size + probe_size(*probes[end]) <= writer.capacity()))
+            size += probe_size(*probes[end++]);
+
+        writer.begin(0, 0);
+        for (size_t i = begin; i < end; ++i) {
+            const Probe& probe = *probes[i];
+            // The first probe asks for unicast responses (RFC 6762 8.1)
+            const uint16_t rclass = MDNS_CLASS_IN | (probe.sent == 1 ? MDNS_UNICAST_RESPONSE : 0);
+            writer.question(probe.full_name, any, rclass);
+            if (first_of_host(begin, i))
+                writer.question(probe.instance.host, any, rclass);
+        }
+        for (size_t i = begin; i < end; ++i) {
+            const ServiceInstance& instance = probes[i]->instance;
+            writer.srv(MDNS_ENTRYTYPE_AUTHORITY, probes[i]->full_name, MDNS_CLASS_IN, HOST_RECORD_TTL,
+                       instance.priority, instance.weight, instance.port, instance.host);
+            writer.txt(MDNS_ENTRYTYPE_AUTHORITY, probes[i]->full_name, MDNS_CLASS_IN, SERVICE_RECORD_TTL,
+                       instance.txt);
+            if (!first_of_host(begin, i))
+                continue;
+            if (instance.ipv4)
+                writer.a(MDNS_ENTRYTYPE_AUTHORITY, instance.host, MDNS_CLASS_IN, HOST_RECORD_TTL, instance.ipv4);
+            if (instance.ipv6)
+                writer.aaaa(MDNS_ENTRYTYPE_AUTHORITY, instance.host, MDNS_CLASS_IN, HOST_RECORD_TTL,
+                            instance.ipv6->data());
+        }
+        if (!writer.empty())
+            send(writer);
+        begin = end;
+    }
+}
+
+inline size_t ProbeSet::probe_size(const Probe& probe) {
+    const ServiceInstance& instance = probe.instance;
+    const size_t name = probe.full_name.size() + 2;
+    const size_t host = instance.host.size() + 2;
+    size_t size = name + 4 + host + 4;
+    size += name + 10 + 6 + host;
+    size += name + 10 + std::max<size_t>(instance.txt.size(), 1);
+    size += host + 10 + 4;
+    size += host + 10 + 16;
+    return size;
+}
+
+inline void ProbeSet::received(const void* data, size_t size, Clock::time_point now) {
+    if (m_probes.empty() || size < sizeof(mdns_header_t))
+        return;
+    std::pmr::monotonic_buffer_resource arena(m_resource);
+    const bool response = (((const uint8_t*)data)[2] & 0x80) != 0;
+    Received received{this, response, &arena, decltype(Received::authority)(&arena),
+                      decltype(Received::conflicts)(&arena)};
+    mdns_packet_parse(0, nullptr, 0, data, size, record_callback, &received);
+
+    // Every differing record of a name reports it, rename each name once
+    std::pmr::vector<NameRef> renamed(&arena);
+    for (const NameRef& name : received.conflicts) {
+        if (std::none_of(renamed.begin(), renamed.end(), [&name](const NameRef& other) {
+                return other.probe == name.probe && other.host == name.host;
+            }))
+            rename(name, now, renamed);
+    }
+
+    // Simultaneous probes: compare the sorted records proposed for each name (RFC 6762 8.2)
+    auto& authority = received.authority;
+    std::stable_sort(authority.begin(), authority.end(), [](const auto& lhs, const auto& rhs) {
+        return std::pair(lhs.first.probe, lhs.first.host) < std::pair(rhs.first.probe, rhs.first.host);
+    });
+    for (size_t begin = 0; begin < authority.size();) {
+        const NameRef name = authority[begin].first;
+        std::pmr::vector<ProbeRecord> theirs(&arena);
+        size_t end = begin;
+        for (; end < authority.size() && authority[end].first.probe == name.probe &&
+               authority[end].first.host == name.host;
+             ++end)
+            theirs.push_back(authority[end].second);
+        std::sort(theirs.begin(), theirs.end());
+        if (proposed(name, &arena) < theirs)
+            restart(*name.probe, now + DEFER_DELAY);
+        begin = end;
+    }
+}
+
+inline int ProbeSet::record_callback(int, const struct sockaddr*, size_t, mdns_entry_type_t entry, uint16_t,
+                                     uint16_t rtype, uint16_t rclass, uint32_t, const void* data, size_t size,
+                                     size_t name_offset, size_t, size_t record_offset, size_t record_length,
+                                     void* user_data) {
+    auto* received = static_cast<Received*>(user_data);
+    const bool probe_record = !received->response && entry == MDNS_ENTRYTYPE_AUTHORITY;
+    const bool response_record = received->response && entry != MDNS_ENTRYTYPE_QUESTION;
+    if (!probe_record && !response_record)
+        return 0;
+
+    auto [first, last] = received->probes->m_names.equal_range(WireName(data, size, name_offset));
+    if (first == last)
+        return 0;
+
+    uint8_t rdata[1024];
+    const size_t rdata_size =
+        mdns_record_rdata_expand(data, size, record_offset, record_length, rtype, rdata, sizeof(rdata));
+    if (rdata_size == MDNS_INVALID_POS)
+        return 0;
+    ProbeRecord record{(uint16_t)(rclass & ~MDNS_CACHE_FLUSH), rtype,
+                       std::pmr::vector<uint8_t>(rdata, rdata + rdata_size, received->resource)};
+
+    for (auto it = first; it != last; ++it) {
+        const NameRef& name = it->second;
+        if (name.probe->state != State::Probing)
+            continue;
+        if (probe_record) {
+            received->authority.emplace_back(name, record);
+            continue;
+        }
+        const auto ours = proposed(name, received->resource);
+        if (std::find(ours.begin(), ours.end(), record) == ours.end())
+            received->conflicts.push_back(name);
+    }
+    return 0;
+}
+
+inline std::pmr::vector<ProbeSet::ProbeRecord> ProbeSet::proposed(const NameRef& name,
+                                                                  std::pmr::memory_resource* resource) {
+    const ServiceInstance& instance = name.probe->instance;
+    std::pmr::vector<ProbeRecord> records(resource);
+    auto add = [&](uint16_t rtype, const void* data, size_t size) {
+        records.push_back({MDNS_CLASS_IN, rtype,
+                           std::pmr::vector<uint8_t>((const uint8_t*)data, (const uint8_t*)data + size, resource)});
+    };
+    if (name.host) {
+        if (instance.ipv4)
+            add(MDNS_RECORDTYPE_A, &instance.ipv4, 4);
+        if (instance.ipv6)
+            add(MDNS_RECORDTYPE_AAAA, instance.ipv6->data(), 16);
+    } else {
+        uint8_t srv[6 + 256];
+        srv[0] = (uint8_t)(instance.priority >> 8);
+        srv[1] = (uint8_t)instance.priority;
+        srv[2] = (uint8_t)(instance.weight >> 8);
+        srv[3] = (uint8_t)instance.weight;
+        srv[4] = (uint8_t)(instance.port >> 8);
+        srv[5] = (uint8_t)instance.port;
+        void* end = mdns_string_make(srv + 6, sizeof(srv) - 6, instance.host.data(), instance.host.size());
+        if (end)
+            add(MDNS_RECORDTYPE_SRV, srv, (size_t)((uint8_t*)end - srv));
+        static const uint8_t empty_txt[] = {0};
+        if (instance.txt.empty())
+            add(MDNS_RECORDTYPE_TXT, empty_txt, 1);
+        else
+            add(MDNS_RECORDTYPE_TXT, instance.txt.data(), instance.txt.size());
+    }
+    std::sort(records.begin(), records.end());
+    return records;
+}
+
+inline void ProbeSet::index(Probe& probe) {
+    m_names.emplace(std::string_view(probe.full_name), NameRef{&probe, false});
+    m_names.emplace(std::string_view(probe.instance.host), NameRef{&probe, true});
+}
+
+inline void ProbeSet::unindex(Probe& probe) {
+    for (std::string_view name : {std::string_view(probe.full_name), std::string_view(probe.instance.host)}) {
+        auto [first, last] = m_names.equal_range(name);
+        for (auto it = first; it != last;) {
+            if (it->second.probe == &probe)
+                it = m_names.erase(it);
+            else
+                ++it;
+        }
+    }
+}
+
+inline void ProbeSet::rename(const NameRef& name, Clock::time_point now, std::pmr::vector<NameRef>& renamed) {
+    Probe& probe = *name.probe;
+    // All instances on a host share its name
+    const size_t first = renamed.size();
+    if (name.host) {
+        const std::string host(probe.instance.host);
+        for (Probe& other : m_probes) {
+            if (other.state == State::Probing && name_equal(other.instance.host, host))
+                renamed.push_back({&other, true});
+        }
+    } else {
+        renamed.push_back(name);
+    }
+    const std::string new_name = name.host ? detail::next_host_name(probe.instance.host)
+                                           : detail::next_instance_name(probe.instance.name);
+    for (size_t i = first; i < renamed.size(); ++i) {
+        Probe* other = renamed[i].probe;
+        unindex(*other);
+        if (name.host)
+            other->instance.host = new_name;
+        else
+            other->instance.name = new_name;
+        other->full_name = ServiceRegistry<SingleThreadSafe>::instance_name(other->instance);
+        index(*other);
+        restart(*other, start_time(now));
+        if (m_conflict_callback)
+            m_conflict_callback(other->instance, m_conflict_data);
+    }
+}
+
+inline void ProbeSet::restart(Probe& probe, Clock::time_point at) {
+    probe.state = State::Probing;
+    probe.sent = 0;
+    probe.next = at;
+}
+
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "record_cache.h"
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+
+namespace mdns
+{
+
+/// When to ask a question of a continuous query again (RFC 6762 5.2)
+///
+/// The first question is due right away, the second one second later and every further interval
+/// is twice the previous one, up to one hour. Each repetition is delayed by another random 20 to
+/// 120 ms so that queriers which started together do not stay in step. The owner stops asking,
+/// and drops the schedule, when its interest is satisfied.
+class QuerySchedule
+{
+public:
+    static constexpr auto FIRST_INTERVAL = std::chrono::seconds(1);
+    static constexpr auto MAX_INTERVAL = std::chrono::minutes(60);
+    static constexpr auto MIN_JITTER = std::chrono::milliseconds(20);
+    static constexpr auto MAX_JITTER = std::chrono::milliseconds(120);
+
+    /// \param start When the first question is due
+    explicit QuerySchedule(Clock::time_point start) : m_next(start), m_random(std::random_device{}()) {}
+
+    bool due(Clock::time_point now) const noexcept { return now >= m_next; }
+    Clock::time_point next() const noexcept { return m_next; }
+    /// Number of questions sent so far
+    unsigned sent() const noexcept { return m_sent; }
+
+    /// The question was sent at \p now, schedule the next one
+    void sent(Clock::time_point now);
+
+private:
+    Clock::time_point m_next;
+    Clock::duration m_interval = FIRST_INTERVAL;
+    unsigned m_sent{};
+    std::minstd_rand m_random;
+};
+
+/// Implementation ///
+
+inline void QuerySchedule::sent(Clock::time_point now) {
+    std::uniform_int_distribution<long> jitter(MIN_JITTER.count(), MAX_JITTER.count());
+    m_next = now + m_interval + std::chrono::milliseconds(jitter(m_random));
+    m_interval = std::min<Clock::duration>(2 * m_interval, MAX_INTERVAL);
+    ++m_sent;
+}
+
+}
@@ -0,0 +1,223 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace mdns
+{
+
+namespace detail
+{
+
+/// Keeps producer and consumer state on separate cache lines
+inline constexpr size_t CACHE_LINE = 64;
+
+/// Wake-up signal for a consumer that waits on an empty queue
+class QueueSignal
+{
+public:
+    // Sequentially consistent, so a consumer that checks a stop flag after value() cannot miss a
+    // notify_all() that follows a change of the flag
+
+    void notify() noexcept {
+        m_signal.fetch_add(1);
+        m_signal.notify_one();
+    }
+    /// Wake all waiting consumers, for example to stop them
+    void notify_all() noexcept {
+        m_signal.fetch_add(1);
+        m_signal.notify_all();
+    }
+    uint32_t value() const noexcept { return m_signal.load(); }
+    void wait(uint32_t value) const noexcept { m_signal.wait(value); }
+
+private:
+    std::atomic<uint32_t> m_signal{};
+};
+
+}
+
+/// Bounded lock-free queue for one producer and one consumer thread
+///
+/// try_push() never blocks, a full queue rejects the element and counts it in rejected(), which is
+/// the backpressure signal of a pipeline stage. The consumer polls with try_pop() and can sleep on
+/// an empty queue with wait().
+template<class T, size_t CAPACITY>
+class SpscQueue
+{
+    static_assert(CAPACITY && !(CAPACITY & (CAPACITY - 1)), "CAPACITY must be a power of two");
+
+public:
+    SpscQueue() = default;
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+    ~SpscQueue() {
+        for (size_t position = m_head.load(); position != m_tail.load(); ++position)
+            slot(position)->~T();
+    }
+
+    static constexpr size_t capacity() noexcept { return CAPACITY; }
+
+    /// \return False if the queue is full, \p value is left untouched then
+    bool try_push(T&& value) noexcept(std::is_nothrow_move_constructible_v<T>) {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head_cache == CAPACITY) {
+            m_head_cache = m_head.load(std::memory_order_acquire);
+            if (tail - m_head_cache == CAPACITY) {
+                m_rejected.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+        }
+        new (slot(tail)) T(std::move(value));
+        m_tail.store(tail + 1, std::memory_order_release);
+        m_signal.notify();
+        return true;
+    }
+
+    bool try_pop(T& value) noexcept(std::is_nothrow_move_assignable_v<T>) {
+        const size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail_cache) {
+            m_tail_cache = m_tail.load(std::memory_order_acquire);
+            if (head == m_tail_cache)
+                return false;
+        }
+        T* element = slot(head);
+        value = std::move(*element);
+        element->~T();
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// Consumer: sleep until an element was pushed, wake() was called or \p running is false.
+    /// Returns at once if the queue is not empty. Set \p running to false before calling wake() to
+    /// stop a consumer.
+    void wait(const std::atomic<bool>& running) const noexcept {
+        const uint32_t signal = m_signal.value();
+        if (size() || !running.load())
+            return;
+        m_signal.wait(signal);
+    }
+    void wake() noexcept { m_signal.notify_all(); }
+
+    /// Approximate number of queued elements
+    size_t size() const noexcept {
+        return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);
+    }
+    /// Number of elements rejected because the queue was full
+    uint64_t rejected() const noexcept { return m_rejected.load(std::memory_order_relaxed); }
+
+private:
+    T* slot(size_t position) noexcept { return std::launder(reinterpret_cast<T*>(m_slots[position % CAPACITY].data)); }
+
+    struct Slot {
+        alignas(T) std::byte data[sizeof(T)];
+    };
+
+    // Producer side
+    alignas(detail::CACHE_LINE) std::atomic<size_t> m_tail{};
+    size_t m_head_cache{};
+    std::atomic<uint64_t> m_rejected{};
+    // Consumer side
+    alignas(detail::CACHE_LINE) std::atomic<size_t> m_head{};
+    size_t m_tail_cache{};
+    alignas(detail::CACHE_LINE) detail::QueueSignal m_signal;
+    std::array<Slot, CAPACITY> m_slots;
+};
+
+/// Bounded lock-free queue for any number of producer threads and one consumer thread
+///
+/// Every slot carries a sequence number that tells producers and the consumer whose turn it is, so
+/// producers only contend on the tail index. Full queues reject elements like SpscQueue.
+template<class T, size_t CAPACITY>
+class MpscQueue
+{
+    static_assert(CAPACITY && !(CAPACITY & (CAPACITY - 1)), "CAPACITY must be a power of two");
+
+public:
+    MpscQueue() {
+        for (size_t i = 0; i < CAPACITY; ++i)
+            m_slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+    ~MpscQueue() {
+        for (size_t position = m_head.load(); m_slots[position % CAPACITY].sequence.load() == position + 1; ++position)
+            std::launder(reinterpret_cast<T*>(m_slots[position % CAPACITY].data))->~T();
+    }
+
+    static constexpr size_t capacity() noexcept { return CAPACITY; }
+
+    /// \return False if the queue is full, \p value is left untouched then
+    bool try_push(T&& value) noexcept(std::is_nothrow_move_constructible_v<T>) {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        Slot* slot;
+        while (true) {
+            slot = &m_slots[tail % CAPACITY];
+            const size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            const auto diff = (std::ptrdiff_t)(sequence - tail);
+            if (diff == 0) {
+                if (m_tail.compare_exchange_weak(tail, tail + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                m_rejected.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            } else {
+                tail = m_tail.load(std::memory_order_relaxed);
+            }
+        }
+        new (slot->data) T(std::move(value));
+        slot->sequence.store(tail + 1, std::memory_order_release);
+        m_signal.notify();
+        return true;
+    }
+
+    bool try_pop(T& value) noexcept(std::is_nothrow_move_assignable_v<T>) {
+        const size_t head = m_head.load(std::memory_order_relaxed);
+        Slot& slot = m_slots[head % CAPACITY];
+        if (slot.sequence.load(std::memory_order_acquire) != head + 1)
+            return false;
+        T* element = std::launder(reinterpret_cast<T*>(slot.data));
+        value = std::move(*element);
+        element->~T();
+        slot.sequence.store(head + CAPACITY, std::memory_order_release);
+        m_head.store(head + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    /// See SpscQueue::wait()
+    void wait(const std::atomic<bool>& running) const noexcept {
+        const uint32_t signal = m_signal.value();
+        const size_t head = m_head.load(std::memory_order_relaxed);
+        if (m_slots[head % CAPACITY].sequence.load(std::memory_order_acquire) == head + 1 || !running.load())
+            return;
+        m_signal.wait(signal);
+    }
+    void wake() noexcept { m_signal.notify_all(); }
+
+    /// Approximate number of queued elements
+    size_t size() const noexcept {
+        const size_t tail = m_tail.load(std::memory_order_acquire);
+        const size_t head = m_head.load(std::memory_order_acquire);
+        return tail > head ? tail - head : 0;
+    }
+    uint64_t rejected() const noexcept { return m_rejected.load(std::memory_order_relaxed); }
+
+private:
+    struct Slot {
+        std::atomic<size_t> sequence;
+        alignas(T) std::byte data[sizeof(T)];
+    };
+
+    alignas(detail::CACHE_LINE) std::atomic<size_t> m_tail{};
+    std::atomic<uint64_t> m_rejected{};
+    alignas(detail::CACHE_LINE) std::atomic<size_t> m_head{};
+    alignas(detail::CACHE_LINE) detail::QueueSignal m_signal;
+    std::array<Slot, CAPACITY> m_slots;
+};
+
+}
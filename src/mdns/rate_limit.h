@@ -0,0 +1,188 @@
+#pragma once
+
+#include "record_cache.h"
+#include "metrics.h"
+#include "thread_safety.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+namespace mdns
+{
+
+/// Counters of a RateLimiter
+struct RateLimitStats {
+    /// Records left out of multicast responses because they were multicast less than a second ago
+    uint64_t suppressed;
+    /// Unicast responses dropped because their destination ran out of tokens
+    uint64_t dropped;
+};
+
+namespace detail
+{
+
+/// Hash of the IP address of \p address, without the port
+inline uint64_t address_hash(const sockaddr* address) noexcept {
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+    if (address->sa_family == AF_INET) {
+        data = (const uint8_t*)&((const sockaddr_in*)address)->sin_addr;
+        size = sizeof(in_addr);
+    } else if (address->sa_family == AF_INET6) {
+        data = (const uint8_t*)&((const sockaddr_in6*)address)->sin6_addr;
+        size = sizeof(in6_addr);
+    }
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < size; ++i)
+        hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    return hash;
+}
+
+/// Fixed size open addressing hash table of recently used keys
+///
+/// A key is looked up in a window of WINDOW slots. If it is not found and the window is full, the
+/// least recently used entry of the window is replaced, so the table never allocates and forgets
+/// old keys first. \p Entry needs a uint64_t key and a Clock::time_point time, which is the time of
+/// the last use and is up to the caller.
+template<class Entry, size_t SIZE, size_t WINDOW = 8>
+class RecentTable
+{
+    static_assert(SIZE && !(SIZE & (SIZE - 1)), "SIZE must be a power of two");
+    static_assert(WINDOW <= SIZE);
+
+public:
+    /// Entry of \p key, a value initialized one with the key set if \p key was not in the table
+    /// \param found Set to false for new entries
+    Entry& get(uint64_t key, bool& found) noexcept {
+        // 0 marks a free slot
+        key |= !key;
+        Entry* oldest = nullptr;
+        for (size_t i = 0; i < WINDOW; ++i) {
+            Entry& entry = m_entries[(key + i) & (SIZE - 1)];
+            if (entry.key == key) {
+                found = true;
+                return entry;
+            }
+            if (!oldest || (oldest->key && (!entry.key || entry.time < oldest->time)))
+                oldest = &entry;
+        }
+        found = false;
+        *oldest = Entry{};
+        oldest->key = key;
+        return *oldest;
+    }
+
+private:
+    std::array<Entry, SIZE> m_entries{};
+};
+
+}
+
+/// Rate limits of a responder against devices that flood the network with questions
+///
+/// - A record is multicast at most once per second on each interface (RFC 6762 6), except to
+///   answer probes. Questions for it in the meantime are left to the answer already sent.
+/// - Unicast responses, to QU questions and legacy unicast queries, are limited per source address
+///   by a token bucket of UNICAST_BURST tokens refilled at UNICAST_RATE per second.
+///
+/// Both live in fixed size tables. A record or source that was forgotten because the table was full
+/// of newer ones is not limited until it is seen again. Not thread safe, the counters are read with
+/// stats() from any thread.
+class RateLimiter
+{
+public:
+    static constexpr auto MULTICAST_INTERVAL = std::chrono::seconds(1);
+    static constexpr float UNICAST_RATE = 10;
+    static constexpr float UNICAST_BURST = 20;
+    static constexpr size_t RECORDS = 1024;
+    static constexpr size_t SOURCES = 256;
+
+    /// True if the record identified by \p record may be multicast on \p sock at \p now, which is then
+    /// taken as the time it was multicast
+    bool multicast(int sock, uint64_t record, Clock::time_point now) noexcept;
+    /// True if a unicast response may be sent to \p source at \p now, takes a token then
+    bool unicast(const sockaddr* source, Clock::time_point now) noexcept;
+
+    RateLimitStats stats() const noexcept {
+        return {m_suppressed.load(std::memory_order_relaxed), m_dropped.load(std::memory_order_relaxed)};
+    }
+
+private:
+    struct RecordEntry {
+        uint64_t key;
+        Clock::time_point time;
+    };
+    struct SourceEntry {
+        uint64_t key;
+        Clock::time_point time;
+        float tokens;
+    };
+
+    detail::RecentTable<RecordEntry, RECORDS> m_records;
+    detail::RecentTable<SourceEntry, SOURCES> m_sources;
+    std::atomic<uint64_t> m_suppressed{};
+    std::atomic<uint64_t> m_dropped{};
+};
+
+/// Multicast rate limit of several responders answering on the same sockets, such as the workers of
+/// a ResponderPipeline. A record answered by one of them is not multicast again by another within
+/// RateLimiter::MULTICAST_INTERVAL. Thread safe.
+class SharedMulticastLimit
+{
+public:
+    /// See RateLimiter::multicast()
+    bool multicast(int sock, uint64_t record, Clock::time_point now) noexcept {
+        auto lock = m_lock.scopeLock();
+        return m_limits.multicast(sock, record, now);
+    }
+
+    /// Records held back, the unicast counter stays 0
+    RateLimitStats stats() const noexcept { return m_limits.stats(); }
+
+private:
+    MultiThreadSafe m_lock;
+    RateLimiter m_limits;
+};
+
+/// Implementation ///
+
+inline bool RateLimiter::multicast(int sock, uint64_t record, Clock::time_point now) noexcept {
+    bool found;
+    RecordEntry& entry = m_records.get((record ^ (uint64_t)(unsigned)sock) * 0x100000001b3ULL, found);
+    if (found && now - entry.time < MULTICAST_INTERVAL) {
+        m_suppressed.fetch_add(1, std::memory_order_relaxed);
+        MetricsRegistry::add(MetricCounter::MulticastSuppressed);
+        return false;
+    }
+    entry.time = now;
+    return true;
+}
+
+inline bool RateLimiter::unicast(const sockaddr* source, Clock::time_point now) noexcept {
+    // Legacy unicast queries come from a new port every time, the bucket is per address
+    bool found;
+    SourceEntry& entry = m_sources.get(detail::address_hash(source), found);
+    if (!found) {
+        entry.tokens = UNICAST_BURST;
+    } else {
+        const std::chrono::duration<float> elapsed = now - entry.time;
+        entry.tokens = std::min(UNICAST_BURST, entry.tokens + elapsed.count() * UNICAST_RATE);
+    }
+    entry.time = now;
+    if (entry.tokens < 1) {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+        MetricsRegistry::add(MetricCounter::UnicastDropped);
+        return false;
+    }
+    entry.tokens -= 1;
+    return true;
+}
+
+}
@@ -0,0 +1,584 @@
+#pragma once
+
+#include "mdns_old.h"
+#include "dns_name.h"
+#include "fixed_name.h"
+#include "thread_safety.h"
+#include "cpp_concepts.h"
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory_resource>
+#include <new>
+#include <queue>
+#include <random>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace mdns
+{
+
+using Clock = std::chrono::steady_clock;
+
+/// A cached resource record
+///
+/// The name is stored in dotted form ("host.local.") and the record data with all embedded domain
+/// names expanded, so a record stays valid after the packet it was received in is gone.
+struct CacheRecord {
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+
+    CacheRecord() = default;
+    explicit CacheRecord(const allocator_type& allocator) : rdata(allocator) {}
+    CacheRecord(const CacheRecord& other) = default;
+    CacheRecord(CacheRecord&& other) = default;
+    CacheRecord(const CacheRecord& other, const allocator_type& allocator)
+        : name(other.name), rtype(other.rtype), rclass(other.rclass), ttl(other.ttl), rdata(other.rdata, allocator),
+          received(other.received), expires(other.expires) {}
+    CacheRecord(CacheRecord&& other, const allocator_type& allocator)
+        : name(other.name), rtype(other.rtype), rclass(other.rclass), ttl(other.ttl),
+          rdata(std::move(other.rdata), allocator), received(other.received), expires(other.expires) {}
+    CacheRecord& operator=(const CacheRecord& other) = default;
+    CacheRecord& operator=(CacheRecord&& other) = default;
+
+    FixedName name;
+    uint16_t rtype{};
+    uint16_t rclass{};
+    uint32_t ttl{};
+    std::pmr::vector<uint8_t> rdata;
+    Clock::time_point received;
+    Clock::time_point expires;
+};
+
+enum class CacheEvent {
+    /// A record that was not known before
+    Added,
+    /// A known record was received again, its lifetime has been extended
+    Refreshed,
+    /// A record expired or was withdrawn with a goodbye packet
+    Removed
+};
+
+struct IgnoreCacheEvents {
+    void operator()(CacheEvent, const CacheRecord&) const noexcept {}
+};
+
+/// Record cache with RFC 6762 5.2 style proactive refresh
+///
+/// Records are grouped into record sets by name and type. A record set with active interest (see
+/// add_interest()) is refreshed before it expires: a query is due at 80%, 85%, 90% and 95% of the
+/// record TTL, each with an additional random jitter of up to 2% of the TTL. Use collect_refresh()
+/// or refresh_cache() to send all due queries batched into shared packets and next_deadline() to
+/// find out when the cache needs attention again.
+///
+/// Changes are reported to the event callback of the method that caused them and to all observers
+/// registered with subscribe(). Both are invoked with the cache lock held and must not call back
+/// into the cache. find(), for_each(), next_deadline() and size() only take the shared scope of the
+/// ThreadSafetyManager and can run in parallel.
+///
+/// All records and indexes are allocated from the memory resource passed to the constructor. If it
+/// refuses an allocation, the record that needed it is dropped.
+template<ThreadSafetyManagerType ThreadSafetyManager>
+class RecordCache
+{
+public:
+    static constexpr unsigned REFRESH_PERCENT[] = {80, 85, 90, 95};
+    static constexpr unsigned REFRESH_JITTER_PERCENT = 2;
+    /// Refreshes due within this window are sent together with the ones due now
+    static constexpr auto REFRESH_COALESCE = std::chrono::milliseconds(250);
+    /// Lifetime of records that are withdrawn or flushed (RFC 6762 10.1, 10.2)
+    static constexpr auto FLUSH_DELAY = std::chrono::seconds(1);
+
+    /// A refresh question, collecting questions never allocates
+    struct Question {
+        FixedName name;
+        uint16_t rtype;
+    };
+
+    using Observer = std::function<void(CacheEvent, const CacheRecord&)>;
+
+    explicit RecordCache(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : m_resource(resource), m_entries(resource), m_rrsets(resource),
+          m_refresh_timers(std::greater<>{}, std::pmr::vector<Timer>(resource)),
+          m_expiry_timers(std::greater<>{}, std::pmr::vector<Timer>(resource)), m_random(std::random_device{}()),
+          m_rdata_buffer(resource) {}
+
+    /// Insert a record straight from a received packet. The parameters match the ones of the
+    /// mdns_record_callback_fn, so this can be called from a record callback.
+    /// \return False if the name or the record data is malformed or the memory resource is exhausted
+    template<class OnChange = IgnoreCacheEvents>
+    bool insert(const void* buffer, size_t size, size_t name_offset, uint16_t rtype, uint16_t rclass, uint32_t ttl,
+                size_t record_offset, size_t record_length, Clock::time_point now, OnChange&& on_change = {});
+
+    /// Call \p fn for all unexpired records of the given name and type
+    /// \return The number of records found
+    template<class Fn>
+    size_t find(std::string_view name, uint16_t rtype, Clock::time_point now, Fn&& fn);
+
+    /// Call \p fn for all unexpired records, for example to copy the cache somewhere else
+    /// \return The number of records found
+    template<class Fn>
+    size_t for_each(Clock::time_point now, Fn&& fn);
+
+    /// Keep the records of the given name and type fresh. Interest is reference counted, every call
+    /// must be matched by a call to remove_interest().
+    /// Throws std::bad_alloc if the memory resource is exhausted.
+    void add_interest(std::string_view name, uint16_t rtype);
+    void remove_interest(std::string_view name, uint16_t rtype);
+
+    /// Fill \p questions with refresh questions that are due. Each record set is asked for only
+    /// once, no matter how many of its records are due. Questions that do not fit stay due.
+    /// \return The number of questions written
+    size_t collect_refresh(Clock::time_point now, std::span<Question> questions);
+
+    /// Remove all expired records
+    /// \return The number of records removed
+    template<class OnChange = IgnoreCacheEvents>
+    size_t expire(Clock::time_point now, OnChange&& on_change = {});
+
+    /// The earliest point in time a refresh query is due or a record expires
+    Clock::time_point next_deadline();
+
+    /// Register an observer for all changes of the cache
+    /// \return An id for unsubscribe()
+    int subscribe(Observer observer) {
+        auto lock = m_lock.scopeLock();
+        m_observers.emplace_back(++m_last_observer, std::move(observer));
+        return m_last_observer;
+    }
+
+    void unsubscribe(int id) {
+        auto lock = m_lock.scopeLock();
+        std::erase_if(m_observers, [id](const auto& observer) { return observer.first == id; });
+    }
+
+    size_t size() {
+        auto lock = m_lock.sharedLock();
+        return m_entries.size();
+    }
+
+private:
+    struct Entry {
+        explicit Entry(std::pmr::memory_resource* resource) : record(resource) {}
+
+        CacheRecord record;
+        Clock::time_point next_refresh;
+        uint8_t refresh_step{};
+        /// Random delay of the next refresh query in per mille of the TTL, drawn once per step
+        uint16_t refresh_jitter{};
+        /// Times of the live timers in the queues, max if none. A live timer that fires before the
+        /// entry is due is queued again, so refreshing a record does not grow the queues.
+        Clock::time_point refresh_timer{Clock::time_point::max()};
+        Clock::time_point expiry_timer{Clock::time_point::max()};
+    };
+
+    struct RRSetKey {
+        FixedName name;
+        uint16_t rtype;
+    };
+
+    /// Lookup key for names that already carry their hash
+    struct FixedNameType {
+        const FixedName& name;
+        uint16_t rtype;
+    };
+
+    struct RRSetHash {
+        using is_transparent = void;
+        size_t operator()(const RRSetKey& key) const noexcept { return key.name.hash(key.rtype); }
+        size_t operator()(const FixedNameType& key) const noexcept { return key.name.hash(key.rtype); }
+        size_t operator()(const NameType& key) const noexcept { return name_hash(key.name, key.rtype); }
+    };
+
+    struct RRSetEqual {
+        using is_transparent = void;
+        template<class L, class R>
+        bool operator()(const L& lhs, const R& rhs) const noexcept {
+            return lhs.rtype == rhs.rtype && name_equal(lhs.name, rhs.name);
+        }
+    };
+
+    struct RRSet {
+        explicit RRSet(std::pmr::memory_resource* resource) : ids(resource) {}
+
+        std::pmr::vector<uint64_t> ids;
+        unsigned interest{};
+        /// Set while collecting refresh questions to ask each record set only once
+        Clock::time_point queried;
+    };
+
+    /// Timers are invalidated lazily: a timer is stale if its time is not the live timer of the entry
+    struct Timer {
+        Clock::time_point at;
+        uint64_t id;
+        bool operator>(const Timer& o) const noexcept { return at > o.at; }
+    };
+    using TimerQueue = std::priority_queue<Timer, std::pmr::vector<Timer>, std::greater<>>;
+
+    typename std::pmr::unordered_map<RRSetKey, RRSet, RRSetHash, RRSetEqual>::iterator find_or_add(
+        const FixedName& name, uint16_t rtype);
+    void schedule_refresh(uint64_t id, Entry& entry);
+    uint16_t draw_refresh_jitter() {
+        return (uint16_t)std::uniform_int_distribution<unsigned>(0, REFRESH_JITTER_PERCENT * 10U)(m_random);
+    }
+    void schedule_expiry(uint64_t id, Entry& entry, Clock::time_point expires);
+    template<class OnChange>
+    void remove(uint64_t id, OnChange& on_change);
+    template<class OnChange>
+    void notify(CacheEvent event, const CacheRecord& record, OnChange& on_change) {
+        on_change(event, record);
+        for (const auto& observer : m_observers)
+            observer.second(event, record);
+    }
+
+    ThreadSafetyManager m_lock;
+    std::pmr::memory_resource* m_resource;
+    std::pmr::unordered_map<uint64_t, Entry> m_entries;
+    std::pmr::unordered_map<RRSetKey, RRSet, RRSetHash, RRSetEqual> m_rrsets;
+    TimerQueue m_refresh_timers;
+    TimerQueue m_expiry_timers;
+    uint64_t m_next_id{1};
+    std::minstd_rand m_random;
+    std::pmr::vector<uint8_t> m_rdata_buffer;
+    std::vector<std::pair<int, Observer>> m_observers;
+    int m_last_observer{};
+};
+
+/// Send all due refresh queries of \p cache on the given sockets
+///
+/// The questions are packed into as few packets as the buffer allows, see mdns_query_send_multi.
+/// \return The number of questions sent, or <0 if sending failed on all sockets
+template<class Cache>
+int refresh_cache(Cache& cache, Clock::time_point now, std::span<const int> sockets, void* buffer, size_t capacity) {
+    constexpr size_t batch = 16;
+    typename Cache::Question due[batch];
+    mdns_question_t questions[batch];
+
+    int total = 0;
+    bool failed = false;
+    size_t count;
+    do {
+        count = cache.collect_refresh(now, due);
+        for (size_t i = 0; i < count; ++i)
+            questions[i] = {due[i].name.data(), due[i].name.size(), due[i].rtype};
+
+        bool sent = sockets.empty();
+        for (int sock : sockets) {
+            if (count && mdns_query_send_multi(sock, questions, count, buffer, capacity, 0) >= 0)
+                sent = true;
+        }
+        failed |= count && !sent;
+        total += (int)count;
+    } while (count == batch);
+    return (failed && total) ? -1 : total;
+}
+
+/// Implementation ///
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+template<class OnChange>
+bool RecordCache<ThreadSafetyManager>::insert(const void* buffer, size_t size, size_t name_offset, uint16_t rtype,
+                                              uint16_t rclass, uint32_t ttl, size_t record_offset,
+                                              size_t record_length, Clock::time_point now, OnChange&& on_change) {
+    // Malformed names (reference loops, more than 255 bytes) decode to an empty name, and the root
+    // name is never the owner of an mDNS record. Neither is cached.
+    const FixedName name = FixedName::extract(buffer, size, &name_offset);
+    if (name.empty() || name_offset == MDNS_INVALID_POS)
+        return false;
+
+    auto lock = m_lock.scopeLock();
+
+    // Names are at most 255 bytes, so expanded record data grows by at most that much
+    try {
+        m_rdata_buffer.resize(record_length + 256);
+    } catch (const std::bad_alloc&) {
+        return false;
+    }
+    size_t rdata_length = mdns_record_rdata_expand(buffer, size, record_offset, record_length, rtype,
+                                                   m_rdata_buffer.data(), m_rdata_buffer.size());
+    if (rdata_length == MDNS_INVALID_POS)
+        return false;
+    std::span<const uint8_t> rdata{m_rdata_buffer.data(), rdata_length};
+
+    auto rrset_it = m_rrsets.end();
+    uint64_t id = 0;
+    CacheEvent event = CacheEvent::Refreshed;
+    try {
+        rrset_it = find_or_add(name, rtype);
+        RRSet& rrset = rrset_it->second;
+
+        // A record with the cache flush bit set replaces all other records of the set that have not
+        // been received within the last second
+        if (rclass & MDNS_CACHE_FLUSH) {
+            for (uint64_t other_id : rrset.ids) {
+                Entry& other = m_entries.at(other_id);
+                if (other.record.received + FLUSH_DELAY < now && other.record.expires > now + FLUSH_DELAY)
+                    schedule_expiry(other_id, other, now + FLUSH_DELAY);
+            }
+        }
+
+        for (uint64_t candidate : rrset.ids) {
+            const CacheRecord& record = m_entries.at(candidate).record;
+            if (record.rdata.size() == rdata.size() && std::equal(rdata.begin(), rdata.end(), record.rdata.begin())) {
+                id = candidate;
+                break;
+            }
+        }
+
+        if (!id) {
+            // A goodbye for a record we never knew about
+            if (!ttl) {
+                if (rrset.ids.empty() && !rrset.interest)
+                    m_rrsets.erase(rrset_it);
+                return true;
+            }
+            Entry added(m_resource);
+            added.record.name = name;
+            added.record.rtype = rtype;
+            added.record.rdata.assign(rdata.begin(), rdata.end());
+            rrset.ids.reserve(rrset.ids.size() + 1);
+            m_entries.emplace(m_next_id, std::move(added));
+            id = m_next_id++;
+            rrset.ids.push_back(id);
+            event = CacheEvent::Added;
+        }
+
+        Entry& entry = m_entries.at(id);
+        CacheRecord& record = entry.record;
+        record.rclass = rclass & ~MDNS_CACHE_FLUSH;
+        record.received = now;
+
+        if (!ttl) {
+            // Goodbye packet, the record is removed one second later (RFC 6762 10.1)
+            entry.next_refresh = Clock::time_point::max();
+            schedule_expiry(id, entry, now + FLUSH_DELAY);
+            return true;
+        }
+
+        record.ttl = ttl;
+        // Receiving the record again within a step only delays its refresh
+        if (event == CacheEvent::Added || entry.refresh_step)
+            entry.refresh_jitter = draw_refresh_jitter();
+        entry.refresh_step = 0;
+        schedule_expiry(id, entry, now + std::chrono::seconds(ttl));
+        if (rrset.interest)
+            schedule_refresh(id, entry);
+        else
+            entry.next_refresh = Clock::time_point::max();
+    } catch (const std::bad_alloc&) {
+        // Out of memory: a new record is dropped again, a known record keeps its previous schedule
+        if (event == CacheEvent::Added) {
+            m_entries.erase(id);
+            std::erase(rrset_it->second.ids, id);
+        }
+        if (rrset_it != m_rrsets.end() && rrset_it->second.ids.empty() && !rrset_it->second.interest)
+            m_rrsets.erase(rrset_it);
+        return false;
+    }
+
+    notify(event, m_entries.at(id).record, on_change);
+    return true;
+}
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+template<class Fn>
+size_t RecordCache<ThreadSafetyManager>::find(std::string_view name, uint16_t rtype, Clock::time_point now, Fn&& fn) {
+    auto lock = m_lock.sharedLock();
+    auto rrset_it = m_rrsets.find(NameType{name, rtype});
+    if (rrset_it == m_rrsets.end())
+        return 0;
+
+    size_t found = 0;
+    for (uint64_t id : rrset_it->second.ids) {
+        const CacheRecord& record = m_entries.at(id).record;
+        if (record.expires <= now)
+            continue;
+        fn(record);
+        ++found;
+    }
+    return found;
+}
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+template<class Fn>
+size_t RecordCache<ThreadSafetyManager>::for_each(Clock::time_point now, Fn&& fn) {
+    auto lock = m_lock.sharedLock();
+    size_t found = 0;
+    for (const auto& [id, entry] : m_entries) {
+        if (entry.record.expires <= now)
+            continue;
+        fn(entry.record);
+        ++found;
+    }
+    return found;
+}
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+void RecordCache<ThreadSafetyManager>::add_interest(std::string_view name, uint16_t rtype) {
+    auto lock = m_lock.scopeLock();
+    RRSet& rrset = find_or_add(FixedName(name), rtype)->second;
+    if (rrset.interest++)
+        return;
+
+    // Records that were cached before anybody was interested get their refresh schedule now
+    for (uint64_t id : rrset.ids) {
+        Entry& entry = m_entries.at(id);
+        if (entry.next_refresh == Clock::time_point::max() && entry.record.ttl)
+            schedule_refresh(id, entry);
+    }
+}
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+void RecordCache<ThreadSafetyManager>::remove_interest(std::string_view name, uint16_t rtype) {
+    auto lock = m_lock.scopeLock();
+    auto rrset_it = m_rrsets.find(NameType{name, rtype});
+    if (rrset_it == m_rrsets.end() || !rrset_it->second.interest)
+        return;
+    RRSet& rrset = rrset_it->second;
+    if (--rrset.interest)
+        return;
+
+    // Pending refresh timers become stale
+    for (uint64_t id : rrset.ids)
+        m_entries.at(id).next_refresh = Clock::time_point::max();
+    if (rrset.ids.empty())
+        m_rrsets.erase(rrset_it);
+}
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+size_t RecordCache<ThreadSafetyManager>::collect_refresh(Clock::time_point now, std::span<Question> questions) {
+    auto lock = m_lock.scopeLock();
+    size_t added = 0;
+    const auto horizon = now + REFRESH_COALESCE;
+    while (!m_refresh_timers.empty() && m_refresh_timers.top().at <= horizon) {
+        Timer timer = m_refresh_timers.top();
+        auto entry_it = m_entries.find(timer.id);
+        if (entry_it == m_entries.end() || entry_it->second.refresh_timer != timer.at) {
+            m_refresh_timers.pop();
+            continue;
+        }
+        Entry& entry = entry_it->second;
+        if (entry.next_refresh != timer.at) {
+            // Cancelled or moved to a later time, the pop makes room for the push
+            m_refresh_timers.pop();
+            entry.refresh_timer = entry.next_refresh;
+            if (entry.next_refresh != Clock::time_point::max())
+                m_refresh_timers.push({entry.next_refresh, timer.id});
+            continue;
+        }
+
+        RRSet& rrset = m_rrsets.find(FixedNameType{entry.record.name, entry.record.rtype})->second;
+        if (rrset.queried != now) {
+            if (added == questions.size())
+                break;
+            rrset.queried = now;
+            Question& question = questions[added++];
+            question.name = entry.record.name;
+            question.rtype = entry.record.rtype;
+        }
+        m_refresh_timers.pop();
+
+        // After the last refresh query the record is left to expire, as it is when the next refresh
+        // cannot be scheduled
+        entry.next_refresh = Clock::time_point::max();
+        entry.refresh_timer = Clock::time_point::max();
+        if (++entry.refresh_step < std::size(REFRESH_PERCENT)) {
+            entry.refresh_jitter = draw_refresh_jitter();
+            try {
+                schedule_refresh(timer.id, entry);
+            } catch (const std::bad_alloc&) {
+            }
+        }
+    }
+    return added;
+}
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+template<class OnChange>
+size_t RecordCache<ThreadSafetyManager>::expire(Clock::time_point now, OnChange&& on_change) {
+    auto lock = m_lock.scopeLock();
+    size_t removed = 0;
+    while (!m_expiry_timers.empty() && m_expiry_timers.top().at <= now) {
+        Timer timer = m_expiry_timers.top();
+        m_expiry_timers.pop();
+
+        auto entry_it = m_entries.find(timer.id);
+        if (entry_it == m_entries.end() || entry_it->second.expiry_timer != timer.at)
+            continue;
+        Entry& entry = entry_it->second;
+        if (entry.record.expires > timer.at) {
+            // Refreshed meanwhile, the pop made room for the push
+            m_expiry_timers.push({entry.record.expires, timer.id});
+            entry.expiry_timer = entry.record.expires;
+            continue;
+        }
+        remove(timer.id, on_change);
+        ++removed;
+    }
+    return removed;
+}
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+Clock::time_point RecordCache<ThreadSafetyManager>::next_deadline() {
+    auto lock = m_lock.sharedLock();
+    // Stale timers at the top only cause an early wake-up, which is harmless
+    Clock::time_point deadline = Clock::time_point::max();
+    if (!m_refresh_timers.empty())
+        deadline = m_refresh_timers.top().at;
+    if (!m_expiry_timers.empty() && m_expiry_timers.top().at < deadline)
+        deadline = m_expiry_timers.top().at;
+    return deadline;
+}
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+auto RecordCache<ThreadSafetyManager>::find_or_add(const FixedName& name, uint16_t rtype) ->
+    typename std::pmr::unordered_map<RRSetKey, RRSet, RRSetHash, RRSetEqual>::iterator {
+    auto rrset_it = m_rrsets.find(FixedNameType{name, rtype});
+    if (rrset_it == m_rrsets.end())
+        rrset_it = m_rrsets.emplace(RRSetKey{name, rtype}, RRSet(m_resource)).first;
+    return rrset_it;
+}
+
+// The timer is pushed before the entry is updated, so an entry keeps a valid timer if the push fails.
+// No timer is pushed if the live timer of the entry fires earlier, it is queued again then.
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+void RecordCache<ThreadSafetyManager>::schedule_refresh(uint64_t id, Entry& entry) {
+    const auto ttl_ms = (uint64_t)entry.record.ttl * 1000U;
+    const unsigned per_mille = REFRESH_PERCENT[entry.refresh_step] * 10U + entry.refresh_jitter;
+    const auto next_refresh = entry.record.received + std::chrono::milliseconds(ttl_ms * per_mille / 1000U);
+    if (entry.refresh_timer > next_refresh) {
+        m_refresh_timers.push({next_refresh, id});
+        entry.refresh_timer = next_refresh;
+    }
+    entry.next_refresh = next_refresh;
+}
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+void RecordCache<ThreadSafetyManager>::schedule_expiry(uint64_t id, Entry& entry, Clock::time_point expires) {
+    if (entry.expiry_timer > expires) {
+        m_expiry_timers.push({expires, id});
+        entry.expiry_timer = expires;
+    }
+    entry.record.expires = expires;
+}
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+template<class OnChange>
+void RecordCache<ThreadSafetyManager>::remove(uint64_t id, OnChange& on_change) {
+    auto entry_it = m_entries.find(id);
+    const CacheRecord& record = entry_it->second.record;
+    notify(CacheEvent::Removed, record, on_change);
+
+    auto rrset_it = m_rrsets.find(FixedNameType{record.name, record.rtype});
+    RRSet& rrset = rrset_it->second;
+    std::erase(rrset.ids, id);
+    if (rrset.ids.empty() && !rrset.interest)
+        m_rrsets.erase(rrset_it);
+    m_entries.erase(entry_it);
+}
+
+}
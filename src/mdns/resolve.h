@@ -0,0 +1,294 @@
+#pragma once
+
+#include "record_cache.h"
+#include "dedup.h"
+#include "metrics.h"
+#include "query_schedule.h"
+#include "packet_writer.h"
+#include "wire_name.h"
+#include "ip_address.h"
+#include "cpp_concepts.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/select.h>
+
+namespace mdns
+{
+
+/// The addresses of one host name, see HostResolver
+struct ResolvedHost {
+    /// The name as passed to resolve()
+    std::string_view name;
+    /// Address of each family answered for the name, empty if none was
+    IpAddress ipv4;
+    IpAddress ipv6;
+    /// Interface the answer arrived on, needed to reach IPv6 link-local addresses. 0 if unknown or
+    /// answered from the record cache.
+    unsigned interface{};
+    /// TTL of the first address record in seconds
+    uint32_t ttl{};
+
+    bool resolved() const noexcept { return ipv4 || ipv6; }
+};
+
+/// Resolves many ".local" host names at once
+///
+/// All names of a batch are asked for together: the A and AAAA questions of each distinct name are
+/// packed into as few packets as possible and sent on every interface. Each name completes on its
+/// own with the first response that carries an address for it, address records being unique
+/// (RFC 6762 6.2), and takes all of its addresses in that response. Only the names still open are
+/// asked for again, after 1, 2, 4 ... seconds, see QuerySchedule. A batch ends when all names are
+/// resolved or at the deadline, whichever comes first.
+///
+/// Names whose addresses are in the record cache are answered from it without a question, and all
+/// received records go into the cache. The sockets are bound to the mDNS port and questions are
+/// multicast, so the answers are multicast as well and responders do not apply their per source
+/// limits on unicast responses.
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+class HostResolver
+{
+public:
+    using Cache = RecordCache<ThreadSafetyManager>;
+
+    /// Keep questions within a typical Ethernet MTU
+    static constexpr size_t MAX_PACKET_SIZE = 1440;
+
+    HostResolver(MemoryManager& memory, SocketLayer& sockets, Cache& cache);
+    ~HostResolver();
+
+    HostResolver(const HostResolver&) = delete;
+    HostResolver& operator=(const HostResolver&) = delete;
+
+    /// Resolve \p names, host names like "printer.local", until all are resolved or \p deadline has
+    /// passed. Blocks the calling thread. Names may repeat, each is asked for once.
+    /// \return One result per name in the order of \p names, valid until the next call and as long
+    /// as \p names. Empty if the resolver has no open socket or no buffer.
+    std::span<const ResolvedHost> resolve(std::span<const std::string_view> names, Clock::time_point deadline);
+
+private:
+    /// A distinct name of the batch
+    struct Host {
+        /// Qualified name, the key in m_index
+        std::string_view name;
+        ResolvedHost result;
+        /// Resolved, or the name cannot be asked for
+        bool done{};
+    };
+
+    static int record_callback(int sock, const struct sockaddr* from, size_t addrlen, mdns_entry_type_t entry,
+                               uint16_t query_id, uint16_t rtype, uint16_t rclass, uint32_t ttl, const void* data,
+                               size_t size, size_t name_offset, size_t name_length, size_t record_offset,
+                               size_t record_length, void* user_data);
+
+    /// Add an address record to \p host, completes the host with its first address
+    void add_address(Host& host, uint16_t rtype, uint32_t ttl, const uint8_t* rdata, size_t length,
+                     unsigned interface);
+    /// Ask for all open names on all sockets
+    void send_questions();
+    void receive(Clock::time_point until);
+
+    MemoryManager& m_memory;
+    SocketLayer& m_sockets;
+    Cache& m_cache;
+    std::vector<typename SocketLayer::SocketDP> m_socket_dps;
+    typename MemoryManager::Buffer* m_buffer{};
+
+    // State of the current batch
+    std::unordered_map<std::string, size_t, NameHash, NameEqual> m_index;
+    std::vector<Host> m_hosts;
+    std::vector<ResolvedHost> m_results;
+    size_t m_open{};
+    /// Responses arrive once per socket, copies are dropped before they are decoded
+    DuplicateFilter<> m_duplicates;
+    /// Interface of the packet being parsed
+    unsigned m_interface{};
+};
+
+/// Implementation ///
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+HostResolver<MemoryManager, SocketLayer, ThreadSafetyManager>::HostResolver(MemoryManager& memory,
+                                                                            SocketLayer& sockets, Cache& cache)
+    : m_memory(memory), m_sockets(sockets), m_cache(cache), m_buffer(memory.acquire()) {
+    m_sockets.open_client_sockets([](char*, uint8_t[16], size_t) { return true; },
+                                  [this](typename SocketLayer::SocketDP socketDp) {
+                                      m_socket_dps.push_back(socketDp);
+                                  },
+                                  MDNS_PORT);
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+HostResolver<MemoryManager, SocketLayer, ThreadSafetyManager>::~HostResolver() {
+    for (auto socketDp : m_socket_dps)
+        m_sockets.close(socketDp);
+    m_memory.release(m_buffer);
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+std::span<const ResolvedHost> HostResolver<MemoryManager, SocketLayer, ThreadSafetyManager>::resolve(
+    std::span<const std::string_view> names, Clock::time_point deadline) {
+    m_index.clear();
+    m_hosts.clear();
+    m_results.clear();
+    m_open = 0;
+    if (m_socket_dps.empty() || !m_buffer)
+        return {};
+
+    // One question per distinct name, keys of m_index do not move when it grows
+    std::vector<size_t> slots;
+    slots.reserve(names.size());
+    for (std::string_view name : names) {
+        auto [index_it, added] = m_index.try_emplace(qualified_name(name), m_hosts.size());
+        if (added)
+            m_hosts.push_back(Host{index_it->first, {}, false});
+        slots.push_back(index_it->second);
+    }
+
+    m_open = m_hosts.size();
+    auto now = Clock::now();
+    for (Host& host : m_hosts) {
+        for (uint16_t rtype : {MDNS_RECORDTYPE_A, MDNS_RECORDTYPE_AAAA}) {
+            m_cache.find(host.name, rtype, now, [this, &host, rtype](const CacheRecord& record) {
+                add_address(host, rtype, record.ttl, record.rdata.data(), record.rdata.size(), 0);
+            });
+        }
+        MetricsRegistry::add(host.done ? MetricCounter::CacheHits : MetricCounter::CacheMisses);
+    }
+
+    QuerySchedule schedule(now);
+    while (m_open && now < deadline) {
+        if (schedule.due(now)) {
+            send_questions();
+            schedule.sent(now);
+        }
+        receive(std::min(schedule.next(), deadline));
+        now = Clock::now();
+    }
+
+    m_results.reserve(names.size());
+    for (size_t i = 0; i < names.size(); ++i) {
+        m_results.push_back(m_hosts[slots[i]].result);
+        m_results.back().name = names[i];
+    }
+    return m_results;
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+void HostResolver<MemoryManager, SocketLayer, ThreadSafetyManager>::send_questions() {
+    PacketWriter writer(m_buffer->data(), std::min(m_buffer->capacity(), MAX_PACKET_SIZE));
+    const auto send = [&] {
+        for (auto socketDp : m_socket_dps)
+            mdns_multicast_send(socketDp.socket, writer.data(), writer.size());
+        writer.begin(0, 0);
+    };
+    for (Host& host : m_hosts) {
+        if (host.done)
+            continue;
+        for (uint16_t rtype : {MDNS_RECORDTYPE_A, MDNS_RECORDTYPE_AAAA}) {
+            if (writer.question(host.name, rtype, MDNS_CLASS_IN))
+                continue;
+            // A name too long for an empty packet cannot be asked for
+            if (writer.empty() || (send(), !writer.question(host.name, rtype, MDNS_CLASS_IN))) {
+                host.done = true;
+                --m_open;
+                break;
+            }
+        }
+    }
+    if (!writer.empty())
+        send();
+    m_buffer->reset();
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+void HostResolver<MemoryManager, SocketLayer, ThreadSafetyManager>::receive(Clock::time_point until) {
+    auto wait = std::chrono::duration_cast<std::chrono::microseconds>(until - Clock::now());
+    if (wait.count() < 0)
+        wait = std::chrono::microseconds(0);
+
+    timeval tv{};
+    tv.tv_sec = (time_t)(wait.count() / 1000000);
+    tv.tv_usec = (suseconds_t)(wait.count() % 1000000);
+
+    int nfds = 0;
+    fd_set readfs;
+    FD_ZERO(&readfs);
+    for (auto socketDp : m_socket_dps) {
+        if (socketDp.socket >= nfds)
+            nfds = socketDp.socket + 1;
+        FD_SET(socketDp.socket, &readfs);
+    }
+    if (select(nfds, &readfs, nullptr, nullptr, &tv) <= 0)
+        return;
+
+    for (auto socketDp : m_socket_dps) {
+        if (!FD_ISSET(socketDp.socket, &readfs))
+            continue;
+        sockaddr_in6 from;
+        size_t from_size;
+        const size_t size = mdns_socket_recv_interface(socketDp.socket, m_buffer->data(), m_buffer->capacity(), &from,
+                                                       &from_size, &m_interface);
+        // Only responses, questions of other queriers and our own are skipped
+        if (size >= sizeof(mdns_header_t) && (((const uint8_t*)m_buffer->data())[2] & 0x80))
+            mdns_packet_parse(socketDp.socket, (const sockaddr*)&from, from_size, m_buffer->data(), size,
+                              record_callback, this);
+        m_buffer->reset();
+    }
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+int HostResolver<MemoryManager, SocketLayer, ThreadSafetyManager>::record_callback(
+    int sock, const struct sockaddr* from, size_t addrlen, mdns_entry_type_t entry, uint16_t query_id, uint16_t rtype,
+    uint16_t rclass, uint32_t ttl, const void* data, size_t size, size_t name_offset, size_t name_length,
+    size_t record_offset, size_t record_length, void* user_data) {
+    if (entry != MDNS_ENTRYTYPE_ANSWER && entry != MDNS_ENTRYTYPE_ADDITIONAL)
+        return 0;
+    auto* resolver = static_cast<HostResolver*>(user_data);
+    const auto now = Clock::now();
+    if (resolver->m_duplicates.duplicate(data, size, name_offset, rtype, ttl, record_offset, record_length, now))
+        return 0;
+    resolver->m_cache.insert(data, size, name_offset, rtype, rclass, ttl, record_offset, record_length, now);
+    if ((rtype != MDNS_RECORDTYPE_A && rtype != MDNS_RECORDTYPE_AAAA) || !ttl || record_offset + record_length > size)
+        return 0;
+    auto host_it = resolver->m_index.find(WireName(data, size, name_offset));
+    if (host_it != resolver->m_index.end())
+        resolver->add_address(resolver->m_hosts[host_it->second], rtype, ttl, (const uint8_t*)data + record_offset,
+                              record_length, resolver->m_interface);
+    return 0;
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+void HostResolver<MemoryManager, SocketLayer, ThreadSafetyManager>::add_address(Host& host, uint16_t rtype,
+                                                                                uint32_t ttl, const uint8_t* rdata,
+                                                                                size_t length, unsigned interface) {
+    ResolvedHost& result = host.result;
+    if (rtype == MDNS_RECORDTYPE_A && length == 4 && !result.ipv4) {
+        uint32_t address;
+        memcpy(&address, rdata, 4);
+        result.ipv4 = IpAddress::ipv4(address);
+    } else if (rtype == MDNS_RECORDTYPE_AAAA && length == 16 && !result.ipv6) {
+        std::array<uint8_t, 16> address;
+        memcpy(address.data(), rdata, 16);
+        result.ipv6 = IpAddress::ipv6(address);
+    } else {
+        return;
+    }
+    if (!result.ttl) {
+        result.ttl = ttl;
+        result.interface = interface;
+    }
+    if (!host.done) {
+        host.done = true;
+        --m_open;
+    }
+}
+
+}
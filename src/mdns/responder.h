@@ -0,0 +1,937 @@
+#pragma once
+
+#include "service_registry.h"
+#include "record_cache.h"
+#include "probe.h"
+#include "rate_limit.h"
+#include "metrics.h"
+#include "wire_name.h"
+#include "packet.h"
+#include "packet_writer.h"
+#include "cpp_concepts.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <memory_resource>
+#include <random>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+#include <netinet/in.h>
+#include <sys/select.h>
+
+namespace mdns
+{
+
+/// Answers mDNS and DNS-SD questions for all instances of a ServiceRegistry
+///
+/// Each question is answered with the matching records in the answer section and the records a
+/// querier needs next in the additional section (RFC 6763 12): SRV, TXT and addresses for PTR
+/// answers, addresses for SRV answers. Answers that do not fit into one packet are split.
+/// Reverse lookups (PTR questions for in-addr.arpa and ip6.arpa names) are answered with the hosts
+/// of the address, see ServiceRegistry::reverse_lookup().
+///
+/// Multicast answers with shared records (PTR records of service types and subtypes) are delayed
+/// by a random 20-120 ms (RFC 6762 6). All such questions received on the same socket and interface
+/// during that window are answered together: their records are packed into as few packets as
+/// possible, each record and address only once. Answers with unique records only, legacy unicast
+/// and unicast (QU) answers are sent right away.
+///
+/// Answers go out on the interface the question arrived on. Address records of a host with local
+/// addresses (ServiceRegistry::add_address()) only carry the addresses of that interface, so
+/// queriers on one link never learn addresses of another. Announcements and goodbyes are sent on
+/// every interface, each with its own addresses.
+///
+/// The receive and send buffers are taken from the memory manager when the sockets are opened.
+/// Everything needed to answer a question lives in the arena of the receive buffer, so answering
+/// does not allocate.
+///
+/// New instances are best added with publish(), which probes their names first and announces them
+/// when they are unique (RFC 6762 8). Instances added to the registry directly are answered right
+/// away, but not announced.
+///
+/// Records are multicast at most once per second per interface and unicast responses are limited per
+/// source address, see RateLimiter and rate_limit_stats().
+///
+/// Instead of receiving and sending itself, a Responder can also answer packets received elsewhere
+/// and hand the responses to a sink, see answer(). This is how ResponderPipeline spreads the work
+/// across threads.
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+class Responder
+{
+public:
+    using Registry = ServiceRegistry<ThreadSafetyManager>;
+
+    static constexpr uint32_t HOST_TTL = HOST_RECORD_TTL;
+    static constexpr uint32_t SERVICE_TTL = SERVICE_RECORD_TTL;
+    /// Keep answers within a typical Ethernet MTU
+    static constexpr size_t MAX_PACKET_SIZE = 1440;
+    /// Delay of answers with shared records (RFC 6762 6)
+    static constexpr auto MIN_SHARED_DELAY = std::chrono::milliseconds(20);
+    static constexpr auto MAX_SHARED_DELAY = std::chrono::milliseconds(120);
+    /// Delayed questions, if more arrive before the delay ends they are answered at once
+    static constexpr size_t MAX_PENDING = 32;
+    /// Goodbye packets sent with one system call, if the memory manager has enough buffers
+    static constexpr size_t GOODBYE_BATCH = 8;
+    static constexpr auto GOODBYE_TIMEOUT = std::chrono::milliseconds(500);
+
+    Responder(MemoryManager& memory, SocketLayer& sockets, Registry& registry)
+        : m_memory(memory), m_sockets(sockets), m_registry(registry), m_probes(memory.resource()),
+          m_random(std::random_device{}()) {}
+    ~Responder() { close(); }
+
+    Responder(const Responder&) = delete;
+    Responder& operator=(const Responder&) = delete;
+
+    /// Open the service sockets on the mDNS port
+    /// \return False if no socket could be opened or no buffers are available
+    bool open(bool ipv4 = true, bool ipv6 = true);
+    void close();
+    /// Number of open service sockets
+    size_t sockets() const noexcept { return m_socket_dps.size(); }
+
+    /// Withdraw all instances and reverse lookup records of the registry by sending them with TTL 0
+    /// on all sockets (RFC 6762 10.1), before shutting down. The records are packed densely and
+    /// several packets go out per system call. Stops after \p timeout, the remaining records then expire normally.
+    /// Not done by close(), as other responders may still answer for the same registry.
+    void goodbye(std::chrono::milliseconds timeout = GOODBYE_TIMEOUT);
+
+    /// Wait up to \p timeout for questions and answer them. Returns early to send delayed answers,
+    /// probes and announcements.
+    /// \return The number of questions answered, or <0 if no socket is open
+    int poll(std::chrono::milliseconds timeout);
+
+    /// Probe the names of \p instance, add it to the registry once they are unique and announce it.
+    /// Instances published before the first probe is sent are probed together, see ProbeSet. Probes
+    /// are sent by poll().
+    /// \return False if the instance is invalid
+    bool publish(const ServiceInstance& instance) { return m_probes.add(instance, Clock::now()); }
+    /// Called when a published instance was renamed because its name is taken
+    void set_conflict_callback(ProbeSet::ConflictCallback callback, void* user_data) {
+        m_probes.set_conflict_callback(callback, user_data);
+    }
+    /// Number of published instances that are still probed or announced
+    size_t publishing() const noexcept { return m_probes.size(); }
+
+    /// A response packet built by answer()
+    struct Response {
+        typename MemoryManager::Buffer* buffer;
+        size_t size;
+        int sock;
+        /// Unicast destination, address_size is 0 for multicast responses
+        sockaddr_in6 address;
+        size_t address_size;
+        /// Interface of multicast responses, 0 for the multicast interface of the socket
+        unsigned interface;
+    };
+
+    /// Receives the responses of answer()
+    /// \return True if the sink took the buffer of the response, which it must release to the
+    /// memory manager when done. Otherwise the response is dropped and its buffer reused.
+    using ResponseSink = bool (*)(Response& response, void* user_data);
+
+    /// Answer the questions of a packet received elsewhere, without sending. Each response packet is
+    /// passed to \p sink. A Responder used this way does not need to be opened, but must only be used
+    /// by one thread at a time. Unless it is opened, it holds no buffers between calls of answer() and
+    /// send_pending(), so many of them can share a small memory manager. Delayed answers are sent by
+    /// send_pending().
+    /// \return The number of questions answered
+    int answer(const SharedPacket<MemoryManager>& packet, ResponseSink sink, void* user_data);
+
+    /// When the delayed answers are due, Clock::time_point::max() if there are none
+    Clock::time_point pending_deadline() const noexcept { return m_pending_deadline; }
+    /// Send all delayed answers now, through \p sink if given
+    void send_pending(ResponseSink sink = nullptr, void* user_data = nullptr);
+
+    /// Records and responses held back by the rate limits, safe to call from any thread. Records held
+    /// back by a shared multicast limit are counted there.
+    RateLimitStats rate_limit_stats() const noexcept { return m_limits.stats(); }
+    /// Use \p limit for the multicast rate limit instead of the own one, nullptr to go back to it.
+    /// The limit must outlive the Responder. The unicast rate limit is always its own.
+    void set_multicast_limit(SharedMulticastLimit* limit) noexcept { m_shared_limit = limit; }
+
+private:
+    static int question_callback(int sock, const struct sockaddr* from, size_t addrlen, mdns_entry_type_t entry,
+                                 uint16_t query_id, uint16_t rtype, uint16_t rclass, uint32_t ttl, const void* data,
+                                 size_t size, size_t name_offset, size_t name_length, size_t record_offset,
+                                 size_t record_length, void* user_data);
+
+    struct Destination {
+        int sock;
+        const struct sockaddr* address;
+        size_t address_size;
+        unsigned interface;
+    };
+
+    /// What a question matched in the registry
+    struct Match {
+        Match(FixedName name, uint16_t rtype, std::pmr::memory_resource* arena)
+            : name(name), rtype(rtype), services(arena), service_types(arena), hosts(arena) {}
+
+        bool empty() const noexcept { return services.empty() && service_types.empty() && hosts.empty(); }
+
+        FixedName name;
+        uint16_t rtype;
+        std::pmr::vector<ServicePtr> services;
+        std::pmr::vector<std::pmr::string> service_types;
+        /// Hosts of a reverse lookup
+        std::pmr::vector<std::pmr::string> hosts;
+    };
+
+    /// A delayed question
+    struct Pending {
+        int sock;
+        unsigned interface;
+        uint16_t rtype;
+        FixedName name;
+    };
+
+    bool answer(const Destination& destination, uint16_t query_id, const WireName& question, uint16_t rtype,
+                uint16_t rclass);
+    template<class Name>
+    void match(const Name& question, uint16_t rtype, Match& match);
+    /// True if the answer to \p match contains shared records
+    static bool shared(const Match& match);
+    /// \return False if the answer cannot be delayed and must be sent now
+    bool delay(int sock, unsigned interface, const FixedName& name, uint16_t rtype);
+    /// True if the record must be left out of a multicast response because it was multicast less than
+    /// a second ago. Counts the answers that are not.
+    bool limited(mdns_entry_type_t section, std::string_view owner, uint16_t rtype, std::string_view target = {});
+    /// True if the packet is a probe, probes are answered regardless of the multicast rate limit
+    static bool probe_query(const void* data, size_t size) noexcept;
+    /// Write the answers and additional records of all \p matches and flush
+    void respond(std::span<const Match> matches, uint16_t unique);
+    /// Send due probes, register and announce instances that finished probing
+    void run_probes(Clock::time_point now);
+    /// Send all records of the instances \p full_names on all sockets
+    void announce(std::span<const std::pmr::string> full_names);
+    /// Call \p put with a function writing a record into a PacketWriter for each record of \p service,
+    /// the addresses of \p interface only if \p addresses is true
+    template<class Put>
+    void for_each_record(const RegisteredService& service, uint32_t host_ttl, uint32_t service_ttl,
+                         bool addresses, unsigned interface, Put&& put);
+    /// Call \p fn with each address of the host of \p instance that is valid on \p interface
+    template<class Fn>
+    void for_each_address(const ServiceInstance& instance, unsigned interface, Fn&& fn);
+    void add_answers(const RegisteredService& service, std::string_view name, uint16_t rtype, uint16_t unique);
+    void add_additionals(const RegisteredService& service, std::string_view name, uint16_t rtype, uint16_t unique);
+    void add_addresses(mdns_entry_type_t section, const RegisteredService& service, uint16_t rtype, uint16_t unique);
+
+    /// Add a record with \p write, sending the current packet first if it is full
+    template<class Write>
+    void put(Write&& write);
+    void flush();
+    /// Start a response in the send buffer, acquiring one if the last was handed to a sink
+    /// \return False if no buffer is available
+    bool begin_response();
+    /// Start the next packet of the response in the send buffer
+    void begin_packet();
+    /// True if the packet holds no records, only the header and the repeated question
+    bool packet_empty() const noexcept {
+        return !m_writer.count(MDNS_ENTRYTYPE_ANSWER) && !m_writer.count(MDNS_ENTRYTYPE_AUTHORITY) &&
+               !m_writer.count(MDNS_ENTRYTYPE_ADDITIONAL);
+    }
+    bool acquire_tx();
+    /// Return the buffers to the memory manager if the Responder is not opened
+    void release_buffers();
+
+    MemoryManager& m_memory;
+    SocketLayer& m_sockets;
+    Registry& m_registry;
+    std::vector<typename SocketLayer::SocketDP> m_socket_dps;
+    /// Distinct interfaces of the local addresses, announcements and goodbyes are sent on each
+    std::vector<unsigned> m_interfaces;
+    typename MemoryManager::Buffer* m_rx{};
+    typename MemoryManager::Buffer* m_tx{};
+    PacketWriter m_writer;
+
+    // State of the answer being built, the containers live in the arena of the received packet
+    std::pmr::memory_resource* m_arena{};
+    ResponseSink m_sink{};
+    void* m_sink_data{};
+    Destination m_destination{};
+    /// Interface of the packet being parsed
+    unsigned m_ingress{};
+    uint16_t m_query_id{};
+    /// Question of a legacy unicast query, repeated in every packet of the response
+    const FixedName* m_question{};
+    uint16_t m_question_type{};
+    std::pmr::unordered_set<std::string_view, NameHash, NameEqual>* m_hosts{};
+    std::pmr::unordered_set<std::string_view, NameHash, NameEqual>* m_services{};
+    Clock::time_point m_now;
+    size_t m_answers{};
+    bool m_probe_query{};
+
+    ProbeSet m_probes;
+    std::array<Pending, MAX_PENDING> m_pending;
+    size_t m_num_pending{};
+    Clock::time_point m_pending_deadline = Clock::time_point::max();
+    std::minstd_rand m_random;
+    RateLimiter m_limits;
+    SharedMulticastLimit* m_shared_limit{};
+};
+
+/// Implementation ///
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+bool Responder<MemoryManager, SocketLayer, ThreadSafetyManager>::open(bool ipv4, bool ipv6) {
+    close();
+    m_rx = m_memory.acquire();
+    if (!m_rx || !acquire_tx()) {
+        close();
+        return false;
+    }
+
+    for (auto socketDp : m_sockets.open_service_sockets(ipv4, ipv6, MDNS_PORT)) {
+        if (socketDp.socket >= 0)
+            m_socket_dps.push_back(socketDp);
+    }
+    for (const auto& address : m_sockets.interface_addresses()) {
+        if (std::find(m_interfaces.begin(), m_interfaces.end(), address.interface) == m_interfaces.end())
+            m_interfaces.push_back(address.interface);
+    }
+    // Without known interfaces everything goes out on the multicast interface of the sockets
+    if (m_interfaces.empty())
+        m_interfaces.push_back(0);
+    return !m_socket_dps.empty();
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+void Responder<MemoryManager, SocketLayer, ThreadSafetyManager>::close() {
+    if (!m_socket_dps.empty())
+        send_pending();
+    m_num_pending = 0;
+    m_pending_deadline = Clock::time_point::max();
+    for (auto socketDp : m_socket_dps)
+        m_sockets.close(socketDp);
+    m_socket_dps.clear();
+    m_interfaces.clear();
+    m_memory.release(m_rx);
+    m_memory.release(m_tx);
+    m_rx = m_tx = nullptr;
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+int Responder<MemoryManager, SocketLayer, ThreadSafetyManager>::poll(std::chrono::milliseconds timeout) {
+    if (m_socket_dps.empty())
+        return -1;
+
+    const auto now = Clock::now();
+    const auto deadline = std::min(m_pending_deadline, m_probes.next_deadline());
+    if (deadline != Clock::time_point::max())
+        timeout = std::clamp(std::chrono::ceil<std::chrono::milliseconds>(deadline - now),
+                             std::chrono::milliseconds(0), timeout);
+
+    timeval tv{};
+    tv.tv_sec = (time_t)(timeout.count() / 1000);
+    tv.tv_usec = (suseconds_t)((timeout.count() % 1000) * 1000);
+
+    int nfds = 0;
+    fd_set readfs;
+    FD_ZERO(&readfs);
+    for (auto socketDp : m_socket_dps) {
+        if (socketDp.socket >= nfds)
+            nfds = socketDp.socket + 1;
+        FD_SET(socketDp.socket, &readfs);
+    }
+
+    int answered = 0;
+    if (select(nfds, &readfs, nullptr, nullptr, &tv) > 0) {
+        m_arena = m_rx->arena();
+        for (auto socketDp : m_socket_dps) {
+            if (!FD_ISSET(socketDp.socket, &readfs))
+                continue;
+            sockaddr_in6 from;
+            size_t from_size;
+            const size_t size = mdns_socket_recv_interface(socketDp.socket, m_rx->data(), m_rx->capacity(), &from,
+                                                           &from_size, &m_ingress);
+            if (size) {
+                m_probe_query = probe_query(m_rx->data(), size);
+                answered += (int)mdns_question_parse(socketDp.socket, (const sockaddr*)&from, from_size,
+                                                     m_rx->data(), size, question_callback, this);
+                m_probe_query = false;
+                m_probes.received(m_rx->data(), size, Clock::now());
+            }
+            m_rx->reset();
+        }
+    }
+    if (Clock::now() >= m_pending_deadline)
+        send_pending();
+    run_probes(Clock::now());
+    return answered;
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+int Responder<MemoryManager, SocketLayer, ThreadSafetyManager>::answer(const SharedPacket<MemoryManager>& packet,
+                                                                       ResponseSink sink, void* user_data) {
+    if (!packet || (!m_tx && !acquire_tx()))
+        return 0;
+    m_arena = packet.arena();
+    m_sink = sink;
+    m_sink_data = user_data;
+    m_probe_query = probe_query(packet.data(), packet.size());
+    m_ingress = packet.interface();
+    const size_t answered = mdns_question_parse(packet.socket(), packet.from(), packet.from_size(), packet.data(),
+                                                packet.size(), question_callback, this);
+    m_probe_query = false;
+    m_sink = nullptr;
+    m_sink_data = nullptr;
+    release_buffers();
+    return (int)answered;
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+void Responder<MemoryManager, SocketLayer, ThreadSafetyManager>::send_pending(ResponseSink sink, void* user_data) {
+    if (!m_num_pending)
+        return;
+    // Without a receive buffer of its own (answer() with a sink) the arena of a scratch buffer is used
+    if (!m_rx)
+        m_rx = m_memory.acquire();
+    if (m_rx && (m_tx || acquire_tx())) {
+        m_arena = m_rx->arena();
+        m_sink = sink;
+        m_sink_data = user_data;
+        std::pmr::vector<Match> matches(m_arena);
+        matches.reserve(m_num_pending);
+        std::array<bool, MAX_PENDING> done{};
+        for (size_t i = 0; i < m_num_pending; ++i) {
+            if (done[i])
+                continue;
+            // One response for all questions received on this socket and interface
+            const int sock = m_pending[i].sock;
+            const unsigned interface = m_pending[i].interface;
+            matches.clear();
+            for (size_t j = i; j < m_num_pending; ++j) {
+                const Pending& pending = m_pending[j];
+                if (pending.sock != sock || pending.interface != interface)
+                    continue;
+                done[j] = true;
+                match(pending.name, pending.rtype, matches.emplace_back(pending.name, pending.rtype, m_arena));
+            }
+            m_destination = Destination{sock, nullptr, 0, interface};
+            m_query_id = 0;
+            if (!begin_response())
+                break;
+            respond(matches, MDNS_CACHE_FLUSH);
+        }
+        matches.clear();
+        m_sink = nullptr;
+        m_sink_data = nullptr;
+        m_rx->reset();
+    }
+    m_num_pending = 0;
+    m_pending_deadline = Clock::time_point::max();
+    release_buffers();
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+void Responder<MemoryManager, SocketLayer, ThreadSafetyManager>::run_probes(Clock::time_point now) {
+    if (now < m_probes.next_deadline() || !m_rx || (!m_tx && !acquire_tx()))
+        return;
+    m_arena = m_rx->arena();
+    {
+        std::vector<ServiceInstance> published;
+        std::pmr::vector<std::pmr::string> announced(m_arena);
+        auto send = [this](const PacketWriter& writer) {
+            for (auto socketDp : m_socket_dps)
+                for (unsigned interface : m_interfaces)
+                    mdns_multicast_send_interface(socketDp.socket, writer.data(), writer.size(), interface);
+        };
+        m_probes.run(now, m_writer, send, published, announced);
+
+        if (!published.empty()) {
+            RegistryTransaction transaction(m_memory.resource());
+            bool committed = false;
+            try {
+                for (const ServiceInstance& instance : published)
+                    transaction.add(instance);
+                committed = m_registry.commit(transaction);
+            } catch (const std::bad_alloc&) {
+            }
+            // Fails as a whole if one of the instances was registered meanwhile, keep the others
+            if (!committed) {
+                for (ServiceInstance& instance : published)
+                    m_registry.add(std::move(instance));
+            }
+        }
+        if (!announced.empty())
+            announce(announced);
+    }
+    m_rx->reset();
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+void Responder<MemoryManager, SocketLayer, ThreadSafetyManager>::announce(
+    std::span<const std::pmr::string> full_names) {
+    constexpr uint16_t any = 255;
+    std::pmr::vector<ServicePtr> services(m_arena);
+    for (const auto& name : full_names)
+        m_registry.lookup(std::string_view(name), MDNS_RECORDTYPE_SRV,
+                          [&services](const ServicePtr& service) { services.push_back(service); });
+
+    for (auto socketDp : m_socket_dps) {
+        for (unsigned interface : m_interfaces) {
+            std::pmr::unordered_set<std::string_view, NameHash, NameEqual> hosts(m_arena);
+            m_destination = Destination{socketDp.socket, nullptr, 0, interface};
+            m_query_id = 0;
+            if (!begin_response())
+                return;
+            for (const ServicePtr& service : services)
+                for_each_record(*service, HOST_TTL, SERVICE_TTL, hosts.insert(service->instance.host).second,
+                                interface, [this](auto&& record) { put([&] { return record(m_writer); }); });
+            flush();
+        }
+    }
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+template<class Put>
+void Responder<MemoryManager, SocketLayer, ThreadSafetyManager>::for_each_record(
+    const RegisteredService& service, uint32_t host_ttl, uint32_t service_ttl, bool addresses, unsigned interface,
+    Put&& put) {
+    const ServiceInstance& instance = service.instance;
+    put([&](PacketWriter& writer) {
+        return writer.ptr(MDNS_ENTRYTYPE_ANSWER, instance.service_type, MDNS_CLASS_IN, service_ttl, service.full_name);
+    });
+    for (const auto& subtype : service.subtype_names)
+        put([&](PacketWriter& writer) {
+            return writer.ptr(MDNS_ENTRYTYPE_ANSWER, subtype, MDNS_CLASS_IN, service_ttl, service.full_name);
+        });
+    put([&](PacketWriter& writer) {
+        return writer.srv(MDNS_ENTRYTYPE_ANSWER, service.full_name, MDNS_CACHE_FLUSH | MDNS_CLASS_IN, host_ttl,
+                          instance.priority, instance.weight, instance.port, instance.host);
+    });
+    put([&](PacketWriter& writer) {
+        return writer.txt(MDNS_ENTRYTYPE_ANSWER, service.full_name, MDNS_CACHE_FLUSH | MDNS_CLASS_IN, service_ttl,
+                          instance.txt);
+    });
+    if (!addresses)
+        return;
+    for_each_address(instance, interface, [&](const IpAddress& address) {
+        if (address.is_ipv4())
+            put([&](PacketWriter& writer) {
+                return writer.a(MDNS_ENTRYTYPE_ANSWER, instance.host, MDNS_CACHE_FLUSH | MDNS_CLASS_IN, host_ttl,
+                                address.to_ipv4());
+            });
+        else
+            put([&](PacketWriter& writer) {
+                return writer.aaaa(MDNS_ENTRYTYPE_ANSWER, instance.host, MDNS_CACHE_FLUSH | MDNS_CLASS_IN, host_ttl,
+                                   address.bytes.data());
+            });
+    });
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+template<class Fn>
+void Responder<MemoryManager, SocketLayer, ThreadSafetyManager>::for_each_address(const ServiceInstance& instance,
+                                                                                  unsigned interface, Fn&& fn) {
+    // Copied out of the registry, fn may send
+    std::pmr::vector<IpAddress> addresses(m_arena);
+    if (!m_registry.host_addresses(instance.host, interface,
+                                   [&addresses](const IpAddress& address) { addresses.push_back(address); })) {
+        // Not a local host, the instance carries its addresses
+        if (instance.ipv4)
+            addresses.push_back(IpAddress::ipv4(instance.ipv4));
+        if (instance.ipv6)
+            addresses.push_back(IpAddress::ipv6(*instance.ipv6));
+    }
+    for (const IpAddress& address : addresses)
+        fn(address);
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+void Responder<MemoryManager, SocketLayer, ThreadSafetyManager>::goodbye(std::chrono::milliseconds timeout) {
+    if (m_socket_dps.empty() || !m_rx || (!m_tx && !acquire_tx()))
+        return;
+    const auto deadline = Clock::now() + timeout;
+    m_arena = m_rx->arena();
+    {
+        std::pmr::vector<ServicePtr> services(m_arena);
+        m_registry.for_each([&services](const ServicePtr& service) { services.push_back(service); });
+        // Reverse lookups are answered on every interface, so they are withdrawn on every interface
+        std::pmr::vector<std::pair<IpAddress, std::pmr::string>> reverses(m_arena);
+        m_registry.for_each_reverse(
+            [&reverses](const IpAddress& address, std::string_view host) { reverses.emplace_back(address, host); });
+
+        // The send buffer plus as many spare buffers as the memory manager has
+        std::array<typename MemoryManager::Buffer*, GOODBYE_BATCH> buffers{m_tx};
+        std::array<PacketWriter, GOODBYE_BATCH> writers;
+        size_t num_buffers = 1;
+        while (num_buffers < GOODBYE_BATCH && (buffers[num_buffers] = m_memory.acquire()))
+            ++num_buffers;
+        for (size_t i = 0; i < num_buffers; ++i)
+            writers[i] = PacketWriter(buffers[i]->data(), std::min(buffers[i]->capacity(), MAX_PACKET_SIZE));
+
+        for (auto socketDp : m_socket_dps) {
+            for (unsigned interface : m_interfaces) {
+                size_t current = 0;
+                writers[current].begin(0, 0x8400);
+                const auto send = [&](size_t count) {
+                    std::array<const void*, GOODBYE_BATCH> data;
+                    std::array<size_t, GOODBYE_BATCH> sizes;
+                    for (size_t i = 0; i < count; ++i) {
+                        data[i] = writers[i].data();
+                        sizes[i] = writers[i].size();
+                    }
+                    if (count)
+                        mdns_multicast_send_batch(socketDp.socket, data.data(), sizes.data(), count, interface);
+                    current = 0;
+                    writers[current].begin(0, 0x8400);
+                };
+
+                const auto put = [&](auto&& record) {
+                    // A record that does not fit into an empty packet is dropped
+                    if (record(writers[current]) || writers[current].empty())
+                        return;
+                    if (++current == num_buffers)
+                        send(num_buffers);
+                    else
+                        writers[current].begin(0, 0x8400);
+                    record(writers[current]);
+                };
+
+                std::pmr::unordered_set<std::string_view, NameHash, NameEqual> hosts(m_arena);
+                for (const ServicePtr& service : services) {
+                    if (Clock::now() >= deadline)
+                        break;
+                    const bool addresses = hosts.insert(service->instance.host).second;
+                    for_each_record(*service, 0, 0, addresses, interface, put);
+                }
+                for (const auto& [address, host] : reverses) {
+                    if (Clock::now() >= deadline)
+                        break;
+                    char name[MAX_REVERSE_NAME];
+                    const std::string_view reverse = reverse_name(address, name);
+                    put([&](PacketWriter& writer) {
+                        return writer.ptr(MDNS_ENTRYTYPE_ANSWER, reverse, MDNS_CACHE_FLUSH | MDNS_CLASS_IN, 0, host);
+                    });
+                }
+                send(current + !writers[current].empty());
+            }
+        }
+        for (size_t i = 1; i < num_buffers; ++i)
+            m_memory.release(buffers[i]);
+    }
+    begin_response();
+    m_rx->reset();
+}
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+bool Responder<MemoryManager, SocketLayer, ThreadSafetyManager>::acquire_tx() {
+    m_tx = m_memory.acquire();
+    if (!m_tx) {
+        m_writer = PacketWriter();
+        return false;
+    }
+    m_writer = PacketWriter(m_tx->data(), std::min(m_tx->capacity(), MAX_PACKET_SIZE));
+    return true;
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+void Responder<MemoryManager, SocketLayer, ThreadSafetyManager>::release_buffers() {
+    if (!m_socket_dps.empty())
+        return;
+    m_memory.release(m_rx);
+    m_memory.release(m_tx);
+    m_rx = m_tx = nullptr;
+    m_writer = PacketWriter();
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+int Responder<MemoryManager, SocketLayer, ThreadSafetyManager>::question_callback(
+    int sock, const struct sockaddr* from, size_t addrlen, mdns_entry_type_t entry, uint16_t query_id, uint16_t rtype,
+    uint16_t rclass, uint32_t, const void* data, size_t size, size_t name_offset, size_t, size_t, size_t,
+    void* user_data) {
+    if (entry != MDNS_ENTRYTYPE_QUESTION)
+        return 0;
+    auto* responder = static_cast<Responder*>(user_data);
+    responder->answer(Destination{sock, from, addrlen, responder->m_ingress}, query_id,
+                      WireName(data, size, name_offset), rtype, rclass);
+    return 0;
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+bool Responder<MemoryManager, SocketLayer, ThreadSafetyManager>::answer(
+    const Destination& destination, uint16_t query_id, const WireName& question, uint16_t rtype, uint16_t rclass) {
+    // The question is matched in its wire form, it is only decoded if there is something to answer
+    Match found(FixedName(), rtype, m_arena);
+    match(question, rtype, found);
+    if (found.empty())
+        return false;
+    found.name = question.decompress();
+    const FixedName& name = found.name;
+
+    // Queries from a port other than 5353 are legacy unicast queries (RFC 6762 6.7): answer unicast,
+    // repeat the question and the query id and do not set the cache flush bit
+    uint16_t source_port = 0;
+    if (destination.address->sa_family == AF_INET)
+        source_port = ntohs(((const sockaddr_in*)destination.address)->sin_port);
+    else if (destination.address->sa_family == AF_INET6)
+        source_port = ntohs(((const sockaddr_in6*)destination.address)->sin6_port);
+    const bool legacy = source_port != MDNS_PORT;
+    const bool unicast = legacy || (rclass & MDNS_UNICAST_RESPONSE);
+    const uint16_t unique = legacy ? 0 : MDNS_CACHE_FLUSH;
+    if (unicast && !m_limits.unicast(destination.address, Clock::now()))
+        return false;
+    if (!unicast && shared(found) && delay(destination.sock, destination.interface, name, rtype))
+        return true;
+
+    m_destination = destination;
+    if (!unicast)
+        m_destination.address_size = 0;
+    m_query_id = legacy ? query_id : 0;
+    if (legacy) {
+        m_question = &name;
+        m_question_type = rtype;
+    }
+    const bool begun = begin_response();
+    if (begun)
+        respond({&found, 1}, unique);
+    m_question = nullptr;
+    return begun;
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+template<class Name>
+void Responder<MemoryManager, SocketLayer, ThreadSafetyManager>::match(const Name& question, uint16_t rtype,
+                                                                      Match& match) {
+    constexpr uint16_t any = 255;
+    if ((rtype == MDNS_RECORDTYPE_PTR || rtype == any) && question == Registry::SERVICE_ENUMERATION) {
+        m_registry.service_types([&match](std::string_view type) { match.service_types.emplace_back(type); });
+        return;
+    }
+    m_registry.lookup(question, rtype, [&match](const ServicePtr& service) { match.services.push_back(service); });
+    if (rtype == MDNS_RECORDTYPE_PTR || rtype == any)
+        m_registry.reverse_lookup(question, [&match](std::string_view host) { match.hosts.emplace_back(host); });
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+bool Responder<MemoryManager, SocketLayer, ThreadSafetyManager>::shared(const Match& match) {
+    // PTR answers for service types and subtypes, every other record has a single owner
+    return !match.service_types.empty() ||
+           std::any_of(match.services.begin(), match.services.end(), [&match](const ServicePtr& service) {
+               return !name_equal(match.name, service->full_name) && !name_equal(match.name, service->instance.host);
+           });
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+bool Responder<MemoryManager, SocketLayer, ThreadSafetyManager>::delay(int sock, unsigned interface,
+                                                                      const FixedName& name, uint16_t rtype) {
+    for (size_t i = 0; i < m_num_pending; ++i) {
+        const Pending& pending = m_pending[i];
+        if (pending.sock == sock && pending.interface == interface && pending.rtype == rtype && pending.name == name)
+            return true;
+    }
+    if (m_num_pending == MAX_PENDING)
+        return false;
+    m_pending[m_num_pending++] = Pending{sock, interface, rtype, name};
+    if (m_pending_deadline == Clock::time_point::max()) {
+        std::uniform_int_distribution<long> delay(MIN_SHARED_DELAY.count(), MAX_SHARED_DELAY.count());
+        m_pending_deadline = Clock::now() + std::chrono::milliseconds(delay(m_random));
+    }
+    return true;
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+void Responder<MemoryManager, SocketLayer, ThreadSafetyManager>::respond(std::span<const Match> matches,
+                                                                        uint16_t unique) {
+    MetricsTimer timer(MetricHistogram::AnswerTime);
+    std::pmr::unordered_set<std::string_view, NameHash, NameEqual> hosts(m_arena);
+    std::pmr::unordered_set<std::string_view, NameHash, NameEqual> services(m_arena);
+    m_hosts = &hosts;
+    m_services = &services;
+    m_now = Clock::now();
+    m_answers = 0;
+
+    for (const Match& match : matches) {
+        for (const auto& type : match.service_types) {
+            if (!limited(MDNS_ENTRYTYPE_ANSWER, match.name, MDNS_RECORDTYPE_PTR, type))
+                put([&] { return m_writer.ptr(MDNS_ENTRYTYPE_ANSWER, match.name, MDNS_CLASS_IN, SERVICE_TTL, type); });
+        }
+        for (const ServicePtr& service : match.services)
+            add_answers(*service, match.name, match.rtype, unique);
+        // Reverse lookup PTR records are unique, each address belongs to this host
+        for (const auto& host : match.hosts) {
+            if (!limited(MDNS_ENTRYTYPE_ANSWER, match.name, MDNS_RECORDTYPE_PTR, host))
+                put([&] {
+                    return m_writer.ptr(MDNS_ENTRYTYPE_ANSWER, match.name, unique | MDNS_CLASS_IN, HOST_TTL, host);
+                });
+        }
+    }
+    // Nothing to send if all answers were multicast just now
+    if (m_answers) {
+        for (const Match& match : matches) {
+            for (const ServicePtr& service : match.services)
+                add_additionals(*service, match.name, match.rtype, unique);
+        }
+        flush();
+    } else {
+        begin_response();
+    }
+
+    m_hosts = nullptr;
+    m_services = nullptr;
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+void Responder<MemoryManager, SocketLayer, ThreadSafetyManager>::add_answers(
+    const RegisteredService& service, std::string_view name, uint16_t rtype, uint16_t unique) {
+    constexpr uint16_t any = 255;
+    const ServiceInstance& instance = service.instance;
+    if (name_equal(name, service.full_name)) {
+        if ((rtype == MDNS_RECORDTYPE_SRV || rtype == any) &&
+            !limited(MDNS_ENTRYTYPE_ANSWER, service.full_name, MDNS_RECORDTYPE_SRV))
+            put([&] {
+                return m_writer.srv(MDNS_ENTRYTYPE_ANSWER, service.full_name, unique | MDNS_CLASS_IN, HOST_TTL,
+                                    instance.priority, instance.weight, instance.port, instance.host);
+            });
+        if ((rtype == MDNS_RECORDTYPE_TXT || rtype == any) &&
+            !limited(MDNS_ENTRYTYPE_ANSWER, service.full_name, MDNS_RECORDTYPE_TXT))
+            put([&] {
+                return m_writer.txt(MDNS_ENTRYTYPE_ANSWER, service.full_name, unique | MDNS_CLASS_IN, SERVICE_TTL,
+                                    instance.txt);
+            });
+    } else if (name_equal(name, instance.host)) {
+        add_addresses(MDNS_ENTRYTYPE_ANSWER, service, rtype, unique);
+    } else {
+        // Service type or subtype, PTR records are shared and never carry the cache flush bit
+        if (!limited(MDNS_ENTRYTYPE_ANSWER, name, MDNS_RECORDTYPE_PTR, service.full_name))
+            put([&] {
+                return m_writer.ptr(MDNS_ENTRYTYPE_ANSWER, name, MDNS_CLASS_IN, SERVICE_TTL, service.full_name);
+            });
+    }
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+void Responder<MemoryManager, SocketLayer, ThreadSafetyManager>::add_additionals(const RegisteredService& service,
+                                                                                 std::string_view name, uint16_t rtype,
+                                                                                 uint16_t unique) {
+    constexpr uint16_t any = 255;
+    const ServiceInstance& instance = service.instance;
+    const bool ptr_answer = !name_equal(name, service.full_name) && !name_equal(name, instance.host);
+    if (ptr_answer && m_services->insert(service.full_name).second) {
+        if (!limited(MDNS_ENTRYTYPE_ADDITIONAL, service.full_name, MDNS_RECORDTYPE_SRV))
+            put([&] {
+                return m_writer.srv(MDNS_ENTRYTYPE_ADDITIONAL, service.full_name, unique | MDNS_CLASS_IN, HOST_TTL,
+                                    instance.priority, instance.weight, instance.port, instance.host);
+            });
+        if (!limited(MDNS_ENTRYTYPE_ADDITIONAL, service.full_name, MDNS_RECORDTYPE_TXT))
+            put([&] {
+            return m_writer.txt(MDNS_ENTRYTYPE_ADDITIONAL, service.full_name, unique | MDNS_CLASS_IN, SERVICE_TTL,
+                                instance.txt);
+        });
+    }
+    if ((ptr_answer || (name_equal(name, service.full_name) && (rtype == MDNS_RECORDTYPE_SRV || rtype == any))) &&
+        m_hosts->insert(instance.host).second)
+        add_addresses(MDNS_ENTRYTYPE_ADDITIONAL, service, any, unique);
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+void Responder<MemoryManager, SocketLayer, ThreadSafetyManager>::add_addresses(
+    mdns_entry_type_t section, const RegisteredService& service, uint16_t rtype, uint16_t unique) {
+    constexpr uint16_t any = 255;
+    const ServiceInstance& instance = service.instance;
+    if (rtype != MDNS_RECORDTYPE_A && rtype != MDNS_RECORDTYPE_AAAA && rtype != any)
+        return;
+    // Only the addresses of the interface the question came from are reachable for the querier
+    for_each_address(instance, m_destination.interface, [&](const IpAddress& address) {
+        const uint16_t type = address.is_ipv4() ? MDNS_RECORDTYPE_A : MDNS_RECORDTYPE_AAAA;
+        const std::string_view data((const char*)address.bytes.data(), address.size);
+        if ((rtype != type && rtype != any) || limited(section, instance.host, type, data))
+            return;
+        if (address.is_ipv4())
+            put([&] {
+                return m_writer.a(section, instance.host, unique | MDNS_CLASS_IN, HOST_TTL, address.to_ipv4());
+            });
+        else
+            put([&] {
+                return m_writer.aaaa(section, instance.host, unique | MDNS_CLASS_IN, HOST_TTL, address.bytes.data());
+            });
+    });
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+bool Responder<MemoryManager, SocketLayer, ThreadSafetyManager>::limited(mdns_entry_type_t section,
+                                                                        std::string_view owner, uint16_t rtype,
+                                                                        std::string_view target) {
+    if (!m_destination.address_size && !m_probe_query) {
+        // Shared PTR records have the same owner, tell them apart by their target
+        uint64_t record = name_hash(name_fingerprint(owner), rtype);
+        if (!target.empty())
+            record = (record ^ name_fingerprint(target)) * 0x100000001b3ULL;
+        record = (record ^ m_destination.interface) * 0x100000001b3ULL;
+        const bool allowed = m_shared_limit ? m_shared_limit->multicast(m_destination.sock, record, m_now)
+                                            : m_limits.multicast(m_destination.sock, record, m_now);
+        if (!allowed)
+            return true;
+    }
+    if (section == MDNS_ENTRYTYPE_ANSWER)
+        ++m_answers;
+    return false;
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+bool Responder<MemoryManager, SocketLayer, ThreadSafetyManager>::probe_query(const void* data, size_t size) noexcept {
+    // Probes are queries with the proposed records in the authority section (RFC 6762 8.1)
+    const auto* header = (const uint8_t*)data;
+    return size >= 12 && !(header[2] & 0x80) && (header[8] || header[9]);
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+template<class Write>
+void Responder<MemoryManager, SocketLayer, ThreadSafetyManager>::put(Write&& write) {
+    if (!m_tx || write())
+        return;
+    // A record that does not fit into an empty packet is dropped
+    if (packet_empty())
+        return;
+    flush();
+    if (m_tx)
+        write();
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+void Responder<MemoryManager, SocketLayer, ThreadSafetyManager>::flush() {
+    if (!m_tx || packet_empty())
+        return;
+    if (m_sink) {
+        Response response{m_tx, m_writer.size(), m_destination.sock, {}, m_destination.address_size,
+                          m_destination.interface};
+        memcpy(&response.address, m_destination.address, std::min(m_destination.address_size, sizeof(sockaddr_in6)));
+        // The sink owns the buffer now. The rest of the answer is dropped if no buffer is left for it.
+        if (m_sink(response, m_sink_data)) {
+            m_tx = nullptr;
+            m_writer = PacketWriter();
+            if (!acquire_tx())
+                return;
+        }
+    } else if (m_destination.address_size) {
+        mdns_unicast_send(m_destination.sock, m_destination.address, m_destination.address_size, m_writer.data(),
+                          m_writer.size());
+    } else {
+        mdns_multicast_send_interface(m_destination.sock, m_writer.data(), m_writer.size(), m_destination.interface);
+    }
+    begin_packet();
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+bool Responder<MemoryManager, SocketLayer, ThreadSafetyManager>::begin_response() {
+    if (!m_tx && !acquire_tx())
+        return false;
+    begin_packet();
+    return true;
+}
+
+template<MemoryManagerType MemoryManager, SocketLayerType SocketLayer, ThreadSafetyManagerType ThreadSafetyManager>
+void Responder<MemoryManager, SocketLayer, ThreadSafetyManager>::begin_packet() {
+    m_writer.begin(m_query_id, 0x8400);
+    // Resolvers expect the question in every packet of a legacy unicast response (RFC 6762 6.7)
+    if (m_question)
+        m_writer.question(*m_question, m_question_type, MDNS_CLASS_IN);
+}
+
+}
@@ -0,0 +1,189 @@
+#pragma once
+
+#include "ip_address.h"
+#include "dns_name.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <type_traits>
+
+namespace mdns
+{
+
+/// Decodes reverse lookup names, "4.3.2.1.in-addr.arpa." and the 32 nibble labels of ip6.arpa,
+/// into the address they stand for (RFC 1035 3.5, RFC 3596 2.5)
+///
+/// Labels are fed one by one, straight from a WireName or a dotted name, so a name is checked
+/// without building a string. Most names are rejected by their first label.
+class ReverseName
+{
+public:
+    /// \return False once the name cannot be a reverse name
+    bool label(std::string_view label) noexcept;
+    /// The address if all labels of a complete reverse name were fed, otherwise an empty address
+    IpAddress address() const noexcept;
+
+private:
+    enum class State : uint8_t { Address, InAddr, Ip6, Arpa, Invalid };
+
+    bool fail() noexcept {
+        m_state = State::Invalid;
+        return false;
+    }
+
+    State m_state = State::Address;
+    /// Values of the address labels, least significant first
+    std::array<uint8_t, 32> m_values{};
+    uint8_t m_count{};
+    /// All address labels so far are single hex digits or decimal octets
+    bool m_nibbles = true;
+    bool m_octets = true;
+};
+
+/// Address of the reverse lookup name \p name, empty if it is none
+/// \param name A WireName or a dotted name
+template<class Name>
+IpAddress reverse_address(const Name& name) noexcept;
+
+/// Longest reverse lookup name, the 32 nibble labels of an IPv6 address and "ip6.arpa."
+inline constexpr size_t MAX_REVERSE_NAME = 73;
+
+/// Reverse lookup name of \p address, the inverse of reverse_address()
+/// \param buffer Receives the name, at least MAX_REVERSE_NAME bytes
+/// \return The name in \p buffer, empty for an empty address
+std::string_view reverse_name(const IpAddress& address, char* buffer) noexcept;
+
+/// Implementation ///
+
+inline bool ReverseName::label(std::string_view label) noexcept {
+    switch (m_state) {
+    case State::Address:
+        break;
+    case State::InAddr:
+    case State::Ip6:
+        if (!name_equal(label, "arpa"))
+            return fail();
+        if ((m_state == State::InAddr && (!m_octets || m_count != 4)) ||
+            (m_state == State::Ip6 && (!m_nibbles || m_count != 32)))
+            return fail();
+        m_state = State::Arpa;
+        return true;
+    case State::Arpa:
+    case State::Invalid:
+        return fail();
+    }
+
+    if (m_count && name_equal(label, "in-addr")) {
+        m_state = State::InAddr;
+        return true;
+    }
+    if (m_count && name_equal(label, "ip6")) {
+        m_state = State::Ip6;
+        return true;
+    }
+    if (label.empty() || label.size() > 3 || m_count == m_values.size())
+        return fail();
+
+    // A label like "1" is both a nibble and an octet, the suffix decides
+    unsigned octet = 0;
+    for (char c : label) {
+        if (c < '0' || c > '9') {
+            m_octets = false;
+            break;
+        }
+        octet = octet * 10 + (unsigned)(c - '0');
+    }
+    if (octet > 255 || (label.size() > 1 && label[0] == '0'))
+        m_octets = false;
+    int nibble = -1;
+    if (label.size() == 1) {
+        const char c = label[0];
+        if (c >= '0' && c <= '9')
+            nibble = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            nibble = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            nibble = c - 'A' + 10;
+    }
+    if (nibble < 0)
+        m_nibbles = false;
+    if (!m_octets && !m_nibbles)
+        return fail();
+    m_values[m_count++] = m_octets ? (uint8_t)octet : (uint8_t)nibble;
+    return true;
+}
+
+inline IpAddress ReverseName::address() const noexcept {
+    IpAddress address;
+    if (m_state != State::Arpa)
+        return address;
+    if (m_count == 4) {
+        for (size_t i = 0; i < 4; ++i)
+            address.bytes[3 - i] = m_values[i];
+        address.size = 4;
+    } else {
+        for (size_t i = 0; i < 32; ++i)
+            address.bytes[15 - i / 2] |= (uint8_t)(m_values[i] << (i % 2 ? 4 : 0));
+        address.size = 16;
+    }
+    return address;
+}
+
+template<class Name>
+IpAddress reverse_address(const Name& name) noexcept {
+    ReverseName reverse;
+    if constexpr (std::is_convertible_v<const Name&, std::string_view>) {
+        std::string_view text = name;
+        if (!text.empty() && text.back() == '.')
+            text.remove_suffix(1);
+        while (!text.empty()) {
+            const size_t dot = text.find('.');
+            if (!reverse.label(text.substr(0, dot)))
+                return {};
+            text = dot == std::string_view::npos ? std::string_view() : text.substr(dot + 1);
+        }
+    } else {
+        for (std::string_view label : name) {
+            if (!reverse.label(label))
+                return {};
+        }
+    }
+    return reverse.address();
+}
+
+inline std::string_view reverse_name(const IpAddress& address, char* buffer) noexcept {
+    char* out = buffer;
+    std::string_view domain;
+    if (address.is_ipv4()) {
+        // "4.3.2.1.in-addr.arpa." for 1.2.3.4
+        for (size_t i = 4; i--;) {
+            const uint8_t octet = address.bytes[i];
+            if (octet >= 100)
+                *out++ = (char)('0' + octet / 100);
+            if (octet >= 10)
+                *out++ = (char)('0' + octet / 10 % 10);
+            *out++ = (char)('0' + octet % 10);
+            *out++ = '.';
+        }
+        domain = "in-addr.arpa.";
+    } else if (address.is_ipv6()) {
+        // One label per nibble, the least significant first
+        constexpr char hex[] = "0123456789abcdef";
+        for (size_t i = 16; i--;) {
+            *out++ = hex[address.bytes[i] & 0xf];
+            *out++ = '.';
+            *out++ = hex[address.bytes[i] >> 4];
+            *out++ = '.';
+        }
+        domain = "ip6.arpa.";
+    } else {
+        return {};
+    }
+    memcpy(out, domain.data(), domain.size());
+    return {buffer, (size_t)(out - buffer) + domain.size()};
+}
+
+}
@@ -0,0 +1,660 @@
+#pragma once
+
+#include "dns_name.h"
+#include "wire_name.h"
+#include "network_types.h"
+#include "ip_address.h"
+#include "reverse_name.h"
+#include "txt.h"
+#include "thread_safety.h"
+#include "cpp_concepts.h"
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace mdns
+{
+
+/// TTLs of the records of a service instance, as recommended by RFC 6762 10: records that carry a
+/// host name or address and all other records
+inline constexpr uint32_t HOST_RECORD_TTL = 120;
+inline constexpr uint32_t SERVICE_RECORD_TTL = 4500;
+
+/// A service instance to advertise
+struct ServiceInstance {
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+
+    ServiceInstance() = default;
+    explicit ServiceInstance(const allocator_type& allocator)
+        : name(allocator), service_type(allocator), subtypes(allocator), host(allocator), txt(allocator) {}
+    ServiceInstance(const ServiceInstance& other) = default;
+    ServiceInstance(ServiceInstance&& other) = default;
+    ServiceInstance(const ServiceInstance& other, const allocator_type& allocator)
+        : name(other.name, allocator), service_type(other.service_type, allocator),
+          subtypes(other.subtypes, allocator), host(other.host, allocator), port(other.port),
+          priority(other.priority), weight(other.weight), txt(other.txt, allocator), ipv4(other.ipv4),
+          ipv6(other.ipv6) {}
+    ServiceInstance(ServiceInstance&& other, const allocator_type& allocator)
+        : name(std::move(other.name), allocator), service_type(std::move(other.service_type), allocator),
+          subtypes(std::move(other.subtypes), allocator), host(std::move(other.host), allocator), port(other.port),
+          priority(other.priority), weight(other.weight), txt(std::move(other.txt), allocator), ipv4(other.ipv4),
+          ipv6(other.ipv6) {}
+    ServiceInstance& operator=(const ServiceInstance& other) = default;
+    ServiceInstance& operator=(ServiceInstance&& other) = default;
+
+    /// Instance label, for example "Living Room Printer"
+    std::pmr::string name;
+    /// For example "_ipp._tcp.local."
+    std::pmr::string service_type;
+    /// Subtype labels without the "._sub" part, for example "_universal"
+    std::pmr::vector<std::pmr::string> subtypes;
+    /// Target host of the SRV record, for example "printer-1.local."
+    std::pmr::string host;
+    uint16_t port{};
+    uint16_t priority{};
+    uint16_t weight{};
+    /// Encoded TXT record data, a sequence of length prefixed strings, see TxtBuilder
+    std::pmr::vector<uint8_t> txt;
+    /// Addresses of the host, answered for A and AAAA questions. IPv4 in network byte order, 0 if none.
+    uint32_t ipv4{};
+    std::optional<std::array<uint8_t, 16>> ipv6;
+};
+
+/// A service instance in the registry together with its fully qualified names
+struct RegisteredService {
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+
+    explicit RegisteredService(const allocator_type& allocator)
+        : instance(allocator), full_name(allocator), subtype_names(allocator) {}
+
+    ServiceInstance instance;
+    /// <instance>.<service type>
+    std::pmr::string full_name;
+    /// <subtype>._sub.<service type> for each subtype
+    std::pmr::vector<std::pmr::string> subtype_names;
+};
+
+/// Registered instances are immutable, a reference stays valid after the instance is removed
+using ServicePtr = std::shared_ptr<const RegisteredService>;
+
+/// A set of additions and removals that is applied to a ServiceRegistry atomically
+class RegistryTransaction
+{
+public:
+    /// \param resource Memory of the queued changes
+    explicit RegistryTransaction(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : m_add(resource), m_remove(resource) {}
+
+    void add(ServiceInstance instance) { m_add.push_back(std::move(instance)); }
+
+    /// \param full_name <instance>.<service type>
+    void remove(std::string_view full_name) {
+        std::pmr::string& name = m_remove.emplace_back(full_name);
+        if (name.empty() || name.back() != '.')
+            name += '.';
+    }
+
+    bool empty() const { return m_add.empty() && m_remove.empty(); }
+
+private:
+    template<ThreadSafetyManagerType>
+    friend class ServiceRegistry;
+
+    std::pmr::vector<ServiceInstance> m_add;
+    std::pmr::vector<std::pmr::string> m_remove;
+};
+
+/// Registry of all service instances a responder advertises
+///
+/// Instances are indexed by service type, subtype, full instance name, host name and address, so
+/// finding the instances an incoming question refers to is a constant number of hash lookups,
+/// independent of how many instances are registered. Changes are applied in transactions: either all changes of
+/// a transaction become visible at once or none.
+///
+/// Lookups only take the shared scope of the ThreadSafetyManager, so with a policy like
+/// SharedMutexThreadSafe many responder threads answer in parallel. Lookup callbacks are invoked with
+/// the shared scope held and receive a ServicePtr, which can be kept to build answers after the
+/// scope is released.
+///
+/// Registered instances and all indexes are allocated from the memory resource passed to the
+/// constructor.
+template<ThreadSafetyManagerType ThreadSafetyManager>
+class ServiceRegistry
+{
+public:
+    static constexpr std::string_view SERVICE_ENUMERATION = "_services._dns-sd._udp.local.";
+
+    explicit ServiceRegistry(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : m_resource(resource), m_services(resource), m_by_instance(resource), m_by_service(resource),
+          m_by_subtype(resource), m_by_host(resource), m_by_address(resource), m_local_addresses(resource),
+          m_host_addresses(resource) {}
+
+    /// Apply all changes of \p transaction atomically. Removals are applied before additions,
+    /// so an instance can be replaced within one transaction.
+    /// \return False, without changing the registry, if an added instance is invalid, already
+    /// registered or added twice, if a removed instance is not registered or if the memory resource
+    /// is exhausted
+    bool commit(const RegistryTransaction& transaction);
+
+    bool add(ServiceInstance instance) {
+        RegistryTransaction transaction(m_resource);
+        try {
+            transaction.add(std::move(instance));
+        } catch (const std::bad_alloc&) {
+            return false;
+        }
+        return commit(transaction);
+    }
+
+    bool remove(std::string_view full_name) {
+        RegistryTransaction transaction(m_resource);
+        try {
+            transaction.remove(full_name);
+        } catch (const std::bad_alloc&) {
+            return false;
+        }
+        return commit(transaction);
+    }
+
+    /// Call \p fn for every instance that answers a question for \p name and \p rtype:
+    /// PTR questions for a service type or subtype, SRV and TXT questions for an instance name,
+    /// A and AAAA questions for a host name. ANY questions match all of them.
+    /// For host names only the first instance of the host is reported, all instances of a host are
+    /// expected to carry the same addresses.
+    /// Questions for SERVICE_ENUMERATION are answered with service_types().
+    /// \param name A std::string_view or a WireName straight from the packet
+    /// \return The number of matching instances
+    template<class Name, class Fn>
+    size_t lookup(const Name& name, uint16_t rtype, Fn&& fn);
+
+    /// Call \p fn with every host name that \p name, a reverse lookup name like
+    /// "4.3.2.1.in-addr.arpa.", points to: the hosts of all instances with that address and the
+    /// host of a local address added with add_address(). Each host is reported once.
+    /// \param name A std::string_view or a WireName straight from the packet
+    /// \return The number of hosts
+    template<class Name, class Fn>
+    size_t reverse_lookup(const Name& name, Fn&& fn);
+    /// Call \p fn with every address that reverse lookups are answered for and each of its hosts,
+    /// all pairs reverse_lookup() can report
+    /// \return The number of pairs
+    template<class Fn>
+    size_t for_each_reverse(Fn&& fn);
+
+    /// Answer reverse lookups for \p address, an address of a local interface, with \p host.
+    /// Replaces the host of an address added before. The address also becomes an address record of
+    /// \p host on the interface with index \p interface, see host_addresses().
+    /// \param interface 0 for an address that is valid on all interfaces
+    /// \return False if the memory resource is exhausted
+    bool add_address(const IpAddress& address, std::string_view host, unsigned interface = 0);
+    void remove_address(const IpAddress& address);
+
+    /// Call \p fn with every address added for \p host with add_address() that is valid on the
+    /// interface with index \p interface: the addresses of that interface and those added for
+    /// interface 0. All addresses of the host if \p interface is 0. The addresses of each host are
+    /// kept in one list when they are added, so this is a single hash lookup.
+    /// \return The number of addresses added for \p host on all interfaces. 0 if there are none, the
+    /// addresses of the instances of the host apply then.
+    template<class Fn>
+    size_t host_addresses(std::string_view host, unsigned interface, Fn&& fn);
+
+    /// Call \p fn for every service type with at least one instance
+    template<class Fn>
+    size_t service_types(Fn&& fn);
+
+    /// Call \p fn for every registered instance
+    template<class Fn>
+    size_t for_each(Fn&& fn);
+
+    size_t size() {
+        auto lock = m_lock.sharedLock();
+        return m_services.size();
+    }
+
+    /// Incremented with every committed transaction
+    uint64_t generation() {
+        auto lock = m_lock.sharedLock();
+        return m_generation;
+    }
+
+    /// True if the names of \p instance are valid DNS names, commit() rejects invalid instances
+    static bool is_valid(const ServiceInstance& instance);
+    /// <instance>.<service type>
+    static std::string instance_name(const ServiceInstance& instance) {
+        std::string name(instance.name);
+        name += '.';
+        name += qualified_name(instance.service_type);
+        return name;
+    }
+
+private:
+    using Id = uint32_t;
+    using IdSet = std::pmr::unordered_set<Id>;
+    using NameIndex = std::pmr::unordered_map<std::pmr::string, IdSet, NameHash, NameEqual>;
+    using HostSet = std::pmr::unordered_set<std::pmr::string, NameHash, NameEqual>;
+    struct LinkAddress {
+        IpAddress address;
+        unsigned interface;
+    };
+
+    /// Like qualified_name(), in place
+    static void qualify(std::pmr::string& name) {
+        if (name.empty() || name.back() != '.')
+            name += '.';
+    }
+    static void index(NameIndex& index, std::string_view name, Id id);
+    static void unindex(NameIndex& index, std::string_view name, Id id);
+    void unindex(Id id);
+    void index_address(const IpAddress& address, std::string_view host);
+    /// Remove \p host from \p address unless another instance of the host still has the address
+    void unindex_address(const IpAddress& address, std::string_view host);
+    static void addresses(const ServiceInstance& instance, std::array<IpAddress, 2>& addresses);
+    /// Remove the local address \p address from the addresses of its host
+    void unlink_address(const IpAddress& address);
+
+    template<class Name, class Fn>
+    size_t visit(const NameIndex& index, const Name& name, Fn& fn);
+
+    ThreadSafetyManager m_lock;
+    std::pmr::memory_resource* m_resource;
+    std::pmr::unordered_map<Id, ServicePtr> m_services;
+    std::pmr::unordered_map<std::pmr::string, Id, NameHash, NameEqual> m_by_instance;
+    NameIndex m_by_service;
+    NameIndex m_by_subtype;
+    NameIndex m_by_host;
+    std::pmr::unordered_map<IpAddress, HostSet, IpAddressHash> m_by_address;
+    std::pmr::unordered_map<IpAddress, std::pmr::string, IpAddressHash> m_local_addresses;
+    /// Addresses of m_local_addresses by host
+    std::pmr::unordered_map<std::pmr::string, std::pmr::vector<LinkAddress>, NameHash, NameEqual> m_host_addresses;
+    Id m_next_id{};
+    uint64_t m_generation{};
+};
+
+/// Implementation ///
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+bool ServiceRegistry<ThreadSafetyManager>::commit(const RegistryTransaction& transaction) {
+    // Names are built and validated before taking the lock, in the memory of the registry like
+    // everything else commit() allocates
+    std::pmr::vector<std::pmr::string> add_names(m_resource);
+    std::pmr::unordered_set<std::string_view, NameHash, NameEqual> adding(m_resource);
+    std::pmr::unordered_set<std::string_view, NameHash, NameEqual> removing(m_resource);
+    try {
+        add_names.reserve(transaction.m_add.size());
+        for (const ServiceInstance& instance : transaction.m_add) {
+            if (!is_valid(instance))
+                return false;
+            std::pmr::string& name = add_names.emplace_back(instance.name);
+            name += '.';
+            name += instance.service_type;
+            qualify(name);
+            if (!adding.insert(name).second)
+                return false;
+        }
+        removing.insert(transaction.m_remove.begin(), transaction.m_remove.end());
+    } catch (const std::bad_alloc&) {
+        return false;
+    }
+
+    auto lock = m_lock.scopeLock();
+
+    for (const std::pmr::string& name : transaction.m_remove) {
+        if (!m_by_instance.contains(name))
+            return false;
+    }
+    for (const std::pmr::string& name : add_names) {
+        if (m_by_instance.contains(name) && !removing.contains(name))
+            return false;
+    }
+
+    // Instances are built before the registry is touched
+    std::pmr::vector<std::shared_ptr<RegisteredService>> added(m_resource);
+    try {
+        added.reserve(transaction.m_add.size());
+        m_services.reserve(m_services.size() + transaction.m_add.size());
+        m_by_instance.reserve(m_by_instance.size() + transaction.m_add.size());
+        for (size_t i = 0; i < transaction.m_add.size(); ++i) {
+            auto service = std::allocate_shared<RegisteredService>(std::pmr::polymorphic_allocator<>(m_resource));
+            service->instance = transaction.m_add[i];
+            qualify(service->instance.service_type);
+            qualify(service->instance.host);
+            service->full_name = add_names[i];
+            for (const auto& subtype : service->instance.subtypes) {
+                std::pmr::string& subtype_name = service->subtype_names.emplace_back(subtype);
+                subtype_name += "._sub.";
+                subtype_name += service->instance.service_type;
+            }
+            added.push_back(std::move(service));
+        }
+    } catch (const std::bad_alloc&) {
+        return false;
+    }
+
+    // Additions are indexed before removals are applied, so running out of memory leaves the
+    // registry unchanged. Replaced instances keep their name entry, it is pointed to the new id below.
+    // Every index entry is made after the m_services entry of its id, which the rollback starts from.
+    const Id first_id = m_next_id;
+    try {
+        for (auto& service : added) {
+            const Id id = m_next_id++;
+            m_services.emplace(id, service);
+            if (!removing.contains(service->full_name))
+                m_by_instance.emplace(service->full_name, id);
+            index(m_by_service, service->instance.service_type, id);
+            for (const auto& subtype : service->subtype_names)
+                index(m_by_subtype, subtype, id);
+            index(m_by_host, service->instance.host, id);
+            std::array<IpAddress, 2> service_addresses;
+            addresses(service->instance, service_addresses);
+            for (const IpAddress& address : service_addresses) {
+                if (address)
+                    index_address(address, service->instance.host);
+            }
+        }
+    } catch (const std::bad_alloc&) {
+        for (Id id = first_id; id != m_next_id; ++id) {
+            auto service_it = m_services.find(id);
+            if (service_it == m_services.end())
+                continue;
+            unindex(id);
+            auto instance_it = m_by_instance.find(service_it->second->full_name);
+            if (instance_it != m_by_instance.end() && instance_it->second == id)
+                m_by_instance.erase(instance_it);
+            m_services.erase(service_it);
+        }
+        m_next_id = first_id;
+        return false;
+    }
+
+    for (std::string_view name : removing) {
+        auto instance_it = m_by_instance.find(name);
+        if (instance_it == m_by_instance.end())
+            continue;
+        const Id id = instance_it->second;
+        unindex(id);
+        m_services.erase(id);
+        if (!adding.contains(name))
+            m_by_instance.erase(instance_it);
+    }
+    Id id = first_id;
+    for (const auto& service : added) {
+        if (removing.contains(service->full_name))
+            m_by_instance.find(service->full_name)->second = id;
+        ++id;
+    }
+
+    ++m_generation;
+    return true;
+}
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+template<class Name, class Fn>
+size_t ServiceRegistry<ThreadSafetyManager>::lookup(const Name& name, uint16_t rtype, Fn&& fn) {
+    constexpr uint16_t any = 255;
+    auto lock = m_lock.sharedLock();
+    size_t found = 0;
+    if (rtype == MDNS_RECORDTYPE_PTR || rtype == any) {
+        found += visit(m_by_service, name, fn);
+        found += visit(m_by_subtype, name, fn);
+    }
+    if (rtype == MDNS_RECORDTYPE_SRV || rtype == MDNS_RECORDTYPE_TXT || rtype == any) {
+        auto instance_it = m_by_instance.find(name);
+        if (instance_it != m_by_instance.end()) {
+            fn(m_services.at(instance_it->second));
+            ++found;
+        }
+    }
+    if (rtype == MDNS_RECORDTYPE_A || rtype == MDNS_RECORDTYPE_AAAA || rtype == any) {
+        auto host_it = m_by_host.find(name);
+        if (host_it != m_by_host.end()) {
+            fn(m_services.at(*host_it->second.begin()));
+            ++found;
+        }
+    }
+    return found;
+}
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+template<class Name, class Fn>
+size_t ServiceRegistry<ThreadSafetyManager>::reverse_lookup(const Name& name, Fn&& fn) {
+    // Decoded without the lock, most names are rejected by their first label
+    const IpAddress address = reverse_address(name);
+    if (!address)
+        return 0;
+    auto lock = m_lock.sharedLock();
+    size_t found = 0;
+    std::string_view local;
+    auto local_it = m_local_addresses.find(address);
+    if (local_it != m_local_addresses.end()) {
+        local = local_it->second;
+        fn(local);
+        ++found;
+    }
+    auto address_it = m_by_address.find(address);
+    if (address_it != m_by_address.end()) {
+        for (const auto& host : address_it->second) {
+            if (local.empty() || !name_equal(host, local)) {
+                fn(std::string_view(host));
+                ++found;
+            }
+        }
+    }
+    return found;
+}
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+template<class Fn>
+size_t ServiceRegistry<ThreadSafetyManager>::for_each_reverse(Fn&& fn) {
+    auto lock = m_lock.sharedLock();
+    size_t found = 0;
+    for (const auto& [address, host] : m_local_addresses) {
+        fn(address, std::string_view(host));
+        ++found;
+    }
+    for (const auto& [address, hosts] : m_by_address) {
+        auto local_it = m_local_addresses.find(address);
+        for (const auto& host : hosts) {
+            if (local_it == m_local_addresses.end() || !name_equal(host, local_it->second)) {
+                fn(address, std::string_view(host));
+                ++found;
+            }
+        }
+    }
+    return found;
+}
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+bool ServiceRegistry<ThreadSafetyManager>::add_address(const IpAddress& address, std::string_view host,
+                                                       unsigned interface) {
+    if (!address || host.empty())
+        return false;
+    const std::string name = qualified_name(host);
+    auto lock = m_lock.scopeLock();
+    try {
+        // Reserve the entries first, so that nothing changes if the resource is exhausted
+        auto host_it = m_host_addresses.find(std::string_view(name));
+        if (host_it == m_host_addresses.end())
+            host_it = m_host_addresses
+                          .emplace(std::piecewise_construct, std::forward_as_tuple(name), std::forward_as_tuple())
+                          .first;
+        auto& addresses = host_it->second;
+        addresses.reserve(addresses.size() + 1);
+        m_local_addresses.reserve(m_local_addresses.size() + 1);
+        // The address moves to this host or to another interface
+        auto local_it = m_local_addresses.find(address);
+        if (local_it != m_local_addresses.end() && !name_equal(local_it->second, name))
+            unlink_address(address);
+        std::erase_if(addresses, [&address](const LinkAddress& link) { return link.address == address; });
+        addresses.push_back({address, interface});
+        m_local_addresses.insert_or_assign(address, std::pmr::string(name, m_resource));
+    } catch (const std::bad_alloc&) {
+        return false;
+    }
+    ++m_generation;
+    return true;
+}
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+void ServiceRegistry<ThreadSafetyManager>::remove_address(const IpAddress& address) {
+    auto lock = m_lock.scopeLock();
+    unlink_address(address);
+    if (m_local_addresses.erase(address))
+        ++m_generation;
+}
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+template<class Fn>
+size_t ServiceRegistry<ThreadSafetyManager>::host_addresses(std::string_view host, unsigned interface, Fn&& fn) {
+    auto lock = m_lock.sharedLock();
+    auto host_it = m_host_addresses.find(host);
+    if (host_it == m_host_addresses.end())
+        return 0;
+    for (const LinkAddress& address : host_it->second) {
+        if (!interface || !address.interface || address.interface == interface)
+            fn(address.address);
+    }
+    return host_it->second.size();
+}
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+void ServiceRegistry<ThreadSafetyManager>::unlink_address(const IpAddress& address) {
+    auto local_it = m_local_addresses.find(address);
+    if (local_it == m_local_addresses.end())
+        return;
+    auto host_it = m_host_addresses.find(std::string_view(local_it->second));
+    if (host_it == m_host_addresses.end())
+        return;
+    auto& addresses = host_it->second;
+    std::erase_if(addresses, [&address](const LinkAddress& link) { return link.address == address; });
+    if (addresses.empty())
+        m_host_addresses.erase(host_it);
+}
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+template<class Fn>
+size_t ServiceRegistry<ThreadSafetyManager>::service_types(Fn&& fn) {
+    auto lock = m_lock.sharedLock();
+    for (const auto& service : m_by_service)
+        fn(std::string_view(service.first));
+    return m_by_service.size();
+}
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+template<class Fn>
+size_t ServiceRegistry<ThreadSafetyManager>::for_each(Fn&& fn) {
+    auto lock = m_lock.sharedLock();
+    for (const auto& service : m_services)
+        fn(service.second);
+    return m_services.size();
+}
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+bool ServiceRegistry<ThreadSafetyManager>::is_valid(const ServiceInstance& instance) {
+    // Labels are at most 63 bytes, full names at most 255 bytes (RFC 1035 2.3.4)
+    if (instance.name.empty() || instance.name.size() > 63 || instance.service_type.empty() ||
+        instance.host.empty())
+        return false;
+    if (instance.name.size() + instance.service_type.size() + 2 > 255)
+        return false;
+    for (const auto& subtype : instance.subtypes) {
+        if (subtype.empty() || subtype.size() > 63)
+            return false;
+    }
+    return true;
+}
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+void ServiceRegistry<ThreadSafetyManager>::index(NameIndex& index, std::string_view name, Id id) {
+    auto index_it = index.find(name);
+    if (index_it == index.end())
+        index_it = index.emplace(std::piecewise_construct, std::forward_as_tuple(name), std::forward_as_tuple()).first;
+    index_it->second.insert(id);
+}
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+void ServiceRegistry<ThreadSafetyManager>::unindex(NameIndex& index, std::string_view name, Id id) {
+    auto index_it = index.find(name);
+    if (index_it == index.end())
+        return;
+    index_it->second.erase(id);
+    if (index_it->second.empty())
+        index.erase(index_it);
+}
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+void ServiceRegistry<ThreadSafetyManager>::unindex(Id id) {
+    const RegisteredService& service = *m_services.at(id);
+    unindex(m_by_service, service.instance.service_type, id);
+    for (const auto& subtype : service.subtype_names)
+        unindex(m_by_subtype, subtype, id);
+    unindex(m_by_host, service.instance.host, id);
+    std::array<IpAddress, 2> service_addresses;
+    addresses(service.instance, service_addresses);
+    for (const IpAddress& address : service_addresses) {
+        if (address)
+            unindex_address(address, service.instance.host);
+    }
+}
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+void ServiceRegistry<ThreadSafetyManager>::index_address(const IpAddress& address, std::string_view host) {
+    auto address_it = m_by_address.find(address);
+    if (address_it == m_by_address.end())
+        address_it =
+            m_by_address.emplace(std::piecewise_construct, std::forward_as_tuple(address), std::forward_as_tuple())
+                .first;
+    if (!address_it->second.contains(host))
+        address_it->second.emplace(host);
+}
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+void ServiceRegistry<ThreadSafetyManager>::unindex_address(const IpAddress& address, std::string_view host) {
+    auto address_it = m_by_address.find(address);
+    if (address_it == m_by_address.end())
+        return;
+    // The instance is already gone from the host index, look at the remaining instances of the host
+    auto host_it = m_by_host.find(host);
+    if (host_it != m_by_host.end()) {
+        for (Id id : host_it->second) {
+            std::array<IpAddress, 2> service_addresses;
+            addresses(m_services.at(id)->instance, service_addresses);
+            if (service_addresses[0] == address || service_addresses[1] == address)
+                return;
+        }
+    }
+    auto entry_it = address_it->second.find(host);
+    if (entry_it != address_it->second.end())
+        address_it->second.erase(entry_it);
+    if (address_it->second.empty())
+        m_by_address.erase(address_it);
+}
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+void ServiceRegistry<ThreadSafetyManager>::addresses(const ServiceInstance& instance,
+                                                     std::array<IpAddress, 2>& addresses) {
+    addresses = {};
+    if (instance.ipv4)
+        addresses[0] = IpAddress::ipv4(instance.ipv4);
+    if (instance.ipv6)
+        addresses[1] = IpAddress::ipv6(*instance.ipv6);
+}
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+template<class Name, class Fn>
+size_t ServiceRegistry<ThreadSafetyManager>::visit(const NameIndex& index, const Name& name, Fn& fn) {
+    auto index_it = index.find(name);
+    if (index_it == index.end())
+        return 0;
+    for (Id id : index_it->second)
+        fn(m_services.at(id));
+    return index_it->second.size();
+}
+
+}
@@ -0,0 +1,301 @@
+#pragma once
+
+#include "record_cache.h"
+#include "dns_name.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace mdns
+{
+
+/// Header of a shared record snapshot, followed by the slots
+struct SharedCacheHeader {
+    static constexpr uint32_t MAGIC = 0x6d646e73;
+    static constexpr uint32_t VERSION = 1;
+
+    uint32_t magic;
+    uint32_t version;
+    /// Number of slots, a power of two
+    uint32_t slots;
+    uint32_t slot_size;
+    /// Odd while the writer changes the snapshot
+    std::atomic<uint64_t> sequence;
+    /// Records in the snapshot
+    uint64_t records;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "The sequence is shared between processes");
+
+/// One record of a shared record snapshot
+struct SharedCacheSlot {
+    static constexpr size_t MAX_NAME = 255;
+    /// Larger records are left out of the snapshot
+    static constexpr size_t MAX_RDATA = 720;
+
+    /// name_hash() of name and type, 0 for free slots
+    uint64_t hash;
+    /// Clock ticks, steady_clock is the same in all processes of a host
+    int64_t expires;
+    uint32_t ttl;
+    uint16_t rtype;
+    uint16_t rclass;
+    uint16_t name_length;
+    uint16_t rdata_length;
+    char name[MAX_NAME];
+    uint8_t rdata[MAX_RDATA];
+};
+
+/// A record read from a shared record snapshot, valid until the callback returns
+struct SharedRecord {
+    std::string_view name;
+    uint16_t rtype;
+    uint16_t rclass;
+    uint32_t ttl;
+    std::span<const uint8_t> rdata;
+    Clock::time_point expires;
+};
+
+/// Publishes a read only copy of a RecordCache in POSIX shared memory
+///
+/// The snapshot is a hash table of fixed size slots, keyed by name and type with linear probing,
+/// filled to at most half of its slots. Readers in other processes look records up without any
+/// round trip to the writer, see SharedCacheReader. publish() rewrites the whole table under a
+/// sequence lock: the sequence is odd while it writes, and readers retry if it changed while they
+/// copied a record. Writes are rare (a burst of responses is published once), so readers almost
+/// never retry.
+class SharedCacheWriter
+{
+public:
+    static constexpr uint32_t DEFAULT_SLOTS = 2048;
+
+    SharedCacheWriter() = default;
+    ~SharedCacheWriter() { close(); }
+
+    SharedCacheWriter(const SharedCacheWriter&) = delete;
+    SharedCacheWriter& operator=(const SharedCacheWriter&) = delete;
+
+    /// Create the shared memory object \p name, for example "/mdnscpp-cache", readable by everybody
+    /// \param slots Rounded up to a power of two, at most half of them hold records
+    /// \return False if the object cannot be created or mapped
+    bool open(std::string_view name, uint32_t slots = DEFAULT_SLOTS);
+    /// Unmap and remove the shared memory object
+    void close();
+
+    /// Replace the snapshot with all unexpired records of \p cache
+    /// \return The number of records published. Records beyond the capacity and records too large
+    /// for a slot are left out.
+    template<ThreadSafetyManagerType ThreadSafetyManager>
+    size_t publish(RecordCache<ThreadSafetyManager>& cache, Clock::time_point now);
+
+private:
+    std::string m_name;
+    SharedCacheHeader* m_header{};
+    SharedCacheSlot* m_slots{};
+    size_t m_size{};
+};
+
+/// Reads the snapshot of a SharedCacheWriter, mapped read only
+class SharedCacheReader
+{
+public:
+    /// Longest wait for a writer, publishing takes well under a millisecond. A writer that died
+    /// while publishing leaves the snapshot locked for good.
+    static constexpr auto MAX_WAIT = std::chrono::milliseconds(10);
+
+    SharedCacheReader() = default;
+    ~SharedCacheReader() { close(); }
+
+    SharedCacheReader(const SharedCacheReader&) = delete;
+    SharedCacheReader& operator=(const SharedCacheReader&) = delete;
+
+    /// \return False if the object does not exist or was not written by a compatible writer
+    bool open(std::string_view name);
+    void close();
+    bool is_open() const noexcept { return m_header != nullptr; }
+
+    /// Call \p fn with each unexpired record of the given name and type
+    /// \return The number of records found, 0 if the snapshot stayed locked for MAX_WAIT
+    template<class Fn>
+    size_t find(std::string_view name, uint16_t rtype, Clock::time_point now, Fn&& fn);
+
+private:
+    const SharedCacheHeader* m_header{};
+    const SharedCacheSlot* m_slots{};
+    size_t m_size{};
+    /// Copies of the matching slots, taken under the sequence lock
+    std::vector<SharedCacheSlot> m_found;
+};
+
+/// Implementation ///
+
+inline bool SharedCacheWriter::open(std::string_view name, uint32_t slots) {
+    close();
+    uint32_t count = 1;
+    while (count < slots)
+        count *= 2;
+    m_name = name;
+    // Readers may still map the object of a previous writer. It is replaced rather than resized
+    // under them, they keep reading the old snapshot until they open the name again.
+    shm_unlink(m_name.c_str());
+    const int fd = shm_open(m_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0)
+        return false;
+    m_size = sizeof(SharedCacheHeader) + count * sizeof(SharedCacheSlot);
+    void* memory = MAP_FAILED;
+    if (ftruncate(fd, (off_t)m_size) == 0)
+        memory = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (memory == MAP_FAILED) {
+        shm_unlink(m_name.c_str());
+        m_size = 0;
+        return false;
+    }
+    m_header = new (memory) SharedCacheHeader{};
+    m_slots = (SharedCacheSlot*)(m_header + 1);
+    m_header->magic = SharedCacheHeader::MAGIC;
+    m_header->version = SharedCacheHeader::VERSION;
+    m_header->slots = count;
+    m_header->slot_size = sizeof(SharedCacheSlot);
+    return true;
+}
+
+inline void SharedCacheWriter::close() {
+    if (!m_header)
+        return;
+    munmap(m_header, m_size);
+    shm_unlink(m_name.c_str());
+    m_header = nullptr;
+    m_slots = nullptr;
+}
+
+template<ThreadSafetyManagerType ThreadSafetyManager>
+size_t SharedCacheWriter::publish(RecordCache<ThreadSafetyManager>& cache, Clock::time_point now) {
+    if (!m_header)
+        return 0;
+    const uint32_t slots = m_header->slots;
+    const uint64_t sequence = m_header->sequence.load(std::memory_order_relaxed);
+    m_header->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    for (uint32_t i = 0; i < slots; ++i)
+        m_slots[i].hash = 0;
+    size_t records = 0;
+    cache.for_each(now, [&](const CacheRecord& record) {
+        if (records >= slots / 2 || record.name.size() > SharedCacheSlot::MAX_NAME ||
+            record.rdata.size() > SharedCacheSlot::MAX_RDATA)
+            return;
+        // Free slots are 0, a hash of 0 would end every probe sequence
+        const uint64_t hash = name_hash(record.name, record.rtype) | 1;
+        uint32_t index = (uint32_t)hash & (slots - 1);
+        while (m_slots[index].hash)
+            index = (index + 1) & (slots - 1);
+        SharedCacheSlot& slot = m_slots[index];
+        slot.hash = hash;
+        slot.expires = record.expires.time_since_epoch().count();
+        slot.ttl = record.ttl;
+        slot.rtype = record.rtype;
+        slot.rclass = record.rclass;
+        slot.name_length = (uint16_t)record.name.size();
+        slot.rdata_length = (uint16_t)record.rdata.size();
+        memcpy(slot.name, record.name.data(), record.name.size());
+        memcpy(slot.rdata, record.rdata.data(), record.rdata.size());
+        ++records;
+    });
+    m_header->records = records;
+
+    m_header->sequence.store(sequence + 2, std::memory_order_release);
+    return records;
+}
+
+inline bool SharedCacheReader::open(std::string_view name) {
+    close();
+    const int fd = shm_open(std::string(name).c_str(), O_RDONLY, 0);
+    if (fd < 0)
+        return false;
+    struct stat info {};
+    void* memory = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(SharedCacheHeader))
+        memory = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (memory == MAP_FAILED)
+        return false;
+    m_size = (size_t)info.st_size;
+    m_header = (const SharedCacheHeader*)memory;
+    m_slots = (const SharedCacheSlot*)(m_header + 1);
+    const uint32_t slots = m_header->slots;
+    if (m_header->magic != SharedCacheHeader::MAGIC || m_header->version != SharedCacheHeader::VERSION ||
+        m_header->slot_size != sizeof(SharedCacheSlot) || !slots || (slots & (slots - 1)) ||
+        m_size < sizeof(SharedCacheHeader) + slots * sizeof(SharedCacheSlot)) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+inline void SharedCacheReader::close() {
+    if (!m_header)
+        return;
+    munmap((void*)m_header, m_size);
+    m_header = nullptr;
+    m_slots = nullptr;
+}
+
+template<class Fn>
+size_t SharedCacheReader::find(std::string_view name, uint16_t rtype, Clock::time_point now, Fn&& fn) {
+    if (!m_header)
+        return 0;
+    const uint32_t slots = m_header->slots;
+    const uint64_t hash = name_hash(name, rtype) | 1;
+    auto give_up = Clock::time_point::max();
+    while (true) {
+        const uint64_t sequence = m_header->sequence.load(std::memory_order_acquire);
+        if (!(sequence & 1)) {
+            m_found.clear();
+            uint32_t index = (uint32_t)hash & (slots - 1);
+            // The table is at most half full, so every probe sequence ends at a free slot
+            for (uint32_t probe = 0; probe < slots && m_slots[index].hash; ++probe) {
+                if (m_slots[index].hash == hash)
+                    m_found.push_back(m_slots[index]);
+                index = (index + 1) & (slots - 1);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (m_header->sequence.load(std::memory_order_relaxed) == sequence)
+                break;
+        }
+        // The clock is only read once a writer got in the way
+        const auto current = Clock::now();
+        if (give_up == Clock::time_point::max())
+            give_up = current + MAX_WAIT;
+        else if (current >= give_up)
+            return 0;
+        std::this_thread::yield();
+    }
+
+    size_t found = 0;
+    for (const SharedCacheSlot& slot : m_found) {
+        const std::string_view slot_name(slot.name, std::min<size_t>(slot.name_length, SharedCacheSlot::MAX_NAME));
+        const Clock::time_point expires{Clock::duration(slot.expires)};
+        if (slot.rtype != rtype || expires <= now || !name_equal(slot_name, name))
+            continue;
+        fn(SharedRecord{slot_name, slot.rtype, slot.rclass, slot.ttl,
+                        {slot.rdata, std::min<size_t>(slot.rdata_length, SharedCacheSlot::MAX_RDATA)}, expires});
+        ++found;
+    }
+    return found;
+}
+
+}
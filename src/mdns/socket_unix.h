@@ -1,9 +1,13 @@
 #pragma once
 
+#include "ip_address.h"
+
 #include <netinet/in.h>
 #include <string_view>
 #include <array>
 #include <functional>
+#include <optional>
+#include <vector>
 
 namespace mdns {
 
@@ -36,13 +40,32 @@ public:
     /// Open service sockets on port MDNS_PORT
     ///
     /// When receiving, each socket can receive data from all network interfaces
-    /// Thus we only need to open one socket for each address family
+    /// Thus we only need to open one socket for each address family. The sockets join the mDNS
+    /// group on every interface of interface_addresses() and report the interface of each packet,
+    /// see mdns_socket_recv_interface()
     ///
     /// \param sockets Application controlled memory for sockets
     /// \param max_sockets Maximum number of sockets
     /// \return Return the number of opened sockets
     std::array<SocketDP,2> open_service_sockets(bool IPv4, bool IPv6, uint16_t port = MDNS_PORT);
 
+    /// First non-loopback addresses found by the last call to one of the open functions
+    /// \return The IPv4 address in network byte order
+    std::optional<uint32_t> ipv4_address() const;
+    std::optional<std::array<uint8_t, 16>> ipv6_address() const;
+
+    /// A non-loopback address of a local interface
+    struct InterfaceAddress {
+        IpAddress address;
+        /// Index of the interface, see if_nametoindex()
+        unsigned interface;
+    };
+    /// All non-loopback interface addresses found by the last call to one of the open functions
+    const std::vector<InterfaceAddress>& interface_addresses() const { return m_interface_addresses; }
+
+    /// Close a socket opened by one of the open functions
+    void close(SocketDP socketDp);
+
     int write();
 
     int readBlock();
@@ -54,6 +77,7 @@ private:
     bool has_ipv4{};
     uint32_t service_address_ipv4{};
     uint8_t service_address_ipv6[16]{};
+    std::vector<InterfaceAddress> m_interface_addresses;
 };
 
 }
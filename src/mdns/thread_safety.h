@@ -1,19 +1,33 @@
 #pragma once
 
 #include <mutex>
+#include <shared_mutex>
 
 namespace mdns
 {
 
+// A thread safety manager hands out two kinds of scopes: scopeLock() for code that modifies the
+// protected state and sharedLock() for code that only reads it. Shared scopes may run concurrently
+// with each other, never with an exclusive scope.
+
 class SingleThreadSafe
 {
 public:
-    class Locker {};
+    class Locker
+    {
+    public:
+        // User provided, so scopes held only for their lifetime do not warn as unused variables
+        ~Locker() {}
+    };
     [[nodiscard]] Locker scopeLock() noexcept {
         return {};
     }
+    [[nodiscard]] Locker sharedLock() noexcept {
+        return {};
+    }
 };
 
+/// All scopes are exclusive
 class MultiThreadSafe
 {
     std::mutex mutex;
@@ -21,6 +35,22 @@ public:
     [[nodiscard]] std::scoped_lock<std::mutex> scopeLock() noexcept {
         return std::scoped_lock<std::mutex>(mutex);
     }
+    [[nodiscard]] std::scoped_lock<std::mutex> sharedLock() noexcept {
+        return std::scoped_lock<std::mutex>(mutex);
+    }
+};
+
+/// Readers share a std::shared_mutex, for read mostly state like the service registry of a responder
+class SharedMutexThreadSafe
+{
+    std::shared_mutex mutex;
+public:
+    [[nodiscard]] std::unique_lock<std::shared_mutex> scopeLock() noexcept {
+        return std::unique_lock<std::shared_mutex>(mutex);
+    }
+    [[nodiscard]] std::shared_lock<std::shared_mutex> sharedLock() noexcept {
+        return std::shared_lock<std::shared_mutex>(mutex);
+    }
 };
 
 }
@@ -0,0 +1,332 @@
+#pragma once
+
+#include "fixed_name.h"
+#include "mdns_old.h"
+#include "network_tools.h"
+#include "queue.h"
+#include "txt.h"
+#include "wire_name.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <string_view>
+
+#include <netinet/in.h>
+
+namespace mdns
+{
+
+// A trace policy is the fourth template argument of Mdns. Mdns calls its hooks at every step of
+// discover(), query() and service_mdns(): sockets opened and closed, questions sent, datagrams
+// received and parsed, records delivered and matched, services published and renamed. NullTrace
+// ignores them, PrintTrace prints them with printf and RingTrace records them in memory.
+
+/// The operation that opened sockets or sent a question
+enum class TraceOperation : uint8_t { Discover, Query, Service };
+
+enum class TraceEvent : uint8_t {
+    /// Sockets of an operation opened, value is their number, 0 if none could be opened
+    Opened,
+    /// No packet buffer was free for an operation
+    NoBuffer,
+    /// A question was sent on a socket, value is 0 or the errno of the failed send
+    Sent,
+    /// A datagram was received, value is its size
+    Received,
+    /// A datagram was parsed, value is the number of records in it
+    Parsed,
+    /// A record was received, value is its TTL. Copies dropped by the DuplicateFilter are not traced.
+    Record,
+    /// A record answered the question of a query
+    Matched,
+    /// A service was published, value is its port or 0 if the instance was invalid
+    Published,
+    /// A published service was renamed after a name conflict
+    Conflict,
+    /// Sockets of an operation closed, value is their number
+    Closed,
+};
+
+/// Ignores all events, every hook compiles to nothing
+struct NullTrace {
+    static constexpr bool ENABLED = false;
+
+    void opened(TraceOperation, int) noexcept {}
+    void no_buffer(TraceOperation) noexcept {}
+    void sent(TraceOperation, int, std::string_view, uint16_t, int) noexcept {}
+    void received(int, unsigned, const sockaddr*, size_t, size_t) noexcept {}
+    void parsed(int, size_t) noexcept {}
+    void record(int, const sockaddr*, size_t, mdns_entry_type_t, uint16_t, uint16_t, uint32_t, const void*, size_t,
+                size_t, size_t, size_t) noexcept {}
+    void matched(int, uint16_t) noexcept {}
+    void published(std::string_view, std::string_view, uint16_t, bool) noexcept {}
+    void conflict(std::string_view, std::string_view) noexcept {}
+    void closed(TraceOperation, int) noexcept {}
+};
+
+/// Prints sockets, sends, records and services to stdout, decoding the data of PTR, SRV, A, AAAA and
+/// TXT records. Datagrams and matches are not printed.
+struct PrintTrace {
+    static constexpr bool ENABLED = true;
+
+    void opened(TraceOperation operation, int sockets) noexcept;
+    void no_buffer(TraceOperation) noexcept { printf("No free buffer\n"); }
+    void sent(TraceOperation operation, int sock, std::string_view name, uint16_t rtype, int error) noexcept;
+    void received(int, unsigned, const sockaddr*, size_t, size_t) noexcept {}
+    void parsed(int, size_t) noexcept {}
+    void record(int sock, const sockaddr* from, size_t addrlen, mdns_entry_type_t entry, uint16_t rtype,
+                uint16_t rclass, uint32_t ttl, const void* data, size_t size, size_t name_offset, size_t record_offset,
+                size_t record_length) noexcept;
+    void matched(int, uint16_t) noexcept {}
+    void published(std::string_view name, std::string_view service, uint16_t port, bool valid) noexcept;
+    void conflict(std::string_view name, std::string_view host) noexcept {
+        printf("Name conflict, renamed to %.*s on host %.*s\n", (int)name.size(), name.data(), (int)host.size(),
+               host.data());
+    }
+    void closed(TraceOperation, int sockets) noexcept { printf("Closed socket%s\n", sockets > 1 ? "s" : ""); }
+};
+
+/// One event recorded by a RingTrace
+struct TraceEntry {
+    /// std::chrono::steady_clock ticks, comparable with Clock of the record cache
+    int64_t time;
+    /// name_fingerprint() of the record or question name, 0 for events without a name
+    uint64_t name;
+    int32_t socket;
+    /// Meaning depends on the event, see TraceEvent
+    uint32_t value;
+    unsigned interface;
+    uint16_t rtype;
+    TraceEvent event;
+    /// TraceOperation, or mdns_entry_type_t for records
+    uint8_t detail;
+};
+
+/// Records the last \p Entries events in a ring buffer for post-mortem dumps
+///
+/// Events are stored as fixed size binary entries: recording one takes a clock read, an atomic
+/// increment and a 40 byte store, nothing is formatted and nothing is allocated. Records and
+/// matches, the bulk of the events, skip the clock read: they carry the time of the last event on
+/// their thread, the datagram they were parsed from. Names are kept as their name_fingerprint(),
+/// compare them with name_fingerprint("host.local."). Threads record concurrently. dump() and
+/// for_each() can run while events are recorded, entries being overwritten at that moment are
+/// skipped.
+template<size_t Entries = 1024>
+class RingTrace
+{
+    static_assert((Entries & (Entries - 1)) == 0, "Entries must be a power of two");
+
+public:
+    static constexpr bool ENABLED = true;
+
+    void opened(TraceOperation operation, int sockets) noexcept {
+        push(now(), TraceEvent::Opened, (uint8_t)operation, -1, 0, 0, (uint32_t)std::max(sockets, 0), 0);
+    }
+    void no_buffer(TraceOperation operation) noexcept {
+        push(now(), TraceEvent::NoBuffer, (uint8_t)operation, -1, 0, 0, 0, 0);
+    }
+    void sent(TraceOperation operation, int sock, std::string_view name, uint16_t rtype, int error) noexcept {
+        push(now(), TraceEvent::Sent, (uint8_t)operation, sock, 0, rtype, (uint32_t)error, name_fingerprint(name));
+    }
+    void received(int sock, unsigned interface, const sockaddr*, size_t, size_t size) noexcept {
+        push(now(), TraceEvent::Received, 0, sock, interface, 0, (uint32_t)size, 0);
+    }
+    void parsed(int sock, size_t records) noexcept {
+        push(now(), TraceEvent::Parsed, 0, sock, 0, 0, (uint32_t)records, 0);
+    }
+    void record(int sock, const sockaddr*, size_t, mdns_entry_type_t entry, uint16_t rtype, uint16_t, uint32_t ttl,
+                const void* data, size_t size, size_t name_offset, size_t, size_t) noexcept {
+        push(datagram_time(), TraceEvent::Record, (uint8_t)entry, sock, 0, rtype, ttl,
+             WireName(data, size, name_offset).fingerprint());
+    }
+    void matched(int sock, uint16_t rtype) noexcept {
+        push(datagram_time(), TraceEvent::Matched, 0, sock, 0, rtype, 0, 0);
+    }
+    void published(std::string_view name, std::string_view, uint16_t port, bool valid) noexcept {
+        push(now(), TraceEvent::Published, (uint8_t)TraceOperation::Service, -1, 0, 0, valid ? port : 0,
+             name_fingerprint(name));
+    }
+    void conflict(std::string_view name, std::string_view) noexcept {
+        push(now(), TraceEvent::Conflict, (uint8_t)TraceOperation::Service, -1, 0, 0, 0, name_fingerprint(name));
+    }
+    void closed(TraceOperation operation, int sockets) noexcept {
+        push(now(), TraceEvent::Closed, (uint8_t)operation, -1, 0, 0, (uint32_t)std::max(sockets, 0), 0);
+    }
+
+    /// Number of events recorded so far, including the ones overwritten
+    uint64_t recorded() const noexcept { return m_next.load(std::memory_order_relaxed); }
+
+    /// Call \p fn with each entry still in the buffer, oldest first
+    /// \return The number of entries passed to \p fn
+    template<class Fn>
+    size_t for_each(Fn&& fn) const;
+
+    /// Print the entries still in the buffer, one per line, with times relative to the oldest one
+    void dump(FILE* file) const;
+
+private:
+    struct Slot {
+        /// Position of the entry in the trace plus one, 0 while it is written
+        std::atomic<uint64_t> sequence;
+        TraceEntry entry;
+    };
+
+    /// Read the clock, and remember the time for the records of the datagram being parsed
+    static int64_t now() noexcept {
+        return t_time = std::chrono::steady_clock::now().time_since_epoch().count();
+    }
+    static int64_t datagram_time() noexcept { return t_time ? t_time : now(); }
+
+    void push(int64_t time, TraceEvent event, uint8_t detail, int sock, unsigned interface, uint16_t rtype,
+              uint32_t value, uint64_t name) noexcept;
+
+    std::array<Slot, Entries> m_slots{};
+    alignas(detail::CACHE_LINE) std::atomic<uint64_t> m_next{};
+    /// Time of the last event on this thread
+    static inline thread_local int64_t t_time{};
+};
+
+/// Name of \p event for dumps, for example "received"
+const char* trace_event_name(TraceEvent event) noexcept;
+
+/// Implementation ///
+
+inline const char* trace_event_name(TraceEvent event) noexcept {
+    static constexpr const char* names[] = {"opened", "no-buffer", "sent",      "received", "parsed",
+                                            "record", "matched",   "published", "conflict", "closed"};
+    return (size_t)event < std::size(names) ? names[(size_t)event] : "unknown";
+}
+
+inline void PrintTrace::opened(TraceOperation operation, int sockets) noexcept {
+    if (sockets <= 0) {
+        printf("Failed to open any %s sockets\n", operation == TraceOperation::Service ? "service" : "client");
+        return;
+    }
+    static constexpr const char* operations[] = {"DNS-SD", "mDNS query", "mDNS service"};
+    printf("Opened %d socket%s for %s\n", sockets, sockets > 1 ? "s" : "", operations[(size_t)operation]);
+}
+
+inline void PrintTrace::sent(TraceOperation operation, int sock, std::string_view name, uint16_t rtype,
+                             int error) noexcept {
+    const char* what = operation == TraceOperation::Discover ? "DNS-SD discovery" : "mDNS query";
+    if (error)
+        printf("Failed to send %s on socket %d: %s\n", what, sock, strerror(error));
+    else
+        printf("Sent %s on socket %d: %.*s type %u\n", what, sock, (int)name.size(), name.data(), rtype);
+}
+
+inline void PrintTrace::record(int, const sockaddr* from, size_t addrlen, mdns_entry_type_t entry, uint16_t rtype,
+                               uint16_t rclass, uint32_t ttl, const void* data, size_t size, size_t name_offset,
+                               size_t record_offset, size_t record_length) noexcept {
+    char from_buffer[64];
+    char addr_buffer[64];
+    std::string_view from_addr = ip_address_to_string(from_buffer, sizeof(from_buffer), from, addrlen);
+    FixedName entry_name = FixedName::extract(data, size, &name_offset);
+    const char* entry_type = (entry == MDNS_ENTRYTYPE_ANSWER)      ? "answer"
+                             : (entry == MDNS_ENTRYTYPE_AUTHORITY) ? "authority"
+                                                                   : "additional";
+
+    if (rtype == MDNS_RECORDTYPE_PTR) {
+        FixedName name = parse_ptr(data, size, record_offset, record_length);
+        printf("%.*s : %s %s PTR %s rclass 0x%x ttl %u length %d\n", (int)from_addr.size(), from_addr.data(),
+               entry_type, entry_name.c_str(), name.c_str(), rclass, ttl, (int)record_length);
+    } else if (rtype == MDNS_RECORDTYPE_SRV) {
+        SrvRecord srv = parse_srv(data, size, record_offset, record_length);
+        printf("%.*s : %s %s SRV %s priority %d weight %d port %d\n", (int)from_addr.size(), from_addr.data(),
+               entry_type, entry_name.c_str(), srv.target.c_str(), srv.priority, srv.weight, srv.port);
+    } else if (rtype == MDNS_RECORDTYPE_A) {
+        sockaddr_in addr{};
+        mdns_record_parse_a(data, size, record_offset, record_length, &addr);
+        std::string_view addr_str = ip_address_to_string(addr_buffer, sizeof(addr_buffer), (sockaddr*)&addr,
+                                                         sizeof(addr));
+        printf("%.*s : %s %s A %.*s\n", (int)from_addr.size(), from_addr.data(), entry_type, entry_name.c_str(),
+               (int)addr_str.size(), addr_str.data());
+    } else if (rtype == MDNS_RECORDTYPE_AAAA) {
+        sockaddr_in6 addr{};
+        mdns_record_parse_aaaa(data, size, record_offset, record_length, &addr);
+        std::string_view addr_str = ip_address_to_string(addr_buffer, sizeof(addr_buffer), (sockaddr*)&addr,
+                                                         sizeof(addr));
+        printf("%.*s : %s %s AAAA %.*s\n", (int)from_addr.size(), from_addr.data(), entry_type, entry_name.c_str(),
+               (int)addr_str.size(), addr_str.data());
+    } else if (rtype == MDNS_RECORDTYPE_TXT) {
+        const size_t end = std::min(size, record_offset + record_length);
+        for (const TxtEntry& txt : TxtView((const uint8_t*)data + record_offset, end - std::min(end, record_offset))) {
+            printf("%.*s : %s %s TXT %.*s = %.*s\n", (int)from_addr.size(), from_addr.data(), entry_type,
+                   entry_name.c_str(), (int)txt.key.size(), txt.key.data(), (int)txt.value.size(), txt.value.data());
+        }
+    } else {
+        printf("%.*s : %s %.*s type %u rclass 0x%x ttl %u length %d\n", (int)from_addr.size(), from_addr.data(),
+               entry_type, (int)entry_name.size(), entry_name.data(), rtype, rclass, ttl, (int)record_length);
+    }
+}
+
+inline void PrintTrace::published(std::string_view name, std::string_view service, uint16_t port,
+                                  bool valid) noexcept {
+    if (!valid) {
+        printf("Invalid service %.*s\n", (int)service.size(), service.data());
+        return;
+    }
+    printf("Service mDNS: %.*s:%u\n", (int)service.size(), service.data(), port);
+    printf("Hostname: %.*s\n", (int)name.size(), name.data());
+}
+
+template<size_t Entries>
+void RingTrace<Entries>::push(int64_t time, TraceEvent event, uint8_t detail, int sock, unsigned interface,
+                              uint16_t rtype, uint32_t value, uint64_t name) noexcept {
+    const uint64_t sequence = m_next.fetch_add(1, std::memory_order_relaxed);
+    Slot& slot = m_slots[sequence & (Entries - 1)];
+    slot.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.entry = TraceEntry{time, name, sock, value, interface, rtype, event, detail};
+    slot.sequence.store(sequence + 1, std::memory_order_release);
+}
+
+template<size_t Entries>
+template<class Fn>
+size_t RingTrace<Entries>::for_each(Fn&& fn) const {
+    const uint64_t end = m_next.load(std::memory_order_acquire);
+    size_t count = 0;
+    for (uint64_t sequence = end > Entries ? end - Entries : 0; sequence < end; ++sequence) {
+        const Slot& slot = m_slots[sequence & (Entries - 1)];
+        if (slot.sequence.load(std::memory_order_acquire) != sequence + 1)
+            continue;
+        const TraceEntry entry = slot.entry;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.sequence.load(std::memory_order_relaxed) != sequence + 1)
+            continue;
+        fn(entry);
+        ++count;
+    }
+    return count;
+}
+
+template<size_t Entries>
+void RingTrace<Entries>::dump(FILE* file) const {
+    static constexpr const char* operations[] = {"discover", "query", "service"};
+    static constexpr const char* entries[] = {"question", "answer", "authority", "additional"};
+    int64_t first = 0;
+    for_each([&](const TraceEntry& entry) {
+        if (!first)
+            first = entry.time;
+        const std::chrono::steady_clock::duration elapsed(entry.time - first);
+        const double seconds = std::chrono::duration<double>(elapsed).count();
+        const char* detail = "";
+        if (entry.event == TraceEvent::Record)
+            detail = entry.detail < std::size(entries) ? entries[entry.detail] : "";
+        else if (entry.event != TraceEvent::Received && entry.event != TraceEvent::Parsed &&
+                 entry.event != TraceEvent::Matched)
+            detail = entry.detail < std::size(operations) ? operations[entry.detail] : "";
+        fprintf(file, "%10.6f %-9s %-10s socket %d interface %u type %u value %u name %016llx\n", seconds,
+                trace_event_name(entry.event), detail, entry.socket, entry.interface, entry.rtype, entry.value,
+                (unsigned long long)entry.name);
+    });
+}
+
+}
@@ -0,0 +1,252 @@
+#pragma once
+
+#include "dns_name.h"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory_resource>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <vector>
+
+namespace mdns
+{
+
+/// One key of a TXT record (RFC 6763 6.4): "key=value", or "key" for a boolean attribute without a value
+struct TxtEntry {
+    std::string_view key;
+    /// May contain any bytes, empty for "key=" and for attributes without a value
+    std::string_view value;
+    bool has_value{};
+};
+
+/// Encodes key/value pairs into TXT record data, a sequence of length prefixed strings
+///
+/// Each pair is encoded when it is added, data() is the finished record data and can be assigned to
+/// ServiceInstance::txt as often as needed. There is no limit on the number of pairs other than the
+/// 65535 bytes of a record.
+class TxtBuilder
+{
+public:
+    explicit TxtBuilder(std::pmr::memory_resource* resource = std::pmr::get_default_resource()) : m_data(resource) {}
+
+    /// Add "key=value"
+    /// \return False if the key is invalid or already added, or the pair is longer than 255 bytes
+    bool add(std::string_view key, std::string_view value) { return append(key, value, true); }
+    /// Add a boolean attribute "key" without a value
+    bool add(std::string_view key) { return append(key, {}, false); }
+
+    /// Encoded TXT record data, empty if nothing was added
+    const std::pmr::vector<uint8_t>& data() const noexcept { return m_data; }
+    void clear() noexcept { m_data.clear(); }
+
+    /// Keys are at least one printable US-ASCII character other than '=' (RFC 6763 6.4)
+    static bool valid_key(std::string_view key) noexcept;
+
+private:
+    bool append(std::string_view key, std::string_view value, bool has_value);
+
+    std::pmr::vector<uint8_t> m_data;
+};
+
+/// Read only view of TXT record data with constant time key lookup
+///
+/// The view does not copy the record data, which must outlive it. Constructing a view walks the
+/// record once and indexes the first MAX_INDEXED keys in a fixed size hash table inside the view,
+/// find() then compares a single key in the common case. Keys are case insensitive, only the first
+/// occurrence of a key counts and strings with an invalid key are skipped (RFC 6763 6.4). Iteration
+/// returns all valid strings in record order.
+class TxtView
+{
+public:
+    static constexpr size_t MAX_INDEXED = 64;
+
+    class Iterator
+    {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = TxtEntry;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const TxtEntry*;
+        using reference = TxtEntry;
+
+        Iterator() = default;
+
+        TxtEntry operator*() const noexcept { return m_entry; }
+        Iterator& operator++() noexcept {
+            next();
+            return *this;
+        }
+        Iterator operator++(int) noexcept {
+            Iterator previous = *this;
+            next();
+            return previous;
+        }
+        friend bool operator==(const Iterator& lhs, const Iterator& rhs) noexcept {
+            return lhs.m_data == rhs.m_data && lhs.m_offset == rhs.m_offset;
+        }
+        friend bool operator==(const Iterator& it, std::default_sentinel_t) noexcept { return it.m_data == nullptr; }
+
+    private:
+        friend class TxtView;
+
+        Iterator(const uint8_t* data, size_t size) noexcept : m_data(data), m_size(size) { next(); }
+
+        void next() noexcept;
+
+        const uint8_t* m_data{};
+        size_t m_size{};
+        /// Offset of the next string
+        size_t m_offset{};
+        TxtEntry m_entry;
+    };
+
+    TxtView() = default;
+    TxtView(const void* data, size_t size) noexcept;
+    explicit TxtView(std::span<const uint8_t> data) noexcept : TxtView(data.data(), data.size()) {}
+
+    Iterator begin() const noexcept { return Iterator(m_data, m_size); }
+    std::default_sentinel_t end() const noexcept { return {}; }
+
+    /// Number of distinct keys
+    size_t size() const noexcept { return m_keys; }
+    bool empty() const noexcept { return !m_keys; }
+
+    std::optional<TxtEntry> find(std::string_view key) const noexcept;
+    bool contains(std::string_view key) const noexcept { return find(key).has_value(); }
+    /// Value of \p key, \p fallback if the key is missing or has no value
+    std::string_view value(std::string_view key, std::string_view fallback = {}) const noexcept;
+
+private:
+    static constexpr size_t INDEX_SIZE = 2 * MAX_INDEXED;
+
+    /// Entry of the string at \p offset, the key is empty if it is invalid
+    static TxtEntry entry(const uint8_t* data, size_t size, size_t offset) noexcept;
+    static size_t key_hash(std::string_view key) noexcept { return (size_t)name_fingerprint(key); }
+
+    const uint8_t* m_data{};
+    size_t m_size{};
+    size_t m_keys{};
+    /// Offset of the first string that is not indexed, m_size if all are
+    size_t m_unindexed{};
+    /// Offset + 1 of the string of each indexed key, 0 for free slots
+    std::array<uint16_t, INDEX_SIZE> m_index{};
+};
+
+/// Implementation ///
+
+inline bool TxtBuilder::valid_key(std::string_view key) noexcept {
+    if (key.empty())
+        return false;
+    for (char c : key) {
+        if (c < 0x20 || c > 0x7E || c == '=')
+            return false;
+    }
+    return true;
+}
+
+inline bool TxtBuilder::append(std::string_view key, std::string_view value, bool has_value) {
+    const size_t length = key.size() + (has_value ? 1 + value.size() : 0);
+    if (!valid_key(key) || length > 255 || m_data.size() + 1 + length > 0xFFFF)
+        return false;
+    if (TxtView(m_data.data(), m_data.size()).contains(key))
+        return false;
+    m_data.push_back((uint8_t)length);
+    m_data.insert(m_data.end(), key.begin(), key.end());
+    if (has_value) {
+        m_data.push_back('=');
+        m_data.insert(m_data.end(), value.begin(), value.end());
+    }
+    return true;
+}
+
+inline void TxtView::Iterator::next() noexcept {
+    while (m_data && m_offset < m_size) {
+        const size_t offset = m_offset;
+        m_offset += 1 + m_data[offset];
+        m_entry = TxtView::entry(m_data, m_size, offset);
+        if (!m_entry.key.empty())
+            return;
+    }
+    m_data = nullptr;
+    m_offset = 0;
+}
+
+inline TxtView::TxtView(const void* data, size_t size) noexcept
+    : m_data((const uint8_t*)data), m_size(std::min<size_t>(size, 0xFFFF)), m_unindexed(m_size) {
+    for (size_t offset = 0; offset < m_size; offset += 1 + m_data[offset]) {
+        const TxtEntry found = entry(m_data, m_size, offset);
+        if (found.key.empty())
+            continue;
+        if (m_keys == MAX_INDEXED) {
+            m_unindexed = offset;
+            // Count the remaining keys, a key counts once
+            for (; offset < m_size; offset += 1 + m_data[offset]) {
+                const TxtEntry rest = entry(m_data, m_size, offset);
+                if (!rest.key.empty() && find(rest.key)->key.data() == rest.key.data())
+                    ++m_keys;
+            }
+            return;
+        }
+        size_t slot = key_hash(found.key) & (INDEX_SIZE - 1);
+        bool duplicate = false;
+        for (; m_index[slot]; slot = (slot + 1) & (INDEX_SIZE - 1)) {
+            if (name_equal(entry(m_data, m_size, m_index[slot] - 1u).key, found.key)) {
+                duplicate = true;
+                break;
+            }
+        }
+        if (duplicate)
+            continue;
+        m_index[slot] = (uint16_t)(offset + 1);
+        ++m_keys;
+    }
+}
+
+inline TxtEntry TxtView::entry(const uint8_t* data, size_t size, size_t offset) noexcept {
+    const size_t length = std::min<size_t>(data[offset], size - offset - 1);
+    const std::string_view text((const char*)data + offset + 1, length);
+    // Strings without a valid key are ignored (RFC 6763 6.4)
+    const size_t separator = text.find('=');
+    const std::string_view key = text.substr(0, separator);
+    if (!TxtBuilder::valid_key(key))
+        return {};
+    if (separator == std::string_view::npos)
+        return {key, {}, false};
+    return {key, text.substr(separator + 1), true};
+}
+
+inline std::optional<TxtEntry> TxtView::find(std::string_view key) const noexcept {
+    if (!m_keys)
+        return std::nullopt;
+    for (size_t slot = key_hash(key) & (INDEX_SIZE - 1); m_index[slot]; slot = (slot + 1) & (INDEX_SIZE - 1)) {
+        // Indexed strings have a valid key, compare it in place before splitting the string
+        const size_t offset = m_index[slot] - 1u;
+        const size_t length = std::min<size_t>(m_data[offset], m_size - offset - 1);
+        const char* text = (const char*)m_data + offset + 1;
+        if (length < key.size() || (length > key.size() && text[key.size()] != '=') ||
+            !name_equal({text, key.size()}, key))
+            continue;
+        if (length == key.size())
+            return TxtEntry{{text, length}, {}, false};
+        return TxtEntry{{text, key.size()}, {text + key.size() + 1, length - key.size() - 1}, true};
+    }
+    // Records with more keys than the index holds are searched linearly from the first one left out
+    for (size_t offset = m_unindexed; offset < m_size; offset += 1 + m_data[offset]) {
+        const TxtEntry found = entry(m_data, m_size, offset);
+        if (!found.key.empty() && name_equal(found.key, key))
+            return found;
+    }
+    return std::nullopt;
+}
+
+inline std::string_view TxtView::value(std::string_view key, std::string_view fallback) const noexcept {
+    const auto found = find(key);
+    return found && found->has_value ? found->value : fallback;
+}
+
+}
@@ -0,0 +1,276 @@
+#pragma once
+
+#include "dns_name.h"
+#include "fixed_name.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <string_view>
+
+namespace mdns
+{
+
+/// A possibly compressed name inside a received packet, decoded lazily
+///
+/// A WireName only references the packet, it is valid as long as the packet data is. Comparing,
+/// hashing, suffix tests and label iteration walk the compression chain directly, the name is
+/// decoded into text only by decompress(). Most questions and records a responder or browser
+/// receives are for names it does not care about, those are rejected without building a string.
+///
+/// Comparisons are case insensitive and use the dotted form of FixedName ("host.local."), hash()
+/// returns the same value as FixedName::hash() and name_hash(). Malformed names (reference loops,
+/// labels beyond the packet, more than 255 bytes) are empty, not valid() and equal to nothing.
+class WireName
+{
+public:
+    /// Iterates the labels of the name without the terminating root label
+    class Iterator
+    {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::string_view;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const std::string_view*;
+        using reference = std::string_view;
+
+        Iterator() = default;
+
+        std::string_view operator*() const noexcept { return m_label; }
+        Iterator& operator++() noexcept {
+            next(m_offset + m_label.size());
+            return *this;
+        }
+        Iterator operator++(int) noexcept {
+            Iterator previous = *this;
+            ++*this;
+            return previous;
+        }
+        friend bool operator==(const Iterator& lhs, const Iterator& rhs) noexcept {
+            return lhs.m_data == rhs.m_data && (lhs.m_data == nullptr || lhs.m_offset == rhs.m_offset);
+        }
+        friend bool operator==(const Iterator& it, std::default_sentinel_t) noexcept { return it.m_data == nullptr; }
+
+        /// True if the iteration ended at the root label, false while iterating or after an error
+        bool complete() const noexcept { return m_complete; }
+
+    private:
+        friend class WireName;
+
+        Iterator(const uint8_t* data, size_t size, size_t offset) noexcept : m_data(data), m_size(size) {
+            next(offset);
+        }
+
+        void next(size_t offset) noexcept;
+        void fail() noexcept { m_data = nullptr; }
+
+        const uint8_t* m_data{};
+        size_t m_size{};
+        /// Offset of the first byte after the length of the current label
+        size_t m_offset{};
+        std::string_view m_label;
+        /// Bytes of the dotted form so far, bounds the walk for malformed packets
+        size_t m_length{};
+        unsigned m_jumps{};
+        bool m_complete{};
+    };
+
+    WireName() = default;
+    /// \param offset Offset of the name in \p buffer
+    WireName(const void* buffer, size_t size, size_t offset) noexcept
+        : m_data((const uint8_t*)buffer), m_size(size), m_offset(offset) {}
+
+    Iterator begin() const noexcept { return m_data ? Iterator(m_data, m_size, m_offset) : Iterator(); }
+    std::default_sentinel_t end() const noexcept { return {}; }
+
+    /// True if the name can be decoded
+    bool valid() const noexcept;
+    /// Length of the dotted form, 0 for malformed names
+    size_t length() const noexcept;
+    size_t labels() const noexcept;
+
+    /// Same value as name_fingerprint() of the dotted form
+    uint64_t fingerprint() const noexcept;
+    /// Same value as name_hash() of the dotted form
+    size_t hash(uint16_t rtype = 0) const noexcept { return name_hash(fingerprint(), rtype); }
+
+    /// True if the name is \p domain or a name below it, see name_in_domain()
+    /// \param domain Dotted form with a trailing dot
+    bool in_domain(std::string_view domain) const noexcept;
+
+    /// Decode the name into text, empty for malformed names
+    FixedName decompress() const noexcept;
+
+    /// Offset of the first byte after the name in the packet, MDNS_INVALID_POS for malformed names
+    size_t next_offset() const noexcept;
+
+    friend bool operator==(const WireName& lhs, std::string_view rhs) noexcept { return lhs.equal_suffix(rhs, 0); }
+    friend bool operator==(const WireName& lhs, const FixedName& rhs) noexcept { return lhs == rhs.view(); }
+    friend bool operator==(const WireName& lhs, const WireName& rhs) noexcept;
+
+private:
+    /// Compare the labels starting at the \p skip th label with \p text
+    bool equal_suffix(std::string_view text, size_t skip) const noexcept;
+
+    const uint8_t* m_data{};
+    size_t m_size{};
+    size_t m_offset{};
+};
+
+/// Implementation ///
+
+namespace detail
+{
+
+inline bool label_equal(std::string_view label, std::string_view text, size_t offset) noexcept {
+    return offset + label.size() < text.size() && text[offset + label.size()] == '.' &&
+           name_equal(label, text.substr(offset, label.size()));
+}
+
+}
+
+inline void WireName::Iterator::next(size_t offset) noexcept {
+    // Labels plus the dots of the dotted form are at most 255 bytes (RFC 1035 2.3.4). A reference
+    // does not add to the length, the number of references is bounded separately.
+    constexpr unsigned max_jumps = 128;
+    while (true) {
+        if (offset >= m_size)
+            return fail();
+        const uint8_t length = m_data[offset];
+        if ((length & 0xC0) == 0xC0) {
+            if (offset + 2 > m_size || ++m_jumps > max_jumps)
+                return fail();
+            offset = ((size_t)(length & 0x3F) << 8) | m_data[offset + 1];
+            continue;
+        }
+        if (length & 0xC0)
+            return fail();
+        if (!length) {
+            m_complete = true;
+            return fail();
+        }
+        if (offset + 1 + length > m_size || (m_length += length + 1) > FixedName::CAPACITY)
+            return fail();
+        m_offset = offset + 1;
+        m_label = {(const char*)m_data + m_offset, length};
+        return;
+    }
+}
+
+inline bool WireName::valid() const noexcept {
+    if (!m_data)
+        return false;
+    Iterator it = begin();
+    while (it != end())
+        ++it;
+    return it.complete();
+}
+
+inline size_t WireName::length() const noexcept {
+    if (!m_data)
+        return 0;
+    size_t length = 0;
+    Iterator it = begin();
+    for (; it != end(); ++it)
+        length += (*it).size() + 1;
+    return it.complete() ? length : 0;
+}
+
+inline size_t WireName::labels() const noexcept {
+    size_t count = 0;
+    for (auto it = begin(); it != end(); ++it)
+        ++count;
+    return count;
+}
+
+inline uint64_t WireName::fingerprint() const noexcept {
+    uint64_t hash = name_fingerprint({});
+    if (!m_data)
+        return hash;
+    Iterator it = begin();
+    for (; it != end(); ++it) {
+        for (char c : *it) {
+            if (c >= 'A' && c <= 'Z')
+                c = (char)(c | 0x20);
+            hash = (hash ^ (uint8_t)c) * 0x100000001b3ULL;
+        }
+        hash = (hash ^ (uint8_t)'.') * 0x100000001b3ULL;
+    }
+    return it.complete() ? hash : name_fingerprint({});
+}
+
+inline bool WireName::in_domain(std::string_view domain) const noexcept {
+    // Count the labels of both names to know where the domain starts
+    size_t domain_labels = 0;
+    for (char c : domain)
+        domain_labels += c == '.';
+    const size_t name_labels = labels();
+    if (domain_labels > name_labels)
+        return false;
+    return equal_suffix(domain, name_labels - domain_labels);
+}
+
+inline FixedName WireName::decompress() const noexcept {
+    // The iterator stops at CAPACITY bytes and after a bounded number of references
+    char text[FixedName::CAPACITY];
+    size_t length = 0;
+    Iterator it = begin();
+    for (; it != end(); ++it) {
+        memcpy(text + length, (*it).data(), (*it).size());
+        length += (*it).size();
+        text[length++] = '.';
+    }
+    return it.complete() ? FixedName(std::string_view(text, length)) : FixedName();
+}
+
+inline size_t WireName::next_offset() const noexcept {
+    if (!valid())
+        return MDNS_INVALID_POS;
+    // The name ends at the first reference or at the root label, whichever comes first
+    size_t offset = m_offset;
+    while (m_data[offset] && (m_data[offset] & 0xC0) != 0xC0)
+        offset += 1 + m_data[offset];
+    return offset + (m_data[offset] ? 2 : 1);
+}
+
+inline bool WireName::equal_suffix(std::string_view text, size_t skip) const noexcept {
+    if (!m_data)
+        return false;
+    size_t position = 0;
+    Iterator it = begin();
+    for (; it != end(); ++it) {
+        if (skip) {
+            --skip;
+            continue;
+        }
+        if (!detail::label_equal(*it, text, position))
+            return false;
+        position += (*it).size() + 1;
+    }
+    return it.complete() && !skip && position == text.size();
+}
+
+inline bool operator==(const WireName& lhs, const WireName& rhs) noexcept {
+    auto lhs_it = lhs.begin(), rhs_it = rhs.begin();
+    if (!lhs.m_data || !rhs.m_data)
+        return false;
+    for (; lhs_it != lhs.end() && rhs_it != rhs.end(); ++lhs_it, ++rhs_it) {
+        if (!name_equal(*lhs_it, *rhs_it))
+            return false;
+    }
+    return lhs_it.complete() && rhs_it.complete();
+}
+
+inline FixedName FixedName::extract(const void* buffer, size_t size, size_t* offset) noexcept {
+    const WireName name(buffer, size, *offset);
+    *offset = name.next_offset();
+    return *offset == MDNS_INVALID_POS ? FixedName() : name.decompress();
+}
+
+inline size_t NameHash::operator()(const WireName& name) const noexcept { return name.hash(); }
+
+inline bool NameEqual::operator()(std::string_view lhs, const WireName& rhs) const noexcept { return rhs == lhs; }
+inline bool NameEqual::operator()(const WireName& lhs, std::string_view rhs) const noexcept { return lhs == rhs; }
+
+}
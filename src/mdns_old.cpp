@@ -1,4 +1,5 @@
 #include "mdns_old.h"
+#include "metrics.h"
 
 int
 mdns_is_string_ref(uint8_t val) {
@@ -105,6 +106,9 @@ mdns_string_extract(const void *buffer, size_t size, size_t *offset, char *str,
             return result;
         if (substr.ref && (end == MDNS_INVALID_POS))
             end = cur + 2;
+        // A full buffer ends the walk, references in malformed packets may form a loop
+        if (substr.length && !remain)
+            return result;
         if (substr.length) {
             size_t to_copy = (substr.length < remain) ? substr.length : remain;
             memcpy(dst, (const char *) buffer + substr.offset, to_copy);
@@ -197,9 +201,16 @@ mdns_records_parse(int sock, const struct sockaddr *from, size_t addrlen, const
                    size_t records, mdns_record_callback_fn callback, void *user_data) {
     size_t parsed = 0;
     int do_callback = (callback ? 1 : 0);
+    // The sections after a malformed record cannot be found
+    if (*offset == MDNS_INVALID_POS)
+        return 0;
     for (size_t i = 0; i < records; ++i) {
         size_t name_offset = *offset;
-        mdns_string_skip(buffer, size, offset);
+        if (!mdns_string_skip(buffer, size, offset) || *offset + 10 > size) {
+            mdns::MetricsRegistry::add(mdns::MetricCounter::ParseErrors);
+            *offset = MDNS_INVALID_POS;
+            break;
+        }
         size_t name_length = (*offset) - name_offset;
         const auto *data = (const uint16_t *) ((const char *) buffer + (*offset));
 
@@ -210,9 +221,16 @@ mdns_records_parse(int sock, const struct sockaddr *from, size_t addrlen, const
         uint16_t length = ntohs(*data++);
 
         *offset += 10;
+        if (*offset + length > size) {
+            mdns::MetricsRegistry::add(mdns::MetricCounter::ParseErrors);
+            *offset = MDNS_INVALID_POS;
+            break;
+        }
 
         if (do_callback) {
             ++parsed;
+            mdns::MetricsTimer timer(mdns::MetricHistogram::CallbackTime,
+                                     mdns::MetricsRegistry::CALLBACK_SAMPLING);
             if (callback(sock, from, addrlen, type, query_id, rtype, rclass, ttl, buffer, size,
                          name_offset, name_length, *offset, length, user_data))
                 do_callback = 0;
@@ -228,20 +246,18 @@ int mdns_unicast_send(int sock, const void *address, size_t address_size, const
     if (sendto(sock, (const char *) buffer, (mdns_size_t) size, 0, (const struct sockaddr *) address,
                (socklen_t) address_size) < 0)
         return -1;
+    mdns::MetricsRegistry::sent(0, size);
     return 0;
 }
 
-int
-mdns_multicast_send(int sock, const void *buffer, size_t size) {
-    sockaddr_storage addr_storage{};
-    sockaddr_in addr{};
-    sockaddr_in6 addr6{};
-    auto *saddr = (struct sockaddr *) &addr_storage;
-    socklen_t saddrlen = sizeof(struct sockaddr_storage);
-    if (getsockname(sock, saddr, &saddrlen))
+// Multicast group address of the address family of the socket
+static int
+mdns_multicast_address(int sock, sockaddr_storage *addr_storage, socklen_t *saddrlen) {
+    *saddrlen = sizeof(struct sockaddr_storage);
+    if (getsockname(sock, (struct sockaddr *) addr_storage, saddrlen))
         return -1;
-    if (saddr->sa_family == AF_INET6) {
-        memset(&addr6, 0, sizeof(addr6));
+    if (addr_storage->ss_family == AF_INET6) {
+        sockaddr_in6 addr6{};
         addr6.sin6_family = AF_INET6;
 #ifdef __APPLE__
         addr6.sin6_len = sizeof(addr6);
@@ -250,25 +266,150 @@ mdns_multicast_send(int sock, const void *buffer, size_t size) {
         addr6.sin6_addr.s6_addr[1] = 0x02;
         addr6.sin6_addr.s6_addr[15] = 0xFB;
         addr6.sin6_port = htons((unsigned short) MDNS_PORT);
-        saddr = (struct sockaddr *) &addr6;
-        saddrlen = sizeof(addr6);
+        memcpy(addr_storage, &addr6, sizeof(addr6));
+        *saddrlen = sizeof(addr6);
     } else {
-        memset(&addr, 0, sizeof(addr));
+        sockaddr_in addr{};
         addr.sin_family = AF_INET;
 #ifdef __APPLE__
         addr.sin_len = sizeof(addr);
 #endif
         addr.sin_addr.s_addr = htonl((((uint32_t) 224U) << 24U) | ((uint32_t) 251U));
         addr.sin_port = htons((unsigned short) MDNS_PORT);
-        saddr = (struct sockaddr *) &addr;
-        saddrlen = sizeof(addr);
+        memcpy(addr_storage, &addr, sizeof(addr));
+        *saddrlen = sizeof(addr);
     }
+    return 0;
+}
 
-    if (sendto(sock, (const char *) buffer, (mdns_size_t) size, 0, saddr, saddrlen) < 0)
+int
+mdns_multicast_send(int sock, const void *buffer, size_t size) {
+    sockaddr_storage addr_storage{};
+    socklen_t saddrlen;
+    if (mdns_multicast_address(sock, &addr_storage, &saddrlen))
+        return -1;
+
+    if (sendto(sock, (const char *) buffer, (mdns_size_t) size, 0, (const struct sockaddr *) &addr_storage,
+               saddrlen) < 0)
         return -1;
+    mdns::MetricsRegistry::sent(0, size);
     return 0;
 }
 
+#ifndef _WIN32
+// Room for one IP_PKTINFO or IPV6_PKTINFO control message
+union mdns_interface_control_t {
+    cmsghdr header;
+    char data[CMSG_SPACE(sizeof(in6_pktinfo)) > CMSG_SPACE(sizeof(in_pktinfo)) ? CMSG_SPACE(sizeof(in6_pktinfo))
+                                                                                 : CMSG_SPACE(sizeof(in_pktinfo))];
+};
+
+// Select the outgoing interface of a multicast packet with a control message, the multicast interface
+// of the socket is used for interface 0
+static void
+mdns_interface_control(int family, unsigned interface, mdns_interface_control_t *control, msghdr *message) {
+    if (!interface)
+        return;
+    memset(control, 0, sizeof(*control));
+    message->msg_control = control;
+    cmsghdr *header = &control->header;
+    if (family == AF_INET6) {
+        in6_pktinfo info{};
+        info.ipi6_ifindex = interface;
+        header->cmsg_level = IPPROTO_IPV6;
+        header->cmsg_type = IPV6_PKTINFO;
+        header->cmsg_len = CMSG_LEN(sizeof(info));
+        memcpy(CMSG_DATA(header), &info, sizeof(info));
+        message->msg_controllen = CMSG_SPACE(sizeof(info));
+    } else {
+        in_pktinfo info{};
+        info.ipi_ifindex = (int) interface;
+        header->cmsg_level = IPPROTO_IP;
+        header->cmsg_type = IP_PKTINFO;
+        header->cmsg_len = CMSG_LEN(sizeof(info));
+        memcpy(CMSG_DATA(header), &info, sizeof(info));
+        message->msg_controllen = CMSG_SPACE(sizeof(info));
+    }
+}
+#endif
+
+int
+mdns_multicast_send_interface(int sock, const void *buffer, size_t size, unsigned interface) {
+#ifdef _WIN32
+    interface = 0;
+#endif
+    if (!interface)
+        return mdns_multicast_send(sock, buffer, size);
+#ifndef _WIN32
+    sockaddr_storage addr_storage{};
+    socklen_t saddrlen;
+    if (mdns_multicast_address(sock, &addr_storage, &saddrlen))
+        return -1;
+
+    iovec iov{(void *) buffer, size};
+    msghdr message{};
+    message.msg_name = &addr_storage;
+    message.msg_namelen = saddrlen;
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    mdns_interface_control_t control;
+    mdns_interface_control(addr_storage.ss_family, interface, &control, &message);
+    if (sendmsg(sock, &message, 0) < 0)
+        return -1;
+    mdns::MetricsRegistry::sent(interface, size);
+#endif
+    return 0;
+}
+
+int
+mdns_multicast_send_batch(int sock, const void *const *buffers, const size_t *sizes, size_t count,
+                          unsigned interface) {
+    sockaddr_storage addr_storage{};
+    socklen_t saddrlen;
+    if (mdns_multicast_address(sock, &addr_storage, &saddrlen))
+        return -1;
+
+    size_t sent = 0;
+#ifdef __linux__
+    // One system call for up to 64 packets
+    constexpr size_t max_batch = 64;
+    mmsghdr messages[max_batch];
+    iovec iov[max_batch];
+    // All packets go out on the same interface and share the control message
+    msghdr control_message{};
+    mdns_interface_control_t control;
+    mdns_interface_control(addr_storage.ss_family, interface, &control, &control_message);
+    while (sent < count) {
+        size_t batch = count - sent < max_batch ? count - sent : max_batch;
+        memset(messages, 0, sizeof(mmsghdr) * batch);
+        for (size_t i = 0; i < batch; ++i) {
+            iov[i].iov_base = (void *) buffers[sent + i];
+            iov[i].iov_len = sizes[sent + i];
+            messages[i].msg_hdr.msg_name = &addr_storage;
+            messages[i].msg_hdr.msg_namelen = saddrlen;
+            messages[i].msg_hdr.msg_iov = &iov[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+            messages[i].msg_hdr.msg_control = control_message.msg_control;
+            messages[i].msg_hdr.msg_controllen = control_message.msg_controllen;
+        }
+        int result = sendmmsg(sock, messages, (unsigned int) batch, 0);
+        if (result <= 0)
+            break;
+        size_t bytes = 0;
+        for (int i = 0; i < result; ++i)
+            bytes += sizes[sent + (size_t) i];
+        mdns::MetricsRegistry::sent(interface, bytes, (size_t) result);
+        sent += (size_t) result;
+    }
+#else
+    for (; sent < count; ++sent) {
+        if (mdns_multicast_send_interface(sock, buffers[sent], sizes[sent], interface))
+            break;
+    }
+#endif
+    return sent || !count ? (int) sent : -1;
+}
+
 static const uint8_t mdns_services_query[] = {
         // Query ID
         0x00, 0x00,
@@ -301,19 +442,21 @@ int mdns_discovery_send(int sock) {
 
 size_t mdns_discovery_recv(int sock, void *buffer, size_t capacity, mdns_record_callback_fn callback, void *user_data) {
     sockaddr_in6 addr{};
-    auto *saddr = (sockaddr *) &addr;
-    socklen_t addrlen = sizeof(addr);
-    memset(&addr, 0, sizeof(addr));
-#ifdef __APPLE__
-    saddr->sa_len = sizeof(addr);
-#endif
-    int ret = recvfrom(sock, (char *) buffer, (mdns_size_t) capacity, 0, saddr, &addrlen);
-    if (ret <= 0)
+    size_t addrlen = 0;
+    size_t data_size = mdns_socket_recv(sock, buffer, capacity, &addr, &addrlen);
+    if (!data_size)
         return 0;
+    return mdns_discovery_parse(sock, (const sockaddr *) &addr, addrlen, buffer, data_size, callback, user_data);
+}
 
-    auto data_size = (size_t) ret;
+size_t mdns_discovery_parse(int sock, const struct sockaddr *saddr, size_t addrlen, const void *buffer,
+                            size_t data_size, mdns_record_callback_fn callback, void *user_data) {
+    if (data_size < sizeof(mdns_header_t)) {
+        mdns::MetricsRegistry::add(mdns::MetricCounter::ParseErrors);
+        return 0;
+    }
     size_t records = 0;
-    auto *data = (uint16_t *) buffer;
+    auto *data = (const uint16_t *) buffer;
 
     uint16_t query_id = ntohs(*data++);
     uint16_t flags = ntohs(*data++);
@@ -367,8 +510,10 @@ size_t mdns_discovery_recv(int sock, void *buffer, size_t capacity, mdns_record_
         uint32_t ttl = ntohl(*(uint32_t *) (void *) data);
         data += 2;
         uint16_t length = ntohs(*data++);
-        if (length >= (data_size - ofs))
+        if (length >= (data_size - ofs)) {
+            mdns::MetricsRegistry::add(mdns::MetricCounter::ParseErrors);
             return 0;
+        }
 
         if (is_answer && do_callback) {
             ++records;
@@ -393,18 +538,20 @@ size_t mdns_discovery_recv(int sock, void *buffer, size_t capacity, mdns_record_
 
 size_t mdns_socket_listen(int sock, void *buffer, size_t capacity, mdns_record_callback_fn callback, void *user_data) {
     sockaddr_in6 addr{};
-    auto *saddr = (struct sockaddr *) &addr;
-    socklen_t addrlen = sizeof(addr);
-    memset(&addr, 0, sizeof(addr));
-#ifdef __APPLE__
-    saddr->sa_len = sizeof(addr);
-#endif
-    int ret = recvfrom(sock, (char *) buffer, (mdns_size_t) capacity, 0, saddr, &addrlen);
-    if (ret <= 0)
+    size_t addrlen = 0;
+    size_t data_size = mdns_socket_recv(sock, buffer, capacity, &addr, &addrlen);
+    if (!data_size)
         return 0;
+    return mdns_question_parse(sock, (const sockaddr *) &addr, addrlen, buffer, data_size, callback, user_data);
+}
 
-    auto data_size = (size_t) ret;
-    auto *data = (uint16_t *) buffer;
+size_t mdns_question_parse(int sock, const struct sockaddr *saddr, size_t addrlen, const void *buffer,
+                           size_t data_size, mdns_record_callback_fn callback, void *user_data) {
+    if (data_size < sizeof(mdns_header_t)) {
+        mdns::MetricsRegistry::add(mdns::MetricCounter::ParseErrors);
+        return 0;
+    }
+    auto *data = (const uint16_t *) buffer;
 
     uint16_t query_id = ntohs(*data++);
     uint16_t flags = ntohs(*data++);
@@ -419,7 +566,7 @@ size_t mdns_socket_listen(int sock, void *buffer, size_t capacity, mdns_record_c
 
     size_t parsed = 0;
     for (int iquestion = 0; iquestion < questions; ++iquestion) {
-        auto question_offset = (size_t) ((char *) data - (char *) buffer);
+        auto question_offset = MDNS_POINTER_DIFF(data, buffer);
         size_t offset = question_offset;
         size_t verify_ofs = 12;
         if (mdns_string_equal(buffer, data_size, &offset, mdns_services_query,
@@ -428,11 +575,17 @@ size_t mdns_socket_listen(int sock, void *buffer, size_t capacity, mdns_record_c
                 return 0;
         } else {
             offset = question_offset;
-            if (!mdns_string_skip(buffer, data_size, &offset))
+            if (!mdns_string_skip(buffer, data_size, &offset)) {
+                mdns::MetricsRegistry::add(mdns::MetricCounter::ParseErrors);
                 break;
+            }
+        }
+        if (offset + 4 > data_size) {
+            mdns::MetricsRegistry::add(mdns::MetricCounter::ParseErrors);
+            break;
         }
         size_t length = offset - question_offset;
-        data = (uint16_t *) ((char *) buffer + offset);
+        data = (const uint16_t *) MDNS_POINTER_OFFSET_CONST(buffer, offset);
 
         uint16_t rtype = ntohs(*data++);
         uint16_t rclass = ntohs(*data++);
@@ -489,10 +642,8 @@ int mdns_discovery_answer(int sock, const void *address, size_t address_size, vo
     return mdns_unicast_send(sock, address, address_size, buffer, (size_t) tosend);
 }
 
-int mdns_query_send(int sock, mdns_record_type_t type, const char *name, size_t length, void *buffer, size_t capacity, uint16_t query_id) {
-    if (capacity < (17 + length))
-        return -1;
-
+uint16_t
+mdns_query_rclass(int sock) {
     uint16_t rclass = MDNS_CLASS_IN | MDNS_UNICAST_RESPONSE;
 
     sockaddr_storage addr_storage{};
@@ -506,6 +657,14 @@ int mdns_query_send(int sock, mdns_record_type_t type, const char *name, size_t
                  (ntohs(((struct sockaddr_in6 *) saddr)->sin6_port) == MDNS_PORT))
             rclass &= ~MDNS_UNICAST_RESPONSE;
     }
+    return rclass;
+}
+
+int mdns_query_send(int sock, mdns_record_type_t type, const char *name, size_t length, void *buffer, size_t capacity, uint16_t query_id) {
+    if (capacity < (17 + length))
+        return -1;
+
+    uint16_t rclass = mdns_query_rclass(sock);
 
     auto *data = (uint16_t *) buffer;
     // Query ID
@@ -534,20 +693,133 @@ int mdns_query_send(int sock, mdns_record_type_t type, const char *name, size_t
     return query_id;
 }
 
-size_t mdns_query_recv(int sock, void *buffer, size_t capacity, mdns_record_callback_fn callback, void *user_data, int only_query_id) {
-    sockaddr_in6 addr{};
-    auto *saddr = (struct sockaddr *) &addr;
-    socklen_t addrlen = sizeof(addr);
-    memset(&addr, 0, sizeof(addr));
+int mdns_query_send_multi(int sock, const mdns_question_t *questions, size_t count, void *buffer, size_t capacity, uint16_t query_id) {
+    if (capacity < sizeof(struct mdns_header_t) + 5)
+        return -1;
+
+    uint16_t rclass = mdns_query_rclass(sock);
+    auto *header = (struct mdns_header_t *) buffer;
+    int packets = 0;
+    size_t iquestion = 0;
+    while (iquestion < count) {
+        header->query_id = htons(query_id);
+        header->flags = 0;
+        header->answer_rrs = 0;
+        header->authority_rrs = 0;
+        header->additional_rrs = 0;
+
+        // Pack as many questions as fit, a question that does not fit starts the next packet
+        void *data = MDNS_POINTER_OFFSET(buffer, sizeof(struct mdns_header_t));
+        uint16_t in_packet = 0;
+        while ((iquestion < count) && (in_packet < 0xFFFF)) {
+            size_t remain = capacity - MDNS_POINTER_DIFF(data, buffer);
+            if (remain <= 4)
+                break;
+            const mdns_question_t &question = questions[iquestion];
+            auto *udata = (uint16_t *) mdns_string_make(data, remain - 4, question.name, question.length);
+            if (!udata)
+                break;
+            *udata++ = htons(question.type);
+            *udata++ = htons(rclass);
+            data = udata;
+            ++in_packet;
+            ++iquestion;
+        }
+        // A single question larger than the buffer can never be sent
+        if (!in_packet)
+            return -1;
+        header->questions = htons(in_packet);
+
+        if (mdns_multicast_send(sock, buffer, MDNS_POINTER_DIFF(data, buffer)))
+            return -1;
+        ++packets;
+    }
+    return packets;
+}
+
+size_t mdns_socket_recv(int sock, void *buffer, size_t capacity, void *address, size_t *address_size) {
+    auto *saddr = (struct sockaddr *) address;
+    socklen_t addrlen = sizeof(sockaddr_in6);
+    memset(address, 0, sizeof(sockaddr_in6));
 #ifdef __APPLE__
-    saddr->sa_len = sizeof(addr);
+    saddr->sa_len = sizeof(sockaddr_in6);
 #endif
+#ifdef __linux__
+    // Returns the full length of a datagram larger than the buffer
+    int ret = recvfrom(sock, (char *) buffer, (mdns_size_t) capacity, MSG_TRUNC, saddr, &addrlen);
+#else
     int ret = recvfrom(sock, (char *) buffer, (mdns_size_t) capacity, 0, saddr, &addrlen);
+#endif
     if (ret <= 0)
         return 0;
+    *address_size = addrlen;
+    mdns::MetricsRegistry::received(0, (size_t) ret);
+    if ((size_t) ret > capacity) {
+        mdns::MetricsRegistry::add(mdns::MetricCounter::Truncated);
+        ret = (int) capacity;
+    }
+    return (size_t) ret;
+}
 
-    auto data_size = (size_t) ret;
-    auto *data = (uint16_t *) buffer;
+size_t mdns_socket_recv_interface(int sock, void *buffer, size_t capacity, void *address, size_t *address_size,
+                                  unsigned *interface) {
+    *interface = 0;
+#ifdef _WIN32
+    return mdns_socket_recv(sock, buffer, capacity, address, address_size);
+#else
+    auto *saddr = (struct sockaddr *) address;
+    memset(address, 0, sizeof(sockaddr_in6));
+#ifdef __APPLE__
+    saddr->sa_len = sizeof(sockaddr_in6);
+#endif
+    iovec iov{buffer, capacity};
+    mdns_interface_control_t control;
+    msghdr message{};
+    message.msg_name = saddr;
+    message.msg_namelen = sizeof(sockaddr_in6);
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = &control;
+    message.msg_controllen = sizeof(control);
+    ssize_t ret = recvmsg(sock, &message, 0);
+    if (ret <= 0)
+        return 0;
+    *address_size = message.msg_namelen;
+    for (cmsghdr *header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level == IPPROTO_IP && header->cmsg_type == IP_PKTINFO) {
+            in_pktinfo info;
+            memcpy(&info, CMSG_DATA(header), sizeof(info));
+            *interface = (unsigned) info.ipi_ifindex;
+        } else if (header->cmsg_level == IPPROTO_IPV6 && header->cmsg_type == IPV6_PKTINFO) {
+            in6_pktinfo info;
+            memcpy(&info, CMSG_DATA(header), sizeof(info));
+            *interface = info.ipi6_ifindex;
+        }
+    }
+    mdns::MetricsRegistry::received(*interface, (size_t) ret);
+    if (message.msg_flags & MSG_TRUNC)
+        mdns::MetricsRegistry::add(mdns::MetricCounter::Truncated);
+    return (size_t) ret;
+#endif
+}
+
+size_t mdns_query_recv(int sock, void *buffer, size_t capacity, mdns_record_callback_fn callback, void *user_data, int only_query_id) {
+    sockaddr_in6 addr{};
+    size_t addrlen = 0;
+    size_t data_size = mdns_socket_recv(sock, buffer, capacity, &addr, &addrlen);
+    if (!data_size)
+        return 0;
+    return mdns_query_parse(sock, (const sockaddr *) &addr, addrlen, buffer, data_size, callback, user_data,
+                            only_query_id);
+}
+
+size_t mdns_query_parse(int sock, const struct sockaddr *saddr, size_t addrlen, const void *buffer, size_t data_size,
+                        mdns_record_callback_fn callback, void *user_data, int only_query_id) {
+    if (data_size < sizeof(mdns_header_t)) {
+        mdns::MetricsRegistry::add(mdns::MetricCounter::ParseErrors);
+        return 0;
+    }
+    auto *data = (const uint16_t *) buffer;
 
     uint16_t query_id = ntohs(*data++);
     uint16_t flags = ntohs(*data++);
@@ -566,14 +838,12 @@ size_t mdns_query_recv(int sock, void *buffer, size_t capacity, mdns_record_call
     // Skip questions part
     int i;
     for (i = 0; i < questions; ++i) {
-        auto ofs = (size_t) ((char *) data - (char *) buffer);
-        if (!mdns_string_skip(buffer, data_size, &ofs))
+        auto ofs = MDNS_POINTER_DIFF(data, buffer);
+        if (!mdns_string_skip(buffer, data_size, &ofs) || ofs + 4 > data_size) {
+            mdns::MetricsRegistry::add(mdns::MetricCounter::ParseErrors);
             return 0;
-        data = (uint16_t *) ((char *) buffer + ofs);
-        uint16_t rtype = ntohs(*data++);
-        uint16_t rclass = ntohs(*data++);
-        (void) sizeof(rtype);
-        (void) sizeof(rclass);
+        }
+        data = (const uint16_t *) MDNS_POINTER_OFFSET_CONST(buffer, ofs + 4);
     }
 
     size_t records = 0;
@@ -589,6 +859,49 @@ size_t mdns_query_recv(int sock, void *buffer, size_t capacity, mdns_record_call
     return records;
 }
 
+size_t mdns_packet_parse(int sock, const struct sockaddr *saddr, size_t addrlen, const void *buffer, size_t data_size,
+                         mdns_record_callback_fn callback, void *user_data) {
+    if (data_size < sizeof(mdns_header_t)) {
+        mdns::MetricsRegistry::add(mdns::MetricCounter::ParseErrors);
+        return 0;
+    }
+    auto *data = (const uint16_t *) buffer;
+
+    uint16_t query_id = ntohs(*data++);
+    data++;
+    uint16_t questions = ntohs(*data++);
+    uint16_t answer_rrs = ntohs(*data++);
+    uint16_t authority_rrs = ntohs(*data++);
+    uint16_t additional_rrs = ntohs(*data++);
+
+    size_t parsed = 0;
+    size_t offset = MDNS_POINTER_DIFF(data, buffer);
+    for (int iquestion = 0; iquestion < questions; ++iquestion) {
+        size_t question_offset = offset;
+        if (!mdns_string_skip(buffer, data_size, &offset) || offset + 4 > data_size) {
+            mdns::MetricsRegistry::add(mdns::MetricCounter::ParseErrors);
+            return parsed;
+        }
+        size_t length = offset - question_offset;
+        const auto *entry = (const uint16_t *) MDNS_POINTER_OFFSET_CONST(buffer, offset);
+        uint16_t rtype = ntohs(*entry++);
+        uint16_t rclass = ntohs(*entry++);
+        offset += 4;
+        if (callback)
+            callback(sock, saddr, addrlen, MDNS_ENTRYTYPE_QUESTION, query_id, rtype, rclass, 0, buffer, data_size,
+                     question_offset, length, question_offset, length, user_data);
+        ++parsed;
+    }
+
+    parsed += mdns_records_parse(sock, saddr, addrlen, buffer, data_size, &offset, MDNS_ENTRYTYPE_ANSWER, query_id,
+                                 answer_rrs, callback, user_data);
+    parsed += mdns_records_parse(sock, saddr, addrlen, buffer, data_size, &offset, MDNS_ENTRYTYPE_AUTHORITY,
+                                 query_id, authority_rrs, callback, user_data);
+    parsed += mdns_records_parse(sock, saddr, addrlen, buffer, data_size, &offset, MDNS_ENTRYTYPE_ADDITIONAL,
+                                 query_id, additional_rrs, callback, user_data);
+    return parsed;
+}
+
 int
 mdns_query_answer(int sock, const void *address, size_t address_size, void *buffer, size_t capacity,
                   uint16_t query_id, const char *service, size_t service_length,
@@ -784,6 +1097,53 @@ mdns_record_parse_srv(const void *buffer, size_t size, size_t offset, size_t len
     return srv;
 }
 
+size_t
+mdns_record_rdata_expand(const void *buffer, size_t size, size_t offset, size_t length,
+                         uint16_t rtype, void *rdata, size_t capacity) {
+    if (size < offset + length)
+        return MDNS_INVALID_POS;
+
+    size_t name_offset;
+    if (rtype == MDNS_RECORDTYPE_PTR)
+        name_offset = 0;
+    else if ((rtype == MDNS_RECORDTYPE_SRV) && (length >= 8))
+        name_offset = 6;
+    else {
+        // No embedded domain names, the record data is already self-contained
+        if (length > capacity)
+            return MDNS_INVALID_POS;
+        memcpy(rdata, (const char *) buffer + offset, length);
+        return length;
+    }
+
+    if (name_offset > capacity)
+        return MDNS_INVALID_POS;
+    memcpy(rdata, (const char *) buffer + offset, name_offset);
+
+    // Copy the labels while following compression references. The number of labels is bounded by
+    // the maximum name length, which also protects against reference loops in malformed packets.
+    auto *dst = (uint8_t *) rdata + name_offset;
+    size_t remain = capacity - name_offset;
+    size_t cur = offset + name_offset;
+    size_t name_length = 0;
+    mdns_string_pair_t substr;
+    do {
+        substr = mdns_get_next_substring(buffer, size, cur);
+        if (substr.offset == MDNS_INVALID_POS)
+            return MDNS_INVALID_POS;
+        name_length += substr.length + 1;
+        if ((name_length > 255) || (substr.length + 1 > remain))
+            return MDNS_INVALID_POS;
+        *dst++ = (uint8_t) substr.length;
+        memcpy(dst, (const char *) buffer + substr.offset, substr.length);
+        dst += substr.length;
+        remain -= substr.length + 1;
+        cur = substr.offset + substr.length;
+    } while (substr.length);
+
+    return MDNS_POINTER_DIFF(dst, rdata);
+}
+
 struct sockaddr_in *
 mdns_record_parse_a(const void *buffer, size_t size, size_t offset, size_t length,
                     struct sockaddr_in *addr) {
@@ -12,6 +12,7 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <ifaddrs.h>
+#include <net/if.h>
 
 #endif
 
@@ -37,6 +38,11 @@ int mdns_socket_setup_ipv4(int sock, struct sockaddr_in* saddr) {
 #endif
     setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, (const char*)&ttl, sizeof(ttl));
     setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, (const char*)&loopback, sizeof(loopback));
+#ifdef IP_PKTINFO
+    // Report the interface of each received packet, see mdns_socket_recv_interface()
+    int pktinfo = 1;
+    setsockopt(sock, IPPROTO_IP, IP_PKTINFO, (const char*)&pktinfo, sizeof(pktinfo));
+#endif
 
     memset(&req, 0, sizeof(req));
     req.imr_multiaddr.s_addr = htonl((((uint32_t)224U) << 24U) | ((uint32_t)251U));
@@ -88,6 +94,10 @@ int mdns_socket_setup_ipv6(int sock, struct sockaddr_in6* saddr) {
 #endif
     setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, (const char*)&hops, sizeof(hops));
     setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, (const char*)&loopback, sizeof(loopback));
+#ifdef IPV6_RECVPKTINFO
+    int pktinfo = 1;
+    setsockopt(sock, IPPROTO_IPV6, IPV6_RECVPKTINFO, (const char*)&pktinfo, sizeof(pktinfo));
+#endif
 
     memset(&req, 0, sizeof(req));
     req.ipv6mr_multiaddr.s6_addr[0] = 0xFF;
@@ -149,6 +159,24 @@ int open_socket(sockaddr_in6* saddr) {
     return sock;
 }
 
+/// Join the mDNS group on the interface of \p address as well, a socket bound to any address only
+/// joins it on the default interface. Joining an interface twice fails harmlessly.
+void join_group(int sock, const mdns::UnixSocket::InterfaceAddress& address) {
+    if (address.address.is_ipv4()) {
+        ip_mreq req{};
+        req.imr_multiaddr.s_addr = htonl((((uint32_t)224U) << 24U) | ((uint32_t)251U));
+        memcpy(&req.imr_interface, address.address.bytes.data(), 4);
+        setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char*)&req, sizeof(req));
+    } else {
+        ipv6_mreq req{};
+        req.ipv6mr_multiaddr.s6_addr[0] = 0xFF;
+        req.ipv6mr_multiaddr.s6_addr[1] = 0x02;
+        req.ipv6mr_multiaddr.s6_addr[15] = 0xFB;
+        req.ipv6mr_interface = address.interface;
+        setsockopt(sock, IPPROTO_IPV6, IPV6_JOIN_GROUP, (char*)&req, sizeof(req));
+    }
+}
+
 }
 
 using namespace mdns;
@@ -283,6 +311,7 @@ int UnixSocket::open_client_sockets(const AcceptInterface& predicate, const AddS
     if (getifaddrs(&ifaddr) < 0)
         return UNABLE_TO_GET_INTERFACE_ADDRESS;
 
+    m_interface_addresses.clear();
     bool first_ipv4 = true;
     bool first_ipv6 = true;
     for (ifaddrs* ifa = ifaddr; ifa; ifa = ifa->ifa_next) {
@@ -298,6 +327,7 @@ int UnixSocket::open_client_sockets(const AcceptInterface& predicate, const AddS
                 first_ipv4 = false;
             }
             has_ipv4 = true;
+            m_interface_addresses.push_back({IpAddress::ipv4(saddr->sin_addr.s_addr), if_nametoindex(ifa->ifa_name)});
             saddr->sin_port = htons(port);
             uint8_t interfaceIPAddr[16];
             memcpy(interfaceIPAddr, &saddr->sin_addr.s_addr, 4);
@@ -323,6 +353,9 @@ int UnixSocket::open_client_sockets(const AcceptInterface& predicate, const AddS
                 first_ipv6 = false;
             }
             has_ipv6 = true;
+            std::array<uint8_t, 16> address;
+            memcpy(address.data(), &saddr->sin6_addr, 16);
+            m_interface_addresses.push_back({IpAddress::ipv6(address), if_nametoindex(ifa->ifa_name)});
             saddr->sin6_port = htons(port);
 
             if (predicate(ifa->ifa_name, saddr->sin6_addr.s6_addr, 16)) {
@@ -352,12 +385,31 @@ std::string_view addr = ipv6_address_to_string(buffer, sizeof(buffer), saddr,
 printf("Local IPv6 address: %.*s\n", MDNS_STRING_FORMAT(addr));
  */
 
+std::optional<uint32_t> UnixSocket::ipv4_address() const {
+    if (!has_ipv4)
+        return std::nullopt;
+    return service_address_ipv4;
+}
+
+std::optional<std::array<uint8_t, 16>> UnixSocket::ipv6_address() const {
+    if (!has_ipv6)
+        return std::nullopt;
+    std::array<uint8_t, 16> address;
+    memcpy(address.data(), service_address_ipv6, 16);
+    return address;
+}
+
+void UnixSocket::close(SocketDP socketDp) {
+    if (socketDp.socket >= 0)
+        closeSocket(socketDp.socket);
+}
+
 std::array<UnixSocket::SocketDP,2> UnixSocket::open_service_sockets(bool IPv4, bool IPv6, uint16_t port) {
     // Call the client socket function to enumerate and get local addresses,
     // but not open the actual sockets
-    open_client_sockets([](char* name, uint8_t ip[16], size_t ipLen){return false;},AddSocketCallback{});
+    open_client_sockets([](char*, uint8_t*, size_t) { return false; },AddSocketCallback{});
 
-    std::array<UnixSocket::SocketDP,2> sockets{};
+    std::array<UnixSocket::SocketDP,2> sockets{SocketDP{-1}, SocketDP{-1}};
 
     if (IPv4) {
         sockaddr_in sock_addr{};
@@ -371,11 +423,7 @@ std::array<UnixSocket::SocketDP,2> UnixSocket::open_service_sockets(bool IPv4, b
 #ifdef __APPLE__
         sock_addr.sin_len = sizeof(struct sockaddr_in);
 #endif
-        int sock = open_socket(&sock_addr);
-        if (sock >= 0)
-            sockets[0].socket = sock;
-    } else {
-        sockets[0].socket = -1;
+        sockets[0].socket = open_socket(&sock_addr);
     }
 
     if (IPv6) {
@@ -386,11 +434,14 @@ std::array<UnixSocket::SocketDP,2> UnixSocket::open_service_sockets(bool IPv4, b
 #ifdef __APPLE__
         sock_addr.sin6_len = sizeof(struct sockaddr_in6);
 #endif
-        int sock = open_socket(&sock_addr);
+        sockets[1].socket = open_socket(&sock_addr);
+    }
+
+    // Questions are answered on every interface, with the addresses of the interface they came from
+    for (const InterfaceAddress& address : m_interface_addresses) {
+        const int sock = sockets[address.address.is_ipv4() ? 0 : 1].socket;
         if (sock >= 0)
-            sockets[1].socket = sock;
-    } else {
-        sockets[1].socket = -1;
+            join_group(sock, address);
     }
 
     return sockets;
@@ -0,0 +1,58 @@
+#pragma once
+
+// A socket layer without network interfaces, for sessions that must not depend on the host
+
+#include "ip_address.h"
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/// Opens one client socket on the loopback interface, on an ephemeral port instead of the mDNS port.
+/// Packets for the session are sent to the port of opened().
+class LoopbackSockets
+{
+public:
+    struct SocketDP {
+        int socket;
+    };
+    struct InterfaceAddress {
+        mdns::IpAddress address;
+        unsigned interface;
+    };
+    using AcceptInterface = std::function<bool(char*, uint8_t[16], size_t)>;
+    using AddSocketCallback = std::function<void(SocketDP)>;
+
+    std::string_view hostname() { return "test"; }
+    std::array<SocketDP, 2> open_service_sockets(bool, bool, int) { return {{{-1}, {-1}}}; }
+    int open_client_sockets(const AcceptInterface&, const AddSocketCallback& add, int) {
+        const int sock = socket(AF_INET, SOCK_DGRAM, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (sock < 0 || bind(sock, (const sockaddr*)&address, sizeof(address)))
+            return 0;
+        m_opened.push_back(sock);
+        add({sock});
+        return 1;
+    }
+    void close(SocketDP socketDp) { ::close(socketDp.socket); }
+    std::optional<uint32_t> ipv4_address() const { return {}; }
+    std::optional<std::array<uint8_t, 16>> ipv6_address() const { return {}; }
+    const std::vector<InterfaceAddress>& interface_addresses() const { return m_addresses; }
+
+    /// Sockets opened by open_client_sockets(), closed ones included
+    const std::vector<int>& opened() const { return m_opened; }
+
+private:
+    std::vector<InterfaceAddress> m_addresses;
+    std::vector<int> m_opened;
+};
@@ -0,0 +1,41 @@
+#pragma once
+
+// Responses are built with PacketWriter and parsed like received packets
+
+#include "packet_writer.h"
+#include "record_cache.h"
+
+#include <cstdint>
+
+/// An mDNS response under construction
+struct Response {
+    Response() { writer.begin(0, 0x8400); }
+    Response(const Response&) = delete;
+    Response& operator=(const Response&) = delete;
+
+    uint8_t data[1500];
+    mdns::PacketWriter writer{data, sizeof(data)};
+};
+
+/// Insert all records of \p response into \p cache
+/// \return The number of records inserted
+template<class Cache>
+size_t insert_response(Cache& cache, const Response& response, mdns::Clock::time_point now) {
+    struct Context {
+        Cache* cache;
+        mdns::Clock::time_point now;
+        size_t inserted;
+    } context{&cache, now, 0};
+    mdns_query_parse(
+        0, nullptr, 0, response.writer.data(), response.writer.size(),
+        [](int, const struct sockaddr*, size_t, mdns_entry_type_t, uint16_t, uint16_t rtype, uint16_t rclass,
+           uint32_t ttl, const void* data, size_t size, size_t name_offset, size_t, size_t record_offset,
+           size_t record_length, void* user_data) {
+            auto* context = static_cast<Context*>(user_data);
+            context->inserted += context->cache->insert(data, size, name_offset, rtype, rclass, ttl, record_offset,
+                                                        record_length, context->now);
+            return 0;
+        },
+        &context, 0);
+    return context.inserted;
+}
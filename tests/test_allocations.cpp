@@ -0,0 +1,193 @@
+// The steady state of answering questions and caching records must not touch the heap: everything
+// per packet comes from the packet buffers and their arenas, registry changes from the memory resource
+// of the registry. Every global operator new is counted.
+
+#include "check.h"
+
+#include "buffers.h"
+#include "packet.h"
+#include "record_cache.h"
+#include "responder.h"
+#include "socket_unix.h"
+
+#include <atomic>
+#include <cstring>
+#include <memory_resource>
+#include <new>
+#include <string>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace
+{
+
+std::atomic<size_t> allocations{0};
+
+void* allocate(size_t size, size_t alignment = alignof(std::max_align_t)) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void* memory = nullptr;
+    if (posix_memalign(&memory, std::max(alignment, sizeof(void*)), size ? size : 1))
+        throw std::bad_alloc();
+    return memory;
+}
+
+}
+
+void* operator new(size_t size) { return allocate(size); }
+void* operator new[](size_t size) { return allocate(size); }
+void* operator new(size_t size, std::align_val_t alignment) { return allocate(size, (size_t)alignment); }
+void* operator new[](size_t size, std::align_val_t alignment) { return allocate(size, (size_t)alignment); }
+void operator delete(void* memory) noexcept { free(memory); }
+void operator delete[](void* memory) noexcept { free(memory); }
+void operator delete(void* memory, size_t) noexcept { free(memory); }
+void operator delete[](void* memory, size_t) noexcept { free(memory); }
+void operator delete(void* memory, std::align_val_t) noexcept { free(memory); }
+void operator delete[](void* memory, std::align_val_t) noexcept { free(memory); }
+void operator delete(void* memory, size_t, std::align_val_t) noexcept { free(memory); }
+void operator delete[](void* memory, size_t, std::align_val_t) noexcept { free(memory); }
+
+namespace
+{
+
+using namespace mdns;
+
+using Memory = FixedSizeBuffer<4>;
+using Worker = Responder<Memory, UnixSocket, SingleThreadSafe>;
+
+/// A legacy unicast query with one question, as sent by a plain DNS resolver
+size_t make_query(uint8_t* packet, std::string_view name, uint16_t rtype) {
+    const uint8_t header[12] = {0x12, 0x34, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0};
+    memcpy(packet, header, sizeof(header));
+    void* end = mdns_string_make(packet + sizeof(header), 256, name.data(), name.size());
+    auto* question = (uint8_t*)end;
+    const uint8_t tail[4] = {(uint8_t)(rtype >> 8), (uint8_t)rtype, 0, MDNS_CLASS_IN};
+    memcpy(question, tail, sizeof(tail));
+    return (size_t)(question + sizeof(tail) - packet);
+}
+
+struct Sink {
+    Memory& memory;
+    int sent{};
+
+    static bool send(Worker::Response& response, void* user_data) {
+        auto* sink = static_cast<Sink*>(user_data);
+        mdns_unicast_send(response.sock, &response.address, response.address_size, response.buffer->data(),
+                          response.size);
+        sink->memory.release(response.buffer);
+        ++sink->sent;
+        return true;
+    }
+};
+
+void test_responder() {
+    Memory memory;
+    UnixSocket sockets;
+    ServiceRegistry<SingleThreadSafe> registry(memory.resource());
+    for (int i = 0; i < 100; ++i) {
+        ServiceInstance instance(memory.resource());
+        instance.name = "printer-" + std::to_string(i);
+        instance.service_type = "_ipp._tcp.local.";
+        instance.host = "host-" + std::to_string(i) + ".local.";
+        instance.port = 631;
+        instance.ipv4 = htonl(INADDR_LOOPBACK);
+        CHECK(registry.add(instance));
+    }
+    Worker responder(memory, sockets, registry);
+
+    const int server = socket(AF_INET, SOCK_DGRAM, 0);
+    const int client = socket(AF_INET, SOCK_DGRAM, 0);
+    CHECK(server >= 0 && client >= 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    CHECK(bind(server, (const sockaddr*)&address, sizeof(address)) == 0);
+    socklen_t address_size = sizeof(address);
+    CHECK(getsockname(server, (sockaddr*)&address, &address_size) == 0);
+    timeval timeout{1, 0};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    uint8_t query[512];
+    const size_t query_size = make_query(query, "printer-7._ipp._tcp.local.", MDNS_RECORDTYPE_SRV);
+    Sink sink{memory};
+    uint8_t reply[2048];
+    auto ask = [&] {
+        CHECK(sendto(client, query, query_size, 0, (const sockaddr*)&address, sizeof(address)) == (ssize_t)query_size);
+        SharedPacket<Memory> packet = SharedPacket<Memory>::receive(memory, server);
+        CHECK(packet);
+        CHECK(responder.answer(packet, Sink::send, &sink) == 1);
+        CHECK(recv(client, reply, sizeof(reply), 0) > 12);
+    };
+
+    // The first answers size the rate limit and duplicate tables
+    ask();
+    ask();
+    const size_t before = allocations.load();
+    // Stays within the unicast burst of the rate limiter, so every question is answered
+    for (int i = 0; i < 15; ++i)
+        ask();
+    CHECK(allocations.load() == before);
+    CHECK(sink.sent == 17);
+
+    close(server);
+    close(client);
+}
+
+/// Everything a registry transaction allocates comes from the memory resource of the registry
+void test_registry() {
+    static std::byte arena[64 * 1024];
+    std::pmr::monotonic_buffer_resource resource(arena, sizeof(arena), std::pmr::null_memory_resource());
+    ServiceRegistry<SingleThreadSafe> registry(&resource);
+    ServiceInstance instance(&resource);
+    instance.name = "A printer with a long instance name";
+    instance.service_type = "_ipp._tcp.local";
+    instance.subtypes.emplace_back("_universal");
+    instance.host = "a-host-with-a-long-name.local";
+    instance.port = 631;
+    instance.ipv4 = htonl(INADDR_LOOPBACK);
+
+    // A plain copy would take the default resource
+    const size_t before = allocations.load();
+    CHECK(registry.add(ServiceInstance(instance, &resource)));
+    CHECK(!registry.add(ServiceInstance(instance, &resource)));
+    CHECK(registry.remove("A printer with a long instance name._ipp._tcp.local."));
+    CHECK(allocations.load() == before);
+}
+
+void test_cache() {
+    Memory memory;
+    RecordCache<SingleThreadSafe> cache(memory.resource());
+
+    // An A record of "host.local." as it appears in a response
+    uint8_t packet[64];
+    void* end = mdns_string_make(packet, sizeof(packet), "host.local.", 11);
+    const size_t rdata_offset = (size_t)((uint8_t*)end - packet);
+    const uint8_t rdata[4] = {192, 168, 1, 2};
+    memcpy(packet + rdata_offset, rdata, sizeof(rdata));
+    const size_t size = rdata_offset + sizeof(rdata);
+
+    auto now = Clock::now();
+    cache.add_interest("host.local.", MDNS_RECORDTYPE_A);
+    CHECK(cache.insert(packet, size, 0, MDNS_RECORDTYPE_A, MDNS_CLASS_IN, 120, rdata_offset, sizeof(rdata), now));
+
+    const size_t before = allocations.load();
+    size_t found = 0;
+    for (int i = 0; i < 1000; ++i) {
+        now += std::chrono::milliseconds(10);
+        cache.insert(packet, size, 0, MDNS_RECORDTYPE_A, MDNS_CLASS_IN, 120, rdata_offset, sizeof(rdata), now);
+        cache.find("host.local.", MDNS_RECORDTYPE_A, now, [&found](const CacheRecord&) { ++found; });
+        cache.expire(now);
+    }
+    CHECK(allocations.load() == before);
+    CHECK(found == 1000);
+}
+
+}
+
+int main() {
+    test_responder();
+    test_registry();
+    test_cache();
+    return 0;
+}
@@ -0,0 +1,119 @@
+// BrowseSession: instances are added, updated and removed as their records enter and leave the cache
+
+#include "check.h"
+#include "loopback_sockets.h"
+#include "responses.h"
+
+#include "browse.h"
+#include "buffers.h"
+
+#include <string>
+#include <vector>
+
+namespace
+{
+
+using namespace mdns;
+using namespace std::chrono_literals;
+
+using Memory = FixedSizeBuffer<2>;
+using Cache = RecordCache<SingleThreadSafe>;
+using Session = BrowseSession<Memory, LoopbackSockets, SingleThreadSafe>;
+
+struct Event {
+    BrowseEventType type;
+    std::string name;
+    std::string target;
+    uint16_t port;
+    size_t txt;
+};
+
+void test_events() {
+    Memory memory;
+    LoopbackSockets sockets;
+    Cache cache;
+    Session session(memory, sockets, cache, "_http._tcp.local");
+    CHECK(session.service_type() == "_http._tcp.local.");
+    std::vector<Event> events;
+    session.subscribe([&events](const BrowseEvent& event) {
+        const BrowseInstance& instance = event.instance;
+        events.push_back({event.type, std::string(instance.name), std::string(instance.target), instance.port,
+                          instance.txt.size()});
+    });
+
+    auto now = Clock::now();
+    Response announce;
+    CHECK(announce.writer.ptr(MDNS_ENTRYTYPE_ANSWER, "_http._tcp.local.", MDNS_CLASS_IN, 4500,
+                              "Printer._http._tcp.local."));
+    // Other service types are ignored
+    CHECK(announce.writer.ptr(MDNS_ENTRYTYPE_ANSWER, "_ipp._tcp.local.", MDNS_CLASS_IN, 4500,
+                              "Other._ipp._tcp.local."));
+    CHECK(announce.writer.srv(MDNS_ENTRYTYPE_ADDITIONAL, "Printer._http._tcp.local.", MDNS_CLASS_IN, 120, 0, 0, 80,
+                              "host.local."));
+    CHECK(insert_response(cache, announce, now) == 3);
+    CHECK(session.poll(0ms) == 1);
+    CHECK(events.size() == 1);
+    CHECK(events[0].type == BrowseEventType::Added);
+    CHECK(events[0].name == "Printer._http._tcp.local.");
+    CHECK(events[0].target == "host.local.");
+    CHECK(events[0].port == 80);
+    CHECK(session.size() == 1);
+
+    // Nothing changed
+    CHECK(insert_response(cache, announce, now) == 3);
+    CHECK(session.poll(0ms) == 0);
+
+    Response update;
+    CHECK(update.writer.srv(MDNS_ENTRYTYPE_ANSWER, "Printer._http._tcp.local.", MDNS_CLASS_IN, 120, 0, 0, 8080,
+                            "host.local."));
+    const uint8_t txt[] = {6, 'p', 'a', 't', 'h', '=', '/'};
+    CHECK(update.writer.txt(MDNS_ENTRYTYPE_ANSWER, "Printer._http._tcp.local.", MDNS_CLASS_IN, 4500, txt));
+    CHECK(insert_response(cache, update, now) == 2);
+    CHECK(session.poll(0ms) == 2);
+    CHECK(events.size() == 3);
+    CHECK(events[1].type == BrowseEventType::Updated && events[1].port == 8080);
+    CHECK(events[2].type == BrowseEventType::Updated && events[2].txt == sizeof(txt));
+
+    // A late subscriber learns about the known instances at once
+    int known = 0;
+    session.subscribe([&known](const BrowseEvent& event) { known += event.type == BrowseEventType::Added; });
+    CHECK(known == 1);
+
+    Response goodbye;
+    CHECK(goodbye.writer.ptr(MDNS_ENTRYTYPE_ANSWER, "_http._tcp.local.", MDNS_CLASS_IN, 0,
+                             "Printer._http._tcp.local."));
+    CHECK(insert_response(cache, goodbye, now) == 1);
+    cache.expire(now + Cache::FLUSH_DELAY);
+    CHECK(session.poll(0ms) == 1);
+    CHECK(events.size() == 4);
+    CHECK(events[3].type == BrowseEventType::Removed);
+    CHECK(events[3].name == "Printer._http._tcp.local.");
+    CHECK(session.size() == 0);
+}
+
+void test_known_before() {
+    Memory memory;
+    LoopbackSockets sockets;
+    Cache cache;
+    Response announce;
+    CHECK(announce.writer.ptr(MDNS_ENTRYTYPE_ANSWER, "_http._tcp.local.", MDNS_CLASS_IN, 4500,
+                              "Camera._http._tcp.local."));
+    CHECK(announce.writer.srv(MDNS_ENTRYTYPE_ADDITIONAL, "Camera._http._tcp.local.", MDNS_CLASS_IN, 120, 0, 0, 554,
+                              "camera.local."));
+    CHECK(insert_response(cache, announce, Clock::now()) == 2);
+
+    // Instances already in the cache are known from the start
+    Session session(memory, sockets, cache, "_http._tcp.local.");
+    CHECK(session.size() == 1);
+    uint16_t port = 0;
+    session.subscribe([&port](const BrowseEvent& event) { port = event.instance.port; });
+    CHECK(port == 554);
+}
+
+}
+
+int main() {
+    test_events();
+    test_known_before();
+    return 0;
+}
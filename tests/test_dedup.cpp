@@ -0,0 +1,144 @@
+// DuplicateFilter: copies of a record are dropped within the window however their names are compressed,
+// goodbyes and changed records pass
+
+#include "check.h"
+#include "responses.h"
+
+#include "dedup.h"
+
+#include <vector>
+
+#include <arpa/inet.h>
+
+namespace
+{
+
+using namespace mdns;
+using namespace std::chrono_literals;
+
+using Filter = DuplicateFilter<>;
+
+/// record_hash() of each record of \p response, in packet order
+std::vector<uint64_t> hashes(const Response& response) {
+    std::vector<uint64_t> result;
+    mdns_query_parse(
+        0, nullptr, 0, response.writer.data(), response.writer.size(),
+        [](int, const struct sockaddr*, size_t, mdns_entry_type_t, uint16_t, uint16_t rtype, uint16_t, uint32_t ttl,
+           const void* data, size_t size, size_t name_offset, size_t, size_t record_offset, size_t record_length,
+           void* user_data) {
+            static_cast<std::vector<uint64_t>*>(user_data)->push_back(
+                Filter::record_hash(data, size, name_offset, rtype, ttl, record_offset, record_length));
+            return 0;
+        },
+        &result, 0);
+    return result;
+}
+
+void test_window() {
+    Filter filter;
+    const auto now = Clock::now();
+    CHECK(!filter.duplicate(42, now));
+    CHECK(filter.duplicate(42, now + 1ms));
+    CHECK(filter.duplicate(42, now + Filter::WINDOW - 1ms));
+    CHECK(!filter.duplicate(43, now));
+    CHECK(filter.dropped() == 2);
+
+    // A copy after the window is new information and starts another window
+    CHECK(!filter.duplicate(42, now + Filter::WINDOW));
+    CHECK(filter.duplicate(42, now + Filter::WINDOW + 500ms));
+    CHECK(filter.dropped() == 3);
+}
+
+/// Hashes competing for the same slots: the oldest one is forgotten, never a newer one
+void test_ways() {
+    Filter filter;
+    const auto now = Clock::now();
+    // The hashes of x << 32 | x all start at slot 0
+    std::vector<uint64_t> colliding;
+    for (uint64_t x = 1; x <= Filter::WAYS + 1; ++x)
+        colliding.push_back(x << 32 | x);
+    for (size_t i = 0; i < Filter::WAYS; ++i)
+        CHECK(!filter.duplicate(colliding[i], now + std::chrono::microseconds(i)));
+    for (size_t i = 0; i < Filter::WAYS; ++i)
+        CHECK(filter.duplicate(colliding[i], now + 1ms));
+
+    CHECK(!filter.duplicate(colliding[Filter::WAYS], now + 1ms));
+    CHECK(!filter.duplicate(colliding[0], now + 2ms));
+    CHECK(filter.duplicate(colliding[Filter::WAYS], now + 2ms));
+    CHECK(filter.dropped() == Filter::WAYS + 1);
+}
+
+/// The same records in two responses, compressed against different names
+void test_compression() {
+    Response first;
+    CHECK(first.writer.ptr(MDNS_ENTRYTYPE_ANSWER, "_ipp._tcp.local.", MDNS_CLASS_IN, 4500, "Printer._ipp._tcp.local."));
+    CHECK(first.writer.srv(MDNS_ENTRYTYPE_ADDITIONAL, "Printer._ipp._tcp.local.", MDNS_CACHE_FLUSH | MDNS_CLASS_IN, 120,
+                           0, 0, 631, "printer.local."));
+    CHECK(first.writer.a(MDNS_ENTRYTYPE_ADDITIONAL, "printer.local.", MDNS_CACHE_FLUSH | MDNS_CLASS_IN, 120,
+                         htonl(0xc0a80102)));
+
+    Response second;
+    CHECK(second.writer.a(MDNS_ENTRYTYPE_ANSWER, "PRINTER.local.", MDNS_CACHE_FLUSH | MDNS_CLASS_IN, 120,
+                          htonl(0xc0a80102)));
+    CHECK(second.writer.srv(MDNS_ENTRYTYPE_ANSWER, "Printer._ipp._tcp.local.", MDNS_CACHE_FLUSH | MDNS_CLASS_IN, 120,
+                            0, 0, 631, "printer.local."));
+    CHECK(second.writer.ptr(MDNS_ENTRYTYPE_ANSWER, "_ipp._tcp.local.", MDNS_CLASS_IN, 4500,
+                            "Printer._ipp._tcp.local."));
+
+    const std::vector<uint64_t> hashes_first = hashes(first);
+    const std::vector<uint64_t> hashes_second = hashes(second);
+    CHECK(hashes_first.size() == 3 && hashes_second.size() == 3);
+    CHECK(hashes_first[0] == hashes_second[2]);
+    CHECK(hashes_first[1] == hashes_second[1]);
+    CHECK(hashes_first[2] == hashes_second[0]);
+    CHECK(hashes_first[0] != hashes_first[1] && hashes_first[1] != hashes_first[2]);
+
+    Filter filter;
+    const auto now = Clock::now();
+    for (uint64_t hash : hashes_first)
+        CHECK(!filter.duplicate(hash, now));
+    for (uint64_t hash : hashes_second)
+        CHECK(filter.duplicate(hash, now));
+}
+
+/// Goodbyes and records with other data are not copies, a changed TTL alone is
+void test_distinct() {
+    Response response;
+    const std::string_view instance = "Printer._ipp._tcp.local.";
+    CHECK(response.writer.srv(MDNS_ENTRYTYPE_ANSWER, instance, MDNS_CLASS_IN, 120, 0, 0, 631, "printer.local."));
+    CHECK(response.writer.srv(MDNS_ENTRYTYPE_ANSWER, instance, MDNS_CLASS_IN, 60, 0, 0, 631, "printer.local."));
+    CHECK(response.writer.srv(MDNS_ENTRYTYPE_ANSWER, instance, MDNS_CLASS_IN, 0, 0, 0, 631, "printer.local."));
+    CHECK(response.writer.srv(MDNS_ENTRYTYPE_ANSWER, instance, MDNS_CLASS_IN, 120, 0, 0, 632, "printer.local."));
+    CHECK(response.writer.srv(MDNS_ENTRYTYPE_ANSWER, instance, MDNS_CLASS_IN, 120, 0, 0, 631, "scanner.local."));
+    CHECK(response.writer.txt(MDNS_ENTRYTYPE_ANSWER, instance, MDNS_CLASS_IN, 120, {}));
+    const std::vector<uint64_t> hashes_all = hashes(response);
+    CHECK(hashes_all.size() == 6);
+    CHECK(hashes_all[0] == hashes_all[1]);
+    for (size_t i = 2; i < hashes_all.size(); ++i) {
+        for (size_t j = 0; j < i; ++j)
+            CHECK(hashes_all[i] != hashes_all[j]);
+    }
+}
+
+/// Record data beyond the packet is not read
+void test_truncated() {
+    Response response;
+    CHECK(response.writer.a(MDNS_ENTRYTYPE_ANSWER, "printer.local.", MDNS_CLASS_IN, 120, htonl(0xc0a80102)));
+    const size_t size = response.writer.size();
+    const uint64_t hash =
+        Filter::record_hash(response.writer.data(), size, 12, MDNS_RECORDTYPE_A, 120, size - 4, 4);
+    CHECK(Filter::record_hash(response.writer.data(), size, 12, MDNS_RECORDTYPE_A, 120, size - 4, 5) != hash);
+    CHECK(Filter::record_hash(response.writer.data(), size, 12, MDNS_RECORDTYPE_A, 120, size + 1, 0) != hash);
+    CHECK(Filter::record_hash(response.writer.data(), size, 12, MDNS_RECORDTYPE_PTR, 120, size - 4, 4) != hash);
+}
+
+}
+
+int main() {
+    test_window();
+    test_ways();
+    test_compression();
+    test_distinct();
+    test_truncated();
+    return 0;
+}
@@ -0,0 +1,300 @@
+// DnsGateway: unicast DNS requests are answered from the cache, misses wait for mDNS responses, names
+// outside local. and malformed requests get an error code
+
+#include "check.h"
+#include "loopback_sockets.h"
+#include "responses.h"
+
+#include "buffers.h"
+#include "dns_gateway.h"
+
+#include <cstring>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+using namespace mdns;
+using namespace std::chrono_literals;
+
+using Memory = FixedSizeBuffer<2>;
+using Cache = RecordCache<SingleThreadSafe>;
+using Gateway = DnsGateway<Memory, LoopbackSockets, SingleThreadSafe>;
+
+constexpr uint16_t RECURSION_DESIRED = 0x0100;
+constexpr uint16_t TRUNCATED = 0x0200;
+constexpr uint16_t OPT = 41;
+
+uint16_t field(const std::vector<uint8_t>& packet, size_t offset) {
+    return (uint16_t)(packet[offset] << 8 | packet[offset + 1]);
+}
+
+/// A question or record of a reply
+struct Entry {
+    mdns_entry_type_t entry;
+    std::string name;
+    uint16_t rtype;
+    uint16_t rclass;
+    std::vector<uint8_t> rdata;
+};
+
+std::vector<Entry> entries(const std::vector<uint8_t>& packet) {
+    std::vector<Entry> result;
+    mdns_packet_parse(
+        0, nullptr, 0, packet.data(), packet.size(),
+        [](int, const struct sockaddr*, size_t, mdns_entry_type_t entry, uint16_t, uint16_t rtype, uint16_t rclass,
+           uint32_t, const void* data, size_t size, size_t name_offset, size_t, size_t record_offset,
+           size_t record_length, void* user_data) {
+            const auto* rdata = (const uint8_t*)data + record_offset;
+            static_cast<std::vector<Entry>*>(user_data)->push_back(
+                {entry, std::string(WireName(data, size, name_offset).decompress().view()), rtype, rclass,
+                 entry == MDNS_ENTRYTYPE_QUESTION ? std::vector<uint8_t>() :
+                                                    std::vector<uint8_t>(rdata, rdata + record_length)});
+            return 0;
+        },
+        &result);
+    return result;
+}
+
+/// A free UDP port on the loopback interface
+uint16_t free_port() {
+    const int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t size = sizeof(address);
+    CHECK(sock >= 0 && bind(sock, (const sockaddr*)&address, sizeof(address)) == 0);
+    CHECK(getsockname(sock, (sockaddr*)&address, &size) == 0);
+    close(sock);
+    return ntohs(address.sin_port);
+}
+
+/// A stub resolver asking the gateway, and a responder answering the questions of the gateway
+class Client
+{
+public:
+    explicit Client(uint16_t port) {
+        m_sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        CHECK(m_sock >= 0);
+        m_gateway.sin_family = AF_INET;
+        m_gateway.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        m_gateway.sin_port = htons(port);
+    }
+    ~Client() { close(m_sock); }
+    Client(const Client&) = delete;
+    Client& operator=(const Client&) = delete;
+
+    /// Send a request with the \p flags and one question for \p name and \p rtype
+    /// \param payload UDP payload size of an EDNS record, 0 for none
+    void ask(uint16_t id, uint16_t flags, std::string_view name, uint16_t rtype, uint16_t rclass = MDNS_CLASS_IN,
+             uint16_t payload = 0) {
+        uint8_t data[512];
+        PacketWriter writer(data, sizeof(data));
+        writer.begin(id, flags);
+        CHECK(writer.question(name, rtype, rclass));
+        if (payload)
+            CHECK(writer.record(MDNS_ENTRYTYPE_ADDITIONAL, "", OPT, payload, 0, {}));
+        send(writer, m_gateway);
+    }
+
+    /// Send \p response to the mDNS socket \p sock of the gateway
+    void respond(const Response& response, int sock) {
+        sockaddr_in address{};
+        socklen_t size = sizeof(address);
+        CHECK(getsockname(sock, (sockaddr*)&address, &size) == 0);
+        send(response.writer, address);
+    }
+
+    std::optional<std::vector<uint8_t>> receive() {
+        std::vector<uint8_t> packet(2048);
+        const ssize_t size = recv(m_sock, packet.data(), packet.size(), 0);
+        if (size <= 0)
+            return std::nullopt;
+        packet.resize((size_t)size);
+        return packet;
+    }
+
+    /// Poll \p gateway until a reply arrives, for up to \p timeout
+    std::optional<std::vector<uint8_t>> wait(Gateway& gateway, Clock::duration timeout) {
+        const auto until = Clock::now() + timeout;
+        while (Clock::now() < until) {
+            CHECK(gateway.poll(20ms) >= 0);
+            if (auto reply = receive())
+                return reply;
+        }
+        return std::nullopt;
+    }
+
+private:
+    void send(const PacketWriter& writer, const sockaddr_in& to) {
+        CHECK(sendto(m_sock, writer.data(), writer.size(), 0, (const sockaddr*)&to, sizeof(to)) ==
+              (ssize_t)writer.size());
+    }
+
+    int m_sock;
+    sockaddr_in m_gateway{};
+};
+
+struct Setup {
+    explicit Setup(Clock::duration timeout = Gateway::DEFAULT_TIMEOUT) {
+        CHECK(gateway.open("127.0.0.1", port, timeout));
+        CHECK(sockets.opened().size() == 1);
+    }
+
+    Memory memory;
+    LoopbackSockets sockets;
+    Cache cache;
+    Gateway gateway{memory, sockets, cache};
+    uint16_t port = free_port();
+    Client client{port};
+};
+
+/// Cached records are answered by the poll() that receives the request
+void test_cache_hit() {
+    Setup setup;
+    Response announce;
+    CHECK(announce.writer.a(MDNS_ENTRYTYPE_ANSWER, "printer.local.", MDNS_CACHE_FLUSH | MDNS_CLASS_IN, 120,
+                            htonl(0xc0a80102)));
+    CHECK(insert_response(setup.cache, announce, Clock::now()) == 1);
+
+    setup.client.ask(0x1234, RECURSION_DESIRED, "Printer.local.", MDNS_RECORDTYPE_A);
+    CHECK(setup.gateway.poll(100ms) == 1);
+    const auto reply = setup.client.receive();
+    CHECK(reply);
+    CHECK(field(*reply, 0) == 0x1234);
+    CHECK(field(*reply, 2) == (0x8400 | RECURSION_DESIRED));
+    CHECK(field(*reply, 4) == 1 && field(*reply, 6) == 1 && field(*reply, 10) == 0);
+    const std::vector<Entry> found = entries(*reply);
+    CHECK(found.size() == 2);
+    CHECK(found[0].entry == MDNS_ENTRYTYPE_QUESTION && found[0].name == "Printer.local.");
+    CHECK(found[1].entry == MDNS_ENTRYTYPE_ANSWER && found[1].rtype == MDNS_RECORDTYPE_A);
+    // Unicast DNS has no cache flush bit, the name may be compressed against the question
+    CHECK(name_equal(found[1].name, "printer.local.") && found[1].rclass == MDNS_CLASS_IN);
+    CHECK(found[1].rdata == std::vector<uint8_t>({192, 168, 1, 2}));
+    CHECK(setup.gateway.pending() == 0);
+}
+
+/// Only the rcode is sent back for requests the gateway does not serve
+void test_errors() {
+    Setup setup;
+    const auto check_error = [&](uint16_t flags, std::string_view name, uint16_t rclass, uint16_t rcode) {
+        setup.client.ask(7, flags, name, MDNS_RECORDTYPE_A, rclass);
+        CHECK(setup.gateway.poll(100ms) == 1);
+        const auto reply = setup.client.receive();
+        CHECK(reply && reply->size() == sizeof(mdns_header_t));
+        CHECK(field(*reply, 0) == 7);
+        CHECK((field(*reply, 2) & 0x800F) == (0x8000 | rcode));
+    };
+    check_error(0, "example.com.", MDNS_CLASS_IN, 5);
+    check_error(0, "local.example.com.", MDNS_CLASS_IN, 5);
+    check_error(0, "printer.local.", 3, 5);
+    // Inverse queries (opcode 1) and status requests (opcode 2)
+    check_error(1 << 11, "printer.local.", MDNS_CLASS_IN, 4);
+    check_error(2 << 11, "printer.local.", MDNS_CLASS_IN, 4);
+
+    uint8_t data[512];
+    PacketWriter writer(data, sizeof(data));
+    writer.begin(7, 0);
+    CHECK(writer.question("printer.local.", MDNS_RECORDTYPE_A, MDNS_CLASS_IN));
+    CHECK(writer.question("scanner.local.", MDNS_RECORDTYPE_A, MDNS_CLASS_IN));
+    sockaddr_in gateway{};
+    gateway.sin_family = AF_INET;
+    gateway.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    gateway.sin_port = htons(setup.port);
+    const int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    CHECK(sendto(sock, writer.data(), writer.size(), 0, (const sockaddr*)&gateway, sizeof(gateway)) > 0);
+    CHECK(setup.gateway.poll(100ms) == 1);
+    std::vector<uint8_t> reply(512);
+    CHECK(recv(sock, reply.data(), reply.size(), MSG_DONTWAIT) == sizeof(mdns_header_t));
+    CHECK((field(reply, 2) & 0x800F) == 0x8001);
+    close(sock);
+    CHECK(setup.gateway.pending() == 0);
+}
+
+/// A miss is asked on the network and answered once a response arrives
+void test_cache_miss() {
+    Setup setup;
+    setup.client.ask(1, 0, "scanner.local.", MDNS_RECORDTYPE_A);
+    CHECK(setup.gateway.poll(0ms) == 0);
+    CHECK(setup.gateway.pending() == 1);
+    CHECK(!setup.client.receive());
+    // Asking again does not add a request
+    setup.client.ask(1, 0, "scanner.local.", MDNS_RECORDTYPE_A);
+    CHECK(setup.gateway.poll(0ms) == 0);
+    CHECK(setup.gateway.pending() == 1);
+
+    Response response;
+    CHECK(response.writer.a(MDNS_ENTRYTYPE_ANSWER, "scanner.local.", MDNS_CACHE_FLUSH | MDNS_CLASS_IN, 120,
+                            htonl(0xc0a80103)));
+    setup.client.respond(response, setup.sockets.opened()[0]);
+    const auto reply = setup.client.wait(setup.gateway, Gateway::DEFAULT_TIMEOUT);
+    CHECK(reply);
+    CHECK(field(*reply, 0) == 1 && (field(*reply, 2) & 0x000F) == 0);
+    const std::vector<Entry> found = entries(*reply);
+    CHECK(found.size() == 2 && found[1].rdata == std::vector<uint8_t>({192, 168, 1, 3}));
+    CHECK(setup.gateway.pending() == 0);
+    CHECK(!setup.client.receive());
+}
+
+/// Requests nobody answers get NXDOMAIN after the timeout, or an empty answer if the name has other records
+void test_timeout() {
+    Setup setup(100ms);
+    Response announce;
+    CHECK(announce.writer.a(MDNS_ENTRYTYPE_ANSWER, "printer.local.", MDNS_CACHE_FLUSH | MDNS_CLASS_IN, 120,
+                            htonl(0xc0a80102)));
+    CHECK(insert_response(setup.cache, announce, Clock::now()) == 1);
+
+    setup.client.ask(2, 0, "nobody.local.", MDNS_RECORDTYPE_A);
+    auto reply = setup.client.wait(setup.gateway, 2s);
+    CHECK(reply && field(*reply, 0) == 2);
+    CHECK((field(*reply, 2) & 0x000F) == 3);
+    CHECK(field(*reply, 4) == 1 && field(*reply, 6) == 0);
+
+    setup.client.ask(3, 0, "printer.local.", MDNS_RECORDTYPE_TXT);
+    reply = setup.client.wait(setup.gateway, 2s);
+    CHECK(reply && field(*reply, 0) == 3);
+    CHECK((field(*reply, 2) & 0x000F) == 0);
+    CHECK(field(*reply, 4) == 1 && field(*reply, 6) == 0);
+    CHECK(setup.gateway.pending() == 0);
+}
+
+/// Answers that do not fit the payload size of the client are truncated
+void test_truncation() {
+    Setup setup;
+    Response announce;
+    constexpr uint32_t ADDRESSES = 40;
+    for (uint32_t i = 0; i < ADDRESSES; ++i)
+        CHECK(announce.writer.a(MDNS_ENTRYTYPE_ANSWER, "farm.local.", MDNS_CLASS_IN, 120, htonl(0x0a000000 + i)));
+    CHECK(insert_response(setup.cache, announce, Clock::now()) == ADDRESSES);
+
+    // 512 bytes without EDNS
+    setup.client.ask(4, 0, "farm.local.", MDNS_RECORDTYPE_A);
+    CHECK(setup.gateway.poll(100ms) == 1);
+    auto reply = setup.client.receive();
+    CHECK(reply && reply->size() <= 512);
+    CHECK(field(*reply, 2) & TRUNCATED);
+    CHECK(field(*reply, 4) == 1 && field(*reply, 6) == 0);
+
+    // The payload size of the EDNS record, which is answered with one of its own
+    setup.client.ask(5, 0, "farm.local.", MDNS_RECORDTYPE_A, MDNS_CLASS_IN, 4096);
+    CHECK(setup.gateway.poll(100ms) == 1);
+    reply = setup.client.receive();
+    CHECK(reply && reply->size() > 512);
+    CHECK(!(field(*reply, 2) & TRUNCATED));
+    CHECK(field(*reply, 6) == ADDRESSES && field(*reply, 10) == 1);
+    const std::vector<Entry> found = entries(*reply);
+    CHECK(found.back().rtype == OPT && found.back().rclass == Gateway::MAX_PAYLOAD);
+}
+
+}
+
+int main() {
+    test_cache_hit();
+    test_errors();
+    test_cache_miss();
+    test_timeout();
+    test_truncation();
+    return 0;
+}
@@ -0,0 +1,166 @@
+// ProbeSet: simultaneous probes are resolved by comparing the proposed records, conflicting responses
+// rename the instance or its host
+
+#include "check.h"
+
+#include "probe.h"
+
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+
+namespace
+{
+
+using namespace mdns;
+using namespace std::chrono_literals;
+
+constexpr std::string_view FULL_NAME = "Printer._ipp._tcp.local.";
+
+ServiceInstance printer() {
+    ServiceInstance instance;
+    instance.name = "Printer";
+    instance.service_type = "_ipp._tcp.local.";
+    instance.host = "printer.local.";
+    instance.port = 631;
+    instance.ipv4 = htonl(0xc0a80102);
+    return instance;
+}
+
+/// Sends the probes and announcements due at \p now
+struct Runner {
+    ProbeSet& probes;
+    std::vector<ServiceInstance> published{};
+    std::pmr::vector<std::pmr::string> announced{};
+    size_t packets{};
+
+    void run(Clock::time_point now) {
+        uint8_t data[1440];
+        PacketWriter writer(data, sizeof(data));
+        probes.run(now, writer, [this](PacketWriter&) { ++packets; }, published, announced);
+    }
+};
+
+/// A probe of another host for our instance name, proposing an SRV record with \p port
+struct OtherProbe {
+    explicit OtherProbe(uint16_t port, std::string_view host = "printer.local.") {
+        writer.begin(0, 0);
+        CHECK(writer.question(FULL_NAME, 255, MDNS_CLASS_IN));
+        CHECK(writer.srv(MDNS_ENTRYTYPE_AUTHORITY, FULL_NAME, MDNS_CLASS_IN, HOST_RECORD_TTL, 0, 0, port, host));
+        CHECK(writer.txt(MDNS_ENTRYTYPE_AUTHORITY, FULL_NAME, MDNS_CLASS_IN, SERVICE_RECORD_TTL, {}));
+    }
+
+    uint8_t data[512];
+    PacketWriter writer{data, sizeof(data)};
+};
+
+/// Add the printer and send its first probe
+Clock::time_point start(ProbeSet& probes, Runner& runner) {
+    const auto added = Clock::now();
+    CHECK(probes.add(printer(), added));
+    const auto first = probes.next_deadline();
+    CHECK(first >= added && first <= added + ProbeSet::PROBE_DELAY);
+    runner.run(first);
+    CHECK(runner.packets == 1);
+    CHECK(probes.next_deadline() == first + ProbeSet::PROBE_INTERVAL);
+    return first;
+}
+
+void test_tie_break_lost() {
+    ProbeSet probes;
+    Runner runner{probes};
+    const auto now = start(probes, runner);
+
+    // Their SRV record is greater, ours loses and probes again after a second
+    OtherProbe other(632);
+    probes.received(other.writer.data(), other.writer.size(), now);
+    CHECK(probes.next_deadline() == now + ProbeSet::DEFER_DELAY);
+    CHECK(runner.published.empty());
+}
+
+void test_tie_break_won() {
+    ProbeSet probes;
+    Runner runner{probes};
+    auto now = start(probes, runner);
+
+    // Their SRV record is smaller, they back off. The host is compared byte by byte.
+    OtherProbe lower_port(630);
+    probes.received(lower_port.writer.data(), lower_port.writer.size(), now);
+    OtherProbe lower_host(631, "other.local.");
+    probes.received(lower_host.writer.data(), lower_host.writer.size(), now);
+    CHECK(probes.next_deadline() == now + ProbeSet::PROBE_INTERVAL);
+
+    for (unsigned i = 1; i < ProbeSet::PROBE_COUNT; ++i) {
+        now += ProbeSet::PROBE_INTERVAL;
+        runner.run(now);
+    }
+    CHECK(runner.packets == ProbeSet::PROBE_COUNT);
+    CHECK(runner.published.empty());
+    now += ProbeSet::PROBE_INTERVAL;
+    runner.run(now);
+    CHECK(runner.published.size() == 1);
+    CHECK(runner.announced.size() == 1 && runner.announced[0] == FULL_NAME);
+}
+
+void test_own_probe() {
+    ProbeSet probes;
+    Runner runner{probes};
+    const auto now = start(probes, runner);
+
+    // Our own probe looped back proposes the same records
+    OtherProbe same(631);
+    probes.received(same.writer.data(), same.writer.size(), now);
+    CHECK(probes.next_deadline() == now + ProbeSet::PROBE_INTERVAL);
+}
+
+void test_conflicts() {
+    ProbeSet probes;
+    std::vector<ServiceInstance> renamed;
+    probes.set_conflict_callback(
+        [](const ServiceInstance& instance, void* user_data) {
+            static_cast<std::vector<ServiceInstance>*>(user_data)->push_back(instance);
+        },
+        &renamed);
+    Runner runner{probes};
+    auto now = start(probes, runner);
+
+    // A response with another SRV record for the instance name: the name is taken
+    uint8_t data[512];
+    PacketWriter response(data, sizeof(data));
+    response.begin(0, 0x8400);
+    CHECK(response.srv(MDNS_ENTRYTYPE_ANSWER, FULL_NAME, MDNS_CACHE_FLUSH | MDNS_CLASS_IN, HOST_RECORD_TTL, 0, 0, 80,
+                       "other.local."));
+    probes.received(response.data(), response.size(), now);
+    CHECK(renamed.size() == 1);
+    CHECK(renamed[0].name == "Printer (2)");
+    CHECK(renamed[0].host == "printer.local.");
+    CHECK(probes.size() == 1);
+
+    // A response with another address for the host
+    response.begin(0, 0x8400);
+    CHECK(response.a(MDNS_ENTRYTYPE_ANSWER, "printer.local.", MDNS_CACHE_FLUSH | MDNS_CLASS_IN, HOST_RECORD_TTL,
+                     htonl(0xc0a80103)));
+    probes.received(response.data(), response.size(), now);
+    CHECK(renamed.size() == 2);
+    CHECK(renamed[1].name == "Printer (2)");
+    CHECK(renamed[1].host == "printer-2.local.");
+
+    // Responses for the old names are no conflict anymore
+    probes.received(response.data(), response.size(), now);
+    CHECK(renamed.size() == 2);
+
+    // The renamed instance is probed from the start
+    runner.run(probes.next_deadline());
+    CHECK(runner.packets == 2);
+}
+
+}
+
+int main() {
+    test_tie_break_lost();
+    test_tie_break_won();
+    test_own_probe();
+    test_conflicts();
+    return 0;
+}
@@ -0,0 +1,125 @@
+// SpscQueue and MpscQueue: order, capacity, destruction of queued elements and concurrent use
+
+#include "check.h"
+
+#include "queue.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+using namespace mdns;
+
+/// Counts live instances, to find elements that are never destroyed or destroyed twice
+struct Tracked {
+    static inline int live = 0;
+
+    explicit Tracked(int value = 0) : value(std::make_unique<int>(value)) { ++live; }
+    Tracked(Tracked&& other) noexcept : value(std::move(other.value)) { ++live; }
+    Tracked& operator=(Tracked&& other) noexcept = default;
+    ~Tracked() { --live; }
+
+    std::unique_ptr<int> value;
+};
+
+template<class Queue>
+void test_single_thread() {
+    {
+        Queue queue;
+        for (int i = 0; i < (int)Queue::capacity(); ++i) {
+            Tracked element(i);
+            CHECK(queue.try_push(std::move(element)));
+        }
+        // A full queue rejects the element and leaves it untouched
+        Tracked extra(-1);
+        CHECK(!queue.try_push(std::move(extra)));
+        CHECK(extra.value && *extra.value == -1);
+        CHECK(queue.rejected() == 1);
+        CHECK(queue.size() == Queue::capacity());
+
+        Tracked element;
+        for (int i = 0; i < 3; ++i) {
+            CHECK(queue.try_pop(element));
+            CHECK(*element.value == i);
+        }
+        // Wraps around
+        for (int i = 0; i < 3; ++i) {
+            Tracked next((int)Queue::capacity() + i);
+            CHECK(queue.try_push(std::move(next)));
+        }
+        for (int i = 3; i < (int)Queue::capacity() + 3; ++i) {
+            CHECK(queue.try_pop(element));
+            CHECK(*element.value == i);
+        }
+        CHECK(!queue.try_pop(element));
+        CHECK(queue.size() == 0);
+
+        // Elements still queued are destroyed with the queue
+        for (int i = 0; i < 5; ++i) {
+            Tracked queued(i);
+            CHECK(queue.try_push(std::move(queued)));
+        }
+    }
+    CHECK(Tracked::live == 0);
+}
+
+/// Each producer pushes increasing values tagged with its index, the consumer checks that every value
+/// arrives exactly once and in order per producer
+template<class Queue>
+void test_threads(int producers) {
+    constexpr uint32_t COUNT = 100000;
+    auto queue = std::make_unique<Queue>();
+    std::atomic<bool> running{true};
+
+    std::vector<uint32_t> next(producers);
+    uint64_t received = 0;
+    std::thread consumer([&] {
+        uint64_t value;
+        while (received < (uint64_t)producers * COUNT) {
+            if (!queue->try_pop(value)) {
+                queue->wait(running);
+                continue;
+            }
+            const auto producer = (size_t)(value >> 32);
+            CHECK(producer < next.size());
+            CHECK((uint32_t)value == next[producer]);
+            ++next[producer];
+            ++received;
+        }
+    });
+
+    std::vector<std::thread> threads;
+    for (int producer = 0; producer < producers; ++producer) {
+        threads.emplace_back([&queue, producer] {
+            for (uint32_t i = 0; i < COUNT; ++i) {
+                uint64_t value = ((uint64_t)producer << 32) | i;
+                while (!queue->try_push(std::move(value)))
+                    std::this_thread::yield();
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    consumer.join();
+    running = false;
+
+    CHECK(received == (uint64_t)producers * COUNT);
+    for (uint32_t count : next)
+        CHECK(count == COUNT);
+    CHECK(queue->size() == 0);
+}
+
+}
+
+int main() {
+    test_single_thread<SpscQueue<Tracked, 8>>();
+    test_single_thread<MpscQueue<Tracked, 8>>();
+    test_threads<SpscQueue<uint64_t, 64>>(1);
+    test_threads<MpscQueue<uint64_t, 64>>(4);
+    return 0;
+}
@@ -0,0 +1,124 @@
+// RateLimiter: records are multicast once per interval and socket, unicast responses are limited by a
+// token bucket per source address, SharedMulticastLimit applies the multicast limit across threads
+
+#include "check.h"
+
+#include "rate_limit.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+
+namespace
+{
+
+using namespace mdns;
+using namespace std::chrono_literals;
+
+sockaddr_in ipv4_source(uint32_t address, uint16_t port) {
+    sockaddr_in source{};
+    source.sin_family = AF_INET;
+    source.sin_addr.s_addr = htonl(address);
+    source.sin_port = htons(port);
+    return source;
+}
+
+void test_multicast() {
+    RateLimiter limiter;
+    const auto now = Clock::now();
+    CHECK(limiter.multicast(3, 1, now));
+    CHECK(!limiter.multicast(3, 1, now));
+    CHECK(!limiter.multicast(3, 1, now + RateLimiter::MULTICAST_INTERVAL - 1ms));
+    // Other sockets and other records are limited on their own
+    CHECK(limiter.multicast(4, 1, now));
+    CHECK(limiter.multicast(3, 2, now));
+    CHECK(limiter.stats().suppressed == 2);
+
+    // A suppressed record does not restart the interval
+    CHECK(limiter.multicast(3, 1, now + RateLimiter::MULTICAST_INTERVAL));
+    CHECK(!limiter.multicast(3, 1, now + RateLimiter::MULTICAST_INTERVAL + 500ms));
+    CHECK(limiter.stats().suppressed == 3);
+    CHECK(limiter.stats().dropped == 0);
+}
+
+/// More records than the table holds: the latest ones are still limited
+void test_multicast_full() {
+    RateLimiter limiter;
+    const auto now = Clock::now();
+    constexpr uint64_t RECORDS = 4 * RateLimiter::RECORDS;
+    for (uint64_t record = 0; record < RECORDS; ++record)
+        CHECK(limiter.multicast(3, record, now + std::chrono::microseconds(record)));
+    const auto later = now + std::chrono::microseconds(RECORDS);
+    for (uint64_t record = RECORDS - 8; record < RECORDS; ++record)
+        CHECK(!limiter.multicast(3, record, later));
+}
+
+void test_unicast() {
+    RateLimiter limiter;
+    const auto now = Clock::now();
+    const sockaddr_in source = ipv4_source(0xc0a80102, 5353);
+    for (int i = 0; i < (int)RateLimiter::UNICAST_BURST; ++i)
+        CHECK(limiter.unicast((const sockaddr*)&source, now));
+    CHECK(!limiter.unicast((const sockaddr*)&source, now));
+    // Legacy unicast queries from another port share the bucket of the address
+    const sockaddr_in other_port = ipv4_source(0xc0a80102, 40000);
+    CHECK(!limiter.unicast((const sockaddr*)&other_port, now));
+    const sockaddr_in other_address = ipv4_source(0xc0a80103, 5353);
+    CHECK(limiter.unicast((const sockaddr*)&other_address, now));
+    sockaddr_in6 ipv6{};
+    ipv6.sin6_family = AF_INET6;
+    ipv6.sin6_addr.s6_addr[15] = 1;
+    CHECK(limiter.unicast((const sockaddr*)&ipv6, now));
+    CHECK(limiter.stats().dropped == 2);
+
+    // Tokens come back at UNICAST_RATE per second
+    const auto refill =
+        std::chrono::duration_cast<Clock::duration>(std::chrono::duration<float>(1 / RateLimiter::UNICAST_RATE));
+    auto later = now + refill + 1ms;
+    CHECK(limiter.unicast((const sockaddr*)&source, later));
+    CHECK(!limiter.unicast((const sockaddr*)&source, later));
+
+    // Up to UNICAST_BURST of them
+    later += 1h;
+    int sent = 0;
+    while (limiter.unicast((const sockaddr*)&source, later))
+        ++sent;
+    CHECK(sent == (int)RateLimiter::UNICAST_BURST);
+    CHECK(limiter.stats().dropped == 4);
+    CHECK(limiter.stats().suppressed == 0);
+}
+
+/// Every record is multicast by one of the threads
+void test_shared() {
+    SharedMulticastLimit limit;
+    const auto now = Clock::now();
+    constexpr uint64_t RECORDS = 500;
+    constexpr int THREADS = 4;
+    std::atomic<uint64_t> sent{};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < THREADS; ++i) {
+        threads.emplace_back([&] {
+            for (uint64_t record = 0; record < RECORDS; ++record) {
+                if (limit.multicast(3, record, now))
+                    sent.fetch_add(1);
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    CHECK(sent == RECORDS);
+    CHECK(limit.stats().suppressed == (THREADS - 1) * RECORDS);
+    CHECK(limit.stats().dropped == 0);
+}
+
+}
+
+int main() {
+    test_multicast();
+    test_multicast_full();
+    test_unicast();
+    test_shared();
+    return 0;
+}
@@ -0,0 +1,140 @@
+// Record cache: refresh queries at 80, 85, 90 and 95 % of the TTL, expiry, goodbyes and cache flushes
+
+#include "check.h"
+#include "responses.h"
+
+#include "record_cache.h"
+
+#include <arpa/inet.h>
+
+namespace
+{
+
+using namespace mdns;
+using namespace std::chrono_literals;
+
+using Cache = RecordCache<SingleThreadSafe>;
+
+size_t count(Cache& cache, std::string_view name, uint16_t rtype, Clock::time_point now) {
+    return cache.find(name, rtype, now, [](const CacheRecord&) {});
+}
+
+size_t refresh(Cache& cache, Clock::time_point now) {
+    Cache::Question questions[4];
+    return cache.collect_refresh(now, questions);
+}
+
+void test_refresh() {
+    Cache cache;
+    const auto start = Clock::now();
+    cache.add_interest("printer.local.", MDNS_RECORDTYPE_A);
+    Response response;
+    CHECK(response.writer.a(MDNS_ENTRYTYPE_ANSWER, "printer.local.", MDNS_CLASS_IN, 100, htonl(0xc0a80102)));
+    CHECK(insert_response(cache, response, start) == 1);
+    CHECK(cache.size() == 1);
+    CHECK(count(cache, "PRINTER.local.", MDNS_RECORDTYPE_A, start) == 1);
+
+    // One query per step, each within 2 % of the TTL after its step
+    CHECK(refresh(cache, start + 79s) == 0);
+    CHECK(refresh(cache, start + 83s) == 1);
+    CHECK(refresh(cache, start + 83s) == 0);
+    CHECK(refresh(cache, start + 88s) == 1);
+    CHECK(refresh(cache, start + 93s) == 1);
+    CHECK(refresh(cache, start + 98s) == 1);
+    CHECK(refresh(cache, start + 99s) == 0);
+
+    // The record expires after its TTL
+    CHECK(cache.expire(start + 99s) == 0);
+    CHECK(count(cache, "printer.local.", MDNS_RECORDTYPE_A, start + 101s) == 0);
+    CHECK(cache.expire(start + 101s) == 1);
+    CHECK(cache.size() == 0);
+}
+
+void test_received_again() {
+    Cache cache;
+    const auto start = Clock::now();
+    cache.add_interest("printer.local.", MDNS_RECORDTYPE_A);
+    Response response;
+    CHECK(response.writer.a(MDNS_ENTRYTYPE_ANSWER, "printer.local.", MDNS_CLASS_IN, 100, htonl(0xc0a80102)));
+    int added = 0;
+    int refreshed = 0;
+    cache.subscribe([&](CacheEvent event, const CacheRecord&) {
+        added += event == CacheEvent::Added;
+        refreshed += event == CacheEvent::Refreshed;
+    });
+    CHECK(insert_response(cache, response, start) == 1);
+    // Many copies, as while a flood of announcements arrives
+    for (auto at = start; at < start + 50s; at += 10ms)
+        CHECK(insert_response(cache, response, at) == 1);
+    CHECK(added == 1 && refreshed == 5000);
+    CHECK(cache.size() == 1);
+
+    // Refresh and expiry start over from the last copy
+    const auto last = start + 50s - 10ms;
+    CHECK(refresh(cache, start + 83s) == 0);
+    CHECK(cache.expire(start + 101s) == 0);
+    CHECK(refresh(cache, last + 79s) == 0);
+    CHECK(refresh(cache, last + 83s) == 1);
+    CHECK(cache.expire(last + 99s) == 0);
+    CHECK(cache.expire(last + 101s) == 1);
+}
+
+void test_goodbye() {
+    Cache cache;
+    const auto start = Clock::now();
+    Response announce;
+    CHECK(announce.writer.ptr(MDNS_ENTRYTYPE_ANSWER, "_ipp._tcp.local.", MDNS_CLASS_IN, 4500,
+                              "Printer._ipp._tcp.local."));
+    CHECK(insert_response(cache, announce, start) == 1);
+
+    Response goodbye;
+    CHECK(goodbye.writer.ptr(MDNS_ENTRYTYPE_ANSWER, "_ipp._tcp.local.", MDNS_CLASS_IN, 0, "Printer._ipp._tcp.local."));
+    CHECK(insert_response(cache, goodbye, start + 10s) == 1);
+    // Removed one second later (RFC 6762 10.1)
+    CHECK(count(cache, "_ipp._tcp.local.", MDNS_RECORDTYPE_PTR, start + 10s) == 1);
+    CHECK(cache.expire(start + 10s + Cache::FLUSH_DELAY - 1ms) == 0);
+    int removed = 0;
+    cache.expire(start + 10s + Cache::FLUSH_DELAY,
+                 [&removed](CacheEvent event, const CacheRecord&) { removed += event == CacheEvent::Removed; });
+    CHECK(removed == 1);
+    CHECK(cache.size() == 0);
+}
+
+void test_cache_flush() {
+    Cache cache;
+    const auto start = Clock::now();
+    Response first;
+    CHECK(first.writer.a(MDNS_ENTRYTYPE_ANSWER, "host.local.", MDNS_CLASS_IN, 120, htonl(0xc0a80102)));
+    CHECK(insert_response(cache, first, start) == 1);
+
+    // A new address with the cache flush bit replaces the old one
+    Response second;
+    CHECK(second.writer.a(MDNS_ENTRYTYPE_ANSWER, "host.local.", MDNS_CLASS_IN | MDNS_CACHE_FLUSH, 120,
+                          htonl(0xc0a80103)));
+    CHECK(insert_response(cache, second, start + 5s) == 1);
+    CHECK(count(cache, "host.local.", MDNS_RECORDTYPE_A, start + 5s) == 2);
+    CHECK(cache.expire(start + 5s + Cache::FLUSH_DELAY) == 1);
+    uint8_t last = 0;
+    CHECK(cache.find("host.local.", MDNS_RECORDTYPE_A, start + 6s,
+                     [&last](const CacheRecord& record) { last = record.rdata.back(); }) == 1);
+    CHECK(last == 3);
+}
+
+void test_malformed_name() {
+    Cache cache;
+    // The name of the record is a reference to itself
+    uint8_t packet[32] = {0, 0, 0x84, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0xc0, 12, 0, 1, 0, 1, 0, 0, 0, 120, 0, 4, 1, 2, 3, 4};
+    CHECK(!cache.insert(packet, 28, 12, MDNS_RECORDTYPE_A, MDNS_CLASS_IN, 120, 24, 4, Clock::now()));
+    CHECK(cache.size() == 0);
+}
+
+}
+
+int main() {
+    test_refresh();
+    test_received_again();
+    test_goodbye();
+    test_cache_flush();
+    test_malformed_name();
+    return 0;
+}
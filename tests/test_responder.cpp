@@ -0,0 +1,163 @@
+// Responder: questions of packets received elsewhere are answered into a sink, as in ResponderPipeline
+
+#include "check.h"
+
+#include "buffers.h"
+#include "packet.h"
+#include "responder.h"
+#include "socket_unix.h"
+
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace
+{
+
+using namespace mdns;
+
+/// A socket on the loopback interface that receives the queries of a client socket. The client
+/// sends from an ephemeral port, so its queries are legacy unicast queries.
+class Loopback
+{
+public:
+    Loopback() {
+        m_server = socket(AF_INET, SOCK_DGRAM, 0);
+        m_client = socket(AF_INET, SOCK_DGRAM, 0);
+        CHECK(m_server >= 0 && m_client >= 0);
+        m_address.sin_family = AF_INET;
+        m_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        CHECK(bind(m_server, (const sockaddr*)&m_address, sizeof(m_address)) == 0);
+        socklen_t address_size = sizeof(m_address);
+        CHECK(getsockname(m_server, (sockaddr*)&m_address, &address_size) == 0);
+    }
+    ~Loopback() {
+        close(m_server);
+        close(m_client);
+    }
+    Loopback(const Loopback&) = delete;
+    Loopback& operator=(const Loopback&) = delete;
+
+    /// Send a query with one question for \p name and \p rtype and receive it into a buffer of \p memory
+    template<class Memory>
+    SharedPacket<Memory> query(Memory& memory, uint16_t query_id, std::string_view name, uint16_t rtype) {
+        uint8_t data[512];
+        PacketWriter writer(data, sizeof(data));
+        writer.begin(query_id, 0);
+        CHECK(writer.question(name, rtype, MDNS_CLASS_IN));
+        CHECK(sendto(m_client, writer.data(), writer.size(), 0, (const sockaddr*)&m_address, sizeof(m_address)) ==
+              (ssize_t)writer.size());
+        return SharedPacket<Memory>::receive(memory, m_server);
+    }
+
+private:
+    int m_server;
+    int m_client;
+    sockaddr_in m_address{};
+};
+
+/// Keeps a copy of every response and releases its buffer
+template<class Worker, class Memory>
+struct Sink {
+    Memory& memory;
+    std::vector<std::vector<uint8_t>> responses{};
+
+    static bool take(typename Worker::Response& response, void* user_data) {
+        auto* sink = static_cast<Sink*>(user_data);
+        const auto* data = (const uint8_t*)response.buffer->data();
+        sink->responses.emplace_back(data, data + response.size);
+        sink->memory.release(response.buffer);
+        return true;
+    }
+};
+
+ServiceInstance printer(int index) {
+    ServiceInstance instance;
+    instance.name = "printer-" + std::to_string(index);
+    instance.service_type = "_ipp._tcp.local.";
+    instance.host = "host-" + std::to_string(index) + ".local.";
+    instance.port = 631;
+    instance.ipv4 = htonl(0xc0a80100 + index);
+    return instance;
+}
+
+/// Responders that are not opened hold no buffers between packets, so more of them than the memory
+/// manager has buffers answer in turn
+void test_idle_buffers() {
+    using Memory = FixedSizeBuffer<3>;
+    using Worker = Responder<Memory, UnixSocket, SingleThreadSafe>;
+    Memory memory;
+    UnixSocket sockets;
+    ServiceRegistry<SingleThreadSafe> registry;
+    CHECK(registry.add(printer(1)));
+    Loopback loopback;
+    Sink<Worker, Memory> sink{memory};
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (int i = 0; i < 6; ++i)
+        workers.push_back(std::make_unique<Worker>(memory, sockets, registry));
+    for (int round = 0; round < 2; ++round) {
+        for (auto& worker : workers) {
+            SharedPacket<Memory> packet = loopback.query(memory, 1, "printer-1._ipp._tcp.local.", MDNS_RECORDTYPE_SRV);
+            CHECK(packet);
+            CHECK(worker->answer(packet, Sink<Worker, Memory>::take, &sink) == 1);
+        }
+    }
+    CHECK(sink.responses.size() == 12);
+
+    // All buffers are back
+    std::array<Memory::Buffer*, 3> buffers;
+    for (auto& buffer : buffers)
+        CHECK((buffer = memory.acquire()));
+    for (auto* buffer : buffers)
+        memory.release(buffer);
+}
+
+/// Every packet of a legacy unicast response repeats the question and the query id
+void test_legacy_continuation() {
+    using Memory = FixedSizeBuffer<3>;
+    using Worker = Responder<Memory, UnixSocket, SingleThreadSafe>;
+    Memory memory;
+    UnixSocket sockets;
+    ServiceRegistry<SingleThreadSafe> registry;
+    for (int i = 0; i < 100; ++i)
+        CHECK(registry.add(printer(i)));
+    Loopback loopback;
+    Sink<Worker, Memory> sink{memory};
+    Worker worker(memory, sockets, registry);
+
+    SharedPacket<Memory> packet = loopback.query(memory, 0x1234, "_ipp._tcp.local.", MDNS_RECORDTYPE_PTR);
+    CHECK(packet);
+    CHECK(worker.answer(packet, Sink<Worker, Memory>::take, &sink) == 1);
+    CHECK(sink.responses.size() > 1);
+
+    uint8_t data[512];
+    PacketWriter question(data, sizeof(data));
+    question.begin(0x1234, 0x8400);
+    CHECK(question.question("_ipp._tcp.local.", MDNS_RECORDTYPE_PTR, MDNS_CLASS_IN));
+    size_t answers = 0;
+    for (const auto& response : sink.responses) {
+        CHECK(response.size() > question.size());
+        // Header up to the question count, then the question
+        CHECK(std::equal(data, data + 6, response.begin()));
+        CHECK(std::equal(data + 12, data + question.size(), response.begin() + 12));
+        // Additional records may follow in packets without answers
+        answers += (size_t)response[6] << 8 | response[7];
+        CHECK(response[7] || response[9] || response[11]);
+    }
+    CHECK(answers == 100);
+}
+
+}
+
+int main() {
+    test_idle_buffers();
+    test_legacy_continuation();
+    return 0;
+}
@@ -0,0 +1,136 @@
+// Reverse lookup names: reverse_address() decodes in-addr.arpa and ip6.arpa names from text and from
+// packets and rejects anything else, reverse_name() is its inverse
+
+#include "check.h"
+
+#include "reverse_name.h"
+#include "wire_name.h"
+
+#include <cstring>
+#include <string>
+
+#include <arpa/inet.h>
+
+namespace
+{
+
+using namespace mdns;
+
+/// Append the dotted \p name to \p packet at \p offset, without the terminating zero
+size_t labels(uint8_t* packet, size_t offset, std::string_view name) {
+    while (!name.empty()) {
+        const size_t dot = name.find('.');
+        const std::string_view label = name.substr(0, dot);
+        packet[offset] = (uint8_t)label.size();
+        memcpy(packet + offset + 1, label.data(), label.size());
+        offset += 1 + label.size();
+        name = dot == std::string_view::npos ? std::string_view() : name.substr(dot + 1);
+    }
+    return offset;
+}
+
+IpAddress ipv6_loopback() {
+    std::array<uint8_t, 16> bytes{};
+    bytes[15] = 1;
+    return IpAddress::ipv6(bytes);
+}
+
+IpAddress ipv6_link_local() {
+    return IpAddress::ipv6({0xfe, 0x80, 0, 0, 0, 0, 0, 0, 0x02, 0x1b, 0x63, 0xff, 0xfe, 0x84, 0x45, 0xe6});
+}
+
+constexpr std::string_view LINK_LOCAL_NAME =
+    "6.e.5.4.4.8.e.f.f.f.3.6.b.1.2.0.0.0.0.0.0.0.0.0.0.0.0.0.0.8.e.f.ip6.arpa.";
+
+void test_text() {
+    CHECK(reverse_address(std::string_view("2.1.168.192.in-addr.arpa.")) == IpAddress::ipv4(htonl(0xc0a80102)));
+    CHECK(reverse_address(std::string_view("2.1.168.192.in-addr.arpa")) == IpAddress::ipv4(htonl(0xc0a80102)));
+    CHECK(reverse_address(std::string_view("255.0.10.1.IN-ADDR.Arpa.")) == IpAddress::ipv4(htonl(0x010a00ff)));
+    // Single digit labels are octets or nibbles, depending on the suffix
+    CHECK(reverse_address(std::string_view("4.3.2.1.in-addr.arpa.")) == IpAddress::ipv4(htonl(0x01020304)));
+    CHECK(reverse_address(LINK_LOCAL_NAME) == ipv6_link_local());
+    CHECK(reverse_address(std::string_view(
+              "1.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.IP6.ARPA.")) == ipv6_loopback());
+}
+
+void test_rejected() {
+    const std::string_view names[] = {
+        "",
+        ".",
+        "printer.local.",
+        "in-addr.arpa.",
+        "arpa.",
+        // Wrong number of labels
+        "1.168.192.in-addr.arpa.",
+        "5.4.3.2.1.in-addr.arpa.",
+        "1.0.0.ip6.arpa.",
+        // Invalid octets
+        "256.1.168.192.in-addr.arpa.",
+        "02.1.168.192.in-addr.arpa.",
+        "a.1.168.192.in-addr.arpa.",
+        "-1.1.168.192.in-addr.arpa.",
+        "2..168.192.in-addr.arpa.",
+        // Octets in an IPv6 name and more than 32 nibbles
+        "10.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.ip6.arpa.",
+        "g.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.ip6.arpa.",
+        "0.1.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.ip6.arpa.",
+        // Suffixes
+        "2.1.168.192.in-addr.",
+        "2.1.168.192.in-addr.arpa.local.",
+        "2.1.168.192.ip6.arpa.",
+        "2.1.168.192.arpa.",
+        "2.1.168.192.in-addr.example.",
+    };
+    for (std::string_view name : names)
+        CHECK(reverse_address(name) == IpAddress());
+}
+
+/// Names in packets are decoded label by label, through compression
+void test_wire() {
+    uint8_t packet[256] = {};
+    size_t end = labels(packet, 12, "in-addr.arpa");
+    packet[end++] = 0;
+    const size_t address = end;
+    end = labels(packet, end, "2.1.168.192");
+    packet[end++] = 0xc0;
+    packet[end++] = 12;
+    CHECK(reverse_address(WireName(packet, end, address)) == IpAddress::ipv4(htonl(0xc0a80102)));
+    // The suffix alone, and a name that is not a reverse name
+    CHECK(reverse_address(WireName(packet, end, 12)) == IpAddress());
+    const size_t local = end;
+    end = labels(packet, end, "2.1.168.192.local");
+    packet[end++] = 0;
+    CHECK(reverse_address(WireName(packet, end, local)) == IpAddress());
+
+    const size_t ipv6 = end;
+    end = labels(packet, end, LINK_LOCAL_NAME.substr(0, LINK_LOCAL_NAME.size() - 1));
+    packet[end++] = 0;
+    CHECK(reverse_address(WireName(packet, end, ipv6)) == ipv6_link_local());
+}
+
+void test_round_trip() {
+    char buffer[MAX_REVERSE_NAME];
+    const IpAddress addresses[] = {
+        IpAddress::ipv4(htonl(0xc0a80102)), IpAddress::ipv4(0), IpAddress::ipv4(htonl(0xfffefdfc)),
+        IpAddress::ipv4(htonl(0x0a00640a)), ipv6_loopback(), ipv6_link_local(),
+    };
+    for (const IpAddress& address : addresses) {
+        const std::string_view name = reverse_name(address, buffer);
+        CHECK(name.size() <= MAX_REVERSE_NAME);
+        CHECK(reverse_address(name) == address);
+    }
+    CHECK(reverse_name(IpAddress::ipv4(htonl(0x0a00640a)), buffer) == "10.100.0.10.in-addr.arpa.");
+    CHECK(reverse_name(ipv6_link_local(), buffer) == LINK_LOCAL_NAME);
+    CHECK(reverse_name(ipv6_link_local(), buffer).size() == MAX_REVERSE_NAME);
+    CHECK(reverse_name(IpAddress(), buffer).empty());
+}
+
+}
+
+int main() {
+    test_text();
+    test_rejected();
+    test_wire();
+    test_round_trip();
+    return 0;
+}
@@ -0,0 +1,193 @@
+// Service registry: transactions that run out of memory at any allocation leave the registry unchanged,
+// reverse lookup entries
+
+#include "check.h"
+
+#include "service_registry.h"
+
+#include <algorithm>
+#include <array>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+
+namespace
+{
+
+using namespace mdns;
+
+using Registry = ServiceRegistry<SingleThreadSafe>;
+
+/// Fails the allocation after the next \p allocations ones, forever after that
+class FailingResource : public std::pmr::memory_resource
+{
+public:
+    void fail_after(size_t allocations) noexcept {
+        m_left = allocations;
+        m_armed = true;
+    }
+    void disarm() noexcept { m_armed = false; }
+    bool failed() const noexcept { return m_failed; }
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        if (m_armed && !m_left--) {
+            m_left = 0;
+            m_failed = true;
+            throw std::bad_alloc();
+        }
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+        std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+    size_t m_left{};
+    bool m_armed{};
+    bool m_failed{};
+};
+
+ServiceInstance instance(std::string_view name, std::string_view host, uint32_t ipv4) {
+    ServiceInstance instance;
+    instance.name = name;
+    instance.service_type = "_ipp._tcp.local.";
+    instance.subtypes.emplace_back("_universal");
+    instance.host = host;
+    instance.port = 631;
+    instance.ipv4 = htonl(ipv4);
+    return instance;
+}
+
+size_t lookup(Registry& registry, std::string_view name, uint16_t rtype) {
+    return registry.lookup(name, rtype, [](const ServicePtr&) {});
+}
+
+size_t reverse_lookup(Registry& registry, std::string_view name) {
+    return registry.reverse_lookup(name, [](std::string_view) {});
+}
+
+/// The registry holds exactly the instance "Office Printer"
+void check_unchanged(Registry& registry) {
+    CHECK(registry.size() == 1);
+    CHECK(lookup(registry, "Office Printer._ipp._tcp.local.", MDNS_RECORDTYPE_SRV) == 1);
+    CHECK(lookup(registry, "Living Room Printer._ipp._tcp.local.", MDNS_RECORDTYPE_SRV) == 0);
+    CHECK(lookup(registry, "_ipp._tcp.local.", MDNS_RECORDTYPE_PTR) == 1);
+    CHECK(lookup(registry, "_universal._sub._ipp._tcp.local.", MDNS_RECORDTYPE_PTR) == 1);
+    CHECK(lookup(registry, "office-printer.local.", MDNS_RECORDTYPE_A) == 1);
+    CHECK(lookup(registry, "living-room-printer.local.", MDNS_RECORDTYPE_A) == 0);
+    CHECK(reverse_lookup(registry, "2.1.168.192.in-addr.arpa.") == 1);
+    CHECK(reverse_lookup(registry, "3.1.168.192.in-addr.arpa.") == 0);
+}
+
+void check_added(Registry& registry) {
+    CHECK(registry.size() == 2);
+    CHECK(lookup(registry, "Living Room Printer._ipp._tcp.local.", MDNS_RECORDTYPE_SRV) == 1);
+    CHECK(lookup(registry, "_ipp._tcp.local.", MDNS_RECORDTYPE_PTR) == 2);
+    CHECK(lookup(registry, "_universal._sub._ipp._tcp.local.", MDNS_RECORDTYPE_PTR) == 2);
+    CHECK(lookup(registry, "living-room-printer.local.", MDNS_RECORDTYPE_A) == 1);
+    CHECK(reverse_lookup(registry, "3.1.168.192.in-addr.arpa.") == 1);
+}
+
+/// Every allocation of an addition fails once, including those between the instance and the name index
+void test_add_out_of_memory() {
+    size_t failures = 0;
+    for (size_t allocations = 0;; ++allocations) {
+        FailingResource resource;
+        Registry registry(&resource);
+        CHECK(registry.add(instance("Office Printer", "office-printer.local.", 0xc0a80102)));
+        const uint64_t generation = registry.generation();
+
+        resource.fail_after(allocations);
+        const bool added = registry.add(instance("Living Room Printer", "living-room-printer.local.", 0xc0a80103));
+        resource.disarm();
+        if (added) {
+            CHECK(!resource.failed());
+            check_added(registry);
+            break;
+        }
+        CHECK(resource.failed());
+        ++failures;
+        CHECK(registry.generation() == generation);
+        check_unchanged(registry);
+
+        // Nothing is left behind that keeps the instance from being added later
+        CHECK(registry.add(instance("Living Room Printer", "living-room-printer.local.", 0xc0a80103)));
+        check_added(registry);
+        CHECK(registry.remove("Living Room Printer._ipp._tcp.local."));
+        check_unchanged(registry);
+    }
+    CHECK(failures > 10);
+}
+
+/// An instance replaced within one transaction keeps the old one if memory runs out
+void test_replace_out_of_memory() {
+    for (size_t allocations = 0;; ++allocations) {
+        FailingResource resource;
+        Registry registry(&resource);
+        CHECK(registry.add(instance("Office Printer", "office-printer.local.", 0xc0a80102)));
+
+        RegistryTransaction transaction(&resource);
+        transaction.remove("Office Printer._ipp._tcp.local.");
+        transaction.add(instance("Office Printer", "office-printer-2.local.", 0xc0a80102));
+        resource.fail_after(allocations);
+        const bool replaced = registry.commit(transaction);
+        resource.disarm();
+        if (replaced) {
+            CHECK(registry.size() == 1);
+            CHECK(lookup(registry, "Office Printer._ipp._tcp.local.", MDNS_RECORDTYPE_SRV) == 1);
+            CHECK(lookup(registry, "office-printer.local.", MDNS_RECORDTYPE_A) == 0);
+            CHECK(lookup(registry, "office-printer-2.local.", MDNS_RECORDTYPE_A) == 1);
+            break;
+        }
+        check_unchanged(registry);
+    }
+}
+
+/// Every address and host reverse lookups are answered for, as withdrawn by Responder::goodbye()
+void test_for_each_reverse() {
+    Registry registry;
+    CHECK(registry.add(instance("Office Printer", "office-printer.local.", 0xc0a80102)));
+    CHECK(registry.add(instance("Office Scanner", "office-printer.local.", 0xc0a80102)));
+    CHECK(registry.add(instance("Living Room Printer", "living-room-printer.local.", 0xc0a80103)));
+    // A local address of the host of an instance is reported once, other hosts of the address as well
+    CHECK(registry.add_address(IpAddress::ipv4(htonl(0xc0a80102)), "office-printer.local", 1));
+    CHECK(registry.add_address(IpAddress::ipv4(htonl(0xc0a80103)), "router.local", 2));
+    std::array<uint8_t, 16> ipv6{0xfe, 0x80};
+    ipv6[15] = 1;
+    CHECK(registry.add_address(IpAddress::ipv6(ipv6), "router.local"));
+
+    std::vector<std::string> entries;
+    const size_t found = registry.for_each_reverse([&entries](const IpAddress& address, std::string_view host) {
+        char name[MAX_REVERSE_NAME];
+        entries.push_back(std::string(reverse_name(address, name)) + " " + std::string(host));
+    });
+    CHECK(found == entries.size());
+    std::sort(entries.begin(), entries.end());
+    const std::vector<std::string> expected{
+        "1.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.8.e.f.ip6.arpa. router.local.",
+        "2.1.168.192.in-addr.arpa. office-printer.local.",
+        "3.1.168.192.in-addr.arpa. living-room-printer.local.",
+        "3.1.168.192.in-addr.arpa. router.local.",
+    };
+    CHECK(entries == expected);
+
+    // Every pair is answered by a reverse lookup
+    for (const std::string& entry : entries) {
+        const std::string_view name(entry.data(), entry.find(' '));
+        const std::string_view host = std::string_view(entry).substr(name.size() + 1);
+        bool answered = false;
+        registry.reverse_lookup(name, [&](std::string_view found) { answered |= found == host; });
+        CHECK(answered);
+    }
+}
+
+}
+
+int main() {
+    test_add_out_of_memory();
+    test_replace_out_of_memory();
+    test_for_each_reverse();
+    return 0;
+}
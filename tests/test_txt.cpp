@@ -0,0 +1,120 @@
+// TXT records: TxtBuilder encodes valid and distinct keys only, TxtView finds keys in records of any size
+// and with invalid strings
+
+#include "check.h"
+
+#include "txt.h"
+
+#include <string>
+#include <vector>
+
+namespace
+{
+
+using namespace mdns;
+using namespace std::string_literals;
+
+/// Record data of the length prefixed \p strings, as received
+std::vector<uint8_t> record(const std::vector<std::string>& strings) {
+    std::vector<uint8_t> data;
+    for (const std::string& string : strings) {
+        data.push_back((uint8_t)string.size());
+        data.insert(data.end(), string.begin(), string.end());
+    }
+    return data;
+}
+
+void test_builder() {
+    TxtBuilder builder;
+    CHECK(builder.data().empty());
+    CHECK(builder.add("txtvers", "1"));
+    CHECK(builder.add("duplex"));
+    CHECK(builder.add("note", ""));
+    const std::vector<uint8_t> expected = record({"txtvers=1", "duplex", "note="});
+    CHECK(std::vector<uint8_t>(builder.data().begin(), builder.data().end()) == expected);
+
+    // Invalid keys and keys added before, in any case, leave the data unchanged
+    CHECK(!builder.add(""));
+    CHECK(!builder.add("a=b", "c"));
+    CHECK(!builder.add("tab\t"));
+    CHECK(!builder.add("caf\xc3\xa9"));
+    CHECK(!builder.add("TxtVers", "2"));
+    CHECK(!builder.add("duplex", "T"));
+    // A string is at most 255 bytes including the key and the separator
+    CHECK(builder.add("long", std::string(250, 'x')));
+    CHECK(!builder.add("longer", std::string(249, 'x')));
+    CHECK(builder.data().size() == expected.size() + 256);
+
+    builder.clear();
+    CHECK(builder.data().empty());
+    CHECK(builder.add("txtvers", "2"));
+}
+
+void test_view() {
+    const std::vector<uint8_t> data =
+        record({"txtvers=1", "=orphan", "Duplex", "", "note=", "bin=\x00\xff"s, "DUPLEX=F"});
+    const TxtView view(data);
+    CHECK(view.size() == 4);
+    CHECK(!view.empty());
+
+    // Keys are case insensitive and the first occurrence counts
+    const auto duplex = view.find("duplex");
+    CHECK(duplex && duplex->key == "Duplex" && !duplex->has_value);
+    CHECK(view.value("duplex", "T") == "T");
+    CHECK(view.value("TXTVERS") == "1");
+    const auto note = view.find("note");
+    CHECK(note && note->has_value && note->value.empty());
+    CHECK(view.value("bin") == "\x00\xff"s);
+    CHECK(!view.contains("txt"));
+    CHECK(!view.contains("txtvers=1"));
+    CHECK(!view.contains(""));
+    CHECK(!view.contains("orphan"));
+
+    // Iteration skips strings without a valid key but keeps later duplicates
+    std::vector<std::string> keys;
+    for (const TxtEntry entry : view)
+        keys.emplace_back(entry.key);
+    CHECK(keys == std::vector<std::string>({"txtvers", "Duplex", "note", "bin", "DUPLEX"}));
+
+    const TxtView empty;
+    CHECK(empty.empty() && !empty.contains("txtvers"));
+    CHECK(empty.begin() == empty.end());
+}
+
+/// Keys beyond the index are found by the linear search, and counted once
+void test_unindexed() {
+    std::vector<std::string> strings;
+    for (size_t i = 0; i < TxtView::MAX_INDEXED + 10; ++i)
+        strings.push_back("key" + std::to_string(i) + "=" + std::to_string(i));
+    strings.push_back("KEY70=duplicate");
+    strings.push_back("key3=duplicate");
+    const std::vector<uint8_t> data = record(strings);
+    const TxtView view(data);
+    CHECK(view.size() == TxtView::MAX_INDEXED + 10);
+    for (size_t i = 0; i < TxtView::MAX_INDEXED + 10; ++i)
+        CHECK(view.value("key" + std::to_string(i)) == std::to_string(i));
+    CHECK(!view.contains("key74"));
+}
+
+/// A string longer than the rest of the data ends with the data
+void test_truncated() {
+    std::vector<uint8_t> data = record({"txtvers=1", "note=abc"});
+    data[10] = 200;
+    const TxtView view(data);
+    CHECK(view.size() == 2);
+    CHECK(view.value("note") == "abc");
+    size_t entries = 0;
+    for (const TxtEntry entry : view)
+        entries += !entry.key.empty();
+    CHECK(entries == 2);
+}
+
+}
+
+int main() {
+    test_builder();
+    test_view();
+    test_unindexed();
+    test_truncated();
+    return 0;
+}
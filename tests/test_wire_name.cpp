@@ -0,0 +1,131 @@
+// WireName and FixedName::extract decode names of received packets, which may be malformed on purpose
+
+#include "check.h"
+
+#include "fixed_name.h"
+#include "wire_name.h"
+
+#include <cstring>
+#include <string>
+
+namespace
+{
+
+using namespace mdns;
+
+/// Append a label to \p packet at \p offset
+size_t label(uint8_t* packet, size_t offset, std::string_view text) {
+    packet[offset] = (uint8_t)text.size();
+    memcpy(packet + offset + 1, text.data(), text.size());
+    return offset + 1 + text.size();
+}
+
+void check_rejected(const uint8_t* packet, size_t size, size_t offset) {
+    const WireName name(packet, size, offset);
+    CHECK(!name.valid());
+    CHECK(name.length() == 0);
+    CHECK(name.decompress().empty());
+    CHECK(name.next_offset() == MDNS_INVALID_POS);
+    CHECK(!(name == std::string_view("")));
+    size_t extract_offset = offset;
+    CHECK(FixedName::extract(packet, size, &extract_offset).empty());
+    CHECK(extract_offset == MDNS_INVALID_POS);
+}
+
+void test_compressed() {
+    uint8_t packet[64] = {};
+    size_t end = label(packet, 12, "host");
+    end = label(packet, end, "local");
+    packet[end++] = 0;
+    const size_t www = end;
+    end = label(packet, end, "www");
+    packet[end++] = 0xc0;
+    packet[end++] = 12;
+
+    const WireName name(packet, end, www);
+    CHECK(name.valid());
+    CHECK(name.labels() == 3);
+    CHECK(name == std::string_view("WWW.host.local."));
+    CHECK(name.decompress() == std::string_view("www.host.local."));
+    CHECK(name.hash() == FixedName("www.host.local.").hash());
+    CHECK(name.next_offset() == end);
+    size_t offset = www;
+    CHECK(FixedName::extract(packet, end, &offset) == std::string_view("www.host.local."));
+    CHECK(offset == end);
+}
+
+void test_reference_loops() {
+    // A reference to itself
+    const uint8_t self[14] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xc0, 12};
+    check_rejected(self, sizeof(self), 12);
+
+    // Two names referring to each other
+    uint8_t pair[20] = {};
+    size_t end = label(pair, 12, "a");
+    pair[end++] = 0xc0;
+    pair[end++] = 16;
+    end = label(pair, end, "b");
+    pair[end++] = 0xc0;
+    pair[end++] = 12;
+    check_rejected(pair, end, 12);
+
+    // A loop of references without any label
+    const uint8_t chain[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xc0, 14, 0xc0, 12};
+    check_rejected(chain, sizeof(chain), 12);
+}
+
+void test_length() {
+    // Four labels of 63, 63, 63 and 62 bytes plus their dots are 255 bytes, the most a name may have
+    uint8_t packet[300] = {};
+    size_t end = 0;
+    for (size_t size : {63, 63, 63, 62})
+        end = label(packet, end, std::string(size, 'x'));
+    packet[end++] = 0;
+    const WireName longest(packet, end, 0);
+    CHECK(longest.valid());
+    CHECK(longest.length() == 255);
+    CHECK(longest.decompress().size() == 255);
+
+    // One more byte is too long
+    end = 0;
+    for (size_t size : {63, 63, 63, 63})
+        end = label(packet, end, std::string(size, 'x'));
+    packet[end++] = 0;
+    check_rejected(packet, end, 0);
+
+    // A long name built by references is still too long
+    end = label(packet, 0, std::string(63, 'x'));
+    end = label(packet, end, std::string(63, 'x'));
+    packet[end++] = 0;
+    const size_t prefix = end;
+    end = label(packet, end, std::string(63, 'y'));
+    end = label(packet, end, std::string(63, 'y'));
+    packet[end++] = 0xc0;
+    packet[end++] = 0;
+    check_rejected(packet, end, prefix);
+}
+
+void test_truncated() {
+    // The label runs past the end of the packet
+    uint8_t packet[16] = {};
+    label(packet, 0, "local");
+    check_rejected(packet, 4, 0);
+    // No root label
+    check_rejected(packet, 6, 0);
+    // Reserved label types
+    const uint8_t reserved[4] = {0x40, 'a', 0, 0};
+    check_rejected(reserved, sizeof(reserved), 0);
+    // A reference cut in half
+    const uint8_t reference[1] = {0xc0};
+    check_rejected(reference, sizeof(reference), 0);
+}
+
+}
+
+int main() {
+    test_compressed();
+    test_reference_loops();
+    test_length();
+    test_truncated();
+    return 0;
+}